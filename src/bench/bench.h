@@ -0,0 +1,48 @@
+#ifndef BLE_MEDICAL_BENCH_H
+#define BLE_MEDICAL_BENCH_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Shared by the benchmarks of bench_suite.
+ *
+ * A result is a benchmark name, a metric and a value. Metrics ending in
+ * "_per_s" are throughputs, higher is better; every other one is a cost,
+ * lower is better. Names and metrics are stable so results can be
+ * compared across commits.
+ */
+
+#define BENCH_RESULTS_MAX       64
+#define BENCH_NAME_MAX          48
+#define BENCH_METRIC_MAX        24
+
+typedef struct _bench_result {
+        char            name[BENCH_NAME_MAX];
+        char            metric[BENCH_METRIC_MAX];
+        double          value;
+} bench_result;
+
+typedef struct _bench_suite {
+        bench_result    results[BENCH_RESULTS_MAX];
+        size_t          count;
+        const char      *filter;        // substring of the names to run, NULL for all
+        const char      *tmp_dir;       // scratch space for the disk benchmarks
+} bench_suite;
+
+// The operation under test, run `n` times
+typedef void (*bench_op)(void *data, size_t n);
+
+int64_t bench_now_ns(void);
+int bench_selected(const bench_suite*, const char *name);
+void bench_report(bench_suite*, const char *name, const char *metric, double value);
+// Median nanoseconds per operation over a few runs long enough to time
+double bench_time(bench_op op, void *data);
+
+// Fills `n` PACKAGE_SIZE frames with a PPG-like waveform
+void bench_frames(uint8_t *frames, size_t n);
+
+// The chart benchmarks; returns -1 when there is no display to draw on
+int bench_chart(bench_suite*);
+
+#endif
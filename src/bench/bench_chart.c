@@ -0,0 +1,115 @@
+/*
+ * The chart benchmarks of bench_suite, the only ones needing GTK.
+ *
+ * Both use a chart set up as the session's, one 10 s window of points at
+ * the sensor rate: plotting times gtk_chart_plot_point() filling the
+ * window, drawing times the snapshot of that window by the auto-scaled
+ * line chart, rendered offscreen into a Cairo image, so no frame clock or
+ * compositor is involved.
+ */
+#include "bench.h"
+#include "../ble_medical_data.h"
+#include "../gtkchart.h"
+
+#include <gtk/gtk.h>
+#include <math.h>
+#include <stdio.h>
+
+#define BENCH_CHART_WIDTH       800
+#define BENCH_CHART_HEIGHT      400
+// One window of the session's chart
+#define BENCH_CHART_POINTS      ((size_t)(10.0 / PACKAGE_INTERVAL))
+
+static GtkChart *_chart_new(void)
+{
+        GtkChart *chart = GTK_CHART(gtk_chart_new());
+
+        gtk_chart_set_type(chart, GTK_CHART_TYPE_LINEAR_AUTOSCALE);
+        gtk_chart_set_title(chart, "PPG Signal");
+        gtk_chart_set_x_label(chart, "Time [s]");
+        gtk_chart_set_y_label(chart, "PPG signal");
+        gtk_chart_set_x_interval(chart, 10.0);
+        gtk_chart_set_y_upper(chart, 5000);
+        gtk_chart_set_width(chart, 1000);
+        return chart;
+}
+
+static double _sample(size_t i)
+{
+        double t = i * PACKAGE_INTERVAL;
+        return 3000 + 800 * sin(2.0 * M_PI * 1.2 * t) + 200 * sin(2.0 * M_PI * 0.25 * t);
+}
+
+static void _plot_window(GtkChart *chart)
+{
+        for (size_t i = 0; i < BENCH_CHART_POINTS; i++)
+                gtk_chart_plot_point(chart, i * PACKAGE_INTERVAL, _sample(i));
+}
+
+// A window plotted into a fresh chart per operation
+static void _plot_point(void *data, size_t n)
+{
+        (void)data;
+        for (size_t i = 0; i < n; i++)
+        {
+                GtkChart *chart = g_object_ref_sink(_chart_new());
+                _plot_window(chart);
+                g_object_unref(chart);
+        }
+}
+
+typedef struct _draw_data {
+        GtkWidget       *chart;
+        cairo_t         *cr;
+} draw_data;
+
+static void _draw_auto_scale(void *data, size_t n)
+{
+        draw_data *d = (draw_data*)data;
+
+        for (size_t i = 0; i < n; i++)
+        {
+                GtkSnapshot *snapshot = gtk_snapshot_new();
+                GTK_WIDGET_GET_CLASS(d->chart)->snapshot(d->chart, snapshot);
+                GskRenderNode *node = gtk_snapshot_free_to_node(snapshot);
+                if (node != NULL)
+                {
+                        gsk_render_node_draw(node, d->cr);
+                        gsk_render_node_unref(node);
+                }
+        }
+}
+
+int bench_chart(bench_suite *suite)
+{
+        if (!bench_selected(suite, "chart_"))
+                return 0;
+        if (!gtk_init_check())
+                return -1;
+
+        if (bench_selected(suite, "chart_plot_point"))
+                bench_report(suite, "chart_plot_point", "ns_per_point",
+                             bench_time(_plot_point, NULL) / BENCH_CHART_POINTS);
+
+        if (bench_selected(suite, "chart_draw_auto_scale"))
+        {
+                GtkWidget *window = gtk_window_new();
+                GtkChart *chart = _chart_new();
+                draw_data data = { GTK_WIDGET(chart), NULL };
+                int minimum, natural;
+
+                gtk_window_set_child(GTK_WINDOW(window), data.chart);
+                _plot_window(chart);
+                gtk_widget_measure(data.chart, GTK_ORIENTATION_HORIZONTAL, -1, &minimum, &natural, NULL, NULL);
+                gtk_widget_measure(data.chart, GTK_ORIENTATION_VERTICAL, BENCH_CHART_WIDTH, &minimum, &natural, NULL, NULL);
+                gtk_widget_size_allocate(data.chart, &(GtkAllocation){ 0, 0, BENCH_CHART_WIDTH, BENCH_CHART_HEIGHT }, -1);
+
+                cairo_surface_t *surface = cairo_image_surface_create(CAIRO_FORMAT_ARGB32, BENCH_CHART_WIDTH, BENCH_CHART_HEIGHT);
+                data.cr = cairo_create(surface);
+                bench_report(suite, "chart_draw_auto_scale", "us_per_frame", bench_time(_draw_auto_scale, &data) / 1e3);
+                cairo_destroy(data.cr);
+                cairo_surface_destroy(surface);
+                gtk_window_destroy(GTK_WINDOW(window));
+        }
+        return 0;
+}
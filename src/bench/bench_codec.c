@@ -0,0 +1,166 @@
+/*
+ * Corpus benchmark for the sample codec.
+ *
+ *   bench_codec [recording.blerec ...]
+ *
+ * Without arguments a synthetic corpus is used: PPG-shaped waveforms with
+ * baseline wander and ADC noise at a few perfusion levels. Recordings given
+ * on the command line are decoded and their red / IR channels re-encoded.
+ * Prints one line per corpus and implementation:
+ *
+ *   corpus impl samples ratio encode_MBps decode_MBps
+ */
+#include "../ble_medical_codec.h"
+#include "../ble_medical_record.h"
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define SYNTH_RATE      120.0
+#define SYNTH_SECONDS   (4 * 3600)
+#define MIN_RUN_NS      200000000LL
+
+typedef struct _corpus {
+        char            name[64];
+        uint16_t        *samples;
+        size_t          n;
+} corpus;
+
+static int64_t _now_ns(void)
+{
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return (int64_t)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static double _gauss(unsigned int *seed)
+{
+        double u = (rand_r(seed) + 1.0) / ((double)RAND_MAX + 2.0);
+        double v = (rand_r(seed) + 1.0) / ((double)RAND_MAX + 2.0);
+        return sqrt(-2.0 * log(u)) * cos(2.0 * M_PI * v);
+}
+
+// Systolic peak plus dicrotic notch, riding on a slow respiratory baseline
+static void _synth(corpus *c, const char *name, double dc, double ac, double noise)
+{
+        unsigned int seed = 7;
+        c->n = (size_t)(SYNTH_RATE * SYNTH_SECONDS);
+        c->samples = malloc(c->n * sizeof(uint16_t));
+        snprintf(c->name, sizeof(c->name), "%s", name);
+
+        double phase = 0.0;
+        for (size_t i = 0; i < c->n; i++)
+        {
+                double t = i / SYNTH_RATE;
+                double hr = 1.2 + 0.1 * sin(2.0 * M_PI * t / 60.0);
+                phase = fmod(phase + hr / SYNTH_RATE, 1.0);
+                double pulse = exp(-pow((phase - 0.2) / 0.08, 2)) + 0.4 * exp(-pow((phase - 0.5) / 0.1, 2));
+                double y = dc + 0.02 * dc * sin(2.0 * M_PI * 0.25 * t) - ac * pulse + noise * _gauss(&seed);
+                c->samples[i] = (uint16_t)fmin(fmax(y, 0.0), 65535.0);
+        }
+}
+
+// Pulls red then IR samples out of every valid frame block of a recording
+static int _load_recording(corpus *c, const char *path)
+{
+        FILE *file = fopen(path, "rb");
+        if (file == NULL)
+                return -1;
+
+        size_t capacity = 1 << 20;
+        uint8_t *payload = malloc(BLE_RECORD_MAX_PAYLOAD);
+        ble_frames *frames = malloc(sizeof(*frames));
+        c->samples = malloc(capacity * sizeof(uint16_t));
+        c->n = 0;
+        snprintf(c->name, sizeof(c->name), "%s", path);
+
+        ble_block_header block;
+        fseek(file, BLE_RECORD_HEADER_SIZE, SEEK_SET);
+        while (fread(&block, sizeof(block), 1, file) == 1)
+        {
+                if (block.length > BLE_RECORD_MAX_PAYLOAD ||
+                    fread(payload, 1, block.length, file) != block.length ||
+                    !ble_record_block_valid(&block, payload))
+                        break;
+                if (ble_record_decode_block(&block, payload, frames) != 0)
+                        continue;
+                size_t samples = (size_t)frames->count * PACKAGE_SAMPLES;
+                while (c->n + 2 * samples > capacity)
+                {
+                        capacity *= 2;
+                        c->samples = realloc(c->samples, capacity * sizeof(uint16_t));
+                }
+                memcpy(c->samples + c->n, frames->red, samples * sizeof(uint16_t));
+                memcpy(c->samples + c->n + samples, frames->ir, samples * sizeof(uint16_t));
+                c->n += 2 * samples;
+        }
+        free(frames);
+        free(payload);
+        fclose(file);
+        return c->n > 0 ? 0 : -1;
+}
+
+static void _run(const corpus *c, ble_codec_impl impl)
+{
+        uint8_t *encoded = malloc(ble_codec_bound(c->n));
+        uint16_t *decoded = malloc(c->n * sizeof(uint16_t));
+        size_t raw = c->n * sizeof(uint16_t), len = 0;
+        int64_t start, elapsed;
+        long runs;
+
+        ble_codec_select(impl);
+
+        start = _now_ns();
+        for (runs = 0; (elapsed = _now_ns() - start) < MIN_RUN_NS || runs == 0; runs++)
+                len = ble_codec_encode(c->samples, c->n, encoded);
+        double encode_mbps = (double)raw * runs / (elapsed / 1e9) / 1e6;
+
+        start = _now_ns();
+        for (runs = 0; (elapsed = _now_ns() - start) < MIN_RUN_NS || runs == 0; runs++)
+                ble_codec_decode(encoded, len, decoded, c->n);
+        double decode_mbps = (double)raw * runs / (elapsed / 1e9) / 1e6;
+
+        if (memcmp(decoded, c->samples, raw) != 0)
+        {
+                fprintf(stderr, "%s: %s round trip mismatch\n", c->name, ble_codec_impl_name(impl));
+                exit(1);
+        }
+        printf("%s %s %zu %.2f %.0f %.0f\n", c->name, ble_codec_impl_name(impl), c->n,
+               (double)raw / len, encode_mbps, decode_mbps);
+        free(decoded);
+        free(encoded);
+}
+
+int main(int argc, char *argv[])
+{
+        corpus corpora[16];
+        int n = 0;
+
+        if (argc > 1)
+        {
+                for (int i = 1; i < argc && n < 16; i++)
+                        if (_load_recording(&corpora[n], argv[i]) == 0)
+                                n++;
+                        else
+                                fprintf(stderr, "%s: no frames\n", argv[i]);
+        }
+        else
+        {
+                _synth(&corpora[n++], "synth_low_perfusion", 42000, 150, 2.0);
+                _synth(&corpora[n++], "synth_typical", 38000, 600, 3.0);
+                _synth(&corpora[n++], "synth_high_perfusion", 30000, 2500, 4.0);
+        }
+
+        printf("# corpus impl samples ratio encode_MBps decode_MBps\n");
+        for (int i = 0; i < n; i++)
+        {
+                for (int impl = BLE_CODEC_SCALAR; impl <= BLE_CODEC_AVX2; impl++)
+                        if (ble_codec_select(impl) == (ble_codec_impl)impl)
+                                _run(&corpora[i], impl);
+                free(corpora[i].samples);
+        }
+        return 0;
+}
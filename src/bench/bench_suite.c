@@ -0,0 +1,515 @@
+/*
+ * Benchmarks of the acquisition, storage and render paths.
+ *
+ *   bench_suite [--baseline FILE] [--tolerance PERCENT] [--output FILE] [--filter NAME]
+ *
+ * Micro benchmarks time the frame decoding (pack_from_data,
+ * pack_to_point), the band-pass filter bank on one and on eight channels,
+ * plotting points into the chart and drawing an auto-scaled chart
+ * offscreen; macro benchmarks write a recording
+ * (binary) and export it to CSV (text), and push synthetic frames through
+ * the decode and store stages into a capture on disk, as a session does.
+ * The chart benchmarks are skipped without a display.
+ *
+ * Results go to stdout, or --output, one per line:
+ *
+ *   name<TAB>metric<TAB>value
+ *
+ * With --baseline each result is compared with the baseline's, a file of
+ * the same lines, and the run fails when one is more than --tolerance
+ * percent (25 by default) worse. Results missing from either side are
+ * listed but do not fail. The comparison is only as good as the baseline
+ * machine is this one, so `make bench` leaves it out unless asked for.
+ */
+#include "bench.h"
+#include "../ble_medical_data.h"
+#include "../ble_medical_record.h"
+#include "../ble_medical_reader.h"
+#include "../ble_medical_csv.h"
+#include "../ble_medical_capture.h"
+#include "../ble_medical_pipeline.h"
+#include "../ble_medical_filter.h"
+
+#include <glib.h>
+#include <glib/gstdio.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define BENCH_MIN_NS            50000000LL
+#define BENCH_REPEATS           5
+// Distinct frames cycled through by the micro benchmarks
+#define BENCH_FRAMES            4096
+// Frames per macro benchmark run, a bit over two hours of recording
+#define BENCH_RECORD_FRAMES     100000
+#define BENCH_MACRO_REPEATS     3
+// Channels of the wide filter bank, red and IR of four sensors
+#define BENCH_FILTER_CHANNELS   8
+
+static gchar *baseline = NULL;
+static gdouble tolerance = 25.0;
+static gchar *output = NULL;
+static gchar *filter = NULL;
+
+static GOptionEntry options[] = {
+        { "baseline", 'b', 0, G_OPTION_ARG_FILENAME, &baseline, "Compare with these results", "FILE" },
+        { "tolerance", 't', 0, G_OPTION_ARG_DOUBLE, &tolerance, "Allowed regression, 25 by default", "PERCENT" },
+        { "output", 'o', 0, G_OPTION_ARG_FILENAME, &output, "Results, stdout by default", "FILE" },
+        { "filter", 'f', 0, G_OPTION_ARG_STRING, &filter, "Only benchmarks whose name contains this", "NAME" },
+        { NULL }
+};
+
+static volatile double sink;
+
+int64_t bench_now_ns(void)
+{
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return (int64_t)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+int bench_selected(const bench_suite *suite, const char *name)
+{
+        return suite->filter == NULL || strstr(name, suite->filter) != NULL;
+}
+
+void bench_report(bench_suite *suite, const char *name, const char *metric, double value)
+{
+        if (suite->count == BENCH_RESULTS_MAX)
+                return;
+        bench_result *result = &suite->results[suite->count++];
+        snprintf(result->name, sizeof(result->name), "%s", name);
+        snprintf(result->metric, sizeof(result->metric), "%s", metric);
+        result->value = value;
+        fprintf(stderr, "%-24s %-16s %12.3f\n", name, metric, value);
+}
+
+static int _compare_double(const void *a, const void *b)
+{
+        double x = *(const double*)a, y = *(const double*)b;
+        return (x > y) - (x < y);
+}
+
+static double _median(double *values, size_t n)
+{
+        qsort(values, n, sizeof(double), _compare_double);
+        return n % 2 ? values[n / 2] : (values[n / 2 - 1] + values[n / 2]) / 2.0;
+}
+
+double bench_time(bench_op op, void *data)
+{
+        double runs[BENCH_REPEATS];
+        size_t n = 1;
+
+        // Enough operations for a run to take BENCH_MIN_NS, warming up meanwhile
+        for (;;)
+        {
+                int64_t start = bench_now_ns();
+                op(data, n);
+                int64_t elapsed = bench_now_ns() - start;
+                if (elapsed >= BENCH_MIN_NS)
+                        break;
+                n = elapsed > 0 ? MAX(n * 2, (size_t)(n * 1.2 * BENCH_MIN_NS / elapsed)) : n * 2;
+        }
+        for (int i = 0; i < BENCH_REPEATS; i++)
+        {
+                int64_t start = bench_now_ns();
+                op(data, n);
+                runs[i] = (double)(bench_now_ns() - start) / n;
+        }
+        return _median(runs, BENCH_REPEATS);
+}
+
+// Systolic peak and dicrotic notch at 72 bpm over a respiratory baseline,
+// IR above red as on the sensor
+void bench_frames(uint8_t *frames, size_t n)
+{
+        for (size_t i = 0; i < n; i++)
+        {
+                uint8_t *frame = frames + i * PACKAGE_SIZE;
+                memset(frame, 0, PACKAGE_SIZE);
+                for (int j = 0; j < PACKAGE_SAMPLES; j++)
+                {
+                        double t = (i * PACKAGE_SAMPLES + j) * PACKAGE_INTERVAL;
+                        double phase = fmod(t * 1.2, 1.0);
+                        double pulse = exp(-pow((phase - 0.2) / 0.08, 2)) + 0.4 * exp(-pow((phase - 0.5) / 0.1, 2));
+                        double wander = sin(2.0 * M_PI * 0.25 * t);
+                        uint16_t red = (uint16_t)(30000 + 600 * wander - 800 * pulse);
+                        uint16_t ir = (uint16_t)(38000 + 700 * wander - 1200 * pulse);
+                        memcpy(frame + 2 + 2 * j, &red, sizeof(red));
+                        memcpy(frame + 22 + 2 * j, &ir, sizeof(ir));
+                }
+                int32_t beat = 72;
+                frame[0] = (uint8_t)i;
+                frame[1] = (uint8_t)(i >> 8);
+                memcpy(frame + 42, &beat, sizeof(beat));
+        }
+}
+
+typedef struct _frames_data {
+        uint8_t         *frames;
+        t_pack          *packs;
+} frames_data;
+
+static void _pack_from_data(void *data, size_t n)
+{
+        frames_data *d = (frames_data*)data;
+        ble_pack_inf inf;
+        double sum = 0;
+
+        for (size_t i = 0; i < n; i++)
+        {
+                pack_from_data(&inf, d->frames + (i % BENCH_FRAMES) * PACKAGE_SIZE);
+                sum += inf.rvalue[i % PACKAGE_SAMPLES];
+        }
+        sink = sum;
+}
+
+static void _pack_to_point(void *data, size_t n)
+{
+        frames_data *d = (frames_data*)data;
+        point_t points[PACKAGE_SAMPLES];
+        double sum = 0;
+
+        for (size_t i = 0; i < n; i++)
+        {
+                pack_to_point(points, 0, &d->packs[i % BENCH_FRAMES]);
+                sum += points[i % PACKAGE_SAMPLES].y;
+        }
+        sink = sum;
+}
+
+static void _bench_decode(bench_suite *suite, uint8_t *frames)
+{
+        frames_data data = { frames, g_new0(t_pack, BENCH_FRAMES) };
+
+        for (size_t i = 0; i < BENCH_FRAMES; i++)
+        {
+                data.packs[i].data = frames + i * PACKAGE_SIZE;
+                data.packs[i].time = (ble_time_t)(i * PACKAGE_SAMPLES * PACKAGE_INTERVAL * 1e6);
+        }
+        if (bench_selected(suite, "pack_from_data"))
+                bench_report(suite, "pack_from_data", "ns_per_frame", bench_time(_pack_from_data, &data));
+        if (bench_selected(suite, "pack_to_point"))
+                bench_report(suite, "pack_to_point", "ns_per_frame", bench_time(_pack_to_point, &data));
+        g_free(data.packs);
+}
+
+typedef struct _filter_data {
+        ble_filter_bank *bank;
+        guint           channels;
+        double          *samples;       // BENCH_FRAMES frames of every channel
+} filter_data;
+
+// `n` frames of every channel, the same samples over and over
+static void _filter_run(void *data, size_t n)
+{
+        filter_data *d = (filter_data*)data;
+        double samples[PACKAGE_SAMPLES * BENCH_FILTER_CHANNELS];
+        size_t length = PACKAGE_SAMPLES * d->channels;
+
+        for (size_t i = 0; i < n; i++)
+        {
+                memcpy(samples, d->samples + (i % BENCH_FRAMES) * length, length * sizeof(double));
+                ble_filter_bank_run(d->bank, samples, PACKAGE_SAMPLES);
+        }
+        sink = samples[0];
+}
+
+// Red and IR of every frame, repeated across sensors past the second channel
+static void _bench_filter(bench_suite *suite, const uint8_t *frames, guint channels, const char *name)
+{
+        if (!bench_selected(suite, name))
+                return;
+        filter_data data = { NULL, channels, g_new(double, (gsize)BENCH_FRAMES * PACKAGE_SAMPLES * channels) };
+        for (size_t i = 0; i < BENCH_FRAMES; i++)
+        {
+                ble_pack_inf inf;
+                pack_from_data(&inf, (ble_pack_t)(frames + i * PACKAGE_SIZE));
+                for (int j = 0; j < PACKAGE_SAMPLES; j++)
+                        for (guint c = 0; c < channels; c++)
+                                data.samples[(i * PACKAGE_SAMPLES + j) * channels + c] = c % 2 ? inf.irvalue[j] : inf.rvalue[j];
+        }
+        data.bank = ble_filter_bank_new(channels, 1.0 / PACKAGE_INTERVAL, BLE_FILTER_LOW_HZ, BLE_FILTER_HIGH_HZ);
+        bench_report(suite, name, "ns_per_sample", bench_time(_filter_run, &data) / (PACKAGE_SAMPLES * channels));
+        ble_filter_bank_free(data.bank);
+        g_free(data.samples);
+}
+
+static void _remove_recording(const char *path)
+{
+        g_autofree gchar *journal = g_strconcat(path, BLE_RECORD_JOURNAL_SUFFIX, NULL);
+        g_unlink(path);
+        g_unlink(journal);
+}
+
+// Appends BENCH_RECORD_FRAMES to a new recording at `path`; nanoseconds
+static double _write_recording(const char *path, const uint8_t *frames)
+{
+        ble_record_recovery report;
+
+        _remove_recording(path);
+        int64_t start = bench_now_ns();
+        ble_record *record = ble_record_open(path, &report);
+        if (record == NULL)
+                return NAN;
+        for (size_t i = 0; i < BENCH_RECORD_FRAMES; i++)
+        {
+                ble_time_t time = (ble_time_t)(i * PACKAGE_SAMPLES * PACKAGE_INTERVAL * 1e6);
+                if (ble_record_append(record, time, frames + (i % BENCH_FRAMES) * PACKAGE_SIZE) != 0)
+                {
+                        ble_record_close(record);
+                        return NAN;
+                }
+        }
+        if (ble_record_close(record) != 0)
+                return NAN;
+        return (double)(bench_now_ns() - start);
+}
+
+static void _bench_writing(bench_suite *suite, const uint8_t *frames)
+{
+        g_autofree gchar *path = g_build_filename(suite->tmp_dir, "bench.blerec", NULL);
+        g_autofree gchar *csv = g_build_filename(suite->tmp_dir, "bench.csv", NULL);
+        double runs[BENCH_MACRO_REPEATS];
+
+        if (!bench_selected(suite, "data_writing"))
+                return;
+        for (int i = 0; i < BENCH_MACRO_REPEATS; i++)
+                runs[i] = BENCH_RECORD_FRAMES / (_write_recording(path, frames) / 1e9);
+        bench_report(suite, "data_writing_binary", "frames_per_s", _median(runs, BENCH_MACRO_REPEATS));
+
+        ble_reader *reader = ble_reader_open(path);
+        for (int i = 0; i < BENCH_MACRO_REPEATS; i++)
+        {
+                int64_t start = bench_now_ns();
+                int res = reader ? ble_csv_export(reader, csv, BLE_CHANNEL_ALL, NULL, 0, NULL, NULL) : -1;
+                runs[i] = res == 0 ? BENCH_RECORD_FRAMES / ((bench_now_ns() - start) / 1e9) : NAN;
+        }
+        bench_report(suite, "data_writing_text", "frames_per_s", _median(runs, BENCH_MACRO_REPEATS));
+        if (reader != NULL)
+                ble_reader_close(reader);
+        g_unlink(csv);
+        _remove_recording(path);
+}
+
+typedef struct _pipeline_data {
+        ble_capture     *capture;
+        ble_filter_bank *filter;        // decode stage only
+        gint            failed;
+} pipeline_data;
+
+static gpointer _pack_ref(gpointer data)
+{
+        g_atomic_int_inc(&((t_pack*)data)->refs);
+        return data;
+}
+
+static void _pack_unref(gpointer data)
+{
+        t_pack *pack = (t_pack*)data;
+
+        if (g_atomic_int_dec_and_test(&pack->refs))
+        {
+                g_free(pack->data);
+                g_free(pack);
+        }
+}
+
+// The session's decode stage, without the chart
+static void _decode_stage(gpointer *items, guint count, gpointer data)
+{
+        pipeline_data *d = (pipeline_data*)data;
+
+        for (guint i = 0; i < count; i++)
+        {
+                t_pack *pack = (t_pack*)items[i];
+                double samples[PACKAGE_SAMPLES];
+                ble_pack_inf inf;
+                pack_from_data(&inf, pack->data);
+                pack_to_point(pack->points, 0, pack);
+                for (int j = 0; j < PACKAGE_SAMPLES; j++)
+                        samples[j] = pack->points[j].y;
+                ble_filter_bank_run(d->filter, samples, PACKAGE_SAMPLES);
+                for (int j = 0; j < PACKAGE_SAMPLES; j++)
+                        pack->points[j].y = samples[j];
+        }
+}
+
+static void _store_stage(gpointer *items, guint count, gpointer data)
+{
+        pipeline_data *d = (pipeline_data*)data;
+
+        for (guint i = 0; i < count; i++)
+                if (ble_capture_append(d->capture, ((t_pack*)items[i])->time, ((t_pack*)items[i])->data) != 0)
+                        g_atomic_int_set(&d->failed, 1);
+}
+
+// Synthetic source to disk through the decode and store stages, with the
+// EDF+ copy, as fast as the stages take it; nanoseconds
+static double _run_pipeline(const char *path, const uint8_t *frames)
+{
+        pipeline_data data = { 0 };
+        ble_record_recovery report;
+        g_autofree gchar *edf = ble_capture_edf_path(path);
+
+        _remove_recording(path);
+        g_unlink(edf);
+        int64_t start = bench_now_ns();
+        data.capture = ble_capture_open(path, true, &report);
+        if (data.capture == NULL)
+                return NAN;
+        data.filter = ble_filter_bank_new(1, 1.0 / PACKAGE_INTERVAL, BLE_FILTER_LOW_HZ, BLE_FILTER_HIGH_HZ);
+        ble_pipeline *pipeline = ble_pipeline_new("bench", _pack_ref, _pack_unref);
+        ble_stage *decode = ble_pipeline_add_stage(pipeline, "decode", _decode_stage, &data, 256, 16, BLE_STAGE_BLOCK, -1);
+        ble_stage *store = ble_pipeline_add_stage(pipeline, "store", _store_stage, &data, 1024, 32, BLE_STAGE_BLOCK, -1);
+        ble_stage_connect(decode, store);
+        ble_pipeline_start(pipeline);
+        for (size_t i = 0; i < BENCH_RECORD_FRAMES; i++)
+        {
+                t_pack *pack = g_new0(t_pack, 1);
+                pack->data = g_memdup2(frames + (i % BENCH_FRAMES) * PACKAGE_SIZE, PACKAGE_SIZE);
+                pack->time = (ble_time_t)(i * PACKAGE_SAMPLES * PACKAGE_INTERVAL * 1e6);
+                pack->refs = 1;
+                ble_stage_push(decode, pack);
+        }
+        ble_pipeline_free(pipeline);
+        ble_capture_free(data.capture);
+        ble_filter_bank_free(data.filter);
+        double elapsed = (double)(bench_now_ns() - start);
+        g_unlink(edf);
+        _remove_recording(path);
+        return data.failed ? NAN : elapsed;
+}
+
+static void _bench_pipeline(bench_suite *suite, const uint8_t *frames)
+{
+        g_autofree gchar *path = g_build_filename(suite->tmp_dir, "live.blerec", NULL);
+        double runs[BENCH_MACRO_REPEATS];
+
+        if (!bench_selected(suite, "pipeline_to_disk"))
+                return;
+        for (int i = 0; i < BENCH_MACRO_REPEATS; i++)
+                runs[i] = BENCH_RECORD_FRAMES / (_run_pipeline(path, frames) / 1e9);
+        bench_report(suite, "pipeline_to_disk", "frames_per_s", _median(runs, BENCH_MACRO_REPEATS));
+}
+
+static gboolean _write_results(const bench_suite *suite, FILE *out)
+{
+        fprintf(out, "# name\tmetric\tvalue\n");
+        for (size_t i = 0; i < suite->count; i++)
+        {
+                char value[G_ASCII_DTOSTR_BUF_SIZE];
+                g_ascii_formatd(value, sizeof(value), "%.9g", suite->results[i].value);
+                fprintf(out, "%s\t%s\t%s\n", suite->results[i].name, suite->results[i].metric, value);
+        }
+        return fflush(out) == 0;
+}
+
+// Lists every result against the baseline; returns the regressions
+static int _compare(const bench_suite *suite, const char *path)
+{
+        g_autofree gchar *text = NULL;
+        g_autoptr(GError) error = NULL;
+        int regressions = 0;
+
+        if (!g_file_get_contents(path, &text, NULL, &error))
+        {
+                fprintf(stderr, "%s\n", error->message);
+                return 1;
+        }
+        g_auto(GStrv) lines = g_strsplit(text, "\n", -1);
+        fprintf(stderr, "\n%-24s %-16s %12s %12s %8s\n", "benchmark", "metric", "baseline", "now", "change");
+        for (size_t i = 0; i < suite->count; i++)
+        {
+                const bench_result *result = &suite->results[i];
+                double base = NAN;
+                for (guint j = 0; lines[j] != NULL && isnan(base); j++)
+                {
+                        g_auto(GStrv) fields = g_strsplit(lines[j], "\t", 3);
+                        if (lines[j][0] != '#' && g_strv_length(fields) == 3 &&
+                            strcmp(fields[0], result->name) == 0 && strcmp(fields[1], result->metric) == 0)
+                                base = g_ascii_strtod(fields[2], NULL);
+                }
+                if (isnan(base) || base == 0)
+                {
+                        fprintf(stderr, "%-24s %-16s %12s %12.3f %8s\n", result->name, result->metric, "-", result->value, "new");
+                        continue;
+                }
+                // Positive when worse, whichever way the metric goes
+                double change = g_str_has_suffix(result->metric, "_per_s") ? base / result->value - 1.0
+                                                                            : result->value / base - 1.0;
+                gboolean regressed = isnan(result->value) || change * 100.0 > tolerance;
+                regressions += regressed;
+                fprintf(stderr, "%-24s %-16s %12.3f %12.3f %+7.1f%%%s\n", result->name, result->metric,
+                        base, result->value, change * 100.0, regressed ? "  REGRESSION" : "");
+        }
+        return regressions;
+}
+
+static void _remove_dir(const char *path)
+{
+        GDir *dir = g_dir_open(path, 0, NULL);
+        const gchar *name;
+
+        while (dir != NULL && (name = g_dir_read_name(dir)) != NULL)
+        {
+                g_autofree gchar *child = g_build_filename(path, name, NULL);
+                g_unlink(child);
+        }
+        if (dir != NULL)
+                g_dir_close(dir);
+        g_rmdir(path);
+}
+
+int main(int argc, char *argv[])
+{
+        g_autoptr(GOptionContext) context = g_option_context_new(NULL);
+        g_autoptr(GError) error = NULL;
+        bench_suite suite = { 0 };
+
+        g_option_context_set_summary(context, "Benchmark the acquisition, storage and render paths.");
+        g_option_context_add_main_entries(context, options, NULL);
+        if (!g_option_context_parse(context, &argc, &argv, &error))
+        {
+                fprintf(stderr, "%s\n", error->message);
+                return 2;
+        }
+        g_autofree gchar *tmp_dir = g_dir_make_tmp("ble_bench.XXXXXX", &error);
+        if (tmp_dir == NULL)
+        {
+                fprintf(stderr, "%s\n", error->message);
+                return 1;
+        }
+        suite.filter = filter;
+        suite.tmp_dir = tmp_dir;
+
+        uint8_t *frames = g_malloc(BENCH_FRAMES * PACKAGE_SIZE);
+        bench_frames(frames, BENCH_FRAMES);
+        _bench_decode(&suite, frames);
+        _bench_filter(&suite, frames, 1, "filter_1ch");
+        _bench_filter(&suite, frames, BENCH_FILTER_CHANNELS, "filter_8ch");
+        if (bench_chart(&suite) != 0)
+                fprintf(stderr, "No display, chart benchmarks skipped\n");
+        _bench_writing(&suite, frames);
+        _bench_pipeline(&suite, frames);
+        g_free(frames);
+        _remove_dir(tmp_dir);
+
+        FILE *out = output ? fopen(output, "w") : stdout;
+        if (out == NULL || !_write_results(&suite, out))
+        {
+                perror(output ? output : "stdout");
+                return 1;
+        }
+        if (out != stdout)
+                fclose(out);
+        if (baseline != NULL && _compare(&suite, baseline) > 0)
+        {
+                fprintf(stderr, "Slower than %s by more than %.0f%%\n", baseline, tolerance);
+                return 1;
+        }
+        return 0;
+}
@@ -4,5 +4,19 @@
 #include "ble_medical_bluetooth.h"
 #include "ble_medical_plot.h"
 #include "ble_medical_data.h"
+#include "ble_medical_record.h"
+#include "ble_medical_reader.h"
+#include "ble_medical_catalog.h"
+#include "ble_medical_query.h"
+#include "ble_medical_edf.h"
+#include "ble_medical_csv.h"
+#include "ble_medical_render.h"
+#include "ble_medical_analytics.h"
+#include "ble_medical_capture.h"
+#include "ble_medical_device.h"
+#include "ble_medical_pipeline.h"
+#include "ble_medical_latency.h"
+#include "ble_medical_metrics.h"
+#include "ble_medical_trace.h"
 #include "config.h"
 #endif
\ No newline at end of file
@@ -0,0 +1,624 @@
+#include "ble_medical_analytics.h"
+
+#include <glib.h>
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define FRAME_US                (PACKAGE_SAMPLES * PACKAGE_INTERVAL * 1e6)
+#define SAMPLE_US(j)            ((int64_t)((j) * PACKAGE_INTERVAL * 1e6 + 0.5))
+#define WINDOW_NOMINAL_FRAMES   ((uint32_t)(BLE_ANALYTICS_WINDOW_US / FRAME_US + 0.5))
+#define WINDOW_MAX_FRAMES       (4 * WINDOW_NOMINAL_FRAMES)
+#define WINDOW_MAX_SAMPLES      (WINDOW_MAX_FRAMES * PACKAGE_SAMPLES)
+#define SMOOTH_HALF             2       // samples each side, low pass
+#define DETREND_HALF            ((int)(0.5 / PACKAGE_INTERVAL))  // half a second, baseline
+#define REFRACTORY_SAMPLES      ((int)(BLE_ANALYTICS_REFRACTORY_US * 1e-6 / PACKAGE_INTERVAL))
+#define MAX_PEAKS               (WINDOW_MAX_SAMPLES / REFRACTORY_SAMPLES + 2)
+#define PEAK_REFERENCE          0.8     // quantile of candidate peak heights
+#define PEAK_FRACTION           0.6     // of the reference, to count as a beat
+#define BATCH_OPEN              G_MAXUINT
+
+// Frames of the window being filled, and the scratch to assess it
+typedef struct _analytics_window {
+        int64_t         index;          // window number from the first frame, -1 if none
+        uint32_t        frames;         // received, kept or not
+        uint32_t        kept;
+        int64_t         *times;         // WINDOW_MAX_FRAMES
+        uint16_t        *red;           // WINDOW_MAX_SAMPLES each
+        uint16_t        *ir;
+        double          *sum;           // one more
+        double          *smooth_red;
+        double          *smooth_ir;
+        double          *detrended;
+        uint32_t        *peaks;         // MAX_PEAKS
+        double          *scratch;       // twice that
+        ble_range       range;
+} analytics_window;
+
+static analytics_window *_window_new(void)
+{
+        analytics_window *w = malloc(sizeof(*w));
+        size_t n = WINDOW_MAX_SAMPLES;
+
+        if (w == NULL)
+                return NULL;
+        w->times = malloc(WINDOW_MAX_FRAMES * sizeof(int64_t));
+        w->red = malloc(2 * n * sizeof(uint16_t));
+        w->sum = malloc((4 * n + 1 + 2 * MAX_PEAKS) * sizeof(double));
+        w->peaks = malloc(MAX_PEAKS * sizeof(uint32_t));
+        if (w->times == NULL || w->red == NULL || w->sum == NULL || w->peaks == NULL)
+        {
+                free(w->times);
+                free(w->red);
+                free(w->sum);
+                free(w->peaks);
+                free(w);
+                return NULL;
+        }
+        w->ir = w->red + n;
+        w->smooth_red = w->sum + n + 1;
+        w->smooth_ir = w->smooth_red + n;
+        w->detrended = w->smooth_ir + n;
+        w->scratch = w->detrended + n;
+        return w;
+}
+
+static void _window_free(analytics_window *w)
+{
+        if (w == NULL)
+                return;
+        free(w->times);
+        free(w->red);
+        free(w->sum);
+        free(w->peaks);
+        free(w);
+}
+
+void ble_analytics_init(ble_analytics *result)
+{
+        memset(result, 0, sizeof(*result));
+        result->hr_min = INFINITY;
+        result->hr_max = -INFINITY;
+        result->spo2_min = INFINITY;
+        result->spo2_max = -INFINITY;
+}
+
+void ble_analytics_merge(ble_analytics *result, const ble_analytics *other)
+{
+        result->frames += other->frames;
+        result->windows += other->windows;
+        result->assessed += other->assessed;
+        result->good += other->good;
+        result->hr_sum += other->hr_sum;
+        result->hr_min = fmin(result->hr_min, other->hr_min);
+        result->hr_max = fmax(result->hr_max, other->hr_max);
+        result->spo2_sum += other->spo2_sum;
+        result->spo2_min = fmin(result->spo2_min, other->spo2_min);
+        result->spo2_max = fmax(result->spo2_max, other->spo2_max);
+}
+
+double ble_analytics_hr(const ble_analytics *result)
+{
+        return result->good > 0 ? result->hr_sum / result->good : NAN;
+}
+
+double ble_analytics_spo2(const ble_analytics *result)
+{
+        return result->good > 0 ? result->spo2_sum / result->good : NAN;
+}
+
+double ble_analytics_quality(const ble_analytics *result)
+{
+        return result->assessed > 0 ? (double)result->good / result->assessed : NAN;
+}
+
+// Centred 5-sample moving average, cut short at the window edges
+static void _smooth(const uint16_t *x, uint32_t n, double *sum, double *out)
+{
+        sum[0] = 0.0;
+        for (uint32_t i = 0; i < n; i++)
+                sum[i + 1] = sum[i] + x[i];
+        for (uint32_t i = 0; i < n; i++)
+        {
+                uint32_t a = i >= SMOOTH_HALF ? i - SMOOTH_HALF : 0;
+                uint32_t b = MIN(i + SMOOTH_HALF + 1, n);
+                out[i] = (sum[b] - sum[a]) / (b - a);
+        }
+}
+
+// Smoothed IR minus its one-second moving average, for beat detection only.
+// `sum` still holds the IR prefix sums.
+static void _detrend(const double *sum, const double *smooth, uint32_t n, double *out)
+{
+        for (uint32_t i = 0; i < n; i++)
+        {
+                uint32_t c = i >= DETREND_HALF ? i - DETREND_HALF : 0;
+                uint32_t d = MIN(i + DETREND_HALF + 1, n);
+                out[i] = smooth[i] - (sum[d] - sum[c]) / (d - c);
+        }
+}
+
+static int64_t _sample_time(const analytics_window *w, uint32_t sample)
+{
+        return w->times[sample / PACKAGE_SAMPLES] + SAMPLE_US(sample % PACKAGE_SAMPLES);
+}
+
+static int _clipped(const uint16_t *x, uint32_t n)
+{
+        for (uint32_t i = 0; i < n; i++)
+                if (x[i] == 0 || x[i] == UINT16_MAX)
+                        return true;
+        return false;
+}
+
+static int _compare_double(const void *a, const void *b)
+{
+        double x = *(const double*)a, y = *(const double*)b;
+        return x < y ? -1 : x > y;
+}
+
+/*
+ * Absorption peaks are minima of the detected light: local minima of the
+ * detrended IR, at least REFRACTORY_SAMPLES apart. A candidate's height is
+ * its drop from the highest detrended level in the REFRACTORY_SAMPLES
+ * before it, which the residual baseline wander hardly changes. Candidates
+ * below PEAK_FRACTION of the PEAK_REFERENCE quantile of heights, such as
+ * dicrotic notches, are dropped.
+ */
+static uint32_t _find_peaks(analytics_window *w, uint32_t n)
+{
+        const double *v = w->detrended;
+        uint32_t count = 0, kept = 0;
+
+        for (uint32_t i = 1; i + 1 < n; i++)
+        {
+                if (v[i] >= 0.0 || v[i] > v[i - 1] || v[i] >= v[i + 1])
+                        continue;
+                if (count > 0 && i - w->peaks[count - 1] < REFRACTORY_SAMPLES)
+                {
+                        if (v[i] < v[w->peaks[count - 1]])
+                                w->peaks[count - 1] = i;
+                        continue;
+                }
+                w->peaks[count++] = i;
+        }
+        if (count == 0)
+                return 0;
+
+        double *height = w->scratch + count;
+        for (uint32_t k = 0; k < count; k++)
+        {
+                uint32_t i = w->peaks[k];
+                double top = v[i];
+                for (uint32_t j = i > REFRACTORY_SAMPLES ? i - REFRACTORY_SAMPLES : 0; j < i; j++)
+                        top = fmax(top, v[j]);
+                height[k] = w->scratch[k] = top - v[i];
+        }
+        qsort(w->scratch, count, sizeof(double), _compare_double);
+        double threshold = PEAK_FRACTION * w->scratch[(uint32_t)(PEAK_REFERENCE * (count - 1))];
+        for (uint32_t k = 0; k < count; k++)
+                if (height[k] >= threshold)
+                        w->peaks[kept++] = w->peaks[k];
+        return kept;
+}
+
+/*
+ * Pulse amplitude over DC of a beat: the highest light level between two
+ * absorption peaks, above the straight line joining them so that baseline
+ * wander cancels out. Median over the beats of the window.
+ */
+static double _perfusion(analytics_window *w, const double *x, uint32_t peaks)
+{
+        for (uint32_t k = 1; k < peaks; k++)
+        {
+                uint32_t a = w->peaks[k - 1], b = w->peaks[k], top = a;
+                for (uint32_t i = a + 1; i < b; i++)
+                        if (x[i] > x[top])
+                                top = i;
+                double line = x[a] + (x[b] - x[a]) * (top - a) / (b - a);
+                w->scratch[k - 1] = (x[top] - line) / x[top];
+        }
+        qsort(w->scratch, peaks - 1, sizeof(double), _compare_double);
+        return w->scratch[(peaks - 1) / 2];
+}
+
+// SpO2 from the ratio of ratios, Maxim's MAX3010x reference curve
+static double _spo2(double ratio)
+{
+        double spo2 = -45.060 * ratio * ratio + 30.354 * ratio + 94.845;
+        return fmin(fmax(spo2, 0.0), 100.0);
+}
+
+static void _window_assess(analytics_window *w, ble_analytics *result)
+{
+        uint32_t n = w->kept * PACKAGE_SAMPLES;
+
+        if (w->frames < BLE_ANALYTICS_MIN_COVERAGE * WINDOW_NOMINAL_FRAMES)
+                return;
+        result->assessed++;
+        if (_clipped(w->red, n) || _clipped(w->ir, n))
+                return;
+
+        _smooth(w->red, n, w->sum, w->smooth_red);
+        _smooth(w->ir, n, w->sum, w->smooth_ir);
+        _detrend(w->sum, w->smooth_ir, n, w->detrended);
+
+        // A finger moving or taken off shifts the DC level
+        double low = w->smooth_ir[0], high = low;
+        for (uint32_t i = 1; i < n; i++)
+        {
+                low = fmin(low, w->smooth_ir[i]);
+                high = fmax(high, w->smooth_ir[i]);
+        }
+        if (low <= 0.0 || high > (1.0 + BLE_ANALYTICS_MAX_DRIFT) * low)
+                return;
+
+        uint32_t peaks = _find_peaks(w, n);
+        if (peaks < 3)
+                return;
+
+        double mean = 0.0, square = 0.0;
+        for (uint32_t i = 1; i < peaks; i++)
+        {
+                double interval = (double)(_sample_time(w, w->peaks[i]) - _sample_time(w, w->peaks[i - 1]));
+                mean += interval;
+                square += interval * interval;
+        }
+        mean /= peaks - 1;
+        double sd = sqrt(fmax(square / (peaks - 1) - mean * mean, 0.0));
+        double hr = 60e6 / mean;
+        if (sd / mean > BLE_ANALYTICS_MAX_IRREGULARITY || hr < BLE_ANALYTICS_MIN_HR || hr > BLE_ANALYTICS_MAX_HR)
+                return;
+
+        double perfusion_ir = _perfusion(w, w->smooth_ir, peaks);
+        double perfusion_red = _perfusion(w, w->smooth_red, peaks);
+        if (!(perfusion_ir >= BLE_ANALYTICS_MIN_PERFUSION && perfusion_ir <= BLE_ANALYTICS_MAX_PERFUSION) ||
+            perfusion_red <= 0.0)
+                return;
+
+        double spo2 = _spo2(perfusion_red / perfusion_ir);
+        result->good++;
+        result->hr_sum += hr;
+        result->hr_min = fmin(result->hr_min, hr);
+        result->hr_max = fmax(result->hr_max, hr);
+        result->spo2_sum += spo2;
+        result->spo2_min = fmin(result->spo2_min, spo2);
+        result->spo2_max = fmax(result->spo2_max, spo2);
+}
+
+static int64_t _ceil_div(int64_t a, int64_t b)
+{
+        return a / b + (a % b != 0);
+}
+
+static void _analyse(const ble_reader   *reader,
+                     int64_t            t_begin,
+                     int64_t            t_end,
+                     analytics_window   *w,
+                     ble_analytics      *result)
+{
+        ble_view view;
+
+        if (reader->blocks == 0 || t_end <= t_begin)
+                return;
+
+        int64_t t0 = reader->index[0].t_first;
+        int64_t t_last = reader->index[reader->blocks - 1].t_last;
+        int64_t last = (t_last - t0) / BLE_ANALYTICS_WINDOW_US;
+        int64_t first = t_begin <= t0 ? 0 : t_begin > t_last ? last + 1 :
+                        _ceil_div(t_begin - t0, BLE_ANALYTICS_WINDOW_US);
+        int64_t end = t_end <= t0 ? 0 : t_end > t_last ? last + 1 :
+                      _ceil_div(t_end - t0, BLE_ANALYTICS_WINDOW_US);
+        if (end <= first)
+                return;
+        result->windows += end - first;
+
+        w->index = -1;
+        ble_range_init(&w->range, reader, t0 + first * BLE_ANALYTICS_WINDOW_US,
+                       t0 + end * BLE_ANALYTICS_WINDOW_US - 1);
+        while (ble_range_next(&w->range, &view))
+        {
+                for (uint32_t i = 0; i < view.count; i++)
+                {
+                        int64_t index = (view.times[i] - t0) / BLE_ANALYTICS_WINDOW_US;
+                        if (index != w->index)
+                        {
+                                if (w->index >= 0)
+                                        _window_assess(w, result);
+                                w->index = index;
+                                w->frames = 0;
+                                w->kept = 0;
+                        }
+                        w->frames++;
+                        if (w->kept == WINDOW_MAX_FRAMES)
+                                continue;
+
+                        size_t offset = (size_t)w->kept * PACKAGE_SAMPLES;
+                        w->times[w->kept] = view.times[i];
+                        memcpy(w->red + offset, view.red + (size_t)i * PACKAGE_SAMPLES, PACKAGE_SAMPLES * sizeof(uint16_t));
+                        memcpy(w->ir + offset, view.ir + (size_t)i * PACKAGE_SAMPLES, PACKAGE_SAMPLES * sizeof(uint16_t));
+                        w->kept++;
+                }
+                result->frames += view.count;
+        }
+        if (w->index >= 0)
+                _window_assess(w, result);
+}
+
+int ble_analytics_range(const ble_reader        *reader,
+                        int64_t                 t_begin,
+                        int64_t                 t_end,
+                        ble_analytics           *result)
+{
+        analytics_window *w = _window_new();
+
+        if (w == NULL)
+                return -1;
+        _analyse(reader, t_begin, t_end, w, result);
+        _window_free(w);
+        return 0;
+}
+
+/*
+ * Work-stealing batch. A task either opens a recording, which pushes its
+ * chunks but the first back onto the same deque and runs that one, or
+ * analyses a chunk. The last chunk of a recording to finish merges them in
+ * order and closes the reader. `pending` counts tasks queued or running,
+ * `queued` those not taken yet; idle workers sleep on `wake` until either
+ * moves.
+ */
+
+typedef struct _batch_recording {
+        ble_analytics_item      *item;
+        ble_reader              *reader;
+        ble_analytics           *chunks;
+        guint                   count;
+        gint                    remaining;
+} batch_recording;
+
+typedef struct _batch_task {
+        batch_recording         *recording;
+        guint                   chunk;          // BATCH_OPEN to open the recording
+} batch_task;
+
+typedef struct _batch_deque {
+        GMutex                  lock;
+        batch_task              *tasks;
+        guint                   head;           // oldest, taken by thieves
+        guint                   tail;           // past the newest, taken by the owner
+        guint                   capacity;
+} batch_deque;
+
+typedef struct _batch batch;
+
+typedef struct _batch_worker {
+        batch                   *batch;
+        batch_deque             deque;
+        guint32                 seed;
+        analytics_window        *window;
+} batch_worker;
+
+struct _batch {
+        batch_worker            *workers;
+        guint                   threads;
+        gint                    pending;
+        gint                    queued;
+        GMutex                  lock;           // for wake
+        GCond                   wake;
+};
+
+static void _batch_wake(batch *b)
+{
+        g_mutex_lock(&b->lock);
+        g_cond_broadcast(&b->wake);
+        g_mutex_unlock(&b->lock);
+}
+
+// Until a task shows up to steal or the batch is over
+static void _batch_idle(batch *b)
+{
+        g_mutex_lock(&b->lock);
+        while (g_atomic_int_get(&b->pending) > 0 && g_atomic_int_get(&b->queued) == 0)
+                g_cond_wait(&b->wake, &b->lock);
+        g_mutex_unlock(&b->lock);
+}
+
+static void _deque_push(batch_deque *deque, batch_task task)
+{
+        g_mutex_lock(&deque->lock);
+        if (deque->tail == deque->capacity)
+        {
+                if (deque->head > 0)
+                {
+                        memmove(deque->tasks, deque->tasks + deque->head,
+                                (deque->tail - deque->head) * sizeof(batch_task));
+                        deque->tail -= deque->head;
+                        deque->head = 0;
+                }
+                else
+                {
+                        deque->capacity = MAX(deque->capacity * 2, 16);
+                        deque->tasks = g_renew(batch_task, deque->tasks, deque->capacity);
+                }
+        }
+        deque->tasks[deque->tail++] = task;
+        g_mutex_unlock(&deque->lock);
+}
+
+static gboolean _deque_take(batch_deque *deque, batch_task *task, gboolean newest)
+{
+        gboolean found = false;
+
+        g_mutex_lock(&deque->lock);
+        if (deque->tail > deque->head)
+        {
+                *task = newest ? deque->tasks[--deque->tail] : deque->tasks[deque->head++];
+                if (deque->head == deque->tail)
+                        deque->head = deque->tail = 0;
+                found = true;
+        }
+        g_mutex_unlock(&deque->lock);
+        return found;
+}
+
+static gboolean _steal(batch_worker *self, batch_task *task)
+{
+        batch *b = self->batch;
+
+        // xorshift32, so that thieves spread over their victims
+        self->seed ^= self->seed << 13;
+        self->seed ^= self->seed >> 17;
+        self->seed ^= self->seed << 5;
+        for (guint i = 0, start = self->seed % b->threads; i < b->threads; i++)
+        {
+                batch_worker *victim = &b->workers[(start + i) % b->threads];
+                if (victim != self && _deque_take(&victim->deque, task, false))
+                        return true;
+        }
+        return false;
+}
+
+static void _run_chunk(batch_worker *self, batch_recording *recording, guint chunk)
+{
+        const ble_reader *reader = recording->reader;
+        int64_t begin = reader->index[0].t_first + (int64_t)chunk * BLE_ANALYTICS_CHUNK_US;
+
+        _analyse(reader, begin, begin + BLE_ANALYTICS_CHUNK_US, self->window, &recording->chunks[chunk]);
+        if (!g_atomic_int_dec_and_test(&recording->remaining))
+                return;
+
+        for (guint i = 0; i < recording->count; i++)
+                ble_analytics_merge(&recording->item->result, &recording->chunks[i]);
+        g_free(recording->chunks);
+        ble_reader_close(recording->reader);
+        recording->reader = NULL;
+}
+
+static void _run_open(batch_worker *self, batch_recording *recording)
+{
+        ble_reader *reader = ble_reader_open(recording->item->path);
+
+        if (reader == NULL)
+        {
+                recording->item->status = -1;
+                return;
+        }
+        if (reader->blocks == 0)
+        {
+                ble_reader_close(reader);
+                return;
+        }
+
+        int64_t span = reader->index[reader->blocks - 1].t_last - reader->index[0].t_first;
+        recording->reader = reader;
+        recording->count = (guint)(span / BLE_ANALYTICS_CHUNK_US + 1);
+        recording->chunks = g_new(ble_analytics, recording->count);
+        for (guint i = 0; i < recording->count; i++)
+                ble_analytics_init(&recording->chunks[i]);
+        g_atomic_int_set(&recording->remaining, (gint)recording->count);
+
+        g_atomic_int_add(&self->batch->pending, (gint)recording->count - 1);
+        for (guint i = recording->count - 1; i > 0; i--)
+                _deque_push(&self->deque, (batch_task){ recording, i });
+        if (recording->count > 1)
+        {
+                g_atomic_int_add(&self->batch->queued, (gint)recording->count - 1);
+                _batch_wake(self->batch);
+        }
+        _run_chunk(self, recording, 0);
+}
+
+static gpointer _batch_work(gpointer data)
+{
+        batch_worker *self = data;
+        batch *b = self->batch;
+        batch_task task;
+
+        while (g_atomic_int_get(&b->pending) > 0)
+        {
+                if (!_deque_take(&self->deque, &task, true) && !_steal(self, &task))
+                {
+                        _batch_idle(b);
+                        continue;
+                }
+                g_atomic_int_add(&b->queued, -1);
+                if (task.chunk == BATCH_OPEN)
+                        _run_open(self, task.recording);
+                else
+                        _run_chunk(self, task.recording, task.chunk);
+                if (g_atomic_int_dec_and_test(&b->pending))
+                        _batch_wake(b);
+        }
+        return NULL;
+}
+
+static int _compare_size(const void *a, const void *b)
+{
+        const batch_recording *x = a, *y = b;
+        return x->item->size < y->item->size ? 1 : x->item->size > y->item->size ? -1 : 0;
+}
+
+void ble_analytics_batch(ble_analytics_item *items, size_t n, int threads)
+{
+        batch b = { .threads = threads > 0 ? (guint)threads : g_get_num_processors() };
+        batch_recording *recordings = g_new0(batch_recording, n);
+        GThread **handles = g_new(GThread*, b.threads);
+        guint started = 0;
+
+        b.workers = g_new0(batch_worker, b.threads);
+        b.pending = (gint)n;
+        b.queued = (gint)n;
+        g_mutex_init(&b.lock);
+        g_cond_init(&b.wake);
+        for (size_t i = 0; i < n; i++)
+        {
+                items[i].status = 0;
+                ble_analytics_init(&items[i].result);
+                recordings[i].item = &items[i];
+        }
+
+        // As many workers as there are windows to analyse with
+        for (guint t = 0; t < b.threads; t++)
+        {
+                b.workers[started].window = _window_new();
+                if (b.workers[started].window != NULL)
+                        started++;
+        }
+        b.threads = started;
+        if (b.threads == 0)
+        {
+                for (size_t i = 0; i < n; i++)
+                        items[i].status = -1;
+                goto DONE;
+        }
+
+        // Largest first: dealt round robin and pushed last, so each owner
+        // starts on its biggest recording and thieves take the small ones
+        qsort(recordings, n, sizeof(*recordings), _compare_size);
+        for (guint t = 0; t < b.threads; t++)
+        {
+                b.workers[t].batch = &b;
+                b.workers[t].seed = 2463534242u + t;
+                g_mutex_init(&b.workers[t].deque.lock);
+        }
+        for (size_t i = n; i > 0; i--)
+                _deque_push(&b.workers[(i - 1) % b.threads].deque, (batch_task){ &recordings[i - 1], BATCH_OPEN });
+
+        for (guint t = 0; t < b.threads; t++)
+                handles[t] = g_thread_new("analytics", _batch_work, &b.workers[t]);
+        for (guint t = 0; t < b.threads; t++)
+                g_thread_join(handles[t]);
+
+        for (guint t = 0; t < b.threads; t++)
+        {
+                _window_free(b.workers[t].window);
+                g_free(b.workers[t].deque.tasks);
+                g_mutex_clear(&b.workers[t].deque.lock);
+        }
+DONE:
+        g_mutex_clear(&b.lock);
+        g_cond_clear(&b.wake);
+        g_free(b.workers);
+        g_free(handles);
+        g_free(recordings);
+}
@@ -0,0 +1,79 @@
+#ifndef BLE_MEDICAL_ANALYTICS_H
+#define BLE_MEDICAL_ANALYTICS_H
+
+#include "ble_medical_reader.h"
+
+/*
+ * Heart rate, SpO2 and signal quality recomputed from recorded samples.
+ *
+ * A recording is cut into BLE_ANALYTICS_WINDOW_US windows aligned on its
+ * first frame. Windows holding at least BLE_ANALYTICS_MIN_COVERAGE of their
+ * nominal frames are assessed. Beats are the IR absorption peaks (signal
+ * minima) at least BLE_ANALYTICS_REFRACTORY_US apart, found on the IR
+ * stream detrended by a one-second moving average. Perfusion is the pulse
+ * amplitude over DC, taken per beat above the line joining its two
+ * absorption peaks so that baseline wander cancels, and SpO2 comes from the
+ * ratio of red to IR perfusion through the MAX3010x calibration curve. A
+ * window is good when nothing is clipped, the IR level stays within
+ * BLE_ANALYTICS_MAX_DRIFT, its perfusion is plausible and its beats are
+ * regular and in the heart rate range. HR and SpO2 are taken over good
+ * windows only; quality is the share of assessed windows that are good.
+ *
+ * Windows are independent, so any stretch of a recording can be analysed on
+ * its own: a window belongs to the range that holds its start, and partial
+ * results merge exactly.
+ *
+ * Batches spread recordings over worker threads that steal work from each
+ * other. Every worker owns a deque of tasks, runs its newest one and, once
+ * empty, steals the oldest task of another worker. Opening a recording cuts
+ * it into BLE_ANALYTICS_CHUNK_US chunks pushed onto the opener's deque, so
+ * one long recording still spreads over every core. Recordings are mapped,
+ * not read, and decoded one block at a time.
+ */
+
+#define BLE_ANALYTICS_WINDOW_US         8000000
+#define BLE_ANALYTICS_CHUNK_US          ((int64_t)225 * BLE_ANALYTICS_WINDOW_US)  // 30 minutes
+#define BLE_ANALYTICS_MIN_COVERAGE      0.75
+#define BLE_ANALYTICS_REFRACTORY_US     250000  // 240 bpm
+#define BLE_ANALYTICS_MIN_HR            30.0
+#define BLE_ANALYTICS_MAX_HR            240.0
+#define BLE_ANALYTICS_MAX_IRREGULARITY  0.25    // beat interval sd over mean
+#define BLE_ANALYTICS_MIN_PERFUSION     0.0002  // IR pulse amplitude over DC
+#define BLE_ANALYTICS_MAX_PERFUSION     0.2
+#define BLE_ANALYTICS_MAX_DRIFT         0.2     // of the IR DC level over a window
+
+typedef struct _ble_analytics {
+        uint64_t        frames;
+        uint64_t        windows;        // spanned by the frames, assessed or not
+        uint64_t        assessed;
+        uint64_t        good;
+        double          hr_sum;         // bpm, over good windows
+        double          hr_min;
+        double          hr_max;
+        double          spo2_sum;       // percent, over good windows
+        double          spo2_min;
+        double          spo2_max;
+} ble_analytics;
+
+typedef struct _ble_analytics_item {
+        const char      *path;          // set by the caller
+        uint64_t        size;           // bytes, a scheduling hint; 0 if unknown
+        int             status;         // 0, or -1 when the recording is unreadable
+        ble_analytics   result;
+} ble_analytics_item;
+
+void ble_analytics_init(ble_analytics*);
+void ble_analytics_merge(ble_analytics*, const ble_analytics*);
+// Means are NaN without a good window
+double ble_analytics_hr(const ble_analytics*);
+double ble_analytics_spo2(const ble_analytics*);
+double ble_analytics_quality(const ble_analytics*);
+
+// Adds the windows starting in [t_begin, t_end) to `result`
+int ble_analytics_range(const ble_reader*, int64_t t_begin, int64_t t_end, ble_analytics *result);
+
+// Blocking; `threads` <= 0 uses every processor. Fills status and result of
+// each item; every status is -1 when not even one worker could start.
+void ble_analytics_batch(ble_analytics_item *items, size_t n, int threads);
+
+#endif
@@ -1,6 +1,7 @@
 #include "ble_medical_bluetooth.h"
 #include "ble_medical_debug.h"
 #include "ble_medical_data.h"
+#include "ble_medical_device.h"
 #include "credentials.h"
 
 #include <glib/gi18n.h>
@@ -8,6 +9,7 @@
 #include <simpleble_c/simpleble.h>
 
 #define PERIPHERAL_LIST_MAX 10 // Default size for peripherals list
+#define BLUETOOTH_UI_RESOURCE "/org/gtk/ble-medical/bluetooth.ui"
 #define DEFAULT_BLE_SERVICE_NAME "LMAO"
 #define G_OBJECT_TRANSFER_DATA(DEST, SRC, KEY) g_object_set_data(SRC, KEY, g_object_get_data(DEST, KEY))
 
@@ -42,6 +44,34 @@ typedef struct _twin_list_1 {
         simpleble_adapter_t adapter;
 } _twin_list_1;
 
+enum {
+        VERIFY_PENDING,
+        VERIFY_OK,
+        VERIFY_FAILED,
+        VERIFY_DROPPED          // answered, disconnected as not chosen
+};
+
+// One round of probing the scanned peripherals, started by activating a
+// row. Every candidate is probed by its own task; the activated address is
+// taken when it answers, another one only once it has failed. Candidates
+// that answered stay connected as fallbacks until one is taken or the round
+// is cancelled.
+typedef struct _verify_session {
+        gint                    ref;            // main thread only
+        GObject                 *bled;
+        GCancellable            *cancellable;
+        simpleble_peripheral_t  *peripherals;   // the dialog's list
+        size_t                  count;
+        size_t                  selected;       // count when not in the list
+        gint                    *results;
+        size_t                  pending;
+        gssize                  chosen;         // -1 until one is taken
+        gboolean                released;       // dialog closed, the list is ours
+        size_t                  keep;           // handle the plotter took then
+} verify_session;
+
+static void _verify_cancel(verify_session *session);
+
 // Update information about a peripheral 's services
 void _load_peripherals_info(gpointer data)
 {
@@ -69,13 +99,26 @@ void _close_button_clicked(GtkButton *self, gpointer data)
         size_t peripheral_len   = GPOINTER_TO_SIZE(_pl);
         main_list[0] = plist[peripheral_index];
 
-        for (size_t i = 0; i < peripheral_len; i++)
+        verify_session *session = (verify_session*) g_object_get_data(bled, "verify_session");
+        g_object_set_data(bled, "verify_next", NULL);
+        if (session != NULL && session->ref > 1)
         {
-                if (i != peripheral_index)
-                        simpleble_peripheral_release_handle(plist[i]);
+                // Probes or disconnects still use the handles; the last one
+                // to finish releases them
+                session->released = true;
+                session->keep = peripheral_index;
+                _verify_cancel(session);
         }
-
-        g_free(plist);
+        else
+        {
+                for (size_t i = 0; i < peripheral_len; i++)
+                {
+                        if (i != peripheral_index)
+                                simpleble_peripheral_release_handle(plist[i]);
+                }
+                g_free(plist);
+        }
+        g_object_set_data(bled, "verify_session", NULL);
         g_object_set_data(bled, "peripherals_list", NULL);
         g_object_set_data(bled, "main_peripheral", main_list);
 
@@ -88,8 +131,8 @@ void _close_button_clicked(GtkButton *self, gpointer data)
         gtk_label_set_text(GTK_LABEL(_label), _label_text);
 
         simpleble_free(_identifier);
+        // Hidden, not destroyed, so the connect button can present it again
         gtk_window_close(GTK_WINDOW(bled));
-        g_object_unref(G_OBJECT(bled));
 }
 
 void _adapter_on_scan_found(    simpleble_adapter_t adapter, 
@@ -126,6 +169,14 @@ void _adapter_on_scan_stop(simpleble_adapter_t adapter, void *data)
 void _adapter_on_scan_start(simpleble_adapter_t adapter, void *data)
 {
 }
+typedef struct _peripherals_scan {
+        GObject                 *bled;
+        simpleble_peripheral_t  *list;
+        size_t                  count;
+} peripherals_scan;
+
+static gboolean _peripherals_scanned(gpointer data);
+
 void _load_peripherals(gpointer data)
 {
         simpleble_err_t err_code = SIMPLEBLE_SUCCESS;
@@ -133,15 +184,11 @@ void _load_peripherals(gpointer data)
         GtkTreeView     *adapters_tree = (GtkTreeView*)data;
         GObject         *bled_obj = (GObject*) g_object_get_data(G_OBJECT(data), "bled");
         simpleble_adapter_t     adapter = simpleble_adapter_get_handle(GPOINTER_TO_INT(g_object_get_data(G_OBJECT(data), "adapter")));
-        GtkTreeIter     iter;
-        GtkListStore    *store = (GtkListStore*) g_object_get_data(bled_obj, "peripherals_store");
 
         size_t                  peripheral_list_len = 0;
         simpleble_peripheral_t  *peripheral_list = (simpleble_peripheral_t*)g_malloc(sizeof(simpleble_peripheral_t) * PERIPHERAL_LIST_MAX);
         _twin_list              _tmp_0 = {&peripheral_list_len, peripheral_list};
 
-        g_object_set_data(bled_obj, "peripherals_list", peripheral_list);
-
         simpleble_adapter_set_callback_on_scan_start(adapter, _adapter_on_scan_start, &_tmp_0);
         simpleble_adapter_set_callback_on_scan_stop(adapter, _adapter_on_scan_stop, &_tmp_0);
         simpleble_adapter_set_callback_on_scan_found(adapter, _adapter_on_scan_found, &_tmp_0);
@@ -149,98 +196,337 @@ void _load_peripherals(gpointer data)
         simpleble_adapter_scan_for(adapter, 5000);
         _debug_print("Scanning for peripherals");
 
-        g_object_set_data(bled_obj, "peripherals_count", GSIZE_TO_POINTER(peripheral_list_len));
+        // The list replaces the dialog's on the main loop, where a round
+        // probing the old one can be cancelled first
+        peripherals_scan *scan = g_new0(peripherals_scan, 1);
+        scan->bled = g_object_ref(bled_obj);
+        scan->list = peripheral_list;
+        scan->count = peripheral_list_len;
+        g_idle_add(_peripherals_scanned, scan);
+}
 
-        for (size_t i = 0; i < peripheral_list_len; i++)
-        {
-                _debug_print("Peripherals: ");
-                simpleble_peripheral_t  peripheral = peripheral_list[i];
-                char    *peripheral_identifier = simpleble_peripheral_identifier(peripheral);
-                char    *peripheral_address = simpleble_peripheral_address(peripheral);
+// Blocking; leaves the peripheral connected only when it answers with a
+// whole frame. Cancellation is checked before connecting and after the read.
+gint _verify_peripherals(simpleble_peripheral_t peri, GCancellable *cancellable)
+{
+        simpleble_uuid_t service, characteristic;
 
-                _debug_print("Peripherals list: ");
-                _debug_print(peripheral_identifier);
+        if (g_cancellable_is_cancelled(cancellable))
+                return false;
+        if (!ble_device_verify(peri, &service, &characteristic))
+                return false;
+        if (g_cancellable_is_cancelled(cancellable))
+        {
+                simpleble_peripheral_disconnect(peri);
+                return false;
+        }
+        _debug_print("Connection verified");
+        return true;
+}
 
-                gtk_list_store_append(store, &iter);
-                gtk_list_store_set(store, &iter,
-                ADDRESS_S_COL, peripheral_address,
-                IDENTIFIER_S_COL, peripheral_identifier,
-                CONNECTION_S_COL, "Unconnected", -1);
+static verify_session *_verify_session_ref(verify_session *session)
+{
+        session->ref++;
+        return session;
+}
 
-                simpleble_free(peripheral_identifier);
-                simpleble_free(peripheral_address);
+static void _verify_session_unref(verify_session *session)
+{
+        if (--session->ref > 0)
+                return;
+        if (session->released)
+        {
+                for (size_t i = 0; i < session->count; i++)
+                {
+                        if (i != session->keep)
+                                simpleble_peripheral_release_handle(session->peripherals[i]);
+                }
+                g_free(session->peripherals);
         }
+        g_object_unref(session->cancellable);
+        g_object_unref(session->bled);
+        g_free(session->results);
+        g_free(session);
+}
 
+static void _set_peripheral_state(verify_session *session, size_t index, const char *state)
+{
+        GtkListStore    *store = (GtkListStore*) g_object_get_data(session->bled, "peripherals_store");
+        GtkTreeIter     iter;
+
+        // Rows were appended in scan order, like the list
+        if (!session->released &&
+            gtk_tree_model_iter_nth_child(GTK_TREE_MODEL(store), &iter, NULL, (gint)index))
+                gtk_list_store_set(store, &iter, CONNECTION_S_COL, state, -1);
 }
 
-gint _verify_peripherals(simpleble_peripheral_t peri)
+static void _disconnect_thread(GTask *task, gpointer source, gpointer data, GCancellable *cancellable)
 {
-        char *_tmp_address = simpleble_peripheral_address(peri);
-        char *_tmp_identifier = simpleble_peripheral_identifier(peri);
+        simpleble_peripheral_disconnect((simpleble_peripheral_t)data);
+        g_task_return_boolean(task, true);
+}
+
+static void _disconnect_done(GObject *source, GAsyncResult *result, gpointer data)
+{
+        _verify_session_unref((verify_session*)data);
+}
 
-        // Attempt connecting
-        simpleble_err_t err_code = simpleble_peripheral_connect(peri);
-        if (err_code != SIMPLEBLE_SUCCESS)
+// Off the main loop, as a disconnect waits for the peripheral
+static void _disconnect_in_background(verify_session *session, size_t index)
+{
+        GTask *task = g_task_new(NULL, NULL, _disconnect_done, _verify_session_ref(session));
+        g_task_set_task_data(task, session->peripherals[index], NULL);
+        g_task_run_in_thread(task, _disconnect_thread);
+        g_object_unref(task);
+}
+
+// Disconnects the fallbacks that answered, all but `chosen` and the handle
+// the plotter kept
+static void _verify_drop(verify_session *session, gssize chosen)
+{
+        for (size_t i = 0; i < session->count; i++)
         {
-                _debug_print("Peripheral connection failed");
-                exit(1);
+                if ((gssize)i == chosen || session->results[i] != VERIFY_OK ||
+                    (session->released && session->keep == i))
+                        continue;
+                session->results[i] = VERIFY_DROPPED;
+                _disconnect_in_background(session, i);
+                _set_peripheral_state(session, i, "Unconnected");
         }
-        else
+}
+
+static void _verify_cancel(verify_session *session)
+{
+        g_cancellable_cancel(session->cancellable);
+        _verify_drop(session, session->chosen);
+}
+
+static void _verify_choose(verify_session *session, size_t index)
+{
+        GObject *bled = session->bled;
+
+        session->chosen = (gssize)index;
+        _verify_cancel(session);
+        if (session->released)
+                return;
+
+        // A sensor taken by an earlier round gives way
+        size_t previous = GPOINTER_TO_SIZE(g_object_get_data(bled, "peripheral_index"));
+        if (g_object_get_data(bled, "verified_connection") != NULL && previous != index && previous < session->count)
         {
-                _debug_print("Peripheral connection success");
+                _disconnect_in_background(session, previous);
+                _set_peripheral_state(session, previous, "Unconnected");
         }
+        _set_peripheral_state(session, index, "Connected");
+        g_object_set_data(bled, "verified_connection", GINT_TO_POINTER(true));
+        g_object_set_data(bled, "peripheral_index", GSIZE_TO_POINTER(index));
+        g_object_set_data(bled, "service_connected", GINT_TO_POINTER(1));
+        g_object_set_data(bled, "characteristic_connected", GINT_TO_POINTER(1));
+}
 
-        size_t services_count = simpleble_peripheral_services_count(peri);
-        g_print("%zu services\n", services_count);
-        // Check for specialized BLE services
-
-        for (size_t i = 0; i < services_count; i++)
+static void _verify_decide(verify_session *session)
+{
+        if (session->chosen >= 0 || g_cancellable_is_cancelled(session->cancellable))
+                return;
+        if (session->selected < session->count)
         {
-                simpleble_service_t service;
-                err_code = simpleble_peripheral_services_get(peri, i, &service);
-                if (err_code != SIMPLEBLE_SUCCESS)
+                if (session->results[session->selected] == VERIFY_OK)
                 {
-                        _debug_print("Failed to get service");
-                        exit(1);
+                        _verify_choose(session, session->selected);
+                        return;
                 }
-
-                if (g_strcmp0(service.uuid.value, DEFAULT_SERVICE_UUID) == 0)
+                if (session->results[session->selected] == VERIFY_PENDING)
+                        return;
+        }
+        for (size_t i = 0; i < session->count; i++)
+        {
+                if (session->results[i] == VERIFY_OK)
                 {
-                        for (size_t j = 0; j < service.characteristic_count; j++)
-                        {
-                                if (g_strcmp0(service.characteristics[j].uuid.value, DEFAULT_CHARACTERISTIC_UUID) == 0)
-                                {
-                                        // Found the correct ones
-                                        uint8_t *data = NULL;
-                                        size_t data_length;
-                                        _debug_print("Start receiving . . . ");
-                                        err_code = simpleble_peripheral_read(peri, service.uuid, service.characteristics[j].uuid, &data, &data_length);
-                                        if (data_length == PACKAGE_SIZE)
-                                        {
-                                                _debug_print("Connection verified");
-                                                simpleble_free(data);
-                                                return true;
-                                        }
-                                        simpleble_free(data);
-                                }
-                        }
+                        _verify_choose(session, i);
+                        return;
                 }
         }
+}
+
+static void _verify_start(GObject *bled, const char *address);
+
+static void _verify_thread(GTask *task, gpointer source, gpointer data, GCancellable *cancellable)
+{
+        simpleble_peripheral_t peri = (simpleble_peripheral_t)data;
+
+        if (g_cancellable_is_cancelled(cancellable))
+                g_task_return_boolean(task, false);
+        else
+                g_task_return_boolean(task, _verify_peripherals(peri, cancellable));
+}
+
+static void _verify_done(GObject *source, GAsyncResult *result, gpointer data)
+{
+        verify_session  *session = (verify_session*)data;
+        size_t          index = GPOINTER_TO_SIZE(g_object_get_data(G_OBJECT(result), "index"));
+        gboolean        ok = g_task_propagate_boolean(G_TASK(result), NULL);
+
+        session->results[index] = ok ? VERIFY_OK : VERIFY_FAILED;
+        session->pending--;
+        _verify_decide(session);
+        // An answer after the round settled is not needed; before, it is
+        // kept in case the activated address fails
+        if (session->chosen >= 0 || g_cancellable_is_cancelled(session->cancellable))
+                _verify_drop(session, session->chosen);
+        if (session->results[index] == VERIFY_OK && session->chosen != (gssize)index)
+                _set_peripheral_state(session, index, "Standing by");
+        else if (session->chosen != (gssize)index && session->results[index] != VERIFY_DROPPED)
+                _set_peripheral_state(session, index, g_cancellable_is_cancelled(session->cancellable)
+                                                      ? "Unconnected" : "Unavailable");
+
+        if (session->pending == 0 && !session->released)
+        {
+                g_autofree char *next = g_strdup(g_object_get_data(session->bled, "verify_next"));
+                GObject *_label = g_object_get_data(session->bled, "bluetooth_status");
+
+                if (session->chosen < 0 && next == NULL && !g_cancellable_is_cancelled(session->cancellable))
+                        gtk_label_set_text(GTK_LABEL(_label), "No peripheral answered as a sensor");
+                g_object_set_data(session->bled, "verify_next", NULL);
+                if (next != NULL)
+                        _verify_start(session->bled, next);
+        }
+        _verify_session_unref(session);
+}
+
+// Probes every scanned peripheral at once, on GTask worker threads, and
+// posts each result back to its row
+static void _verify_start(GObject *bled, const char *address)
+{
+        simpleble_peripheral_t  *peripherals = (simpleble_peripheral_t*) g_object_get_data(bled, "peripherals_list");
+        size_t                  count = GPOINTER_TO_SIZE(g_object_get_data(bled, "peripherals_count"));
+        verify_session          *previous = (verify_session*) g_object_get_data(bled, "verify_session");
+
+        if (peripherals == NULL || count == 0)
+                return;
+        // Two rounds would connect the same peripherals at once; the new one
+        // starts when the last probe of the old one is back
+        if (previous != NULL && previous->pending > 0)
+        {
+                _verify_cancel(previous);
+                g_object_set_data_full(bled, "verify_next", g_strdup(address), g_free);
+                return;
+        }
+
+        verify_session *session = g_new0(verify_session, 1);
+        session->ref = 1;
+        session->bled = g_object_ref(bled);
+        session->cancellable = g_cancellable_new();
+        session->peripherals = peripherals;
+        session->count = count;
+        session->selected = count;
+        session->results = g_new0(gint, count);
+        session->chosen = -1;
+        g_object_set_data_full(bled, "verify_session", session, (GDestroyNotify)_verify_session_unref);
+
+        for (size_t i = 0; i < count; i++)
+        {
+                char *peripheral_address = simpleble_peripheral_address(peripherals[i]);
+                if (g_strcmp0(peripheral_address, address) == 0)
+                        session->selected = i;
+                simpleble_free(peripheral_address);
+        }
+
+        // The activated address goes first, in case workers are short
+        for (size_t n = 0; n < count; n++)
+        {
+                size_t i = session->selected < count ? (n == 0 ? session->selected
+                                                               : n <= session->selected ? n - 1 : n)
+                                                     : n;
+                GTask *task = g_task_new(NULL, session->cancellable, _verify_done, _verify_session_ref(session));
+                // The result must come back even when cancelled, so that a
+                // peripheral left connected is known
+                g_task_set_check_cancellable(task, false);
+                g_task_set_task_data(task, peripherals[i], NULL);
+                g_object_set_data(G_OBJECT(task), "index", GSIZE_TO_POINTER(i));
+                session->pending++;
+                _set_peripheral_state(session, i, "Verifying");
+                g_task_run_in_thread(task, _verify_thread);
+                g_object_unref(task);
+        }
+}
 
-        return false;
+// A round still on the old list is cancelled and given the list, which it
+// releases with the last probe back, the sensor it took disconnected
+static void _verify_retire(verify_session *session)
+{
+        GObject *bled = session->bled;
+        size_t  connected = GPOINTER_TO_SIZE(g_object_get_data(bled, "peripheral_index"));
+
+        session->released = true;
+        session->keep = session->count;
+        _verify_cancel(session);
+        if (g_object_get_data(bled, "verified_connection") != NULL && connected < session->count &&
+            session->results[connected] != VERIFY_DROPPED)
+        {
+                session->results[connected] = VERIFY_DROPPED;
+                _disconnect_in_background(session, connected);
+        }
 }
 
+static gboolean _peripherals_scanned(gpointer data)
+{
+        peripherals_scan        *scan = (peripherals_scan*)data;
+        GObject                 *bled = scan->bled;
+        GtkListStore            *store = (GtkListStore*) g_object_get_data(bled, "peripherals_store");
+        verify_session          *session = (verify_session*) g_object_get_data(bled, "verify_session");
+        simpleble_peripheral_t  *old = (simpleble_peripheral_t*) g_object_get_data(bled, "peripherals_list");
+        size_t                  old_count = GPOINTER_TO_SIZE(g_object_get_data(bled, "peripherals_count"));
+        GtkTreeIter             iter;
+
+        g_object_set_data(bled, "verify_next", NULL);
+        if (session != NULL)
+        {
+                _verify_retire(session);
+        }
+        else if (old != NULL)
+        {
+                for (size_t i = 0; i < old_count; i++)
+                        simpleble_peripheral_release_handle(old[i]);
+                g_free(old);
+        }
+        g_object_set_data(bled, "verify_session", NULL);
+        g_object_set_data(bled, "verified_connection", NULL);
+        g_object_set_data(bled, "peripheral_index", NULL);
+        g_object_set_data(bled, "peripherals_list", scan->list);
+        g_object_set_data(bled, "peripherals_count", GSIZE_TO_POINTER(scan->count));
+
+        // Rows follow the list, index for index
+        gtk_list_store_clear(store);
+        for (size_t i = 0; i < scan->count; i++)
+        {
+                _debug_print("Peripherals: ");
+                simpleble_peripheral_t  peripheral = scan->list[i];
+                char    *peripheral_identifier = simpleble_peripheral_identifier(peripheral);
+                char    *peripheral_address = simpleble_peripheral_address(peripheral);
+
+                _debug_print("Peripherals list: ");
+                _debug_print(peripheral_identifier);
 
+                gtk_list_store_append(store, &iter);
+                gtk_list_store_set(store, &iter,
+                ADDRESS_S_COL, peripheral_address,
+                IDENTIFIER_S_COL, peripheral_identifier,
+                CONNECTION_S_COL, "Unconnected", -1);
+
+                simpleble_free(peripheral_identifier);
+                simpleble_free(peripheral_address);
+        }
+        g_object_unref(bled);
+        g_free(scan);
+        return G_SOURCE_REMOVE;
+}
 
 void _peripherals_tree_selected(GtkTreeView     *self,
                                 GtkTreePath     *path,
                                 GtkTreeViewColumn       *column,
                                 gpointer        data)
 {
-        simpleble_err_t         err_code = SIMPLEBLE_SUCCESS;
         GObject                 *bled = (GObject*) g_object_get_data(G_OBJECT(self), "bled");
-        simpleble_peripheral_t  *peripherals = (simpleble_peripheral_t*) g_object_get_data(bled, "peripherals_list");
-        size_t                  peripheral_count = GPOINTER_TO_SIZE (g_object_get_data(bled, "peripherals_count"));
         GtkTreeSelection        *select = (GtkTreeSelection*)data;
         GtkTreeIter             iter;
         GtkTreeModel            *model;
@@ -249,31 +535,9 @@ void _peripherals_tree_selected(GtkTreeView     *self,
         if (gtk_tree_selection_get_selected(select, &model, &iter))
         {
                 gtk_tree_model_get(model, &iter, ADDRESS_P_COL, &address, -1);
-
-                for (size_t i = 0; i < peripheral_count; i++)
-                {
-                        simpleble_peripheral_t _tmp_peripheral = peripherals[i];
-                        if (_verify_peripherals(_tmp_peripheral))
-                        {
-                                gtk_list_store_set(GTK_LIST_STORE(model), &iter,
-                                                CONNECTION_S_COL,
-                                                "Connected", -1);
-                                g_object_set_data(bled, "verified_connection", GINT_TO_POINTER(true));
-                                g_object_set_data(bled, "peripheral_index", GSIZE_TO_POINTER(i));
-                                g_object_set_data(bled, "service_connected", GINT_TO_POINTER(1));
-                                g_object_set_data(bled, "characteristic_connected", GINT_TO_POINTER(1));
-
-                                return;
-                        }
-                        simpleble_peripheral_disconnect(_tmp_peripheral);
-                }
-
-
+                _verify_start(bled, address);
+                g_free(address);
         }
-
-                // Scan the received list of peripherals for one that have the same address as the list
-
-
 }
 void _adapters_tree_selected(   GtkTreeView       *self, 
                                 GtkTreePath       *path, 
@@ -352,70 +616,119 @@ void _adapters_tree_changed(    GtkTreeSelection *selection,
                 g_object_unref(G_OBJECT(buffer));
         }
 }
-void _load_adapters_on_exit()
-{
+typedef struct _adapter_info {
+        gchar   *address;
+        gchar   *identifier;
+} adapter_info;
 
+static void _adapter_info_free(gpointer data)
+{
+        adapter_info *info = (adapter_info*)data;
+        g_free(info->address);
+        g_free(info->identifier);
+        g_free(info);
 }
 
-void _load_adapters(gpointer data)
+// The first SimpleBLE call brings the Bluetooth backend up, which can take a
+// while, so adapters are listed on a worker thread and never on startup
+void _load_adapters(GTask *task, gpointer source, gpointer data, GCancellable *cancellable)
 {
-        simpleble_err_t err_code = SIMPLEBLE_SUCCESS;
         size_t          adapter_count = simpleble_adapter_get_count();
-        GtkTreeIter     iter;
-        GtkListStore    *store = (GtkListStore*)data;
-        GtkEntry        *text = GTK_ENTRY(g_object_get_data(G_OBJECT(data), "text"));
-        GtkTreeView     *tree = g_object_get_data(G_OBJECT(data), "tree");
+        GPtrArray       *adapters = g_ptr_array_new_with_free_func(_adapter_info_free);
 
-        atexit(_load_adapters_on_exit);
-        if (adapter_count == 0)
+        for (size_t i = 0; i < adapter_count; i++)
         {
-                // [TODO]: Reload after 5 seconds. If not, print a message
-                _debug_print("No Bluetooth adapter found");
-                exit(1);
+                simpleble_adapter_t _tmp_adapter = simpleble_adapter_get_handle(i);
+                char    *identifier = simpleble_adapter_identifier(_tmp_adapter);
+                char    *address = simpleble_adapter_address(_tmp_adapter);
+                adapter_info *info = g_new0(adapter_info, 1);
+
+                info->address = g_strdup(address);
+                info->identifier = g_strdup(identifier);
+                g_ptr_array_add(adapters, info);
+
+                simpleble_free(identifier);
+                simpleble_free(address);
+                simpleble_adapter_release_handle(_tmp_adapter);
         }
-        else
-        {
-                GObject         *store_obj = G_OBJECT(store);
-                gpointer        __tmp_ptr = GSIZE_TO_POINTER(adapter_count);
+        g_task_return_pointer(task, adapters, (GDestroyNotify)g_ptr_array_unref);
+}
 
-                g_object_set_data(store_obj, "adapter_count", __tmp_ptr);
-                for (size_t i = 0; i < adapter_count; i++)
-                {
-                        simpleble_adapter_t _tmp_adapter = simpleble_adapter_get_handle(i);
-                        char    *identifier = simpleble_adapter_identifier(_tmp_adapter);
-                        char    *address = simpleble_adapter_address(_tmp_adapter);
+static void _fill_adapters(GObject *bled, GPtrArray *adapters)
+{
+        GtkListStore    *store = (GtkListStore*) g_object_get_data(bled, "adapters_store");
+        GtkTreeIter     iter;
 
-                        gtk_list_store_append(store, &iter);
-                        gtk_list_store_set(store, &iter, 
-                        ADDRESS_COL, address,
-                        IDENTIFIER_COL, identifier,
-                        CONNECTION_COL, "A", -1);
+        gtk_list_store_clear(store);
+        for (guint i = 0; i < adapters->len; i++)
+        {
+                adapter_info *info = g_ptr_array_index(adapters, i);
+                gtk_list_store_append(store, &iter);
+                gtk_list_store_set(store, &iter,
+                ADDRESS_COL, info->address,
+                IDENTIFIER_COL, info->identifier,
+                CONNECTION_COL, "A", -1);
+        }
+}
 
-                        simpleble_free(identifier);
-                        simpleble_free(address);
-                        simpleble_adapter_release_handle(_tmp_adapter);
-                }
+void _adapters_loaded(GObject *source, GAsyncResult *result, gpointer data)
+{
+        GPtrArray       *adapters = g_task_propagate_pointer(G_TASK(result), NULL);
+        GObject         *bled = (GObject*) g_object_get_data(source, "bled");
+
+        if (adapters->len == 0)
+        {
+                // [TODO]: Reload after 5 seconds
+                _debug_print("No Bluetooth adapter found");
+                gtk_label_set_text(GTK_LABEL(g_object_get_data(source, "bluetooth_status")),
+                                   "No Bluetooth adapter found");
         }
+        g_object_set_data_full(source, "adapters", adapters, (GDestroyNotify)g_ptr_array_unref);
+        if (bled != NULL)
+                _fill_adapters(bled, adapters);
 }
 
-void _connect_button_clicked(   GtkButton       *self, 
-                                gpointer        data)
+// Low priority idle, so it only starts once the window has been drawn
+gboolean _start_loading_adapters(gpointer data)
 {
+        GTask *task = g_task_new(data, NULL, _adapters_loaded, NULL);
+        g_task_run_in_thread(task, _load_adapters);
+        g_object_unref(task);
+        return G_SOURCE_REMOVE;
+}
+
+static GObject *_bluetooth_dialog_new(GObject *button)
+{
+        GtkBuilder *builder = gtk_builder_new_from_resource(BLUETOOTH_UI_RESOURCE);
+        GObject *bled   = gtk_builder_get_object(builder, "bluetooth_dialog");
+        GtkWindow *window = GTK_WINDOW(g_object_get_data(button, "window"));
+
+        gtk_window_set_transient_for(GTK_WINDOW(bled), window);
+
+        GObject *adapters_text      = gtk_builder_get_object(builder, "adapters_text");
+        GObject *adapters_tree      = gtk_builder_get_object(builder, "adapters_tree");
+
+        GObject *peripherals_text   = gtk_builder_get_object(builder, "peripherals_text");
+        GObject *peripherals_tree   = gtk_builder_get_object(builder, "peripherals_tree");
 
-        gtk_window_present(GTK_WINDOW(data));
+        GObject *connect_button     = gtk_builder_get_object(builder, "bluetooth_connect_button");
+        GObject *close_button       = gtk_builder_get_object(builder, "bluetooth_close_button");
 
-        GObject *adapters_tree      = (GObject*) g_object_get_data(data, "adapters_tree");
-        GObject *adapters_text      = (GObject*) g_object_get_data(data, "adapters_text");
-        GObject *peripherals_text   = (GObject*) g_object_get_data(data, "peripherals_text");
-        GObject *peripherals_tree   = (GObject*) g_object_get_data(data, "peripherals_tree");
-        GObject *close_button       = (GObject*) g_object_get_data(data, "close_button");
-        GObject *connect_button     = (GObject*) g_object_get_data(data, "connect_button");
+        g_object_set_data(bled,"bluetooth_status", g_object_get_data(button, "bluetooth_status"));
+        g_object_set_data(bled, "adapters_text", adapters_text);
+        g_object_set_data(bled, "adapters_tree", adapters_tree);
+        g_object_set_data(bled, "peripherals_text", peripherals_text);
+        g_object_set_data(bled, "peripherals_tree", peripherals_tree);
+        g_object_set_data(bled, "connect_button", connect_button);
+        g_object_set_data(bled, "close_button", close_button);
+        g_object_set_data(bled, "window", window);
 
         // Load adapters tree view
         GtkListStore *adapters_store    = gtk_list_store_new(N_COLUMNS, G_TYPE_STRING, G_TYPE_STRING, G_TYPE_STRING);
         GtkListStore *peripherals_store = gtk_list_store_new(NP_COLUMNS, G_TYPE_STRING, G_TYPE_STRING, G_TYPE_STRING);
 
-        g_object_set_data(data, "peripherals_store", peripherals_store);
+        g_object_set_data_full(bled, "adapters_store", adapters_store, g_object_unref);
+        g_object_set_data_full(bled, "peripherals_store", peripherals_store, g_object_unref);
         gtk_tree_view_set_model(GTK_TREE_VIEW(adapters_tree), GTK_TREE_MODEL(adapters_store));
         gtk_tree_view_set_model(GTK_TREE_VIEW(peripherals_tree), GTK_TREE_MODEL(peripherals_store));
 
@@ -441,10 +754,10 @@ void _connect_button_clicked(   GtkButton       *self,
         g_signal_connect(G_OBJECT(adapters_tree), "row-activated", G_CALLBACK(_adapters_tree_selected), select_1);
         g_signal_connect(G_OBJECT(select_2), "changed", G_CALLBACK(_peripherals_tree_changed), peripherals_text);
         g_signal_connect(G_OBJECT(peripherals_tree), "row-activated", G_CALLBACK(_peripherals_tree_selected), select_2);
-        g_signal_connect(G_OBJECT(close_button), "clicked", G_CALLBACK(_close_button_clicked), data);
+        g_signal_connect(G_OBJECT(close_button), "clicked", G_CALLBACK(_close_button_clicked), bled);
 
-        g_object_set_data(G_OBJECT(adapters_tree), "bled", data);
-        g_object_set_data(G_OBJECT(peripherals_tree), "bled", data);
+        g_object_set_data(G_OBJECT(adapters_tree), "bled", bled);
+        g_object_set_data(G_OBJECT(peripherals_tree), "bled", bled);
 
         gtk_tree_view_append_column(GTK_TREE_VIEW(adapters_tree), column_1);
         gtk_tree_view_append_column(GTK_TREE_VIEW(adapters_tree), column_2);
@@ -453,44 +766,36 @@ void _connect_button_clicked(   GtkButton       *self,
         gtk_tree_view_append_column(GTK_TREE_VIEW(peripherals_tree), column_5);
         gtk_tree_view_append_column(GTK_TREE_VIEW(peripherals_tree), column_6);
 
-        g_object_set_data(G_OBJECT(adapters_store), "text", adapters_text);
-        g_object_set_data(G_OBJECT(adapters_store), "tree", adapters_tree);
-
-        GThread* thread_1 = g_thread_new("bluetooth_connection", _load_adapters, adapters_store);
+        // GTK keeps the toplevel alive, hidden between uses
+        g_object_unref(builder);
+        return bled;
 }
 
-void _bluetooth_dialog_activate(GtkWindow       *self, 
+void _connect_button_clicked(   GtkButton       *self, 
                                 gpointer        data)
 {
+        // Built on first use, so startup never parses the dialog
+        GObject *bled = (GObject*) g_object_get_data(G_OBJECT(self), "bled");
+        if (bled == NULL)
+        {
+                GPtrArray *adapters = g_object_get_data(G_OBJECT(self), "adapters");
+
+                bled = _bluetooth_dialog_new(G_OBJECT(self));
+                g_object_set_data(G_OBJECT(self), "bled", bled);
+                if (adapters != NULL)
+                        _fill_adapters(bled, adapters);
+        }
+        gtk_window_present(GTK_WINDOW(bled));
 }
+
 void load_bluetooth (   GtkBuilder      *builder, 
                         GtkWindow       *window)
 {
-        GObject *bled   = gtk_builder_get_object(builder, "bluetooth_dialog");
         GObject *button = gtk_builder_get_object(builder, "button_connect");
-
-        gtk_window_set_transient_for(GTK_WINDOW(bled), window);
-        g_object_set_data(bled, "builder", builder);
-
-
-        GObject *adapters_text      = gtk_builder_get_object(builder, "adapters_text");
-        GObject *adapters_tree      = gtk_builder_get_object(builder, "adapters_tree");
-
-        GObject *peripherals_text   = gtk_builder_get_object(builder, "peripherals_text");
-        GObject *peripherals_tree   = gtk_builder_get_object(builder, "peripherals_tree");
-
-        GObject *connect_button     = gtk_builder_get_object(builder, "bluetooth_connect_button");
-        GObject *close_button       = gtk_builder_get_object(builder, "bluetooth_close_button");
-
         GObject *status_label       = gtk_builder_get_object(builder, "label_status");
 
-        g_object_set_data(bled,"bluetooth_status", status_label);
-        g_object_set_data(bled, "adapters_text", adapters_text);
-        g_object_set_data(bled, "adapters_tree", adapters_tree);
-        g_object_set_data(bled, "peripherals_text", peripherals_text);
-        g_object_set_data(bled, "peripherals_tree", peripherals_tree);
-        g_object_set_data(bled, "connect_button", connect_button);
-        g_object_set_data(bled, "close_button", close_button);
-        g_object_set_data(bled, "window", window);
-        g_signal_connect(button, "clicked", G_CALLBACK(_connect_button_clicked), bled);
-}
\ No newline at end of file
+        g_object_set_data(button, "bluetooth_status", status_label);
+        g_object_set_data(button, "window", window);
+        g_signal_connect(button, "clicked", G_CALLBACK(_connect_button_clicked), NULL);
+        g_idle_add_full(G_PRIORITY_LOW, _start_loading_adapters, g_object_ref(button), g_object_unref);
+}
@@ -0,0 +1,413 @@
+#include "ble_medical_capture.h"
+#include "ble_medical_debug.h"
+#include "ble_medical_metrics.h"
+#include "ble_medical_trace.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <glib/gstdio.h>
+
+typedef struct _finished_segment {
+        ble_record              *record;
+        ble_edf_writer          *edf;
+        gchar                   *path;
+        ble_capture_done_func   done;
+        gpointer                data;
+} finished_segment;
+
+gchar *ble_capture_edf_path(const gchar *record_path)
+{
+        g_autofree gchar *base = g_strdup(record_path);
+        if (g_str_has_suffix(base, BLE_RECORD_EXTENSION))
+                base[strlen(base) - strlen(BLE_RECORD_EXTENSION)] = '\0';
+        return g_strconcat(base, BLE_EDF_EXTENSION, NULL);
+}
+
+// The name is taken by creating the file, so no one else can take it
+// between this and a rename or an open
+static gchar *_reserve(const gchar *dir, gchar *base)
+{
+        if (g_str_has_suffix(base, BLE_RECORD_EXTENSION))
+                base[strlen(base) - strlen(BLE_RECORD_EXTENSION)] = '\0';
+
+        gchar *path = g_strdup_printf("%s/%s%s", dir, base, BLE_RECORD_EXTENSION);
+        for (int i = 1; ; i++)
+        {
+                int fd = g_open(path, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+                if (fd >= 0)
+                {
+                        close(fd);
+                        return path;
+                }
+                if (errno != EEXIST)
+                {
+                        g_free(path);
+                        return NULL;
+                }
+                g_free(path);
+                path = g_strdup_printf("%s/%s-%d%s", dir, base, i, BLE_RECORD_EXTENSION);
+        }
+}
+
+gchar *ble_capture_segment_path(const gchar *live_path, const gchar *filename, const ble_record_meta *meta)
+{
+        g_autofree gchar *dir = g_path_get_dirname(live_path);
+        g_autofree gchar *base = NULL;
+
+        if (filename != NULL && filename[0] != '\0')
+        {
+                base = g_strdup(filename);
+        }
+        else
+        {
+                g_autoptr(GDateTime) now = g_date_time_new_now_local();
+                g_autofree gchar *stamp = g_date_time_format(now, "%Y%m%d-%H%M%S");
+                base = g_strdup_printf("%s_%s_%s_%s",
+                                       meta->id && meta->id[0] ? meta->id : "noid",
+                                       meta->name && meta->name[0] ? meta->name : "noname",
+                                       meta->day && meta->day[0] ? meta->day : "noday",
+                                       stamp);
+        }
+        g_strdelimit(base, "/\\:*?\"<>| ", '_');
+        return _reserve(dir, base);
+}
+
+// "<live stem>_" followed by the start time
+static gchar *_session_prefix(const gchar *live_path)
+{
+        g_autofree gchar *stem = g_path_get_basename(live_path);
+        if (g_str_has_suffix(stem, BLE_RECORD_EXTENSION))
+                stem[strlen(stem) - strlen(BLE_RECORD_EXTENSION)] = '\0';
+        return g_strconcat(stem, "_", NULL);
+}
+
+gchar *ble_capture_session_path(const gchar *live_path)
+{
+        g_autofree gchar *dir = g_path_get_dirname(live_path);
+        g_autofree gchar *prefix = _session_prefix(live_path);
+        g_autoptr(GDateTime) now = g_date_time_new_now_local();
+        g_autofree gchar *stamp = g_date_time_format(now, "%Y%m%d-%H%M%S");
+        g_autofree gchar *base = g_strconcat(prefix, stamp, NULL);
+        return _reserve(dir, base);
+}
+
+GPtrArray *ble_capture_unfinished(const gchar *live_path)
+{
+        GPtrArray *paths = g_ptr_array_new_with_free_func(g_free);
+        g_autofree gchar *dir = g_path_get_dirname(live_path);
+        g_autofree gchar *prefix = _session_prefix(live_path);
+        GDir *listing = g_dir_open(dir, 0, NULL);
+        const gchar *name;
+
+        while (listing != NULL && (name = g_dir_read_name(listing)) != NULL)
+        {
+                ble_record_header header;
+                if (!g_str_has_prefix(name, prefix) || !g_str_has_suffix(name, BLE_RECORD_EXTENSION))
+                        continue;
+                gchar *path = g_build_filename(dir, name, NULL);
+                // Placeholders still empty come up too; recovery removes them
+                if (ble_record_read_header(path, &header) != 0 || (header.flags & BLE_RECORD_FINALIZED) == 0)
+                        g_ptr_array_add(paths, path);
+                else
+                        g_free(path);
+        }
+        if (listing != NULL)
+                g_dir_close(listing);
+        return paths;
+}
+
+// Removes a recording and whatever sits beside it
+static void _discard(const gchar *path)
+{
+        g_autofree gchar *journal = g_strconcat(path, BLE_RECORD_JOURNAL_SUFFIX, NULL);
+        g_autofree gchar *edf = ble_capture_edf_path(path);
+        g_remove(path);
+        g_remove(journal);
+        g_remove(edf);
+}
+
+// Finalizes `record`, detached from any capture, as a segment named after
+// `meta` next to `live_path`, or in place when `meta` is NULL, and closes
+// it. Its journal goes, the recording no longer needs it. A recording of no
+// frames is removed instead.
+static int _finish(ble_record *record, const gchar *live_path, ble_edf_writer *edf,
+                   const ble_record_meta *meta, gchar **final_path)
+{
+        g_autofree gchar *journal = g_strconcat(live_path, BLE_RECORD_JOURNAL_SUFFIX, NULL);
+        gchar *path = NULL;
+        int res = 0;
+
+        *final_path = NULL;
+        if (record->frames == 0)
+        {
+                ble_record_close(record);
+                if (edf != NULL)
+                        ble_edf_writer_close(edf);
+                _discard(live_path);
+                return 0;
+        }
+        if (meta != NULL && (path = ble_capture_segment_path(live_path, NULL, meta)) == NULL)
+                res = -1;
+        else if (ble_record_finalize(record, meta) != 0)
+                res = -1;
+        else if (path != NULL && rename(live_path, path) != 0)
+                res = -1;
+        if (res != 0)
+        {
+                // Left unfinished, it is recovered on the next start
+                _debug_print("Recording could not be finalized");
+                if (path != NULL)
+                        g_remove(path);
+                g_free(path);
+                ble_record_close(record);
+                if (edf != NULL)
+                        ble_edf_writer_close(edf);
+                return -1;
+        }
+        if (path != NULL)
+        {
+                record->moved = true;
+                if (edf != NULL)
+                {
+                        g_autofree gchar *edf_live = ble_capture_edf_path(live_path);
+                        g_autofree gchar *edf_final = ble_capture_edf_path(path);
+                        if (rename(edf_live, edf_final) != 0)
+                                _debug_print("EDF+ export could not be renamed");
+                }
+        }
+        g_remove(journal);
+        if (ble_record_close(record) != 0)
+        {
+                _debug_print("Finished recording could not be synced");
+                res = -1;
+        }
+        if (edf != NULL && ble_edf_writer_close(edf) != 0)
+                _debug_print("EDF+ export could not be completed");
+        *final_path = path != NULL ? path : g_strdup(live_path);
+        return res;
+}
+
+int ble_capture_recover_session(const gchar *path, ble_record_recovery *report, gchar **final_path)
+{
+        ble_record *record = ble_record_open(path, report);
+
+        *final_path = NULL;
+        if (record == NULL)
+                return -1;
+        return _finish(record, path, NULL, NULL, final_path);
+}
+
+static ble_edf_writer *_edf_open(const gchar *record_path, const ble_record *record)
+{
+        g_autofree gchar *edf_path = ble_capture_edf_path(record_path);
+        ble_edf_writer *edf = ble_edf_writer_open(edf_path, record->header.origin_mono, record->header.origin_real);
+        if (edf == NULL)
+                _debug_print("EDF+ export could not be opened");
+        return edf;
+}
+
+// A recording from an earlier boot becomes a segment of its own, so that
+// times in the live one keep going forward
+static ble_record *_restart_segment(ble_record *record, const gchar *live_path)
+{
+        const ble_record_meta meta = { 0 };
+        g_autofree gchar *path = ble_capture_segment_path(live_path, NULL, &meta);
+
+        if (path == NULL)
+                return record;
+        ble_record *next = ble_record_rotate(record, path, &meta);
+        if (next == NULL)
+        {
+                if (g_strcmp0(record->path, path) != 0)
+                        g_remove(path);
+                _debug_print("Recording from an earlier boot could not be moved aside");
+                return record;
+        }
+        if (ble_record_close(record) != 0)
+                _debug_print("Recording from an earlier boot could not be synced");
+        _debug_print("Recording from an earlier boot moved aside");
+        return next;
+}
+
+ble_capture *ble_capture_open(const gchar *live_path, gboolean with_edf, ble_record_recovery *report)
+{
+        ble_record_recovery _report;
+        if (report == NULL)
+                report = &_report;
+        ble_record *record = ble_record_open(live_path, report);
+        if (record == NULL)
+                return NULL;
+        if (report->clock_restarted)
+                record = _restart_segment(record, live_path);
+
+        ble_capture *capture = g_new0(ble_capture, 1);
+        g_mutex_init(&capture->lock);
+        capture->record = record;
+        capture->live_path = g_strdup(live_path);
+        capture->with_edf = with_edf;
+        // A live export left by a crashed run is replaced; the recovered
+        // recording can be exported again with ble_edf_export()
+        if (with_edf)
+                capture->edf = _edf_open(live_path, record);
+        return capture;
+}
+
+int ble_capture_append(ble_capture *capture, ble_time_t time, const uint8_t *frame)
+{
+        int res = 0;
+        const ble_metrics_core *core = ble_metrics_core_get();
+
+        g_mutex_lock(&capture->lock);
+        ble_record *record = capture->record;
+        if (record != NULL)
+        {
+                uint64_t offset = record->offset;
+                uint32_t syncs = record->syncs;
+                ble_trace(BLE_TRACE_APPEND_BEGIN, 0, 0);
+                if (ble_record_append(record, time, frame) != 0)
+                {
+                        _debug_print("Recording block write failed");
+                        ble_metric_add(core->write_errors, 1);
+                        res = -1;
+                }
+                ble_trace(BLE_TRACE_APPEND_END, (int64_t)(record->offset - offset), 0);
+                ble_metric_add(core->bytes_written, (gint64)(record->offset - offset));
+                if (record->syncs != syncs)
+                {
+                        ble_trace(BLE_TRACE_FSYNC, record->sync_us, 0);
+                        ble_metric_observe(core->fsync, record->sync_us);
+                }
+        }
+        if (capture->edf != NULL && !capture->edf->failed && ble_edf_writer_append(capture->edf, time, frame) != 0)
+                _debug_print("EDF+ export failed, recording goes on without it");
+        g_mutex_unlock(&capture->lock);
+        return res;
+}
+
+static gpointer _segment_close_thread(gpointer data)
+{
+        finished_segment *segment = (finished_segment*)data;
+        int res = 0;
+
+        if (ble_record_close(segment->record) != 0)
+        {
+                _debug_print("Finished segment could not be synced");
+                res = -1;
+        }
+        if (segment->edf != NULL && ble_edf_writer_close(segment->edf) != 0)
+                _debug_print("Finished EDF+ export could not be completed");
+        if (segment->done != NULL)
+                segment->done(segment->path, res, segment->data);
+        g_free(segment->path);
+        g_free(segment);
+        return NULL;
+}
+
+int ble_capture_rotate(ble_capture *capture, const gchar *path, const ble_record_meta *meta,
+                       gint64 *latency, ble_capture_done_func done, gpointer data)
+{
+        // The writer only waits on the lock meanwhile; frames keep queueing
+        // in front of it so acquisition is never paused. The pause counts
+        // from the lock taken, not from an append it waited for.
+        g_mutex_lock(&capture->lock);
+        gint64 t_begin = g_get_monotonic_time();
+        ble_record *finished = capture->record;
+        ble_edf_writer *finished_edf = NULL;
+        ble_record *next = finished ? ble_record_rotate(finished, path, meta) : NULL;
+        if (next != NULL)
+        {
+                capture->record = next;
+                // The open stream follows the rename and the next one starts
+                // at the live path; if the rename fails the export just spans
+                // both segments
+                if (capture->edf != NULL)
+                {
+                        g_autofree gchar *edf_live = ble_capture_edf_path(capture->live_path);
+                        g_autofree gchar *edf_final = ble_capture_edf_path(path);
+                        ble_edf_writer_set_meta(capture->edf, meta);
+                        if (rename(edf_live, edf_final) == 0)
+                                finished_edf = capture->edf;
+                        else
+                                _debug_print("EDF+ export could not be renamed");
+                }
+                if (capture->with_edf && (capture->edf == NULL || finished_edf != NULL))
+                        capture->edf = _edf_open(capture->live_path, next);
+        }
+        gint64 elapsed = g_get_monotonic_time() - t_begin;
+        if (next != NULL)
+                capture->rotation_max = MAX(capture->rotation_max, elapsed);
+        g_mutex_unlock(&capture->lock);
+        if (latency != NULL)
+                *latency = elapsed;
+
+        if (next == NULL)
+        {
+                // The name reserved for the segment, unless the frames ended
+                // up there
+                if (finished == NULL || g_strcmp0(finished->path, path) != 0)
+                        g_remove(path);
+                return -1;
+        }
+
+        finished_segment *segment = g_new0(finished_segment, 1);
+        segment->record = finished;
+        segment->edf = finished_edf;
+        segment->path = g_strdup(path);
+        segment->done = done;
+        segment->data = data;
+        g_thread_unref(g_thread_new("segment_close", _segment_close_thread, segment));
+        return 0;
+}
+
+gint64 ble_capture_rotation_max(ble_capture *capture)
+{
+        g_mutex_lock(&capture->lock);
+        gint64 rotation_max = capture->rotation_max;
+        g_mutex_unlock(&capture->lock);
+        return rotation_max;
+}
+
+int ble_capture_finish(ble_capture *capture, const ble_record_meta *meta, gchar **final_path)
+{
+        // Appends are dropped from here on; what takes time runs unlocked
+        g_mutex_lock(&capture->lock);
+        ble_record *record = capture->record;
+        ble_edf_writer *edf = capture->edf;
+        capture->record = NULL;
+        capture->edf = NULL;
+        g_mutex_unlock(&capture->lock);
+
+        *final_path = NULL;
+        if (record == NULL)
+        {
+                if (edf != NULL)
+                        ble_edf_writer_close(edf);
+                return 0;
+        }
+        return _finish(record, capture->live_path, edf, meta, final_path);
+}
+
+void ble_capture_stop(ble_capture *capture)
+{
+        g_mutex_lock(&capture->lock);
+        if (capture->record != NULL)
+                ble_record_close(capture->record);
+        capture->record = NULL;
+        if (capture->edf != NULL)
+                ble_edf_writer_close(capture->edf);
+        capture->edf = NULL;
+        g_mutex_unlock(&capture->lock);
+}
+
+void ble_capture_free(ble_capture *capture)
+{
+        if (capture == NULL)
+                return;
+        ble_capture_stop(capture);
+        g_mutex_clear(&capture->lock);
+        g_free(capture->live_path);
+        g_free(capture);
+}
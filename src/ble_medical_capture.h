@@ -0,0 +1,72 @@
+#ifndef BLE_MEDICAL_CAPTURE_H
+#define BLE_MEDICAL_CAPTURE_H
+
+#include <glib.h>
+
+#include "ble_medical_record.h"
+#include "ble_medical_edf.h"
+
+/*
+ * The recording being captured, independent of any front end.
+ *
+ * Frames go to the live recording and, when asked for, to its EDF+ copy
+ * beside it, both under one lock. Rotating renames the live files to the
+ * finished segment and opens fresh ones in their place; the writer only
+ * waits for that, while syncing and finalizing the finished segment run on
+ * a thread of their own. Both the GUI and the headless daemon drive it.
+ */
+
+typedef struct _ble_capture {
+        GMutex          lock;
+        ble_record      *record;        // NULL once stopped
+        ble_edf_writer  *edf;           // NULL when off or failed
+        gchar           *live_path;
+        gboolean        with_edf;
+        gint64          rotation_max;   // longest writer pause, microseconds, under lock
+} ble_capture;
+
+// Runs on the closing thread once the finished segment is complete; status
+// is 0 or -1
+typedef void (*ble_capture_done_func)(const gchar *path, int status, gpointer data);
+
+// Recovers and reopens the recording at `live_path`
+ble_capture *ble_capture_open(const gchar *live_path, gboolean with_edf, ble_record_recovery *report);
+int ble_capture_append(ble_capture*, ble_time_t, const uint8_t *frame);
+// Moves the recording so far to `path`, a name ble_capture_segment_path()
+// reserved. `latency` gets how long the writer was held up. Returns -1,
+// still recording to the same file, on failure, and removes `path`.
+int ble_capture_rotate(ble_capture*, const gchar *path, const ble_record_meta*,
+                       gint64 *latency, ble_capture_done_func done, gpointer data);
+// Longest the writer was held up by a rotation so far, microseconds
+gint64 ble_capture_rotation_max(ble_capture*);
+// Ends the recording for good: finalizes it and renames it to a segment
+// named after `meta`, as a rotation does, with its EDF+ copy. `final_path`
+// gets the name, or NULL when nothing was recorded and the files are
+// removed. On failure the recording stays unfinished at the live path,
+// for ble_capture_recover_session() to pick up. Frames appended later are
+// dropped.
+int ble_capture_finish(ble_capture*, const ble_record_meta *meta, gchar **final_path);
+// Flushes and closes the files, leaving the recording unfinished for the
+// next open to carry on; frames appended later are dropped
+void ble_capture_stop(ble_capture*);
+void ble_capture_free(ble_capture*);
+
+// A free name for a finished segment next to `live_path`, reserved by
+// creating an empty file there. An explicit filename wins, otherwise ID,
+// name, day and the local time. NULL when the directory is not writable.
+gchar *ble_capture_segment_path(const gchar *live_path, const gchar *filename, const ble_record_meta*);
+// A live path of its own for a capture session, "<stem>_<local time>" next
+// to `live_path`, reserved the same way, so that sessions running side by
+// side never share a file. NULL when the directory is not writable.
+gchar *ble_capture_session_path(const gchar *live_path);
+// Every session path next to `live_path` whose recording was never
+// finished: what a crash may have left to recover. `live_path` itself is
+// left out, a capture carries on with it.
+GPtrArray *ble_capture_unfinished(const gchar *live_path);
+// Recovers one of those and finalizes it in place, or removes it when it
+// holds no frame; `final_path` as for ble_capture_finish()
+int ble_capture_recover_session(const gchar *path, ble_record_recovery *report, gchar **final_path);
+// The EDF+ file sits beside its recording, with the extension swapped
+gchar *ble_capture_edf_path(const gchar *record_path);
+
+#endif
@@ -0,0 +1,860 @@
+#include "ble_medical_catalog.h"
+#include "ble_medical_reader.h"
+#include "ble_medical_debug.h"
+
+#include <glib/gstdio.h>
+
+#include <string.h>
+
+#define CATALOG_ATTRIBUTES      G_FILE_ATTRIBUTE_STANDARD_NAME "," \
+                                G_FILE_ATTRIBUTE_STANDARD_TYPE "," \
+                                G_FILE_ATTRIBUTE_STANDARD_SIZE "," \
+                                G_FILE_ATTRIBUTE_TIME_MODIFIED "," \
+                                G_FILE_ATTRIBUTE_TIME_MODIFIED_USEC
+#define CATALOG_SAVE_DELAY      2       // seconds
+#define CATALOG_ENUM_BATCH      1000
+
+#define ENTRY_STORED_OFFSET     offsetof(ble_catalog_entry, mtime)
+#define ENTRY_STORED_SIZE       (sizeof(ble_catalog_entry) - ENTRY_STORED_OFFSET)
+
+typedef struct _catalog_file_header {
+        char    magic[8];
+        guint32 count;
+        guint32 entry_size;
+        gint64  folder_mtime;
+} catalog_file_header;
+
+typedef struct _catalog_scan {
+        ble_catalog             *catalog;
+        GCancellable            *cancellable;
+        GFileEnumerator         *fenum;
+        GHashTable              *seen;          // every candidate listed so far
+        GHashTable              *dirty;         // refreshed by the monitor meanwhile
+        gint64                  folder_mtime;
+        guint                   pending;        // header batches in flight
+        guint                   headers_read;
+        gboolean                enumerated;
+        gboolean                failed;
+} catalog_scan;
+
+typedef struct _catalog_load {
+        catalog_scan            *scan;
+        gchar                   *path;
+        GPtrArray               *infos;         // GFileInfo of the files to read
+        GPtrArray               *entries;       // matching entries, NULL if not a recording
+} catalog_load;
+
+typedef struct _thumbnail_cache {
+        char                    magic[8];
+        gint64                  mtime;          // of the recording it outlines
+        guint64                 size;
+        guint64                 nonce;          // of its header
+        guint32                 blocks;         // frame blocks taken in
+        guint32                 reserved;
+        ble_thumbnail           thumbnail;
+} thumbnail_cache;
+
+struct _ble_catalog {
+        GFile                   *folder;
+        gchar                   *path;
+        gchar                   *cache;         // _cache_dir() of path
+        GHashTable              *entries;       // filename -> ble_catalog_entry
+        gint64                  folder_mtime;
+        GFileMonitor            *monitor;
+        GCancellable            *cancellable;
+        catalog_scan            *scan;          // running rescan, if any
+        guint                   save_source;
+        ble_catalog_changed_func changed;
+        gpointer                data;
+};
+
+static void _entry_clear(gpointer data)
+{
+        ble_catalog_entry *entry = data;
+        g_free(entry->filename);
+}
+
+static void _entry_unref(gpointer data)
+{
+        if (data != NULL)
+                g_atomic_rc_box_release_full(data, _entry_clear);
+}
+
+static GHashTable *_entries_new(void)
+{
+        return g_hash_table_new_full(g_str_hash, g_str_equal, NULL, _entry_unref);
+}
+
+static void _entries_insert(GHashTable *entries, ble_catalog_entry *entry)
+{
+        // Keys are owned by the entries themselves
+        g_hash_table_replace(entries, entry->filename, entry);
+}
+
+static void _copy_text(gchar *dest, const char *src, gsize size)
+{
+        memcpy(dest, src, size);
+        dest[size - 1] = '\0';
+}
+
+static gint64 _info_mtime(GFileInfo *info)
+{
+        return (gint64)g_file_info_get_attribute_uint64(info, G_FILE_ATTRIBUTE_TIME_MODIFIED) * G_USEC_PER_SEC +
+               g_file_info_get_attribute_uint32(info, G_FILE_ATTRIBUTE_TIME_MODIFIED_USEC);
+}
+
+static gboolean _is_candidate(const gchar *filename)
+{
+        return filename[0] != '.' && !g_str_has_suffix(filename, BLE_RECORD_JOURNAL_SUFFIX);
+}
+
+// Reads the header of `filename` in `path`. NULL when it is not a recording.
+static ble_catalog_entry *_entry_load(const gchar *path, const gchar *filename,
+                                      gint64 mtime, guint64 size)
+{
+        ble_record_header header;
+        g_autofree gchar *full = g_build_filename(path, filename, NULL);
+
+        if (ble_record_read_header(full, &header) != 0)
+                return NULL;
+
+        ble_catalog_entry *entry = g_atomic_rc_box_new0(ble_catalog_entry);
+        entry->filename = g_strdup(filename);
+        entry->mtime = mtime;
+        entry->size = size;
+        _copy_text(entry->id, header.id, sizeof(entry->id));
+        _copy_text(entry->name, header.name, sizeof(entry->name));
+        _copy_text(entry->day, header.day, sizeof(entry->day));
+        entry->t_first = header.t_first;
+        entry->t_last = header.t_last;
+        entry->frames = header.frames;
+        entry->channels = header.channels ? header.channels : BLE_CHANNEL_ALL;
+        entry->flags = header.flags;
+        if (header.frames > 0)
+                entry->start_real = header.t_first - header.origin_mono + header.origin_real;
+        return entry;
+}
+
+// Nothing is written into the folder itself, whose mtime has to move only
+// when recordings come and go
+static gchar *_cache_dir(const gchar *folder)
+{
+        g_autofree gchar *key = g_compute_checksum_for_string(G_CHECKSUM_SHA1, folder, -1);
+        return g_build_filename(g_get_user_cache_dir(), BLE_CATALOG_CACHE_DIR, key, NULL);
+}
+
+static gchar *_thumbnail_path(const gchar *cache, const gchar *filename)
+{
+        g_autofree gchar *name = g_strconcat(filename, BLE_THUMBNAIL_SUFFIX, NULL);
+        return g_build_filename(cache, name, NULL);
+}
+
+gboolean ble_catalog_thumbnail(const gchar              *folder,
+                               const ble_catalog_entry  *entry,
+                               ble_thumbnail            *thumbnail)
+{
+        g_autofree gchar *cache_dir = _cache_dir(folder);
+        g_autofree gchar *cache_path = _thumbnail_path(cache_dir, entry->filename);
+        g_autofree gchar *path = g_build_filename(folder, entry->filename, NULL);
+        g_autofree gchar *contents = NULL;
+        thumbnail_cache cache;
+        gboolean cached = false;
+        gsize length;
+
+        if (g_file_get_contents(cache_path, &contents, &length, NULL) && length == sizeof(cache))
+        {
+                memcpy(&cache, contents, sizeof(cache));
+                cached = memcmp(cache.magic, BLE_THUMBNAIL_MAGIC, sizeof(cache.magic)) == 0 &&
+                         cache.thumbnail.count <= BLE_THUMBNAIL_POINTS;
+                if (cached && cache.mtime == entry->mtime && cache.size == entry->size)
+                {
+                        *thumbnail = cache.thumbnail;
+                        return true;
+                }
+        }
+
+        ble_reader *reader = ble_reader_open(path);
+        if (reader == NULL)
+                return false;
+        if (reader->header.thumbnail_offset != 0)
+        {
+                gboolean res = ble_reader_thumbnail(reader, thumbnail) == 0;
+                ble_reader_close(reader);
+                return res;
+        }
+
+        // A recording being written only grows: the outline cached at an
+        // earlier size goes on from the blocks it already took in
+        uint32_t first = 0;
+        if (cached && cache.nonce == reader->header.nonce && cache.size <= entry->size &&
+            cache.blocks <= reader->blocks)
+        {
+                *thumbnail = cache.thumbnail;
+                first = cache.blocks;
+        }
+        else
+                ble_thumbnail_init(thumbnail);
+        int64_t blocks = ble_reader_thumbnail_extend(reader, first, thumbnail);
+        guint64 nonce = reader->header.nonce;
+        ble_reader_close(reader);
+
+        if (blocks >= 0)
+        {
+                memcpy(cache.magic, BLE_THUMBNAIL_MAGIC, sizeof(cache.magic));
+                cache.mtime = entry->mtime;
+                cache.size = entry->size;
+                cache.nonce = nonce;
+                cache.blocks = (guint32)blocks;
+                cache.reserved = 0;
+                cache.thumbnail = *thumbnail;
+                g_mkdir_with_parents(cache_dir, 0700);
+                g_file_set_contents(cache_path, (const gchar*)&cache, sizeof(cache), NULL);
+        }
+        return blocks >= 0;
+}
+
+static gint64 _folder_mtime(GFile *folder)
+{
+        g_autoptr(GFileInfo) info = g_file_query_info(folder, CATALOG_ATTRIBUTES,
+                                                      G_FILE_QUERY_INFO_NONE, NULL, NULL);
+        return info ? _info_mtime(info) : 0;
+}
+
+static gboolean _load(ble_catalog *catalog)
+{
+        g_autofree gchar *file = g_build_filename(catalog->cache, BLE_CATALOG_FILE, NULL);
+        g_autofree gchar *contents = NULL;
+        gsize length = 0, offset = sizeof(catalog_file_header);
+        catalog_file_header header;
+
+        if (!g_file_get_contents(file, &contents, &length, NULL) || length < sizeof(header))
+                return false;
+        memcpy(&header, contents, sizeof(header));
+        if (memcmp(header.magic, BLE_CATALOG_MAGIC, sizeof(header.magic)) != 0 ||
+            header.entry_size != ENTRY_STORED_SIZE)
+                return false;
+
+        for (guint32 i = 0; i < header.count; i++)
+        {
+                guint16 name_length;
+                if (length - offset < sizeof(name_length))
+                        goto FAIL;
+                memcpy(&name_length, contents + offset, sizeof(name_length));
+                offset += sizeof(name_length);
+                if (name_length == 0 || length - offset < name_length + ENTRY_STORED_SIZE)
+                        goto FAIL;
+
+                ble_catalog_entry *entry = g_atomic_rc_box_new0(ble_catalog_entry);
+                entry->filename = g_strndup(contents + offset, name_length);
+                offset += name_length;
+                memcpy((char*)entry + ENTRY_STORED_OFFSET, contents + offset, ENTRY_STORED_SIZE);
+                offset += ENTRY_STORED_SIZE;
+                _entries_insert(catalog->entries, entry);
+        }
+        catalog->folder_mtime = header.folder_mtime;
+        return true;
+
+FAIL:
+        g_hash_table_remove_all(catalog->entries);
+        return false;
+}
+
+static GBytes *_serialize(ble_catalog *catalog)
+{
+        GByteArray *bytes = g_byte_array_sized_new(sizeof(catalog_file_header) +
+                                                   g_hash_table_size(catalog->entries) * (ENTRY_STORED_SIZE + 32));
+        catalog_file_header header = {
+                .count          = g_hash_table_size(catalog->entries),
+                .entry_size     = ENTRY_STORED_SIZE,
+                .folder_mtime   = catalog->folder_mtime,
+        };
+        GHashTableIter iter;
+        gpointer value;
+
+        memcpy(header.magic, BLE_CATALOG_MAGIC, sizeof(header.magic));
+        g_byte_array_append(bytes, (const guint8*)&header, sizeof(header));
+
+        g_hash_table_iter_init(&iter, catalog->entries);
+        while (g_hash_table_iter_next(&iter, NULL, &value))
+        {
+                const ble_catalog_entry *entry = value;
+                guint16 name_length = (guint16)strlen(entry->filename);
+                g_byte_array_append(bytes, (const guint8*)&name_length, sizeof(name_length));
+                g_byte_array_append(bytes, (const guint8*)entry->filename, name_length);
+                g_byte_array_append(bytes, (const guint8*)entry + ENTRY_STORED_OFFSET, ENTRY_STORED_SIZE);
+        }
+        return g_byte_array_free_to_bytes(bytes);
+}
+
+static void _saved(GObject *source, GAsyncResult *result, gpointer data)
+{
+        g_autoptr(GError) error = NULL;
+        if (!g_file_replace_contents_finish(G_FILE(source), result, NULL, &error))
+                _debug_print(error->message);
+}
+
+static void _save_now(ble_catalog *catalog, gboolean sync)
+{
+        g_autofree gchar *path = g_build_filename(catalog->cache, BLE_CATALOG_FILE, NULL);
+        g_autoptr(GFile) file = g_file_new_for_path(path);
+        g_autoptr(GBytes) bytes = _serialize(catalog);
+
+        g_mkdir_with_parents(catalog->cache, 0700);
+        if (sync)
+        {
+                gsize size;
+                const gchar *contents = g_bytes_get_data(bytes, &size);
+                g_file_replace_contents(file, contents, size, NULL, false,
+                                        G_FILE_CREATE_NONE, NULL, NULL, NULL);
+        }
+        else
+                g_file_replace_contents_bytes_async(file, bytes, NULL, false, G_FILE_CREATE_NONE,
+                                                    NULL, _saved, NULL);
+}
+
+static gboolean _save_timeout(gpointer data)
+{
+        ble_catalog *catalog = data;
+        catalog->save_source = 0;
+        _save_now(catalog, false);
+        return G_SOURCE_REMOVE;
+}
+
+static void _schedule_save(ble_catalog *catalog)
+{
+        catalog->folder_mtime = _folder_mtime(catalog->folder);
+        if (catalog->save_source == 0)
+                catalog->save_source = g_timeout_add_seconds(CATALOG_SAVE_DELAY, _save_timeout, catalog);
+}
+
+static void _notify(ble_catalog *catalog, GPtrArray *updated, GPtrArray *removed)
+{
+        if ((updated->len > 0 || removed->len > 0) && catalog->changed)
+                catalog->changed(catalog, updated, removed, catalog->data);
+}
+
+static GPtrArray *_updated_new(void)
+{
+        return g_ptr_array_new_with_free_func(_entry_unref);
+}
+
+static GPtrArray *_removed_new(void)
+{
+        return g_ptr_array_new_with_free_func(g_free);
+}
+
+// Brings a single file up to date and tells the owner about it
+static void _refresh(ble_catalog *catalog, const gchar *filename)
+{
+        if (!_is_candidate(filename))
+                return;
+
+        g_autoptr(GFile) file = g_file_get_child(catalog->folder, filename);
+        g_autoptr(GFileInfo) info = g_file_query_info(file, CATALOG_ATTRIBUTES,
+                                                      G_FILE_QUERY_INFO_NONE, NULL, NULL);
+        g_autoptr(GPtrArray) updated = _updated_new();
+        g_autoptr(GPtrArray) removed = _removed_new();
+        ble_catalog_entry *entry = NULL;
+
+        if (info != NULL && g_file_info_get_file_type(info) == G_FILE_TYPE_REGULAR)
+                entry = _entry_load(catalog->path, filename, _info_mtime(info), g_file_info_get_size(info));
+
+        // A running scan may still hold an older look at this file
+        if (catalog->scan != NULL)
+                g_hash_table_add(catalog->scan->dirty, g_strdup(filename));
+
+        if (entry != NULL)
+        {
+                _entries_insert(catalog->entries, entry);
+                g_ptr_array_add(updated, g_atomic_rc_box_acquire(entry));
+        }
+        else if (g_hash_table_remove(catalog->entries, filename))
+        {
+                g_autofree gchar *cache_path = _thumbnail_path(catalog->cache, filename);
+                g_unlink(cache_path);
+                g_ptr_array_add(removed, g_strdup(filename));
+        }
+        else
+                return;
+
+        _notify(catalog, updated, removed);
+        _schedule_save(catalog);
+}
+
+static void _monitor_changed(GFileMonitor       *monitor,
+                             GFile              *file,
+                             GFile              *other,
+                             GFileMonitorEvent  event,
+                             gpointer           data)
+{
+        g_autofree gchar *filename = g_file_get_basename(file);
+
+        switch (event)
+        {
+        case G_FILE_MONITOR_EVENT_RENAMED:
+                _refresh(data, filename);
+                g_free(filename);
+                filename = g_file_get_basename(other);
+                // fall through
+        case G_FILE_MONITOR_EVENT_CREATED:
+        case G_FILE_MONITOR_EVENT_DELETED:
+        case G_FILE_MONITOR_EVENT_CHANGES_DONE_HINT:
+        case G_FILE_MONITOR_EVENT_MOVED_IN:
+        case G_FILE_MONITOR_EVENT_MOVED_OUT:
+                _refresh(data, filename);
+                break;
+        default:
+                break;
+        }
+}
+
+/*
+ * Rescan. The folder is listed with next_files_async() in large batches so
+ * that neither the UI thread nor a slow mount stalls the other. Files whose
+ * size and mtime match the catalog are only marked as seen; the others get
+ * their headers read on a GTask thread, one task per batch, while the
+ * enumerator already fetches the next batch. Every batch is handed to the
+ * owner as soon as it is known. Entries never seen are dropped at the end.
+ *
+ * Each in-flight operation holds a reference on the scan. Once the
+ * catalog's cancellable fired the catalog is gone and callbacks only drop
+ * their reference.
+ */
+
+static void _scan_clear(gpointer data)
+{
+        catalog_scan *scan = data;
+        g_object_unref(scan->cancellable);
+        g_clear_object(&scan->fenum);
+        g_hash_table_unref(scan->seen);
+        g_hash_table_unref(scan->dirty);
+}
+
+static void _scan_unref(catalog_scan *scan)
+{
+        g_rc_box_release_full(scan, _scan_clear);
+}
+
+static void _load_free(gpointer data)
+{
+        catalog_load *load = data;
+        _scan_unref(load->scan);
+        g_free(load->path);
+        g_ptr_array_unref(load->infos);
+        g_ptr_array_unref(load->entries);
+        g_free(load);
+}
+
+static void _scan_finish(catalog_scan *scan)
+{
+        ble_catalog *catalog = scan->catalog;
+
+        if (!scan->enumerated || scan->pending > 0)
+                return;
+
+        if (!scan->failed)
+        {
+                g_autoptr(GPtrArray) updated = _updated_new();
+                g_autoptr(GPtrArray) removed = _removed_new();
+                GHashTableIter iter;
+                gpointer filename;
+
+                g_hash_table_iter_init(&iter, catalog->entries);
+                while (g_hash_table_iter_next(&iter, &filename, NULL))
+                {
+                        if (g_hash_table_contains(scan->seen, filename) ||
+                            g_hash_table_contains(scan->dirty, filename))
+                                continue;
+                        g_ptr_array_add(removed, g_strdup(filename));
+                        g_hash_table_iter_remove(&iter);
+                }
+                _notify(catalog, updated, removed);
+
+                catalog->folder_mtime = scan->folder_mtime;
+                _save_now(catalog, false);
+        }
+
+        g_autofree gchar *message = g_strdup_printf("Catalog scan: %u recordings, %u headers read",
+                                                    g_hash_table_size(catalog->entries), scan->headers_read);
+        _debug_print(message);
+        catalog->scan = NULL;
+}
+
+static void _scan_load_thread(GTask            *task,
+                              gpointer         source,
+                              gpointer         data,
+                              GCancellable     *cancellable)
+{
+        catalog_load *load = data;
+
+        for (guint i = 0; i < load->infos->len; i++)
+        {
+                GFileInfo *info = g_ptr_array_index(load->infos, i);
+                if (g_cancellable_is_cancelled(cancellable))
+                        break;
+                g_ptr_array_add(load->entries, _entry_load(load->path, g_file_info_get_name(info),
+                                                           _info_mtime(info), g_file_info_get_size(info)));
+        }
+        g_task_return_boolean(task, true);
+}
+
+static void _scan_loaded(GObject *source, GAsyncResult *result, gpointer data)
+{
+        catalog_load *load = g_task_get_task_data(G_TASK(result));
+        catalog_scan *scan = load->scan;
+        ble_catalog *catalog = scan->catalog;
+
+        if (g_cancellable_is_cancelled(scan->cancellable))
+                return;
+
+        g_autoptr(GPtrArray) updated = _updated_new();
+        g_autoptr(GPtrArray) removed = _removed_new();
+        for (guint i = 0; i < load->entries->len; i++)
+        {
+                const gchar *filename = g_file_info_get_name(g_ptr_array_index(load->infos, i));
+                ble_catalog_entry *entry = g_ptr_array_index(load->entries, i);
+
+                if (g_hash_table_contains(scan->dirty, filename))
+                        continue;
+                if (entry != NULL)
+                {
+                        _entries_insert(catalog->entries, g_atomic_rc_box_acquire(entry));
+                        g_ptr_array_add(updated, g_atomic_rc_box_acquire(entry));
+                }
+                else if (g_hash_table_remove(catalog->entries, filename))
+                        g_ptr_array_add(removed, g_strdup(filename));
+        }
+        scan->headers_read += load->entries->len;
+        _notify(catalog, updated, removed);
+
+        scan->pending--;
+        _scan_finish(scan);
+}
+
+static void _scan_load(catalog_scan *scan, GPtrArray *infos)
+{
+        catalog_load *load = g_new0(catalog_load, 1);
+        GTask *task = g_task_new(NULL, scan->cancellable, _scan_loaded, NULL);
+
+        load->scan = g_rc_box_acquire(scan);
+        load->path = g_strdup(scan->catalog->path);
+        load->infos = infos;
+        load->entries = g_ptr_array_new_full(infos->len, _entry_unref);
+        scan->pending++;
+
+        g_task_set_task_data(task, load, _load_free);
+        g_task_run_in_thread(task, _scan_load_thread);
+        g_object_unref(task);
+}
+
+static void _scan_batch(GObject *source, GAsyncResult *result, gpointer data)
+{
+        catalog_scan *scan = data;
+        ble_catalog *catalog = scan->catalog;
+        g_autoptr(GError) error = NULL;
+        GList *infos = g_file_enumerator_next_files_finish(G_FILE_ENUMERATOR(source), result, &error);
+
+        if (g_cancellable_is_cancelled(scan->cancellable))
+        {
+                g_list_free_full(infos, g_object_unref);
+                _scan_unref(scan);
+                return;
+        }
+        if (infos == NULL)
+        {
+                if (error != NULL)
+                        _debug_print(error->message);
+                scan->enumerated = true;
+                scan->failed = error != NULL;
+                _scan_finish(scan);
+                _scan_unref(scan);
+                return;
+        }
+
+        GPtrArray *stale = g_ptr_array_new_with_free_func(g_object_unref);
+        for (GList *l = infos; l != NULL; l = l->next)
+        {
+                GFileInfo *info = l->data;
+                const gchar *filename = g_file_info_get_name(info);
+                if (g_file_info_get_file_type(info) != G_FILE_TYPE_REGULAR || !_is_candidate(filename))
+                        continue;
+
+                g_hash_table_add(scan->seen, g_strdup(filename));
+                ble_catalog_entry *entry = g_hash_table_lookup(catalog->entries, filename);
+                if (entry == NULL || entry->mtime != _info_mtime(info) ||
+                    entry->size != (guint64)g_file_info_get_size(info))
+                        g_ptr_array_add(stale, g_object_ref(info));
+        }
+        g_list_free_full(infos, g_object_unref);
+
+        if (stale->len > 0)
+                _scan_load(scan, stale);
+        else
+                g_ptr_array_unref(stale);
+
+        // The enumerator goes on while the headers are read
+        g_file_enumerator_next_files_async(scan->fenum, CATALOG_ENUM_BATCH, G_PRIORITY_LOW,
+                                           scan->cancellable, _scan_batch, scan);
+}
+
+static void _scan_enumerated(GObject *source, GAsyncResult *result, gpointer data)
+{
+        catalog_scan *scan = data;
+        g_autoptr(GError) error = NULL;
+        GFileEnumerator *fenum = g_file_enumerate_children_finish(G_FILE(source), result, &error);
+
+        if (g_cancellable_is_cancelled(scan->cancellable) || fenum == NULL)
+        {
+                if (fenum == NULL && !g_cancellable_is_cancelled(scan->cancellable))
+                {
+                        _debug_print(error->message);
+                        scan->enumerated = true;
+                        scan->failed = true;
+                        _scan_finish(scan);
+                }
+                g_clear_object(&fenum);
+                _scan_unref(scan);
+                return;
+        }
+
+        scan->fenum = fenum;
+        g_file_enumerator_next_files_async(fenum, CATALOG_ENUM_BATCH, G_PRIORITY_LOW,
+                                           scan->cancellable, _scan_batch, scan);
+}
+
+static void _scan(ble_catalog *catalog)
+{
+        catalog_scan *scan = g_rc_box_new0(catalog_scan);
+
+        scan->catalog = catalog;
+        scan->cancellable = g_object_ref(catalog->cancellable);
+        scan->seen = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+        scan->dirty = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+        scan->folder_mtime = _folder_mtime(catalog->folder);
+        catalog->scan = scan;
+
+        g_file_enumerate_children_async(catalog->folder, CATALOG_ATTRIBUTES, G_FILE_QUERY_INFO_NONE,
+                                        G_PRIORITY_LOW, scan->cancellable, _scan_enumerated, scan);
+}
+
+static gboolean _needs_scan(ble_catalog *catalog)
+{
+        return catalog->folder_mtime == 0 || catalog->folder_mtime != _folder_mtime(catalog->folder);
+}
+
+// A recording still being written grows, and is finalized, in place without
+// touching the folder: only such files are looked at again, one by one,
+// before the owner lists the catalog
+static void _refresh_growing(ble_catalog *catalog)
+{
+        g_autoptr(GPtrArray) growing = g_ptr_array_new_with_free_func(g_free);
+        gboolean changed = false;
+        GHashTableIter iter;
+        gpointer value;
+
+        g_hash_table_iter_init(&iter, catalog->entries);
+        while (g_hash_table_iter_next(&iter, NULL, &value))
+                if ((((ble_catalog_entry*)value)->flags & BLE_RECORD_FINALIZED) == 0)
+                        g_ptr_array_add(growing, g_strdup(((ble_catalog_entry*)value)->filename));
+
+        for (guint i = 0; i < growing->len; i++)
+        {
+                const gchar *filename = g_ptr_array_index(growing, i);
+                const ble_catalog_entry *entry = g_hash_table_lookup(catalog->entries, filename);
+                g_autoptr(GFile) file = g_file_get_child(catalog->folder, filename);
+                g_autoptr(GFileInfo) info = g_file_query_info(file, CATALOG_ATTRIBUTES,
+                                                              G_FILE_QUERY_INFO_NONE, NULL, NULL);
+                ble_catalog_entry *fresh = NULL;
+
+                if (info != NULL && entry->mtime == _info_mtime(info) &&
+                    entry->size == (guint64)g_file_info_get_size(info))
+                        continue;
+                if (info != NULL && g_file_info_get_file_type(info) == G_FILE_TYPE_REGULAR)
+                        fresh = _entry_load(catalog->path, filename, _info_mtime(info),
+                                            g_file_info_get_size(info));
+                if (fresh != NULL)
+                        _entries_insert(catalog->entries, fresh);
+                else
+                {
+                        g_autofree gchar *cache_path = _thumbnail_path(catalog->cache, filename);
+                        g_unlink(cache_path);
+                        g_hash_table_remove(catalog->entries, filename);
+                }
+                changed = true;
+        }
+        if (changed)
+                _schedule_save(catalog);
+}
+
+ble_catalog *ble_catalog_open(GFile                     *folder,
+                              ble_catalog_changed_func  changed,
+                              gpointer                  data)
+{
+        ble_catalog *catalog = g_new0(ble_catalog, 1);
+
+        catalog->folder = g_object_ref(folder);
+        catalog->path = g_file_get_path(folder);
+        catalog->entries = _entries_new();
+        catalog->cancellable = g_cancellable_new();
+        catalog->changed = changed;
+        catalog->data = data;
+        if (catalog->path == NULL)
+        {
+                ble_catalog_close(catalog);
+                return NULL;
+        }
+        catalog->cache = _cache_dir(catalog->path);
+
+        _load(catalog);
+        catalog->monitor = g_file_monitor_directory(folder, G_FILE_MONITOR_WATCH_MOVES, NULL, NULL);
+        if (catalog->monitor != NULL)
+                g_signal_connect(catalog->monitor, "changed", G_CALLBACK(_monitor_changed), catalog);
+
+        if (_needs_scan(catalog))
+                _scan(catalog);
+        else
+                _refresh_growing(catalog);
+        return catalog;
+}
+
+void ble_catalog_close(ble_catalog *catalog)
+{
+        if (catalog == NULL)
+                return;
+
+        g_cancellable_cancel(catalog->cancellable);
+        if (catalog->monitor != NULL)
+        {
+                g_signal_handlers_disconnect_by_data(catalog->monitor, catalog);
+                g_file_monitor_cancel(catalog->monitor);
+                g_object_unref(catalog->monitor);
+        }
+        if (catalog->save_source != 0)
+        {
+                g_source_remove(catalog->save_source);
+                _save_now(catalog, true);
+        }
+
+        g_object_unref(catalog->cancellable);
+        g_hash_table_unref(catalog->entries);
+        g_object_unref(catalog->folder);
+        g_free(catalog->path);
+        g_free(catalog->cache);
+        g_free(catalog);
+}
+
+ble_catalog_entry *ble_catalog_entry_ref(ble_catalog_entry *entry)
+{
+        return g_atomic_rc_box_acquire(entry);
+}
+
+void ble_catalog_entry_unref(ble_catalog_entry *entry)
+{
+        _entry_unref(entry);
+}
+
+GFile *ble_catalog_get_folder(ble_catalog *catalog)
+{
+        return catalog->folder;
+}
+
+guint ble_catalog_size(ble_catalog *catalog)
+{
+        return g_hash_table_size(catalog->entries);
+}
+
+static gint _compare_filename(gconstpointer a, gconstpointer b)
+{
+        const ble_catalog_entry *x = *(ble_catalog_entry* const*)a;
+        const ble_catalog_entry *y = *(ble_catalog_entry* const*)b;
+        return strcmp(x->filename, y->filename);
+}
+
+GPtrArray *ble_catalog_entries(ble_catalog *catalog)
+{
+        GPtrArray *entries = g_ptr_array_new_full(g_hash_table_size(catalog->entries), _entry_unref);
+        GHashTableIter iter;
+        gpointer value;
+
+        g_hash_table_iter_init(&iter, catalog->entries);
+        while (g_hash_table_iter_next(&iter, NULL, &value))
+                g_ptr_array_add(entries, g_atomic_rc_box_acquire(value));
+        g_ptr_array_sort(entries, _compare_filename);
+        return entries;
+}
+
+GPtrArray *ble_catalog_list(GFile *folder, GCancellable *cancellable, GError **error)
+{
+        ble_catalog catalog = { .folder = folder, .path = g_file_get_path(folder) };
+        g_autoptr(GFileEnumerator) fenum = NULL;
+        GError *local = NULL;
+        GFileInfo *info;
+
+        if (catalog.path == NULL)
+        {
+                g_set_error(error, G_IO_ERROR, G_IO_ERROR_NOT_SUPPORTED, "Folder has no local path");
+                return NULL;
+        }
+        fenum = g_file_enumerate_children(folder, CATALOG_ATTRIBUTES, G_FILE_QUERY_INFO_NONE,
+                                          cancellable, error);
+        if (fenum == NULL)
+        {
+                g_free(catalog.path);
+                return NULL;
+        }
+
+        catalog.cache = _cache_dir(catalog.path);
+        catalog.entries = _entries_new();
+        _load(&catalog);
+
+        GPtrArray *entries = g_ptr_array_new_with_free_func(_entry_unref);
+        while ((info = g_file_enumerator_next_file(fenum, cancellable, &local)) != NULL)
+        {
+                const gchar *filename = g_file_info_get_name(info);
+                if (g_file_info_get_file_type(info) == G_FILE_TYPE_REGULAR && _is_candidate(filename))
+                {
+                        ble_catalog_entry *entry = g_hash_table_lookup(catalog.entries, filename);
+                        if (entry != NULL && entry->mtime == _info_mtime(info) &&
+                            entry->size == (guint64)g_file_info_get_size(info))
+                                entry = g_atomic_rc_box_acquire(entry);
+                        else
+                                entry = _entry_load(catalog.path, filename, _info_mtime(info),
+                                                    g_file_info_get_size(info));
+                        if (entry != NULL)
+                                g_ptr_array_add(entries, entry);
+                }
+                g_object_unref(info);
+        }
+        g_hash_table_unref(catalog.entries);
+        g_free(catalog.path);
+        g_free(catalog.cache);
+
+        if (local != NULL)
+        {
+                g_propagate_error(error, local);
+                g_ptr_array_unref(entries);
+                return NULL;
+        }
+        g_ptr_array_sort(entries, _compare_filename);
+        return entries;
+}
+
+gint64 ble_catalog_entry_duration(const ble_catalog_entry *entry)
+{
+        return entry->frames > 0 ? entry->t_last - entry->t_first : 0;
+}
+
+gchar *ble_catalog_entry_channels(const ble_catalog_entry *entry)
+{
+        GString *channels = g_string_new(NULL);
+        static const struct { guint32 bit; const char *name; } names[] = {
+                { BLE_CHANNEL_RED, "Red" },
+                { BLE_CHANNEL_IR, "IR" },
+                { BLE_CHANNEL_BEAT, "Beat" },
+        };
+
+        for (gsize i = 0; i < G_N_ELEMENTS(names); i++)
+                if (entry->channels & names[i].bit)
+                        g_string_append_printf(channels, "%s%s", channels->len ? ", " : "", names[i].name);
+        return g_string_free(channels, false);
+}
@@ -0,0 +1,79 @@
+#ifndef BLE_MEDICAL_CATALOG_H
+#define BLE_MEDICAL_CATALOG_H
+
+#include <gio/gio.h>
+
+#include "ble_medical_record.h"
+
+/*
+ * Catalog of the recordings found in a folder.
+ *
+ * Entries are built from the fixed recording header only, never from the
+ * data blocks, and persisted in BLE_CATALOG_FILE together with the folder's
+ * mtime. That file and the thumbnails live in a per-folder directory under
+ * the user cache directory, so the catalog never moves the mtime it checks.
+ * Reopening a folder whose mtime did not move costs one file read, plus a
+ * stat of each recording that was still being written, as those grow in
+ * place; otherwise the folder is listed again asynchronously and only files
+ * whose size or mtime changed get their header read, off the main thread.
+ * Results are delivered batch by batch while the listing runs.
+ *
+ * While the catalog is open a GFileMonitor keeps it current, one file at a
+ * time. Callbacks always run on the thread default main context of the
+ * caller of ble_catalog_open().
+ */
+
+// $XDG_CACHE_HOME/BLE_CATALOG_CACHE_DIR/<SHA-1 of the folder path>/
+#define BLE_CATALOG_CACHE_DIR   "ble_medical"
+#define BLE_CATALOG_FILE        "catalog"
+#define BLE_CATALOG_MAGIC       "BLECAT\0\1"
+#define BLE_THUMBNAIL_MAGIC     "BLETHM\0\2"
+#define BLE_THUMBNAIL_SUFFIX    ".thumb"
+
+typedef struct _ble_catalog_entry {
+        gchar   *filename;
+        // Everything from here on is stored as is in BLE_CATALOG_FILE
+        gint64  mtime;
+        guint64 size;
+        gchar   id[32];
+        gchar   name[64];
+        gchar   day[16];
+        gint64  t_first;
+        gint64  t_last;
+        gint64  start_real;     // wall clock of t_first, 0 while recording
+        guint64 frames;
+        guint32 channels;       // BLE_CHANNEL_*
+        guint32 flags;          // ble_record_header flags
+} ble_catalog_entry;
+
+typedef struct _ble_catalog ble_catalog;
+
+// `updated` holds new or changed entries, `removed` filenames that went away
+typedef void (*ble_catalog_changed_func)(ble_catalog*, GPtrArray *updated,
+                                         GPtrArray *removed, gpointer);
+
+ble_catalog *ble_catalog_open(GFile *folder, ble_catalog_changed_func changed, gpointer data);
+void ble_catalog_close(ble_catalog*);
+
+GFile *ble_catalog_get_folder(ble_catalog*);
+guint ble_catalog_size(ble_catalog*);
+// Entries sorted by filename; unref the array, entries are owned by it
+GPtrArray *ble_catalog_entries(ble_catalog*);
+
+// Blocking listing for tools without a main loop: entries unchanged since
+// the persisted catalog are taken from it, others get their header read.
+// Nothing is written back. NULL with `error` set on failure.
+GPtrArray *ble_catalog_list(GFile *folder, GCancellable *cancellable, GError **error);
+
+// Outline of a recording: its thumbnail block, else the "<filename>.thumb"
+// cache in the folder's cache directory, else computed from the samples and
+// cached. A recording still growing only has its new blocks decoded, on top
+// of the cached outline. Blocking; meant for worker threads.
+gboolean ble_catalog_thumbnail(const gchar *folder, const ble_catalog_entry*, ble_thumbnail*);
+
+ble_catalog_entry *ble_catalog_entry_ref(ble_catalog_entry*);
+void ble_catalog_entry_unref(ble_catalog_entry*);
+gint64 ble_catalog_entry_duration(const ble_catalog_entry*);
+gchar *ble_catalog_entry_channels(const ble_catalog_entry*);
+
+#endif
@@ -0,0 +1,451 @@
+#include "ble_medical_codec.h"
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define BLE_CODEC_HAVE_X86
+#endif
+
+#define ROWS    (BLE_CODEC_GROUP / 8)
+
+typedef size_t (*_group_fn)(const uint8_t*, uint16_t*);
+typedef size_t (*_encode_fn)(const uint16_t*, uint8_t*);
+
+static _encode_fn encode_group;
+static _group_fn decode_group;
+
+static inline int _width(uint16_t all)
+{
+        return all ? 32 - __builtin_clz(all) : 0;
+}
+
+static inline void _put_header(uint8_t *out, uint16_t first, int16_t base, int w)
+{
+        memcpy(out, &first, sizeof(first));
+        memcpy(out + 2, &base, sizeof(base));
+        out[4] = (uint8_t)w;
+}
+
+static inline void _get_header(const uint8_t *in, uint16_t *first, int16_t *base, int *w)
+{
+        memcpy(first, in, sizeof(*first));
+        memcpy(base, in + 2, sizeof(*base));
+        *w = in[4];
+}
+
+/* ---------- scalar ---------- */
+
+static size_t _encode_group_scalar(const uint16_t *x, uint8_t *out)
+{
+        int16_t d[BLE_CODEC_GROUP];
+        uint16_t z[BLE_CODEC_GROUP];
+        uint16_t all = 0;
+        int16_t base = INT16_MAX;
+
+        for (size_t i = 1; i < BLE_CODEC_GROUP; i++)
+        {
+                d[i] = (int16_t)(x[i] - x[i - 1]);
+                if (d[i] < base)
+                        base = d[i];
+        }
+        d[0] = base;
+        for (size_t i = 0; i < BLE_CODEC_GROUP; i++)
+        {
+                z[i] = (uint16_t)(d[i] - base);
+                all |= z[i];
+        }
+
+        int w = _width(all);
+        _put_header(out, x[0], base, w);
+        uint8_t *packed = out + BLE_CODEC_GROUP_HEADER;
+
+        for (int l = 0; l < 8 && w > 0; l++)
+        {
+                uint32_t acc = 0;
+                int filled = 0, k = 0;
+                for (int j = 0; j < ROWS; j++)
+                {
+                        uint16_t v = z[j * 8 + l];
+                        acc |= (uint32_t)v << filled;
+                        filled += w;
+                        if (filled >= 16)
+                        {
+                                uint16_t word = (uint16_t)acc;
+                                memcpy(packed + (k * 8 + l) * 2, &word, sizeof(word));
+                                k++;
+                                filled -= 16;
+                                acc >>= 16;
+                        }
+                }
+        }
+        return BLE_CODEC_GROUP_HEADER + 16 * (size_t)w;
+}
+
+static size_t _decode_group_scalar(const uint8_t *in, uint16_t *x)
+{
+        uint16_t first;
+        int16_t base;
+        int w;
+        _get_header(in, &first, &base, &w);
+        const uint8_t *packed = in + BLE_CODEC_GROUP_HEADER;
+        uint16_t d[BLE_CODEC_GROUP] = { 0 };
+
+        for (int l = 0; l < 8 && w > 0; l++)
+        {
+                uint32_t acc = 0;
+                int avail = 0, k = 0;
+                for (int j = 0; j < ROWS; j++)
+                {
+                        if (avail < w)
+                        {
+                                uint16_t word;
+                                memcpy(&word, packed + (k * 8 + l) * 2, sizeof(word));
+                                acc |= (uint32_t)word << avail;
+                                avail += 16;
+                                k++;
+                        }
+                        d[j * 8 + l] = (uint16_t)(acc & ((1u << w) - 1));
+                        acc >>= w;
+                        avail -= w;
+                }
+        }
+
+        // The first delta is stored as `base` itself, so start one base early
+        uint16_t prev = (uint16_t)(first - base);
+        for (size_t i = 0; i < BLE_CODEC_GROUP; i++)
+        {
+                prev = (uint16_t)(prev + d[i] + base);
+                x[i] = prev;
+        }
+        return BLE_CODEC_GROUP_HEADER + 16 * (size_t)w;
+}
+
+#ifdef BLE_CODEC_HAVE_X86
+
+/* ---------- SSE2 ---------- */
+
+static inline uint16_t _hor_or_sse2(__m128i v)
+{
+        v = _mm_or_si128(v, _mm_srli_si128(v, 8));
+        v = _mm_or_si128(v, _mm_srli_si128(v, 4));
+        v = _mm_or_si128(v, _mm_srli_si128(v, 2));
+        return (uint16_t)_mm_cvtsi128_si32(v);
+}
+
+static inline int16_t _hor_min_sse2(__m128i v)
+{
+        v = _mm_min_epi16(v, _mm_srli_si128(v, 8));
+        v = _mm_min_epi16(v, _mm_srli_si128(v, 4));
+        v = _mm_min_epi16(v, _mm_srli_si128(v, 2));
+        return (int16_t)_mm_cvtsi128_si32(v);
+}
+
+// Subtracts the reference from every delta and returns the OR of the results;
+// the first delta of the group becomes the reference itself.
+static inline uint16_t _reference_rows_sse2(__m128i *z, int16_t base)
+{
+        __m128i vbase = _mm_set1_epi16(base);
+        __m128i all = _mm_setzero_si128();
+
+        z[0] = _mm_insert_epi16(z[0], base, 0);
+        for (int j = 0; j < ROWS; j++)
+        {
+                z[j] = _mm_sub_epi16(z[j], vbase);
+                all = _mm_or_si128(all, z[j]);
+        }
+        return _hor_or_sse2(all);
+}
+
+// Packs 16 rows of referenced deltas, 8 lanes at a time, `w` bits each.
+static inline void _pack_rows_sse2(const __m128i *z, int w, uint8_t *packed)
+{
+        __m128i acc = _mm_setzero_si128();
+        int filled = 0;
+        for (int j = 0; j < ROWS; j++)
+        {
+                acc = _mm_or_si128(acc, _mm_sll_epi16(z[j], _mm_cvtsi32_si128(filled)));
+                filled += w;
+                if (filled >= 16)
+                {
+                        _mm_storeu_si128((__m128i*)packed, acc);
+                        packed += 16;
+                        filled -= 16;
+                        acc = filled ? _mm_srl_epi16(z[j], _mm_cvtsi32_si128(w - filled)) : _mm_setzero_si128();
+                }
+        }
+}
+
+static inline void _unpack_rows_sse2(const uint8_t *packed, int w, __m128i *z)
+{
+        const __m128i mask = _mm_set1_epi16((short)((1u << w) - 1));
+        __m128i cur = _mm_loadu_si128((const __m128i*)packed);
+        int bitpos = 0;
+
+        for (int j = 0; j < ROWS; j++)
+        {
+                if (bitpos == 16)
+                {
+                        packed += 16;
+                        cur = _mm_loadu_si128((const __m128i*)packed);
+                        bitpos = 0;
+                }
+                __m128i v = _mm_srl_epi16(cur, _mm_cvtsi32_si128(bitpos));
+                if (bitpos + w > 16)
+                {
+                        packed += 16;
+                        cur = _mm_loadu_si128((const __m128i*)packed);
+                        v = _mm_or_si128(v, _mm_sll_epi16(cur, _mm_cvtsi32_si128(16 - bitpos)));
+                        bitpos += w - 16;
+                }
+                else
+                {
+                        bitpos += w;
+                }
+                z[j] = _mm_and_si128(v, mask);
+        }
+}
+
+static size_t _encode_group_sse2(const uint16_t *x, uint8_t *out)
+{
+        __m128i z[ROWS];
+
+        __m128i row = _mm_loadu_si128((const __m128i*)x);
+        __m128i prev = _mm_or_si128(_mm_slli_si128(row, 2), _mm_cvtsi32_si128(x[0]));
+        z[0] = _mm_sub_epi16(row, prev);
+        __m128i low = _mm_insert_epi16(z[0], INT16_MAX, 0);
+        for (int j = 1; j < ROWS; j++)
+        {
+                row = _mm_loadu_si128((const __m128i*)(x + j * 8));
+                prev = _mm_loadu_si128((const __m128i*)(x + j * 8 - 1));
+                z[j] = _mm_sub_epi16(row, prev);
+                low = _mm_min_epi16(low, z[j]);
+        }
+
+        int16_t base = _hor_min_sse2(low);
+        int w = _width(_reference_rows_sse2(z, base));
+        _put_header(out, x[0], base, w);
+        if (w > 0)
+                _pack_rows_sse2(z, w, out + BLE_CODEC_GROUP_HEADER);
+        return BLE_CODEC_GROUP_HEADER + 16 * (size_t)w;
+}
+
+static size_t _decode_group_sse2(const uint8_t *in, uint16_t *x)
+{
+        uint16_t first;
+        int16_t base;
+        int w;
+        _get_header(in, &first, &base, &w);
+        __m128i vbase = _mm_set1_epi16(base);
+        __m128i carry = _mm_set1_epi16((short)(first - base));
+        __m128i z[ROWS];
+
+        if (w > 0)
+                _unpack_rows_sse2(in + BLE_CODEC_GROUP_HEADER, w, z);
+        else
+                for (int j = 0; j < ROWS; j++)
+                        z[j] = _mm_setzero_si128();
+
+        for (int j = 0; j < ROWS; j++)
+        {
+                __m128i v = _mm_add_epi16(z[j], vbase);
+                v = _mm_add_epi16(v, _mm_slli_si128(v, 2));
+                v = _mm_add_epi16(v, _mm_slli_si128(v, 4));
+                v = _mm_add_epi16(v, _mm_slli_si128(v, 8));
+                v = _mm_add_epi16(v, carry);
+                _mm_storeu_si128((__m128i*)(x + j * 8), v);
+                carry = _mm_shufflehi_epi16(v, 0xff);
+                carry = _mm_unpackhi_epi64(carry, carry);
+        }
+        return BLE_CODEC_GROUP_HEADER + 16 * (size_t)w;
+}
+
+/* ---------- AVX2 ----------
+ * The bit layout is 8 lanes wide, so packing stays on 128-bit registers;
+ * AVX2 takes the delta / reference transforms and the prefix sum two rows at
+ * a time, which is where the decoder spends most of its instructions.
+ */
+
+__attribute__((target("avx2")))
+static size_t _encode_group_avx2(const uint16_t *x, uint8_t *out)
+{
+        __m128i z[ROWS];
+        __m256i low = _mm256_set1_epi16(INT16_MAX);
+        __m256i first = _mm256_set_m128i(_mm_setzero_si128(), _mm_cvtsi32_si128(x[0]));
+
+        for (int j = 0; j < ROWS; j += 2)
+        {
+                __m256i rows = _mm256_loadu_si256((const __m256i*)(x + j * 8));
+                __m256i prev, d;
+                if (j == 0)
+                {
+                        // Shift by one sample across the 128-bit halves, x[0] in front
+                        __m256i shifted = _mm256_permute2x128_si256(rows, rows, 0x08);
+                        prev = _mm256_or_si256(_mm256_alignr_epi8(rows, shifted, 14), first);
+                        d = _mm256_sub_epi16(rows, prev);
+                        low = _mm256_min_epi16(low, _mm256_insert_epi16(d, INT16_MAX, 0));
+                }
+                else
+                {
+                        prev = _mm256_loadu_si256((const __m256i*)(x + j * 8 - 1));
+                        d = _mm256_sub_epi16(rows, prev);
+                        low = _mm256_min_epi16(low, d);
+                }
+                z[j] = _mm256_castsi256_si128(d);
+                z[j + 1] = _mm256_extracti128_si256(d, 1);
+        }
+
+        __m128i low128 = _mm_min_epi16(_mm256_castsi256_si128(low), _mm256_extracti128_si256(low, 1));
+        int16_t base = _hor_min_sse2(low128);
+        int w = _width(_reference_rows_sse2(z, base));
+        _put_header(out, x[0], base, w);
+        if (w > 0)
+                _pack_rows_sse2(z, w, out + BLE_CODEC_GROUP_HEADER);
+        return BLE_CODEC_GROUP_HEADER + 16 * (size_t)w;
+}
+
+__attribute__((target("avx2")))
+static size_t _decode_group_avx2(const uint8_t *in, uint16_t *x)
+{
+        uint16_t first;
+        int16_t base;
+        int w;
+        _get_header(in, &first, &base, &w);
+        __m256i vbase = _mm256_set1_epi16(base);
+        __m256i carry = _mm256_set1_epi16((short)(first - base));
+        __m128i z[ROWS];
+
+        if (w > 0)
+                _unpack_rows_sse2(in + BLE_CODEC_GROUP_HEADER, w, z);
+        else
+                for (int j = 0; j < ROWS; j++)
+                        z[j] = _mm_setzero_si128();
+
+        for (int j = 0; j < ROWS; j += 2)
+        {
+                __m256i v = _mm256_add_epi16(_mm256_set_m128i(z[j + 1], z[j]), vbase);
+
+                // Scan each 128-bit half, then carry the low half into the high one
+                v = _mm256_add_epi16(v, _mm256_slli_si256(v, 2));
+                v = _mm256_add_epi16(v, _mm256_slli_si256(v, 4));
+                v = _mm256_add_epi16(v, _mm256_slli_si256(v, 8));
+                __m256i last = _mm256_shufflehi_epi16(v, 0xff);
+                last = _mm256_unpackhi_epi64(last, last);
+                v = _mm256_add_epi16(v, _mm256_permute2x128_si256(last, last, 0x08));
+                v = _mm256_add_epi16(v, carry);
+                _mm256_storeu_si256((__m256i*)(x + j * 8), v);
+
+                last = _mm256_shufflehi_epi16(v, 0xff);
+                last = _mm256_unpackhi_epi64(last, last);
+                carry = _mm256_permute2x128_si256(last, last, 0x11);
+        }
+        return BLE_CODEC_GROUP_HEADER + 16 * (size_t)w;
+}
+
+#endif
+
+ble_codec_impl ble_codec_select(ble_codec_impl impl)
+{
+        ble_codec_impl best = BLE_CODEC_SCALAR;
+#ifdef BLE_CODEC_HAVE_X86
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("sse2"))
+                best = BLE_CODEC_SSE2;
+        if (__builtin_cpu_supports("avx2"))
+                best = BLE_CODEC_AVX2;
+#endif
+        if (impl == BLE_CODEC_AUTO || impl > best)
+                impl = best;
+
+        switch (impl)
+        {
+#ifdef BLE_CODEC_HAVE_X86
+                case BLE_CODEC_AVX2:
+                        encode_group = _encode_group_avx2;
+                        decode_group = _decode_group_avx2;
+                        break;
+                case BLE_CODEC_SSE2:
+                        encode_group = _encode_group_sse2;
+                        decode_group = _decode_group_sse2;
+                        break;
+#endif
+                default:
+                        impl = BLE_CODEC_SCALAR;
+                        encode_group = _encode_group_scalar;
+                        decode_group = _decode_group_scalar;
+                        break;
+        }
+        return impl;
+}
+
+const char *ble_codec_impl_name(ble_codec_impl impl)
+{
+        switch (impl)
+        {
+                case BLE_CODEC_SCALAR:  return "scalar";
+                case BLE_CODEC_SSE2:    return "sse2";
+                case BLE_CODEC_AVX2:    return "avx2";
+                default:                return "auto";
+        }
+}
+
+__attribute__((constructor))
+static void _codec_init(void)
+{
+        ble_codec_select(BLE_CODEC_AUTO);
+}
+
+size_t ble_codec_bound(size_t n)
+{
+        size_t groups = (n + BLE_CODEC_GROUP - 1) / BLE_CODEC_GROUP;
+        return groups * (BLE_CODEC_GROUP_HEADER + 2 * BLE_CODEC_GROUP);
+}
+
+size_t ble_codec_encode(const uint16_t *in, size_t n, uint8_t *out)
+{
+        uint8_t *p = out;
+        size_t i = 0;
+
+        for (; i + BLE_CODEC_GROUP <= n; i += BLE_CODEC_GROUP)
+                p += encode_group(in + i, p);
+
+        if (i < n)
+        {
+                uint16_t tail[BLE_CODEC_GROUP];
+                size_t rest = n - i;
+                memcpy(tail, in + i, rest * sizeof(uint16_t));
+                for (size_t k = rest; k < BLE_CODEC_GROUP; k++)
+                        tail[k] = in[n - 1];
+                p += encode_group(tail, p);
+        }
+        return (size_t)(p - out);
+}
+
+// Returns the bytes consumed, or 0 when `in` does not hold `n` samples.
+size_t ble_codec_decode(const uint8_t *in, size_t len, uint16_t *out, size_t n)
+{
+        const uint8_t *p = in, *end = in + len;
+        size_t i = 0;
+
+        while (i < n)
+        {
+                if (end - p < BLE_CODEC_GROUP_HEADER)
+                        return 0;
+                size_t w = p[4];
+                if (w > 16 || (size_t)(end - p) < BLE_CODEC_GROUP_HEADER + 16 * w)
+                        return 0;
+
+                if (n - i >= BLE_CODEC_GROUP)
+                {
+                        p += decode_group(p, out + i);
+                        i += BLE_CODEC_GROUP;
+                }
+                else
+                {
+                        uint16_t tail[BLE_CODEC_GROUP];
+                        p += decode_group(p, tail);
+                        memcpy(out + i, tail, (n - i) * sizeof(uint16_t));
+                        i = n;
+                }
+        }
+        return (size_t)(p - in);
+}
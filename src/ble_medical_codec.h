@@ -0,0 +1,42 @@
+#ifndef BLE_MEDICAL_CODEC_H
+#define BLE_MEDICAL_CODEC_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+/*
+ * Lossless codec for 16-bit sample streams (red / IR channels).
+ *
+ * Samples are cut in groups of BLE_CODEC_GROUP, each laid out as 16 rows of
+ * 8 consecutive samples. A group keeps its first sample and the smallest of
+ * its deltas as frame of reference; every delta minus that reference then
+ * fits in w bits. Each of the 8 lanes packs its 16 values into w 16-bit
+ * words, words of the 8 lanes interleaved. That layout is what lets SSE2 /
+ * AVX2 unpack a whole row per instruction; the scalar path produces the very
+ * same bytes.
+ *
+ *   [first : u16][reference : i16][w : u8][w * 16 bytes]
+ *
+ * A trailing partial group is padded with its last sample.
+ */
+
+#define BLE_CODEC_GROUP         128
+#define BLE_CODEC_GROUP_HEADER  5
+
+typedef enum _ble_codec_impl {
+        BLE_CODEC_SCALAR,
+        BLE_CODEC_SSE2,
+        BLE_CODEC_AVX2,
+        BLE_CODEC_AUTO
+} ble_codec_impl;
+
+size_t ble_codec_bound(size_t n);
+size_t ble_codec_encode(const uint16_t *in, size_t n, uint8_t *out);
+size_t ble_codec_decode(const uint8_t *in, size_t len, uint16_t *out, size_t n);
+
+// Forces an implementation, mainly for benchmarks. Returns the one in use,
+// which falls back to the best supported when the request is unavailable.
+ble_codec_impl ble_codec_select(ble_codec_impl);
+const char *ble_codec_impl_name(ble_codec_impl);
+
+#endif
@@ -0,0 +1,102 @@
+#include "ble_medical_crc.h"
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <nmmintrin.h>
+#define BLE_CRC_HAVE_SSE42_PATH
+#endif
+
+#define CRC32C_POLY 0x82F63B78u
+
+static uint32_t crc32c_table[8][256];
+static uint32_t (*crc32c_impl)(uint32_t, const uint8_t*, size_t);
+
+static uint32_t _crc32c_sw(uint32_t crc, const uint8_t *p, size_t len)
+{
+        while (len && ((uintptr_t)p & 7))
+        {
+                crc = crc32c_table[0][(crc ^ *p++) & 0xff] ^ (crc >> 8);
+                len--;
+        }
+        while (len >= 8)
+        {
+                uint64_t word;
+                memcpy(&word, p, sizeof(word));
+                word ^= crc;
+                crc =   crc32c_table[7][word & 0xff] ^
+                        crc32c_table[6][(word >> 8) & 0xff] ^
+                        crc32c_table[5][(word >> 16) & 0xff] ^
+                        crc32c_table[4][(word >> 24) & 0xff] ^
+                        crc32c_table[3][(word >> 32) & 0xff] ^
+                        crc32c_table[2][(word >> 40) & 0xff] ^
+                        crc32c_table[1][(word >> 48) & 0xff] ^
+                        crc32c_table[0][word >> 56];
+                p += 8;
+                len -= 8;
+        }
+        while (len--)
+                crc = crc32c_table[0][(crc ^ *p++) & 0xff] ^ (crc >> 8);
+        return crc;
+}
+
+#ifdef BLE_CRC_HAVE_SSE42_PATH
+__attribute__((target("sse4.2")))
+static uint32_t _crc32c_sse42(uint32_t crc, const uint8_t *p, size_t len)
+{
+        while (len && ((uintptr_t)p & 7))
+        {
+                crc = _mm_crc32_u8(crc, *p++);
+                len--;
+        }
+#ifdef __x86_64__
+        uint64_t crc64 = crc;
+        while (len >= 8)
+        {
+                uint64_t word;
+                memcpy(&word, p, sizeof(word));
+                crc64 = _mm_crc32_u64(crc64, word);
+                p += 8;
+                len -= 8;
+        }
+        crc = (uint32_t)crc64;
+#endif
+        while (len >= 4)
+        {
+                uint32_t word;
+                memcpy(&word, p, sizeof(word));
+                crc = _mm_crc32_u32(crc, word);
+                p += 4;
+                len -= 4;
+        }
+        while (len--)
+                crc = _mm_crc32_u8(crc, *p++);
+        return crc;
+}
+#endif
+
+__attribute__((constructor))
+static void _crc32c_init(void)
+{
+        for (uint32_t i = 0; i < 256; i++)
+        {
+                uint32_t crc = i;
+                for (int k = 0; k < 8; k++)
+                        crc = (crc & 1) ? (crc >> 1) ^ CRC32C_POLY : crc >> 1;
+                crc32c_table[0][i] = crc;
+        }
+        for (uint32_t i = 0; i < 256; i++)
+                for (int t = 1; t < 8; t++)
+                        crc32c_table[t][i] = crc32c_table[0][crc32c_table[t - 1][i] & 0xff] ^ (crc32c_table[t - 1][i] >> 8);
+
+        crc32c_impl = _crc32c_sw;
+#ifdef BLE_CRC_HAVE_SSE42_PATH
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("sse4.2"))
+                crc32c_impl = _crc32c_sse42;
+#endif
+}
+
+uint32_t ble_crc32c(uint32_t crc, const void *buf, size_t len)
+{
+        return ~crc32c_impl(~crc, (const uint8_t*)buf, len);
+}
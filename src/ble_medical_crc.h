@@ -0,0 +1,11 @@
+#ifndef BLE_MEDICAL_CRC_H
+#define BLE_MEDICAL_CRC_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+// CRC32C (Castagnoli). Uses the SSE4.2 crc32 instruction when the CPU has it,
+// a slicing-by-8 table otherwise. Chain calls by passing the previous result.
+uint32_t ble_crc32c(uint32_t crc, const void *buf, size_t len);
+
+#endif
@@ -0,0 +1,216 @@
+#include "ble_medical_csv.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+// Longest row: time, two samples and a beat average
+#define CSV_ROW_MAX             (24 + 1 + 5 + 1 + 5 + 1 + 11 + 1)
+#define CSV_SAMPLE_US(j)        ((int64_t)((j) * PACKAGE_INTERVAL * 1e6 + 0.5))
+
+static const char _digits[] =
+        "0001020304050607080910111213141516171819"
+        "2021222324252627282930313233343536373839"
+        "4041424344454647484950515253545556575859"
+        "6061626364656667686970717273747576777879"
+        "8081828384858687888990919293949596979899";
+
+// Two digits at a time, written from the end
+static char *_put_uint(char *p, uint64_t value)
+{
+        char text[20];
+        char *q = text + sizeof(text);
+
+        while (value >= 100)
+        {
+                unsigned pair = (unsigned)(value % 100) * 2;
+                value /= 100;
+                *--q = _digits[pair + 1];
+                *--q = _digits[pair];
+        }
+        if (value >= 10)
+        {
+                *--q = _digits[value * 2 + 1];
+                *--q = _digits[value * 2];
+        }
+        else
+                *--q = (char)('0' + value);
+
+        size_t len = text + sizeof(text) - q;
+        memcpy(p, q, len);
+        return p + len;
+}
+
+static char *_put_int(char *p, int64_t value)
+{
+        if (value < 0)
+        {
+                *p++ = '-';
+                return _put_uint(p, (uint64_t)0 - (uint64_t)value);
+        }
+        return _put_uint(p, (uint64_t)value);
+}
+
+// Microseconds as seconds, trailing zeros of the fraction dropped
+static char *_put_us(char *p, int64_t us)
+{
+        uint64_t magnitude;
+        unsigned fraction;
+
+        if (us < 0)
+                *p++ = '-';
+        magnitude = us < 0 ? (uint64_t)0 - (uint64_t)us : (uint64_t)us;
+        p = _put_uint(p, magnitude / 1000000);
+        fraction = (unsigned)(magnitude % 1000000);
+        if (fraction == 0)
+                return p;
+
+        char text[6];
+        int len = 6;
+        for (int i = 5; i >= 0; i--, fraction /= 10)
+                text[i] = (char)('0' + fraction % 10);
+        while (text[len - 1] == '0')
+                len--;
+        *p++ = '.';
+        memcpy(p, text, len);
+        return p + len;
+}
+
+static int _write_full(int fd, const char *buf, size_t len)
+{
+        while (len > 0)
+        {
+                ssize_t n = write(fd, buf, len);
+                if (n < 0 && errno == EINTR)
+                        continue;
+                if (n <= 0)
+                        return -1;
+                buf += n;
+                len -= (size_t)n;
+        }
+        return 0;
+}
+
+static uint64_t _range_frames(const ble_reader *reader, const ble_csv_range *range)
+{
+        uint64_t frames = 0;
+        for (uint32_t i = ble_reader_seek(reader, range->t_begin);
+             i < reader->blocks && reader->index[i].t_first <= range->t_end; i++)
+                frames += reader->index[i].count;
+        return frames;
+}
+
+static char *_put_header(char *p, uint32_t channels)
+{
+        static const char time[] = "time_s";
+        memcpy(p, time, sizeof(time) - 1);
+        p += sizeof(time) - 1;
+        if (channels & BLE_CHANNEL_RED)
+                p += sprintf(p, ",red");
+        if (channels & BLE_CHANNEL_IR)
+                p += sprintf(p, ",ir");
+        if (channels & BLE_CHANNEL_BEAT)
+                p += sprintf(p, ",beat");
+        *p++ = '\n';
+        return p;
+}
+
+int ble_csv_export(const ble_reader             *reader,
+                   const char                   *path,
+                   uint32_t                     channels,
+                   const ble_csv_range          *ranges,
+                   size_t                       n_ranges,
+                   ble_csv_progress_func        progress,
+                   void                         *data)
+{
+        ble_csv_range whole = { INT64_MIN, INT64_MAX };
+        int64_t t0 = reader->blocks > 0 ? reader->index[0].t_first : 0;
+        uint64_t total = 0, done = 0;
+        int res = 0;
+
+        if (n_ranges == 0)
+        {
+                ranges = &whole;
+                n_ranges = 1;
+        }
+        for (size_t r = 0; r < n_ranges; r++)
+                total += _range_frames(reader, &ranges[r]);
+
+        char *buf = malloc(BLE_CSV_BUFFER_SIZE);
+        ble_range *range = malloc(sizeof(*range));
+        int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        if (buf == NULL || range == NULL || fd < 0)
+        {
+                res = -1;
+                goto DONE;
+        }
+
+        char *p = _put_header(buf, channels);
+        char *limit = buf + BLE_CSV_BUFFER_SIZE - PACKAGE_SAMPLES * CSV_ROW_MAX;
+        for (size_t r = 0; r < n_ranges && res == 0; r++)
+        {
+                ble_view view;
+                ble_range_init(range, reader, ranges[r].t_begin, ranges[r].t_end);
+                while (res == 0 && ble_range_next(range, &view))
+                {
+                        for (uint32_t i = 0; i < view.count; i++)
+                        {
+                                const uint16_t *red = view.red + (size_t)i * PACKAGE_SAMPLES;
+                                const uint16_t *ir = view.ir + (size_t)i * PACKAGE_SAMPLES;
+                                int64_t t = view.times[i] - t0;
+
+                                if (p > limit)
+                                {
+                                        if (_write_full(fd, buf, p - buf) != 0)
+                                        {
+                                                res = -1;
+                                                break;
+                                        }
+                                        p = buf;
+                                        if (progress != NULL && !progress(done, total, data))
+                                        {
+                                                res = BLE_CSV_CANCELLED;
+                                                break;
+                                        }
+                                }
+                                for (uint32_t j = 0; j < PACKAGE_SAMPLES; j++)
+                                {
+                                        p = _put_us(p, t + CSV_SAMPLE_US(j));
+                                        if (channels & BLE_CHANNEL_RED)
+                                        {
+                                                *p++ = ',';
+                                                p = _put_uint(p, red[j]);
+                                        }
+                                        if (channels & BLE_CHANNEL_IR)
+                                        {
+                                                *p++ = ',';
+                                                p = _put_uint(p, ir[j]);
+                                        }
+                                        if (channels & BLE_CHANNEL_BEAT)
+                                        {
+                                                *p++ = ',';
+                                                p = _put_int(p, view.beat[i]);
+                                        }
+                                        *p++ = '\n';
+                                }
+                        }
+                        done += view.count;
+                }
+        }
+        if (res == 0 && _write_full(fd, buf, p - buf) != 0)
+                res = -1;
+        if (res == 0 && progress != NULL)
+                progress(total, total, data);
+
+DONE:
+        if (fd >= 0 && close(fd) != 0 && res == 0)
+                res = -1;
+        if (res != 0 && fd >= 0)
+                unlink(path);
+        free(range);
+        free(buf);
+        return res;
+}
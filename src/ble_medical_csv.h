@@ -0,0 +1,39 @@
+#ifndef BLE_MEDICAL_CSV_H
+#define BLE_MEDICAL_CSV_H
+
+#include "ble_medical_reader.h"
+
+/*
+ * CSV export of recordings.
+ *
+ * One row per sample: the time in seconds since the recording's first
+ * frame, then the selected channels. Samples of a frame are spaced by
+ * PACKAGE_INTERVAL from the frame's receive time; the beat average is
+ * repeated on each of them. Rows are formatted by hand into a
+ * BLE_CSV_BUFFER_SIZE buffer that goes out in single write() calls.
+ *
+ * Times are exact to the microsecond, without trailing zeros: "12.5"
+ * and not "12.500000".
+ *
+ * Export is blocking and meant for worker threads; the progress callback
+ * runs on that thread after every buffer and can stop the export.
+ */
+
+#define BLE_CSV_BUFFER_SIZE     (4 << 20)
+#define BLE_CSV_CANCELLED       1
+
+typedef struct _ble_csv_range {
+        int64_t         t_begin;        // receive times, inclusive
+        int64_t         t_end;
+} ble_csv_range;
+
+// `done` and `total` count frames; return false to stop the export
+typedef int (*ble_csv_progress_func)(uint64_t done, uint64_t total, void *data);
+
+// `channels` is a mask of BLE_CHANNEL_*; with no range the whole recording
+// is exported. Returns 0, -1 on error, or BLE_CSV_CANCELLED.
+int ble_csv_export(const ble_reader*, const char *path, uint32_t channels,
+                   const ble_csv_range *ranges, size_t n_ranges,
+                   ble_csv_progress_func progress, void *data);
+
+#endif
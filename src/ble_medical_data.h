@@ -5,6 +5,7 @@
 #include <stdlib.h>
 
 #define PACKAGE_SIZE 46
+#define PACKAGE_SAMPLES 10
 #define PACKAGE_INTERVAL (1.0/120.0)
 
 typedef uint8_t* ble_pack_t;
@@ -34,8 +35,10 @@ typedef enum _value_type {
 typedef struct _t_pack {
         ble_pack_t      data;
         ble_time_t      time;
-        int             fileWritten;
-        int             plotWritten;
+        int             refs;           // stages still holding the frame
+        point_t         points[PACKAGE_SAMPLES]; // filled in by the decode stage
+        ble_time_t      decoded;        // when the decode stage was done with it
+        ble_time_t      queued;         // when it was handed on for rendering
 } t_pack;
 
 void pack_from_data(ble_pack_inf*, ble_pack_t);
@@ -14,17 +14,12 @@
 #define c_cyan          "\033[1;36m"
 #define c_reset         "\033[0m"
 
+// One write, so lines from different threads do not interleave
 static inline void _debug_print(const char* title) {
-        fprintf(stderr, c_red);
-        fprintf(stderr, "[DEBUG]: ");
-        fprintf(stderr, c_reset);
-        fprintf(stderr, c_green);
-        fprintf(stderr, title);
-        fprintf(stderr, c_reset);
-        fprintf(stderr, "\n");
+        fprintf(stderr, c_red "[DEBUG]: " c_reset c_green "%s" c_reset "\n", title);
 }
 #else
-void _debug_print(const char* title) {
+static inline void _debug_print(const char* title) {
 }
 #endif
 
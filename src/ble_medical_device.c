@@ -0,0 +1,155 @@
+#include "ble_medical_device.h"
+#include "ble_medical_debug.h"
+#include "credentials.h"
+
+#include <stdbool.h>
+
+G_DEFINE_QUARK(ble-device-error-quark, ble_device_error)
+
+static simpleble_adapter_t _adapter_find(const gchar *address)
+{
+        size_t count = simpleble_adapter_get_count();
+
+        for (size_t i = 0; i < count; i++)
+        {
+                simpleble_adapter_t adapter = simpleble_adapter_get_handle(i);
+                if (adapter == NULL)
+                        continue;
+                if (address == NULL)
+                        return adapter;
+                char *_address = simpleble_adapter_address(adapter);
+                int found = _address != NULL && g_ascii_strcasecmp(_address, address) == 0;
+                simpleble_free(_address);
+                if (found)
+                        return adapter;
+                simpleble_adapter_release_handle(adapter);
+        }
+        return NULL;
+}
+
+gboolean ble_device_find(simpleble_peripheral_t peripheral, simpleble_uuid_t *service,
+                         simpleble_uuid_t *characteristic)
+{
+        size_t services_count = simpleble_peripheral_services_count(peripheral);
+        for (size_t i = 0; i < services_count; i++)
+        {
+                simpleble_service_t _service;
+                if (simpleble_peripheral_services_get(peripheral, i, &_service) != SIMPLEBLE_SUCCESS)
+                        return false;
+                if (g_strcmp0(_service.uuid.value, DEFAULT_SERVICE_UUID) != 0)
+                        continue;
+                for (size_t j = 0; j < _service.characteristic_count; j++)
+                {
+                        if (g_strcmp0(_service.characteristics[j].uuid.value, DEFAULT_CHARACTERISTIC_UUID) == 0)
+                        {
+                                *service = _service.uuid;
+                                *characteristic = _service.characteristics[j].uuid;
+                                return true;
+                        }
+                }
+        }
+        return false;
+}
+
+gboolean ble_device_verify(simpleble_peripheral_t peripheral, simpleble_uuid_t *service,
+                           simpleble_uuid_t *characteristic)
+{
+        if (simpleble_peripheral_connect(peripheral) != SIMPLEBLE_SUCCESS)
+        {
+                _debug_print("Peripheral connection failed");
+                return false;
+        }
+        if (ble_device_find(peripheral, service, characteristic))
+        {
+                uint8_t *data = NULL;
+                size_t data_length = 0;
+                simpleble_err_t err_code = simpleble_peripheral_read(peripheral, *service, *characteristic,
+                                                                     &data, &data_length);
+                simpleble_free(data);
+                if (err_code == SIMPLEBLE_SUCCESS && data_length == PACKAGE_SIZE)
+                        return true;
+        }
+        simpleble_peripheral_disconnect(peripheral);
+        return false;
+}
+
+ble_device *ble_device_open(const gchar *adapter_address, const gchar *peripheral_address,
+                            int scan_ms, GError **error)
+{
+        ble_device *device = g_new0(ble_device, 1);
+
+        device->adapter = _adapter_find(adapter_address);
+        if (device->adapter == NULL)
+        {
+                g_set_error(error, BLE_DEVICE_ERROR, BLE_DEVICE_ERROR_NO_ADAPTER,
+                            "No Bluetooth adapter %s", adapter_address ? adapter_address : "found");
+                g_free(device);
+                return NULL;
+        }
+
+        _debug_print("Scanning for peripherals");
+        simpleble_adapter_scan_for(device->adapter, scan_ms > 0 ? scan_ms : BLE_DEVICE_SCAN_MS);
+        size_t count = simpleble_adapter_scan_get_results_count(device->adapter);
+        for (size_t i = 0; i < count; i++)
+        {
+                simpleble_peripheral_t peripheral = simpleble_adapter_scan_get_results_handle(device->adapter, i);
+                if (peripheral == NULL)
+                        continue;
+                char *address = simpleble_peripheral_address(peripheral);
+                gboolean wanted = peripheral_address == NULL ||
+                                  (address != NULL && g_ascii_strcasecmp(address, peripheral_address) == 0);
+                if (device->peripheral == NULL && wanted &&
+                    ble_device_verify(peripheral, &device->service, &device->characteristic))
+                {
+                        char *identifier = simpleble_peripheral_identifier(peripheral);
+                        device->peripheral = peripheral;
+                        device->address = g_strdup(address);
+                        device->identifier = g_strdup(identifier);
+                        simpleble_free(identifier);
+                }
+                else
+                {
+                        simpleble_peripheral_release_handle(peripheral);
+                }
+                simpleble_free(address);
+        }
+
+        if (device->peripheral == NULL)
+        {
+                g_set_error(error, BLE_DEVICE_ERROR, BLE_DEVICE_ERROR_NOT_FOUND,
+                            "No sensor %s among %zu peripherals",
+                            peripheral_address ? peripheral_address : "found", count);
+                ble_device_close(device);
+                return NULL;
+        }
+        return device;
+}
+
+int ble_device_read(ble_device *device, ble_pack_t *frame, size_t *length, GError **error)
+{
+        simpleble_err_t err_code = simpleble_peripheral_read(device->peripheral, device->service,
+                                                             device->characteristic, frame, length);
+        if (err_code != SIMPLEBLE_SUCCESS)
+        {
+                g_set_error(error, BLE_DEVICE_ERROR, BLE_DEVICE_ERROR_READ,
+                            "Reading from %s failed", device->address);
+                return -1;
+        }
+        return 0;
+}
+
+void ble_device_close(ble_device *device)
+{
+        if (device == NULL)
+                return;
+        if (device->peripheral != NULL)
+        {
+                simpleble_peripheral_disconnect(device->peripheral);
+                simpleble_peripheral_release_handle(device->peripheral);
+        }
+        if (device->adapter != NULL)
+                simpleble_adapter_release_handle(device->adapter);
+        g_free(device->address);
+        g_free(device->identifier);
+        g_free(device);
+}
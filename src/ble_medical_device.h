@@ -0,0 +1,53 @@
+#ifndef BLE_MEDICAL_DEVICE_H
+#define BLE_MEDICAL_DEVICE_H
+
+#include <glib.h>
+#include <simpleble_c/simpleble.h>
+
+#include "ble_medical_data.h"
+
+/*
+ * Discovery and acquisition from the sensor without any widget.
+ *
+ * A device is the first peripheral, in scan order, that offers the
+ * DEFAULT_SERVICE_UUID service with its DEFAULT_CHARACTERISTIC_UUID
+ * characteristic and answers a read with a PACKAGE_SIZE-byte frame. An
+ * adapter or peripheral address narrows the choice; the others are
+ * released unconnected once one verifies.
+ */
+
+#define BLE_DEVICE_ERROR                (ble_device_error_quark())
+#define BLE_DEVICE_SCAN_MS              5000
+
+typedef enum _ble_device_error {
+        BLE_DEVICE_ERROR_NO_ADAPTER,
+        BLE_DEVICE_ERROR_NOT_FOUND,
+        BLE_DEVICE_ERROR_READ
+} ble_device_error;
+
+typedef struct _ble_device {
+        simpleble_adapter_t     adapter;
+        simpleble_peripheral_t  peripheral;
+        simpleble_uuid_t        service;
+        simpleble_uuid_t        characteristic;
+        gchar                   *address;
+        gchar                   *identifier;
+} ble_device;
+
+GQuark ble_device_error_quark(void);
+
+// Addresses may be NULL for any; blocks for the scan and the connections
+ble_device *ble_device_open(const gchar *adapter_address, const gchar *peripheral_address,
+                            int scan_ms, GError **error);
+// Finds the sensor's service and characteristic on a connected peripheral
+gboolean ble_device_find(simpleble_peripheral_t, simpleble_uuid_t *service,
+                         simpleble_uuid_t *characteristic);
+// Connects and reads one frame; the peripheral stays connected only when
+// it answers with a whole frame
+gboolean ble_device_verify(simpleble_peripheral_t, simpleble_uuid_t *service,
+                           simpleble_uuid_t *characteristic);
+// One frame to release with simpleble_free()
+int ble_device_read(ble_device*, ble_pack_t *frame, size_t *length, GError **error);
+void ble_device_close(ble_device*);
+
+#endif
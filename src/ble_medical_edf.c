@@ -0,0 +1,695 @@
+#include "ble_medical_edf.h"
+
+#include <fcntl.h>
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define EDF_SAMPLES             (BLE_EDF_RECORD_FRAMES * PACKAGE_SAMPLES)
+#define EDF_RED_OFFSET          0
+#define EDF_IR_OFFSET           (2 * EDF_SAMPLES)
+#define EDF_BEAT_OFFSET         (4 * EDF_SAMPLES)
+#define EDF_ANNOTATION_OFFSET   (EDF_BEAT_OFFSET + 2 * BLE_EDF_RECORD_FRAMES)
+#define EDF_TAL_ONSET           '\x14'
+#define EDF_TAL_DURATION        '\x15'
+
+static_assert(EDF_ANNOTATION_OFFSET + BLE_EDF_ANNOTATION_BYTES == BLE_EDF_RECORD_BYTES,
+              "EDF record layout");
+
+static const char *_months[] = {
+        "JAN", "FEB", "MAR", "APR", "MAY", "JUN",
+        "JUL", "AUG", "SEP", "OCT", "NOV", "DEC"
+};
+
+// Left-justified and space padded; EDF header text is printable ASCII only
+static void _field(char *dest, size_t width, const char *text)
+{
+        size_t i = 0;
+        for (; text != NULL && text[i] != '\0' && i < width; i++)
+                dest[i] = text[i] >= 32 && text[i] < 127 ? text[i] : '_';
+        memset(dest + i, ' ', width - i);
+}
+
+static void _field_int(char *dest, size_t width, int64_t value)
+{
+        char text[24];
+        snprintf(text, sizeof(text), "%lld", (long long)value);
+        _field(dest, width, text);
+}
+
+// EDF+ subfields are separated by spaces, so spaces inside become '_'
+static void _subfield(char *dest, size_t size, const char *text)
+{
+        size_t i = 0;
+        if (text == NULL || text[0] == '\0')
+                text = "X";
+        for (; text[i] != '\0' && i + 1 < size; i++)
+                dest[i] = text[i] == ' ' ? '_' : text[i];
+        dest[i] = '\0';
+}
+
+static void _write_signal_fields(char *header, size_t stride, size_t field, const char *const *values)
+{
+        for (int i = 0; i < BLE_EDF_SIGNALS; i++)
+                _field(header + 256 + field * BLE_EDF_SIGNALS + (size_t)i * stride, stride, values[i]);
+}
+
+static int _write_header(ble_edf_writer *writer, int64_t records)
+{
+        static const char *const labels[] = { "Red", "IR", "Beat", "EDF Annotations" };
+        static const char *const transducers[] = { "PPG red LED", "PPG infrared LED", "Beat detector", "" };
+        static const char *const units[] = { "adu", "adu", "bpm", "" };
+        static const char *const phys_min[] = { "0", "0", "-32768", "-1" };
+        static const char *const phys_max[] = { "65535", "65535", "32767", "1" };
+        static const char *const dig_min[] = { "-32768", "-32768", "-32768", "-32768" };
+        static const char *const dig_max[] = { "32767", "32767", "32767", "32767" };
+        static const char *const filters[] = { "", "", "", "" };
+        char samples_red[8], samples_beat[8], samples_annotations[8];
+        const char *const samples[] = { samples_red, samples_red, samples_beat, samples_annotations };
+        const char *const reserved[] = { "", "", "", "" };
+        char header[256 * (BLE_EDF_SIGNALS + 1)];
+        char text[160];
+        struct tm tm;
+        time_t start = (time_t)(writer->start_real / 1000000);
+
+        localtime_r(&start, &tm);
+        _field(header, 8, "0");
+        _field(header + 8, 80, writer->patient);
+        snprintf(text, sizeof(text), "Startdate %02d-%s-%04d X X ble-med%s%s",
+                 tm.tm_mday, _months[tm.tm_mon], tm.tm_year + 1900,
+                 writer->recording_extra[0] ? " " : "", writer->recording_extra);
+        _field(header + 88, 80, text);
+        snprintf(text, sizeof(text), "%02d.%02d.%02d", tm.tm_mday, tm.tm_mon + 1, tm.tm_year % 100);
+        _field(header + 168, 8, text);
+        snprintf(text, sizeof(text), "%02d.%02d.%02d", tm.tm_hour, tm.tm_min, tm.tm_sec);
+        _field(header + 176, 8, text);
+        _field_int(header + 184, 8, sizeof(header));
+        _field(header + 192, 44, "EDF+D");
+        _field_int(header + 236, 8, records);
+        _field_int(header + 244, 8, BLE_EDF_RECORD_US / 1000000);
+        _field_int(header + 252, 4, BLE_EDF_SIGNALS);
+
+        snprintf(samples_red, sizeof(samples_red), "%d", EDF_SAMPLES);
+        snprintf(samples_beat, sizeof(samples_beat), "%d", BLE_EDF_RECORD_FRAMES);
+        snprintf(samples_annotations, sizeof(samples_annotations), "%d", BLE_EDF_ANNOTATION_BYTES / 2);
+        _write_signal_fields(header, 16, 0, labels);
+        _write_signal_fields(header, 80, 16, transducers);
+        _write_signal_fields(header, 8, 96, units);
+        _write_signal_fields(header, 8, 104, phys_min);
+        _write_signal_fields(header, 8, 112, phys_max);
+        _write_signal_fields(header, 8, 120, dig_min);
+        _write_signal_fields(header, 8, 128, dig_max);
+        _write_signal_fields(header, 80, 136, filters);
+        _write_signal_fields(header, 8, 216, samples);
+        _write_signal_fields(header, 32, 224, reserved);
+
+        if (fseek(writer->file, 0, SEEK_SET) != 0 ||
+            fwrite(header, sizeof(header), 1, writer->file) != 1)
+                return -1;
+        return fseek(writer->file, 0, SEEK_END);
+}
+
+static int _format_time(char *dest, size_t size, int64_t us)
+{
+        return snprintf(dest, size, "%s%lld.%06lld", us < 0 ? "-" : "+",
+                        (long long)(llabs(us) / 1000000), (long long)(llabs(us) % 1000000));
+}
+
+// Timekeeping TAL, then the pending gap annotation if any
+static void _write_annotations(ble_edf_writer *writer)
+{
+        char *tal = (char*)writer->record + EDF_ANNOTATION_OFFSET;
+        size_t size = BLE_EDF_ANNOTATION_BYTES, len;
+
+        memset(tal, 0, size);
+        len = _format_time(tal, size, writer->onset);
+        len += snprintf(tal + len, size - len, "%c%c", EDF_TAL_ONSET, EDF_TAL_ONSET) + 1;
+        if (writer->gap_duration > 0 && len < size)
+        {
+                char onset[24], duration[24];
+                _format_time(onset, sizeof(onset), writer->gap_onset);
+                _format_time(duration, sizeof(duration), writer->gap_duration);
+                snprintf(tal + len, size - len, "%s%c%s%c%s%c", onset, EDF_TAL_DURATION,
+                         duration + 1, EDF_TAL_ONSET, BLE_EDF_GAP_LABEL, EDF_TAL_ONSET);
+        }
+        writer->gap_duration = 0;
+}
+
+static void _store_frame(ble_edf_writer *writer, uint32_t i, const uint8_t *frame)
+{
+        uint16_t red[PACKAGE_SAMPLES], ir[PACKAGE_SAMPLES];
+        int16_t digital[PACKAGE_SAMPLES];
+        int32_t beat;
+
+        memcpy(red, frame + 2, sizeof(red));
+        memcpy(ir, frame + 22, sizeof(ir));
+        memcpy(&beat, frame + 42, sizeof(beat));
+        for (int j = 0; j < PACKAGE_SAMPLES; j++)
+                digital[j] = (int16_t)(red[j] - 32768);
+        memcpy(writer->record + EDF_RED_OFFSET + (size_t)i * sizeof(digital), digital, sizeof(digital));
+        for (int j = 0; j < PACKAGE_SAMPLES; j++)
+                digital[j] = (int16_t)(ir[j] - 32768);
+        memcpy(writer->record + EDF_IR_OFFSET + (size_t)i * sizeof(digital), digital, sizeof(digital));
+        digital[0] = (int16_t)(beat < INT16_MIN ? INT16_MIN : beat > INT16_MAX ? INT16_MAX : beat);
+        memcpy(writer->record + EDF_BEAT_OFFSET + (size_t)i * 2, digital, 2);
+}
+
+// Pads the record with the last frame and writes it out
+static int _emit_record(ble_edf_writer *writer)
+{
+        for (uint32_t i = writer->count; i < BLE_EDF_RECORD_FRAMES; i++)
+                _store_frame(writer, i, writer->last);
+        _write_annotations(writer);
+        if (fwrite(writer->record, BLE_EDF_RECORD_BYTES, 1, writer->file) != 1)
+                return -1;
+        writer->records++;
+        writer->end = writer->onset + BLE_EDF_RECORD_US;
+        writer->count = 0;
+        return 0;
+}
+
+ble_edf_writer *ble_edf_writer_open(const char *path, int64_t origin_mono, int64_t origin_real)
+{
+        ble_edf_writer *writer = calloc(1, sizeof(*writer));
+        if (writer == NULL)
+                return NULL;
+        writer->file = fopen(path, "wb");
+        if (writer->file == NULL)
+        {
+                free(writer);
+                return NULL;
+        }
+        // Whole data records go out in few large writes
+        setvbuf(writer->file, NULL, _IOFBF, 64 * BLE_EDF_RECORD_BYTES);
+        writer->origin_mono = origin_mono;
+        writer->origin_real = origin_real;
+        ble_edf_writer_set_meta(writer, NULL);
+        return writer;
+}
+
+void ble_edf_writer_set_meta(ble_edf_writer *writer, const ble_record_meta *meta)
+{
+        char id[32], name[64], day[16];
+
+        _subfield(id, sizeof(id), meta ? meta->id : NULL);
+        _subfield(name, sizeof(name), meta ? meta->name : NULL);
+        _subfield(day, sizeof(day), meta && meta->day && meta->day[0] ? meta->day : NULL);
+        snprintf(writer->patient, sizeof(writer->patient), "%s X X %s", id, name);
+        snprintf(writer->recording_extra, sizeof(writer->recording_extra), "%s",
+                 strcmp(day, "X") != 0 ? day : "");
+}
+
+int ble_edf_writer_append(ble_edf_writer *writer, int64_t time, const uint8_t *frame)
+{
+        if (writer->failed)
+                return -1;
+
+        // Onset 0 is the whole second of the wall clock before the first frame
+        if (!writer->started)
+        {
+                int64_t real = time - writer->origin_mono + writer->origin_real;
+                writer->start_real = real - (real % 1000000 + 1000000) % 1000000;
+                writer->start_mono = time - (real - writer->start_real);
+                writer->next_time = time;
+                writer->started = true;
+                if (_write_header(writer, -1) != 0)
+                        goto FAIL;
+        }
+
+        // Annotated in file time: from the first padded frame, or the end of
+        // the last record, to where the next record will start
+        if (time - writer->next_time > BLE_EDF_GAP_US)
+        {
+                int64_t resume = time - writer->start_mono;
+                int64_t end = writer->count > 0 ? writer->onset + BLE_EDF_RECORD_US : writer->end;
+                writer->gap_onset = writer->count > 0 ?
+                        writer->onset + (int64_t)writer->count * BLE_EDF_FRAME_US : end;
+                writer->gap_duration = (resume > end ? resume : end) - writer->gap_onset;
+                if (writer->count > 0 && _emit_record(writer) != 0)
+                        goto FAIL;
+        }
+        if (writer->count == 0)
+        {
+                int64_t onset = time - writer->start_mono;
+                writer->onset = onset > writer->end ? onset : writer->end;
+        }
+
+        _store_frame(writer, writer->count++, frame);
+        memcpy(writer->last, frame, PACKAGE_SIZE);
+        writer->next_time = time + BLE_EDF_FRAME_US;
+        if (writer->count == BLE_EDF_RECORD_FRAMES && _emit_record(writer) != 0)
+                goto FAIL;
+        return 0;
+FAIL:
+        writer->failed = true;
+        return -1;
+}
+
+int ble_edf_writer_close(ble_edf_writer *writer)
+{
+        int res = writer->failed ? -1 : 0;
+
+        if (writer->started && !writer->failed)
+        {
+                // The padding of the last record is a gap too
+                if (writer->count > 0)
+                {
+                        writer->gap_onset = writer->onset + (int64_t)writer->count * BLE_EDF_FRAME_US;
+                        writer->gap_duration = writer->onset + BLE_EDF_RECORD_US - writer->gap_onset;
+                        if (_emit_record(writer) != 0)
+                                res = -1;
+                }
+                if (res == 0 && _write_header(writer, writer->records) != 0)
+                        res = -1;
+        }
+        else if (!writer->started)
+        {
+                writer->start_real = writer->origin_real - writer->origin_real % 1000000;
+                res = _write_header(writer, 0);
+        }
+        if (fflush(writer->file) != 0 || fsync(fileno(writer->file)) != 0)
+                res = -1;
+        if (fclose(writer->file) != 0)
+                res = -1;
+        free(writer);
+        return res;
+}
+
+static int64_t _parse_int(const uint8_t *field, size_t width, int *ok)
+{
+        char text[24];
+        char *end;
+        size_t len = width < sizeof(text) - 1 ? width : sizeof(text) - 1;
+
+        memcpy(text, field, len);
+        text[len] = '\0';
+        long long value = strtoll(text, &end, 10);
+        while (*end == ' ')
+                end++;
+        if (end == text || *end != '\0')
+                *ok = false;
+        return value;
+}
+
+static double _parse_double(const uint8_t *field, size_t width, int *ok)
+{
+        char text[24];
+        char *end;
+        size_t len = width < sizeof(text) - 1 ? width : sizeof(text) - 1;
+
+        memcpy(text, field, len);
+        text[len] = '\0';
+        double value = strtod(text, &end);
+        while (*end == ' ')
+                end++;
+        if (end == text || *end != '\0')
+                *ok = false;
+        return value;
+}
+
+static void _parse_text(char *dest, const uint8_t *field, size_t width)
+{
+        memcpy(dest, field, width);
+        dest[width] = '\0';
+        for (size_t i = width; i > 0 && dest[i - 1] == ' '; i--)
+                dest[i - 1] = '\0';
+}
+
+// "+seconds[.fraction]" as microseconds; `len` bytes at most are read
+static int _parse_time(const char *text, size_t len, int64_t *us)
+{
+        size_t i = 0;
+        int64_t seconds = 0, fraction = 0, scale = 100000;
+        int negative;
+
+        if (len == 0 || (text[0] != '+' && text[0] != '-'))
+                return -1;
+        negative = text[i++] == '-';
+        if (i == len || text[i] < '0' || text[i] > '9')
+                return -1;
+        for (; i < len && text[i] >= '0' && text[i] <= '9'; i++)
+                seconds = seconds * 10 + (text[i] - '0');
+        if (i < len && text[i] == '.')
+                for (i++; i < len && text[i] >= '0' && text[i] <= '9'; i++, scale /= 10)
+                        fraction += (text[i] - '0') * scale;
+        *us = seconds * 1000000 + fraction;
+        if (negative)
+                *us = -*us;
+        return (int)i;
+}
+
+static int64_t _parse_start(const uint8_t *date, const uint8_t *clock)
+{
+        struct tm tm = { 0 };
+        char text[9];
+
+        memcpy(text, date, 8);
+        text[8] = '\0';
+        if (sscanf(text, "%d.%d.%d", &tm.tm_mday, &tm.tm_mon, &tm.tm_year) != 3)
+                return 0;
+        memcpy(text, clock, 8);
+        if (sscanf(text, "%d.%d.%d", &tm.tm_hour, &tm.tm_min, &tm.tm_sec) != 3)
+                return 0;
+        // Two-digit years cover 1985 to 2084
+        tm.tm_year += tm.tm_year >= 85 ? 0 : 100;
+        tm.tm_mon -= 1;
+        tm.tm_isdst = -1;
+        return (int64_t)mktime(&tm) * 1000000;
+}
+
+static int _parse_signals(ble_edf_reader *reader, const uint8_t *header)
+{
+        uint32_t n = reader->signal_count;
+        const uint8_t *base = header + 256;
+        size_t offset = 0;
+        int ok = true;
+
+        reader->signals = calloc(n ? n : 1, sizeof(*reader->signals));
+        if (reader->signals == NULL)
+                return -1;
+        reader->red = reader->ir = reader->beat = reader->annotations = -1;
+
+        for (uint32_t i = 0; i < n; i++)
+        {
+                ble_edf_signal *signal = &reader->signals[i];
+                _parse_text(signal->label, base + i * 16, 16);
+                _parse_text(signal->unit, base + n * 96 + i * 8, 8);
+                signal->phys_min = _parse_double(base + n * 104 + i * 8, 8, &ok);
+                signal->phys_max = _parse_double(base + n * 112 + i * 8, 8, &ok);
+                signal->dig_min = (int32_t)_parse_int(base + n * 120 + i * 8, 8, &ok);
+                signal->dig_max = (int32_t)_parse_int(base + n * 128 + i * 8, 8, &ok);
+                int64_t samples = _parse_int(base + n * 216 + i * 8, 8, &ok);
+                if (!ok || samples <= 0 || samples > BLE_RECORD_MAX_PAYLOAD ||
+                    signal->dig_max <= signal->dig_min)
+                        return -1;
+                signal->samples = (uint32_t)samples;
+                signal->offset = offset;
+                offset += (size_t)samples * 2;
+
+                if (strcmp(signal->label, "EDF Annotations") == 0 && reader->annotations < 0)
+                        reader->annotations = (int)i;
+                else if (strcmp(signal->label, "Red") == 0 && reader->red < 0)
+                        reader->red = (int)i;
+                else if (strcmp(signal->label, "IR") == 0 && reader->ir < 0)
+                        reader->ir = (int)i;
+                else if (strcmp(signal->label, "Beat") == 0 && reader->beat < 0)
+                        reader->beat = (int)i;
+        }
+        reader->record_bytes = offset;
+
+        if (reader->red >= 0 && reader->ir >= 0)
+        {
+                uint32_t samples = reader->signals[reader->red].samples;
+                if (samples == reader->signals[reader->ir].samples && samples % PACKAGE_SAMPLES == 0)
+                        reader->frames_per_record = samples / PACKAGE_SAMPLES;
+        }
+        return 0;
+}
+
+ble_edf_reader *ble_edf_reader_open(const char *path)
+{
+        ble_edf_reader *reader = calloc(1, sizeof(*reader));
+        struct stat st;
+        int ok = true;
+
+        if (reader == NULL)
+                return NULL;
+        reader->map = MAP_FAILED;
+        reader->fd = open(path, O_RDONLY | O_CLOEXEC);
+        if (reader->fd < 0 || fstat(reader->fd, &st) != 0 || st.st_size < 256)
+                goto FAIL;
+        reader->size = (size_t)st.st_size;
+        reader->map = mmap(NULL, reader->size, PROT_READ, MAP_SHARED, reader->fd, 0);
+        if (reader->map == MAP_FAILED)
+                goto FAIL;
+        madvise((void*)reader->map, reader->size, MADV_SEQUENTIAL);
+
+        const uint8_t *header = reader->map;
+        int64_t header_bytes = _parse_int(header + 184, 8, &ok);
+        int64_t records = _parse_int(header + 236, 8, &ok);
+        double duration = _parse_double(header + 244, 8, &ok);
+        int64_t signals = _parse_int(header + 252, 4, &ok);
+        if (!ok || signals <= 0 || header_bytes != 256 * (signals + 1) ||
+            (size_t)header_bytes > reader->size || duration <= 0)
+                goto FAIL;
+
+        _parse_text(reader->patient, header + 8, 80);
+        _parse_text(reader->recording, header + 88, 80);
+        reader->discontinuous = memcmp(header + 192, "EDF+D", 5) == 0;
+        reader->start_real = _parse_start(header + 168, header + 176);
+        reader->duration = llround(duration * 1000000);
+        reader->header_bytes = (size_t)header_bytes;
+        reader->signal_count = (uint32_t)signals;
+        if (_parse_signals(reader, header) != 0 || reader->record_bytes == 0)
+                goto FAIL;
+
+        // -1 while being recorded: count the complete records on disk
+        uint64_t on_disk = (reader->size - reader->header_bytes) / reader->record_bytes;
+        reader->records = records < 0 || (uint64_t)records > on_disk ? on_disk : (uint64_t)records;
+        return reader;
+FAIL:
+        ble_edf_reader_close(reader);
+        return NULL;
+}
+
+void ble_edf_reader_close(ble_edf_reader *reader)
+{
+        if (reader == NULL)
+                return;
+        if (reader->map != MAP_FAILED)
+                munmap((void*)reader->map, reader->size);
+        if (reader->fd >= 0)
+                close(reader->fd);
+        free(reader->signals);
+        free(reader);
+}
+
+static const char *_annotations(const ble_edf_reader *reader, uint64_t record, size_t *len)
+{
+        const ble_edf_signal *signal = &reader->signals[reader->annotations];
+        *len = (size_t)signal->samples * 2;
+        return (const char*)reader->map + reader->header_bytes +
+               record * reader->record_bytes + signal->offset;
+}
+
+int64_t ble_edf_reader_onset(const ble_edf_reader *reader, uint64_t record)
+{
+        int64_t onset;
+        size_t len;
+
+        if (reader->annotations >= 0)
+        {
+                const char *tal = _annotations(reader, record, &len);
+                if (_parse_time(tal, len, &onset) > 0)
+                        return onset;
+        }
+        return (int64_t)record * reader->duration;
+}
+
+int ble_edf_reader_gap(const ble_edf_reader *reader, uint64_t record, int64_t *onset, int64_t *duration)
+{
+        const size_t label_len = strlen(BLE_EDF_GAP_LABEL);
+        size_t len, i = 0;
+
+        if (reader->annotations < 0)
+                return false;
+        const char *tal = _annotations(reader, record, &len);
+
+        // TALs end with a 0 byte; the timekeeping one has an empty text
+        while (i < len && tal[i] != '\0')
+        {
+                size_t end = i;
+                while (end < len && tal[end] != '\0')
+                        end++;
+                int used = _parse_time(tal + i, end - i, onset);
+                *duration = 0;
+                if (used > 0 && i + used < end && tal[i + used] == EDF_TAL_DURATION)
+                {
+                        char sign[24] = "+";
+                        size_t k = i + used + 1, n = 1;
+                        for (; k < end && tal[k] != EDF_TAL_ONSET && n + 1 < sizeof(sign); k++)
+                                sign[n++] = tal[k];
+                        if (_parse_time(sign, n, duration) > 0 && k + 1 + label_len <= end &&
+                            memcmp(tal + k + 1, BLE_EDF_GAP_LABEL, label_len) == 0 &&
+                            tal[k + 1 + label_len] == EDF_TAL_ONSET)
+                                return true;
+                }
+                i = end + 1;
+        }
+        return false;
+}
+
+uint64_t ble_edf_reader_frames(const ble_edf_reader *reader)
+{
+        return reader->records * reader->frames_per_record;
+}
+
+static double _physical(const ble_edf_reader *reader, int signal, uint64_t record, uint32_t sample)
+{
+        const ble_edf_signal *s = &reader->signals[signal];
+        int16_t digital;
+
+        memcpy(&digital, reader->map + reader->header_bytes + record * reader->record_bytes +
+               s->offset + (size_t)sample * 2, sizeof(digital));
+        return s->phys_min + (double)(digital - s->dig_min) *
+               (s->phys_max - s->phys_min) / (double)(s->dig_max - s->dig_min);
+}
+
+static uint16_t _sample(double value)
+{
+        value = round(value);
+        return (uint16_t)(value < 0 ? 0 : value > UINT16_MAX ? UINT16_MAX : value);
+}
+
+int ble_edf_reader_frame(const ble_edf_reader *reader, uint64_t frame, int64_t *time, uint8_t *out)
+{
+        uint32_t per_record = reader->frames_per_record;
+        uint16_t red[PACKAGE_SAMPLES], ir[PACKAGE_SAMPLES];
+        int32_t beat = 0;
+
+        if (per_record == 0 || frame >= ble_edf_reader_frames(reader))
+                return -1;
+        uint64_t record = frame / per_record;
+        uint32_t i = (uint32_t)(frame % per_record);
+
+        for (uint32_t j = 0; j < PACKAGE_SAMPLES; j++)
+        {
+                red[j] = _sample(_physical(reader, reader->red, record, i * PACKAGE_SAMPLES + j));
+                ir[j] = _sample(_physical(reader, reader->ir, record, i * PACKAGE_SAMPLES + j));
+        }
+        // A beat signal at another rate is sampled at the frame start
+        if (reader->beat >= 0)
+        {
+                uint32_t samples = reader->signals[reader->beat].samples;
+                beat = (int32_t)lround(_physical(reader, reader->beat, record,
+                                                 (uint32_t)((uint64_t)i * samples / per_record)));
+        }
+
+        memset(out, 0, PACKAGE_SIZE);
+        memcpy(out + 2, red, sizeof(red));
+        memcpy(out + 22, ir, sizeof(ir));
+        memcpy(out + 42, &beat, sizeof(beat));
+        *time = ble_edf_reader_onset(reader, record) + (int64_t)i * reader->duration / per_record;
+        return 0;
+}
+
+int ble_edf_export(const ble_reader *reader, const char *path)
+{
+        ble_record_meta meta = { reader->header.id, reader->header.name, reader->header.day };
+        uint8_t frame[PACKAGE_SIZE];
+        ble_range range;
+        ble_view view;
+
+        ble_edf_writer *writer = ble_edf_writer_open(path, reader->header.origin_mono,
+                                                     reader->header.origin_real);
+        if (writer == NULL)
+                return -1;
+        ble_edf_writer_set_meta(writer, &meta);
+
+        ble_range_init(&range, reader, INT64_MIN, INT64_MAX);
+        while (ble_range_next(&range, &view))
+        {
+                for (uint32_t i = 0; i < view.count; i++)
+                {
+                        frame[0] = view.t1[i];
+                        frame[1] = view.t2[i];
+                        memcpy(frame + 2, view.red + (size_t)i * PACKAGE_SAMPLES, 2 * PACKAGE_SAMPLES);
+                        memcpy(frame + 22, view.ir + (size_t)i * PACKAGE_SAMPLES, 2 * PACKAGE_SAMPLES);
+                        memcpy(frame + 42, &view.beat[i], sizeof(int32_t));
+                        ble_edf_writer_append(writer, view.times[i], frame);
+                }
+        }
+        return ble_edf_writer_close(writer);
+}
+
+// Splits an EDF+ header field into at most `max` subfields, in place
+static int _subfields(char *text, char **fields, int max)
+{
+        char *save = NULL;
+        int n = 0;
+        for (char *tok = strtok_r(text, " ", &save); tok != NULL && n < max; tok = strtok_r(NULL, " ", &save))
+                fields[n++] = tok;
+        return n;
+}
+
+// Undoes _subfield(); "X" stands for unknown
+static void _from_subfield(char *dest, size_t size, const char *field)
+{
+        dest[0] = '\0';
+        if (field == NULL || strcmp(field, "X") == 0)
+                return;
+        snprintf(dest, size, "%s", field);
+        for (char *c = dest; *c != '\0'; c++)
+                if (*c == '_')
+                        *c = ' ';
+}
+
+// Patient "code sex birthdate name", recording "Startdate date admin
+// technician equipment day" as written by ble_edf_writer_set_meta()
+static void _header_meta(const ble_edf_reader *reader, char *id, char *name, char *day)
+{
+        char patient[81], recording[81];
+        char *fields[6] = { NULL };
+
+        memcpy(patient, reader->patient, sizeof(patient));
+        _subfields(patient, fields, 4);
+        _from_subfield(id, 32, fields[0]);
+        _from_subfield(name, 64, fields[3]);
+
+        memcpy(recording, reader->recording, sizeof(recording));
+        memset(fields, 0, sizeof(fields));
+        _subfields(recording, fields, 6);
+        _from_subfield(day, 16, fields[5]);
+}
+
+int ble_edf_import(const char *edf_path, const char *record_path, const ble_record_meta *meta)
+{
+        char id[32], name[64], day[16];
+        ble_record_meta _meta = { id, name, day };
+        uint8_t frame[PACKAGE_SIZE];
+        int64_t time, gap_onset = 0, gap_duration = 0;
+        int res = 0;
+
+        if (access(record_path, F_OK) == 0)
+                return -1;
+        ble_edf_reader *reader = ble_edf_reader_open(edf_path);
+        if (reader == NULL || reader->frames_per_record == 0)
+        {
+                ble_edf_reader_close(reader);
+                return -1;
+        }
+        ble_record *record = ble_record_open(record_path, NULL);
+        if (record == NULL)
+        {
+                ble_edf_reader_close(reader);
+                return -1;
+        }
+        if (meta == NULL)
+        {
+                _header_meta(reader, id, name, day);
+                meta = &_meta;
+        }
+
+        // EDF times are placed on the recording's clocks through its origin
+        int64_t shift = reader->start_real - record->header.origin_real + record->header.origin_mono;
+        for (uint64_t f = 0; res == 0 && f < ble_edf_reader_frames(reader); f++)
+        {
+                if (f % reader->frames_per_record == 0 &&
+                    !ble_edf_reader_gap(reader, f / reader->frames_per_record, &gap_onset, &gap_duration))
+                        gap_duration = 0;
+                if (ble_edf_reader_frame(reader, f, &time, frame) != 0)
+                        res = -1;
+                else if (gap_duration == 0 || time < gap_onset || time >= gap_onset + gap_duration)
+                        res = ble_record_append(record, shift + time, frame);
+        }
+        if (res == 0)
+                res = ble_record_finalize(record, meta);
+        if (ble_record_close(record) != 0)
+                res = -1;
+        ble_edf_reader_close(reader);
+        return res;
+}
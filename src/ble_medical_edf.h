@@ -0,0 +1,121 @@
+#ifndef BLE_MEDICAL_EDF_H
+#define BLE_MEDICAL_EDF_H
+
+#include <stdio.h>
+
+#include "ble_medical_record.h"
+#include "ble_medical_reader.h"
+
+/*
+ * EDF+ export and import.
+ *
+ * Files are written as EDF+D with one-second data records of
+ * BLE_EDF_RECORD_FRAMES frames: the red and IR streams at
+ * BLE_EDF_RECORD_FRAMES * PACKAGE_SAMPLES Hz, the beat average once per
+ * frame, and an "EDF Annotations" signal. Each record starts with the
+ * timekeeping TAL giving its onset, taken from the receive time of its first
+ * frame, so clock jitter never accumulates. Records may not overlap, so
+ * while frames come faster than the nominal rate they are laid back to back
+ * and onsets lag the receive times until the next gap.
+ *
+ * A pause longer than BLE_EDF_GAP_US ends the current record early. Its
+ * remaining frames repeat the last one and a BLE_EDF_GAP_LABEL annotation,
+ * stored in that same record, covers them up to the next received frame.
+ *
+ * The writer buffers one data record, so memory does not depend on the
+ * session length. The record count stays -1, as the EDF spec allows for
+ * files being recorded, until ble_edf_writer_close() patches it.
+ *
+ * The reader maps the file and rebuilds PACKAGE_SIZE frames from the
+ * signals labelled "Red", "IR" and "Beat", converting through each signal's
+ * physical range, so recordings of other devices replay as well when their
+ * red and IR streams come in multiples of PACKAGE_SAMPLES per record.
+ */
+
+#define BLE_EDF_EXTENSION               ".edf"
+#define BLE_EDF_RECORD_FRAMES           12
+#define BLE_EDF_RECORD_US               1000000
+#define BLE_EDF_FRAME_US                (BLE_EDF_RECORD_US / BLE_EDF_RECORD_FRAMES)
+#define BLE_EDF_GAP_US                  500000
+#define BLE_EDF_GAP_LABEL               "Signal gap"
+#define BLE_EDF_ANNOTATION_BYTES        80
+#define BLE_EDF_SIGNALS                 4
+#define BLE_EDF_RECORD_BYTES            (2 * 2 * BLE_EDF_RECORD_FRAMES * PACKAGE_SAMPLES + \
+                                         2 * BLE_EDF_RECORD_FRAMES + BLE_EDF_ANNOTATION_BYTES)
+
+typedef struct _ble_edf_writer {
+        FILE            *file;
+        int64_t         origin_mono;    // maps receive times to the wall clock
+        int64_t         origin_real;
+        int64_t         start_real;     // wall clock of onset 0, whole seconds
+        int64_t         start_mono;     // receive time of onset 0
+        int             started;
+        int             failed;
+        int64_t         records;
+        int64_t         onset;          // of the record being filled, from start_mono
+        int64_t         end;            // earliest onset of the next record
+        int64_t         next_time;      // receive time expected for the next frame
+        int64_t         gap_onset;      // pending gap annotation, 0 duration if none
+        int64_t         gap_duration;
+        uint32_t        count;          // frames in the record being filled
+        uint8_t         last[PACKAGE_SIZE];
+        char            patient[128];   // cut to the 80-character field
+        char            recording_extra[16];
+        uint8_t         record[BLE_EDF_RECORD_BYTES];
+} ble_edf_writer;
+
+typedef struct _ble_edf_signal {
+        char            label[17];
+        char            unit[9];
+        double          phys_min;
+        double          phys_max;
+        int32_t         dig_min;
+        int32_t         dig_max;
+        uint32_t        samples;        // per data record
+        size_t          offset;         // of its samples inside a data record
+} ble_edf_signal;
+
+typedef struct _ble_edf_reader {
+        int             fd;
+        const uint8_t   *map;
+        size_t          size;
+        char            patient[81];
+        char            recording[81];
+        int64_t         start_real;     // wall clock of onset 0
+        int64_t         duration;       // of a data record, microseconds
+        uint64_t        records;
+        size_t          header_bytes;
+        size_t          record_bytes;
+        uint32_t        signal_count;
+        ble_edf_signal  *signals;
+        int             red;            // signal indexes, -1 when absent
+        int             ir;
+        int             beat;
+        int             annotations;
+        uint32_t        frames_per_record; // 0 when no frame can be rebuilt
+        int             discontinuous;
+} ble_edf_reader;
+
+// `origin_mono` and `origin_real` are one instant on both clocks, e.g. the
+// header of the recording being written alongside.
+ble_edf_writer *ble_edf_writer_open(const char *path, int64_t origin_mono, int64_t origin_real);
+int ble_edf_writer_append(ble_edf_writer*, int64_t time, const uint8_t *frame);
+// Stored in the patient and recording fields when the writer closes
+void ble_edf_writer_set_meta(ble_edf_writer*, const ble_record_meta*);
+int ble_edf_writer_close(ble_edf_writer*);
+
+ble_edf_reader *ble_edf_reader_open(const char *path);
+void ble_edf_reader_close(ble_edf_reader*);
+// Microseconds from start_real
+int64_t ble_edf_reader_onset(const ble_edf_reader*, uint64_t record);
+uint64_t ble_edf_reader_frames(const ble_edf_reader*);
+int ble_edf_reader_frame(const ble_edf_reader*, uint64_t frame, int64_t *time, uint8_t *out);
+// First BLE_EDF_GAP_LABEL annotation stored in `record`, false if none
+int ble_edf_reader_gap(const ble_edf_reader*, uint64_t record, int64_t *onset, int64_t *duration);
+
+// Whole-file conversions. Import creates `record_path`, which must not
+// exist, and leaves out the frames that gap annotations mark as padding.
+int ble_edf_export(const ble_reader*, const char *path);
+int ble_edf_import(const char *edf_path, const char *record_path, const ble_record_meta*);
+
+#endif
@@ -1,21 +1,669 @@
 #include "ble_medical_filebrowsing.h"
+#include "ble_medical_catalog.h"
+#include "ble_medical_csv.h"
 #include "ble_medical_debug.h"
+#include "ble_medical_render.h"
 
 #include <glib/gi18n.h>
 #include <glib/gstdio.h>
+#include <string.h>
+
+#define THUMBNAIL_THREADS       2
+#define THUMBNAIL_WIDTH         120
+#define THUMBNAIL_HEIGHT        24
+#define EXPORT_PROGRESS_US      100000
+#define REPORT_PAGE_US          (10 * 60 * G_USEC_PER_SEC)
 
 enum
 {
         ID_COLUMN,
         NAME_COLUMN,
+        DAY_COLUMN,
+        DURATION_COLUMN,
+        CHANNELS_COLUMN,
         FILE_NAME_COLUMN,
-        N_COLUMNS = 3
+        N_COLUMNS
+};
+
+static const struct {
+        const char      *title;
+        const char      *property;
+        gboolean        numeric;
+} columns[N_COLUMNS] = {
+        [ID_COLUMN]             = { u8"ID",       "id",       false },
+        [NAME_COLUMN]           = { u8"Name",     "name",     false },
+        [DAY_COLUMN]            = { u8"Day",      "day",      false },
+        [DURATION_COLUMN]       = { u8"Duration", "duration", true },
+        [CHANNELS_COLUMN]       = { u8"Channels", "channels", false },
+        [FILE_NAME_COLUMN]      = { u8"Filename", "filename", false },
+};
+
+// List item wrapping a catalog entry, exposing it as properties for sorters
+#define BLE_TYPE_CATALOG_ITEM (ble_catalog_item_get_type())
+G_DECLARE_FINAL_TYPE(BleCatalogItem, ble_catalog_item, BLE, CATALOG_ITEM, GObject)
+
+enum
+{
+        THUMBNAIL_NONE,
+        THUMBNAIL_PENDING,
+        THUMBNAIL_READY,
+        THUMBNAIL_FAILED
+};
+
+struct _BleCatalogItem {
+        GObject                 parent_instance;
+        ble_catalog_entry       *entry;
+        ble_thumbnail           *thumbnail;     // allocated once shown
+        gint                    thumbnail_state;
+        gint                    bound;          // cells showing the item, atomic
+};
+
+G_DEFINE_TYPE(BleCatalogItem, ble_catalog_item, G_TYPE_OBJECT)
+
+enum
+{
+        PROP_0,
+        PROP_ID,
+        PROP_NAME,
+        PROP_DAY,
+        PROP_DURATION,
+        PROP_CHANNELS,
+        PROP_FILENAME,
+        PROP_THUMBNAIL,
+        N_PROPS
 };
 
+static GParamSpec *item_props[N_PROPS];
+
+static void ble_catalog_item_get_property(GObject       *object,
+                                          guint         prop_id,
+                                          GValue        *value,
+                                          GParamSpec    *pspec)
+{
+        const ble_catalog_entry *entry = BLE_CATALOG_ITEM(object)->entry;
+
+        switch (prop_id)
+        {
+        case PROP_ID:
+                g_value_set_string(value, entry->id);
+                break;
+        case PROP_NAME:
+                g_value_set_string(value, entry->name);
+                break;
+        case PROP_DAY:
+                g_value_set_string(value, entry->day);
+                break;
+        case PROP_DURATION:
+                g_value_set_int64(value, ble_catalog_entry_duration(entry));
+                break;
+        case PROP_CHANNELS:
+                g_value_take_string(value, ble_catalog_entry_channels(entry));
+                break;
+        case PROP_FILENAME:
+                g_value_set_string(value, entry->filename);
+                break;
+        case PROP_THUMBNAIL:
+                g_value_set_pointer(value, BLE_CATALOG_ITEM(object)->thumbnail);
+                break;
+        default:
+                G_OBJECT_WARN_INVALID_PROPERTY_ID(object, prop_id, pspec);
+        }
+}
+
+static void ble_catalog_item_finalize(GObject *object)
+{
+        ble_catalog_entry_unref(BLE_CATALOG_ITEM(object)->entry);
+        g_free(BLE_CATALOG_ITEM(object)->thumbnail);
+        G_OBJECT_CLASS(ble_catalog_item_parent_class)->finalize(object);
+}
+
+static void ble_catalog_item_class_init(BleCatalogItemClass *class)
+{
+        GObjectClass *object_class = G_OBJECT_CLASS(class);
+        GParamFlags flags = G_PARAM_READABLE | G_PARAM_STATIC_STRINGS;
+
+        object_class->get_property = ble_catalog_item_get_property;
+        object_class->finalize = ble_catalog_item_finalize;
+
+        item_props[PROP_ID] =
+                g_param_spec_string("id", "ID", "Session ID", NULL, flags);
+        item_props[PROP_NAME] =
+                g_param_spec_string("name", "Name", "Patient name", NULL, flags);
+        item_props[PROP_DAY] =
+                g_param_spec_string("day", "Day", "Session day", NULL, flags);
+        item_props[PROP_DURATION] =
+                g_param_spec_int64("duration", "Duration", "Duration in microseconds",
+                                   0, G_MAXINT64, 0, flags);
+        item_props[PROP_CHANNELS] =
+                g_param_spec_string("channels", "Channels", "Recorded channels", NULL, flags);
+        item_props[PROP_FILENAME] =
+                g_param_spec_string("filename", "Filename", "File name in the folder", NULL, flags);
+        item_props[PROP_THUMBNAIL] =
+                g_param_spec_pointer("thumbnail", "Thumbnail", "ble_thumbnail, once loaded", flags);
+        g_object_class_install_properties(object_class, N_PROPS, item_props);
+}
+
+static void ble_catalog_item_init(BleCatalogItem *self)
+{
+}
+
+static BleCatalogItem *ble_catalog_item_new(ble_catalog_entry *entry)
+{
+        BleCatalogItem *item = g_object_new(BLE_TYPE_CATALOG_ITEM, NULL);
+        item->entry = ble_catalog_entry_ref(entry);
+        return item;
+}
+
+typedef struct _file_browser {
+        GtkColumnView   *view;
+        GThreadPool     *thumbnails;
+        gint            closing;        // queued thumbnails are skipped
+        GListStore      *store;         // BleCatalogItem
+        GHashTable      *items;         // filename -> BleCatalogItem
+        GtkFilter       *filter;
+        gchar           *needle;        // casefolded search text
+        ble_catalog     *catalog;
+        GtkSingleSelection *selection;
+        GtkButton       *export_button; // CSV
+        GtkButton       *report_button; // PDF
+        GtkProgressBar  *export_progress;
+        GCancellable    *export;        // set while an export runs
+        GtkWindow       *window;
+        GtkWidget       *folder_dialog; // built on first use
+} file_browser;
+
+static void _browser_free(gpointer data)
+{
+        file_browser *browser = data;
+        // Queued jobs still run, skipped, so each hands its item back
+        g_atomic_int_set(&browser->closing, 1);
+        g_thread_pool_free(browser->thumbnails, false, true);
+        ble_catalog_close(browser->catalog);
+        g_hash_table_unref(browser->items);
+        g_object_unref(browser->store);
+        g_object_unref(browser->filter);
+        g_free(browser->needle);
+        // The task outlives the browser and finds it gone
+        if (browser->export != NULL)
+        {
+                g_object_set_data(G_OBJECT(browser->export), "browser", NULL);
+                g_cancellable_cancel(browser->export);
+                g_object_unref(browser->export);
+        }
+        g_free(browser);
+}
+
+static void _store_remove(file_browser *browser, gpointer item)
+{
+        guint position;
+        if (g_list_store_find(browser->store, item, &position))
+                g_list_store_remove(browser->store, position);
+}
+
+// New rows are spliced in once per batch; the sort and filter models above
+// the store work through them incrementally.
+static void _catalog_changed(ble_catalog        *catalog,
+                             GPtrArray          *updated,
+                             GPtrArray          *removed,
+                             gpointer           data)
+{
+        file_browser *browser = data;
+        g_autoptr(GPtrArray) added = g_ptr_array_new_with_free_func(g_object_unref);
+
+        for (guint i = 0; i < removed->len; i++)
+        {
+                const gchar *filename = g_ptr_array_index(removed, i);
+                BleCatalogItem *item = g_hash_table_lookup(browser->items, filename);
+                if (item == NULL)
+                        continue;
+                _store_remove(browser, item);
+                g_hash_table_remove(browser->items, filename);
+        }
+
+        for (guint i = 0; i < updated->len; i++)
+        {
+                ble_catalog_entry *entry = g_ptr_array_index(updated, i);
+                BleCatalogItem *item = g_hash_table_lookup(browser->items, entry->filename);
+                BleCatalogItem *fresh = ble_catalog_item_new(entry);
+                guint position;
+
+                if (item != NULL && g_list_store_find(browser->store, item, &position))
+                        g_list_store_splice(browser->store, position, 1, (gpointer*)&fresh, 1);
+                else
+                        g_ptr_array_add(added, g_object_ref(fresh));
+                g_hash_table_replace(browser->items, g_strdup(entry->filename), fresh);
+        }
+
+        if (added->len > 0)
+                g_list_store_splice(browser->store, g_list_model_get_n_items(G_LIST_MODEL(browser->store)),
+                                    0, added->pdata, added->len);
+}
+
+static gchar *_column_text(BleCatalogItem *item, gint column)
+{
+        const ble_catalog_entry *entry = item->entry;
+
+        switch (column)
+        {
+        case ID_COLUMN:
+                return g_strdup(entry->id);
+        case NAME_COLUMN:
+                return g_strdup(entry->name);
+        case DAY_COLUMN:
+                return g_strdup(entry->day);
+        case DURATION_COLUMN:
+        {
+                gint64 seconds = ble_catalog_entry_duration(entry) / G_USEC_PER_SEC;
+                if (seconds <= 0)
+                        return g_strdup("-");
+                return g_strdup_printf("%" G_GINT64_FORMAT ":%02d:%02d", seconds / 3600,
+                                       (gint)(seconds / 60 % 60), (gint)(seconds % 60));
+        }
+        case CHANNELS_COLUMN:
+                return ble_catalog_entry_channels(entry);
+        default:
+                return g_strdup(entry->filename);
+        }
+}
+
+static void _cell_setup(GtkSignalListItemFactory        *factory,
+                        GtkListItem                     *list_item,
+                        gpointer                        data)
+{
+        GtkWidget *label = gtk_label_new(NULL);
+        gtk_label_set_xalign(GTK_LABEL(label), 0);
+        gtk_label_set_ellipsize(GTK_LABEL(label), PANGO_ELLIPSIZE_END);
+        gtk_list_item_set_child(list_item, label);
+}
+
+static void _cell_bind(GtkSignalListItemFactory         *factory,
+                       GtkListItem                      *list_item,
+                       gpointer                         data)
+{
+        BleCatalogItem *item = gtk_list_item_get_item(list_item);
+        g_autofree gchar *text = _column_text(item, GPOINTER_TO_INT(data));
+        gtk_label_set_text(GTK_LABEL(gtk_list_item_get_child(list_item)), text);
+}
+
+/*
+ * Thumbnails are loaded for bound rows only, on a small pool. A row scrolled
+ * away before a worker picked it up is skipped and asked for again the next
+ * time it is shown.
+ */
+
+typedef struct _thumbnail_job {
+        BleCatalogItem  *item;
+        gchar           *folder;
+        ble_thumbnail   thumbnail;
+        gboolean        skipped;
+        gboolean        loaded;
+} thumbnail_job;
+
+static gboolean _thumbnail_ready(gpointer data)
+{
+        thumbnail_job *job = data;
+        BleCatalogItem *item = job->item;
+
+        if (job->skipped)
+                item->thumbnail_state = THUMBNAIL_NONE;
+        else if (job->loaded)
+        {
+                item->thumbnail = g_new(ble_thumbnail, 1);
+                *item->thumbnail = job->thumbnail;
+                item->thumbnail_state = THUMBNAIL_READY;
+        }
+        else
+                item->thumbnail_state = THUMBNAIL_FAILED;
+        g_object_notify_by_pspec(G_OBJECT(item), item_props[PROP_THUMBNAIL]);
+
+        g_object_unref(item);
+        g_free(job->folder);
+        g_free(job);
+        return G_SOURCE_REMOVE;
+}
+
+static void _thumbnail_work(gpointer data, gpointer user_data)
+{
+        thumbnail_job *job = data;
+        file_browser *browser = user_data;
+
+        if (g_atomic_int_get(&browser->closing) == 0 && g_atomic_int_get(&job->item->bound) > 0)
+                job->loaded = ble_catalog_thumbnail(job->folder, job->item->entry, &job->thumbnail);
+        else
+                job->skipped = true;
+        g_idle_add(_thumbnail_ready, job);
+}
+
+static void _thumbnail_request(file_browser *browser, BleCatalogItem *item)
+{
+        if (item->thumbnail_state != THUMBNAIL_NONE || browser->catalog == NULL)
+                return;
+
+        thumbnail_job *job = g_new0(thumbnail_job, 1);
+        job->item = g_object_ref(item);
+        job->folder = g_file_get_path(ble_catalog_get_folder(browser->catalog));
+        item->thumbnail_state = THUMBNAIL_PENDING;
+        g_thread_pool_push(browser->thumbnails, job, NULL);
+}
+
+static void _thumbnail_draw(GtkDrawingArea      *area,
+                            cairo_t             *cr,
+                            int                 width,
+                            int                 height,
+                            gpointer            data)
+{
+        BleCatalogItem *item = gtk_list_item_get_item(GTK_LIST_ITEM(data));
+        const ble_thumbnail *thumbnail = item ? item->thumbnail : NULL;
+        guint16 low = G_MAXUINT16, high = 0;
+
+        if (thumbnail == NULL || thumbnail->count == 0)
+                return;
+        for (guint32 i = 0; i < thumbnail->count; i++)
+        {
+                low = MIN(low, thumbnail->min[i]);
+                high = MAX(high, thumbnail->max[i]);
+        }
+
+        double scale = (double)(height - 2) / MAX(high - low, 1);
+        double step = (double)width / thumbnail->count;
+        cairo_set_source_rgb(cr, 0.2, 0.45, 0.8);
+        for (guint32 i = 0; i < thumbnail->count; i++)
+        {
+                double top = height - 1 - (thumbnail->max[i] - low) * scale;
+                double bottom = height - 1 - (thumbnail->min[i] - low) * scale;
+                cairo_rectangle(cr, i * step, top, MAX(step, 1.0), MAX(bottom - top, 1.0));
+        }
+        cairo_fill(cr);
+}
+
+static void _thumbnail_changed(BleCatalogItem *item, GParamSpec *pspec, gpointer data)
+{
+        GtkWidget *area = data;
+        file_browser *browser = g_object_get_data(G_OBJECT(area), "file_browser");
+
+        // Skipped while still shown: the row came back in the meantime
+        _thumbnail_request(browser, item);
+        gtk_widget_queue_draw(area);
+}
+
+static void _thumbnail_setup(GtkSignalListItemFactory   *factory,
+                             GtkListItem                *list_item,
+                             gpointer                   data)
+{
+        GtkWidget *area = gtk_drawing_area_new();
+        gtk_drawing_area_set_content_width(GTK_DRAWING_AREA(area), THUMBNAIL_WIDTH);
+        gtk_drawing_area_set_content_height(GTK_DRAWING_AREA(area), THUMBNAIL_HEIGHT);
+        gtk_drawing_area_set_draw_func(GTK_DRAWING_AREA(area), _thumbnail_draw, list_item, NULL);
+        g_object_set_data(G_OBJECT(area), "file_browser", data);
+        gtk_list_item_set_child(list_item, area);
+}
+
+static void _thumbnail_bind(GtkSignalListItemFactory    *factory,
+                            GtkListItem                 *list_item,
+                            gpointer                    data)
+{
+        BleCatalogItem *item = gtk_list_item_get_item(list_item);
+        GtkWidget *area = gtk_list_item_get_child(list_item);
+
+        g_atomic_int_inc(&item->bound);
+        g_signal_connect(item, "notify::thumbnail", G_CALLBACK(_thumbnail_changed), area);
+        _thumbnail_request(data, item);
+        gtk_widget_queue_draw(area);
+}
+
+static void _thumbnail_unbind(GtkSignalListItemFactory  *factory,
+                              GtkListItem               *list_item,
+                              gpointer                  data)
+{
+        BleCatalogItem *item = gtk_list_item_get_item(list_item);
+
+        g_signal_handlers_disconnect_by_func(item, _thumbnail_changed, gtk_list_item_get_child(list_item));
+        g_atomic_int_add(&item->bound, -1);
+}
+
+static void _append_thumbnail_column(file_browser *browser)
+{
+        GtkListItemFactory *factory = gtk_signal_list_item_factory_new();
+
+        g_signal_connect(factory, "setup", G_CALLBACK(_thumbnail_setup), browser);
+        g_signal_connect(factory, "bind", G_CALLBACK(_thumbnail_bind), browser);
+        g_signal_connect(factory, "unbind", G_CALLBACK(_thumbnail_unbind), browser);
+
+        GtkColumnViewColumn *view_column = gtk_column_view_column_new(_(u8"Preview"), factory);
+        gtk_column_view_append_column(browser->view, view_column);
+        g_object_unref(view_column);
+}
+
+static void _append_column(GtkColumnView *view, gint column)
+{
+        GtkListItemFactory *factory = gtk_signal_list_item_factory_new();
+        GtkExpression *expression = gtk_property_expression_new(BLE_TYPE_CATALOG_ITEM, NULL,
+                                                                 columns[column].property);
+        GtkSorter *sorter = columns[column].numeric ?
+                GTK_SORTER(gtk_numeric_sorter_new(expression)) :
+                GTK_SORTER(gtk_string_sorter_new(expression));
+
+        g_signal_connect(factory, "setup", G_CALLBACK(_cell_setup), NULL);
+        g_signal_connect(factory, "bind", G_CALLBACK(_cell_bind), GINT_TO_POINTER(column));
+
+        GtkColumnViewColumn *view_column = gtk_column_view_column_new(_(columns[column].title), factory);
+        gtk_column_view_column_set_sorter(view_column, sorter);
+        gtk_column_view_column_set_resizable(view_column, true);
+        gtk_column_view_append_column(view, view_column);
+        g_object_unref(view_column);
+        g_object_unref(sorter);
+}
+
+static gboolean _search_match(gpointer object, gpointer data)
+{
+        const file_browser *browser = data;
+        const ble_catalog_entry *entry = BLE_CATALOG_ITEM(object)->entry;
+        const gchar *fields[] = { entry->id, entry->name, entry->day, entry->filename };
+
+        if (browser->needle == NULL)
+                return true;
+        for (gsize i = 0; i < G_N_ELEMENTS(fields); i++)
+        {
+                g_autofree gchar *folded = g_utf8_casefold(fields[i], -1);
+                if (strstr(folded, browser->needle) != NULL)
+                        return true;
+        }
+        return false;
+}
+
+static void _search_changed(GtkSearchEntry *self, gpointer data)
+{
+        file_browser *browser = data;
+        const gchar *text = gtk_editable_get_text(GTK_EDITABLE(self));
+
+        g_free(browser->needle);
+        browser->needle = text[0] ? g_utf8_casefold(text, -1) : NULL;
+        gtk_filter_changed(browser->filter, GTK_FILTER_CHANGE_DIFFERENT);
+}
+
+/*
+ * CSV export and PDF report of the selected recording, next to it with the
+ * extension swapped. Either runs in a GTask thread; its button cancels it
+ * meanwhile, the other one is disabled, and the progress bar is refreshed
+ * at most every EXPORT_PROGRESS_US. The task reaches the browser through
+ * its cancellable, which the browser clears when it goes first.
+ */
+
+typedef enum {
+        EXPORT_CSV,
+        EXPORT_PDF
+} export_kind;
+
+typedef struct _export_job {
+        export_kind     kind;
+        gchar           *record_path;
+        gchar           *out_path;
+        GtkProgressBar  *progress;
+        gint64          reported;
+} export_job;
+
+typedef struct _export_update {
+        GtkProgressBar  *progress;
+        gdouble         fraction;
+} export_update;
+
+static void _export_job_free(gpointer data)
+{
+        export_job *job = data;
+        g_free(job->record_path);
+        g_free(job->out_path);
+        g_object_unref(job->progress);
+        g_free(job);
+}
+
+static gboolean _export_update_progress(gpointer data)
+{
+        export_update *update = data;
+        gtk_progress_bar_set_fraction(update->progress, update->fraction);
+        g_object_unref(update->progress);
+        g_free(update);
+        return G_SOURCE_REMOVE;
+}
+
+static int _export_progress(uint64_t done, uint64_t total, void *data)
+{
+        GTask *task = data;
+        export_job *job = g_task_get_task_data(task);
+        gint64 now = g_get_monotonic_time();
+
+        if (now - job->reported >= EXPORT_PROGRESS_US && total > 0)
+        {
+                export_update *update = g_new(export_update, 1);
+                update->progress = g_object_ref(job->progress);
+                update->fraction = (gdouble)done / total;
+                job->reported = now;
+                g_idle_add(_export_update_progress, update);
+        }
+        return !g_task_return_error_if_cancelled(task);
+}
+
+static void _export_thread(GTask        *task,
+                           gpointer     source,
+                           gpointer     data,
+                           GCancellable *cancellable)
+{
+        export_job *job = data;
+        ble_reader *reader = ble_reader_open(job->record_path);
+        ble_render_options options = {
+                INT64_MIN, INT64_MAX, BLE_CHANNEL_RED | BLE_CHANNEL_IR,
+                BLE_RENDER_PDF_WIDTH, BLE_RENDER_PDF_HEIGHT, BLE_RENDER_PDF_COLUMNS
+        };
+        int res;
+
+        if (reader == NULL)
+        {
+                g_task_return_new_error(task, G_IO_ERROR, G_IO_ERROR_FAILED,
+                                        "%s could not be read", job->record_path);
+                return;
+        }
+        if (job->kind == EXPORT_PDF)
+                res = ble_render_report(reader, job->out_path, &options, REPORT_PAGE_US, 0,
+                                        _export_progress, task);
+        else
+                res = ble_csv_export(reader, job->out_path, BLE_CHANNEL_ALL, NULL, 0,
+                                     _export_progress, task);
+        ble_reader_close(reader);
+
+        // A cancelled export was already returned by _export_progress()
+        if (g_task_had_error(task))
+                return;
+        if (res == 0)
+                g_task_return_boolean(task, true);
+        else if (res < 0)
+                g_task_return_new_error(task, G_IO_ERROR, G_IO_ERROR_FAILED,
+                                        "%s could not be written", job->out_path);
+}
+
+static void _export_done(GObject *source, GAsyncResult *result, gpointer data)
+{
+        GCancellable *export = g_task_get_cancellable(G_TASK(result));
+        file_browser *browser = g_object_get_data(G_OBJECT(export), "browser");
+        export_job *job = g_task_get_task_data(G_TASK(result));
+        g_autoptr(GError) error = NULL;
+        g_autofree gchar *text = NULL;
+
+        if (browser == NULL)
+                return;
+        if (g_task_propagate_boolean(G_TASK(result), &error))
+        {
+                text = g_strdup_printf("Exported %s", job->out_path);
+                gtk_progress_bar_set_fraction(browser->export_progress, 1.0);
+        }
+        else
+                text = g_strdup(error->message);
+        gtk_progress_bar_set_text(browser->export_progress, text);
+        gtk_button_set_label(browser->export_button, _(u8"Export CSV"));
+        gtk_button_set_label(browser->report_button, _(u8"Report PDF"));
+        gtk_widget_set_sensitive(GTK_WIDGET(browser->export_button), true);
+        gtk_widget_set_sensitive(GTK_WIDGET(browser->report_button), true);
+        g_clear_object(&browser->export);
+}
+
+static void _export_clicked(GtkButton *button, gpointer data)
+{
+        file_browser *browser = data;
+        BleCatalogItem *item = gtk_single_selection_get_selected_item(browser->selection);
+
+        if (browser->export != NULL)
+        {
+                g_cancellable_cancel(browser->export);
+                return;
+        }
+        if (item == NULL || browser->catalog == NULL)
+                return;
+
+        g_autofree gchar *folder = g_file_get_path(ble_catalog_get_folder(browser->catalog));
+        g_autofree gchar *base = g_strdup(item->entry->filename);
+        if (g_str_has_suffix(base, BLE_RECORD_EXTENSION))
+                base[strlen(base) - strlen(BLE_RECORD_EXTENSION)] = '\0';
+
+        export_job *job = g_new0(export_job, 1);
+        job->kind = button == browser->report_button ? EXPORT_PDF : EXPORT_CSV;
+        job->record_path = g_build_filename(folder, item->entry->filename, NULL);
+        job->out_path = g_strdup_printf("%s/%s.%s", folder, base,
+                                        job->kind == EXPORT_PDF ? "pdf" : "csv");
+        job->progress = g_object_ref(browser->export_progress);
+
+        browser->export = g_cancellable_new();
+        g_object_set_data(G_OBJECT(browser->export), "browser", browser);
+        GTask *task = g_task_new(NULL, browser->export, _export_done, NULL);
+        g_task_set_task_data(task, job, _export_job_free);
+        g_task_set_return_on_cancel(task, false);
+        g_task_run_in_thread(task, _export_thread);
+        g_object_unref(task);
+
+        gtk_progress_bar_set_fraction(browser->export_progress, 0.0);
+        gtk_progress_bar_set_text(browser->export_progress, item->entry->filename);
+        gtk_button_set_label(button, _(u8"Cancel"));
+        gtk_widget_set_sensitive(GTK_WIDGET(job->kind == EXPORT_PDF ? browser->export_button
+                                                                    : browser->report_button),
+                                 false);
+}
+
+void _file_chooser_response (GtkDialog       *self, 
+                             gint            response_id, 
+                             gpointer        data);
+
 void _browsing_button_triggered(GtkButton       *self, 
                                 gpointer        data)
 {
-        gtk_window_present (GTK_WINDOW (data));
+        file_browser *browser = data;
+
+        // A file chooser is costly to build and most sessions never open one
+        if (browser->folder_dialog == NULL)
+        {
+                browser->folder_dialog = gtk_file_chooser_dialog_new(_(u8"Open Folder"), browser->window,
+                                                                     GTK_FILE_CHOOSER_ACTION_SELECT_FOLDER,
+                                                                     _(u8"_Cancel"), GTK_RESPONSE_CANCEL,
+                                                                     _(u8"_Open"), GTK_RESPONSE_ACCEPT, NULL);
+                g_signal_connect(browser->folder_dialog, "response", G_CALLBACK(_file_chooser_response), browser);
+        }
+        gtk_window_present (GTK_WINDOW (browser->folder_dialog));
         _debug_print("Dialog presented");
 }
 
@@ -23,72 +671,40 @@ void _file_chooser_response (GtkDialog       *self,
                              gint            response_id, 
                              gpointer        data)
 {
+        file_browser *browser = data;
 
         if (response_id == GTK_RESPONSE_ACCEPT)
         {
-                GtkListStore *store = gtk_list_store_new(N_COLUMNS, G_TYPE_INT, G_TYPE_STRING, G_TYPE_STRING);
-                GtkTreeIter iter;
-                GtkCellRenderer *renderer;
-                GtkTreeViewColumn *column1, *column2, *column3;        
-
-                gtk_tree_view_set_model(data, GTK_TREE_MODEL(store));
-
-                renderer = gtk_cell_renderer_text_new();
-                column1 = gtk_tree_view_column_new_with_attributes("ID", renderer, "text", ID_COLUMN, NULL);
-                column2 = gtk_tree_view_column_new_with_attributes("Name", renderer, "text", NAME_COLUMN, NULL);
-                column3 = gtk_tree_view_column_new_with_attributes("Filename", renderer, "text", FILE_NAME_COLUMN, NULL);
-
-                gtk_tree_view_append_column (GTK_TREE_VIEW(data), column1);
-                gtk_tree_view_append_column (GTK_TREE_VIEW(data), column2);
-                gtk_tree_view_append_column (GTK_TREE_VIEW(data), column3);
-
-                GtkFileChooser          *chooser = GTK_FILE_CHOOSER(self);
-                g_autoptr(GFile)        file = gtk_file_chooser_get_file(chooser);
-                GFileInfo*              inf = g_file_query_info(file, "standard::name", 
-                                                                G_FILE_QUERY_INFO_NONE, NULL, NULL);
-                GFileEnumerator         *fenum = g_file_enumerate_children(file, "standard::name", G_FILE_QUERY_INFO_NONE, NULL, NULL);
-                
-                gint i = 0;
-                
-                while (true)
-                {
-                        GFileInfo *info = g_file_enumerator_next_file(fenum, NULL, NULL);
-                        if (info)
-                        {
-                                char *filename = g_file_info_get_name(info);
-
-                                gtk_list_store_append(store, &iter);
-                                gtk_list_store_set(store, &iter, ID_COLUMN, i, NAME_COLUMN, "Default_name", FILE_NAME_COLUMN, filename, -1);
-                                //g_free(filename);
-                        }
-                        else
-                                break;
-                        g_object_unref(G_OBJECT(info));
+                g_autoptr(GFile) folder = gtk_file_chooser_get_file(GTK_FILE_CHOOSER(self));
+                g_autoptr(GPtrArray) removed = g_ptr_array_new();
 
-                }
-                g_object_unref(G_OBJECT(chooser));
-                g_object_unref(G_OBJECT(file));
-                g_object_unref(G_OBJECT(inf));
-                g_object_unref(G_OBJECT(fenum));
+                ble_catalog_close(browser->catalog);
+                g_list_store_remove_all(browser->store);
+                g_hash_table_remove_all(browser->items);
 
+                browser->catalog = ble_catalog_open(folder, _catalog_changed, browser);
+                if (browser->catalog != NULL)
+                {
+                        g_autoptr(GPtrArray) entries = ble_catalog_entries(browser->catalog);
+                        _catalog_changed(browser->catalog, entries, removed, browser);
+                }
+                else
+                        _debug_print("Folder catalog could not be opened");
         }
 
-        gtk_window_destroy (GTK_WINDOW(self));
-
+        // Kept around for the next time the button is clicked
+        gtk_widget_hide(GTK_WIDGET(self));
 }
-void _tree_selection_changed (GtkTreeSelection *selection, gpointer data)
+
+void _file_selection_changed (GtkSingleSelection *selection, GParamSpec *pspec, gpointer data)
 {
-        GtkTreeIter iter;
-        GtkTreeModel *model;
-        char *filename;
+        BleCatalogItem *item = gtk_single_selection_get_selected_item(selection);
 
-        if (gtk_tree_selection_get_selected(selection, &model, &iter))
+        if (item != NULL)
         {
-                gtk_tree_model_get(model, &iter, FILE_NAME_COLUMN, &filename, -1);
-                GtkEntryBuffer *buffer = gtk_entry_buffer_new(_(filename), -1);
+                GtkEntryBuffer *buffer = gtk_entry_buffer_new(item->entry->filename, -1);
                 gtk_entry_set_buffer(GTK_ENTRY(data), buffer);
                 g_object_unref(buffer);
-                g_free(filename);
         }
 }
 
@@ -96,21 +712,58 @@ void load_file_browsing(GtkBuilder      *builder,
                         GtkWindow       *window)
 {
         
-        GtkWidget               *dialog;
-        GtkFileChooserAction    action  = GTK_FILE_CHOOSER_ACTION_SELECT_FOLDER;
         GObject                 *button = gtk_builder_get_object (builder, 
                                                                   "button_browsing");
         GObject                 *list   = gtk_builder_get_object(builder, 
-                                                               "treeview_file");
+                                                               "columnview_file");
+        GObject                 *search = gtk_builder_get_object(builder, 
+                                                               "search_file");
         GObject                 *text   = gtk_builder_get_object(builder, 
                                                                "text_filename");
-        GtkTreeSelection        *select;
+        GObject                 *export = gtk_builder_get_object(builder,
+                                                               "button_export_csv");
+        GObject                 *report = gtk_builder_get_object(builder,
+                                                               "button_report_pdf");
+        GObject                 *progress = gtk_builder_get_object(builder,
+                                                               "progress_export");
+        file_browser            *browser = g_new0(file_browser, 1);
+        GtkSortListModel        *sorted;
+        GtkFilterListModel      *filtered;
+        GtkSingleSelection      *selection;
 
-        dialog = gtk_file_chooser_dialog_new(_(u8"Open Folder"), GTK_WINDOW(window), action, _(u8"_Cancel"), GTK_RESPONSE_CANCEL, _(u8"_Open"), GTK_RESPONSE_ACCEPT, NULL);
-        select = gtk_tree_view_get_selection(GTK_TREE_VIEW(list));
-        gtk_tree_selection_set_mode (select, GTK_SELECTION_SINGLE);
-        
-        g_signal_connect(dialog, "response", G_CALLBACK(_file_chooser_response), list);
-        g_signal_connect(G_OBJECT(select), "changed", G_CALLBACK(_tree_selection_changed), text);
-        g_signal_connect (button, "clicked", G_CALLBACK (_browsing_button_triggered), dialog);
+        browser->view = GTK_COLUMN_VIEW(list);
+        browser->store = g_list_store_new(BLE_TYPE_CATALOG_ITEM);
+        browser->items = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, g_object_unref);
+        browser->filter = GTK_FILTER(gtk_custom_filter_new(_search_match, browser, NULL));
+        g_object_set_data_full(list, "file_browser", browser, _browser_free);
+
+        browser->thumbnails = g_thread_pool_new(_thumbnail_work, browser, THUMBNAIL_THREADS, false, NULL);
+        _append_thumbnail_column(browser);
+        for (gint column = 0; column < N_COLUMNS; column++)
+                _append_column(browser->view, column);
+
+        // store -> filter -> sort -> selection; the row widgets themselves
+        // are recycled by the view, only visible rows are bound
+        filtered = gtk_filter_list_model_new(G_LIST_MODEL(g_object_ref(browser->store)),
+                                             g_object_ref(browser->filter));
+        gtk_filter_list_model_set_incremental(filtered, true);
+        sorted = gtk_sort_list_model_new(G_LIST_MODEL(filtered),
+                                         g_object_ref(gtk_column_view_get_sorter(browser->view)));
+        gtk_sort_list_model_set_incremental(sorted, true);
+        selection = gtk_single_selection_new(G_LIST_MODEL(sorted));
+        gtk_single_selection_set_autoselect(selection, false);
+        gtk_single_selection_set_can_unselect(selection, true);
+        gtk_column_view_set_model(browser->view, GTK_SELECTION_MODEL(selection));
+        browser->selection = selection;
+        browser->export_button = GTK_BUTTON(export);
+        browser->report_button = GTK_BUTTON(report);
+        browser->export_progress = GTK_PROGRESS_BAR(progress);
+        browser->window = window;
+
+        g_signal_connect(selection, "notify::selected-item", G_CALLBACK(_file_selection_changed), text);
+        g_signal_connect(search, "search-changed", G_CALLBACK(_search_changed), browser);
+        g_signal_connect(export, "clicked", G_CALLBACK(_export_clicked), browser);
+        g_signal_connect(report, "clicked", G_CALLBACK(_export_clicked), browser);
+        g_signal_connect (button, "clicked", G_CALLBACK (_browsing_button_triggered), browser);
+        g_object_unref(selection);
 }
@@ -0,0 +1,149 @@
+#include "ble_medical_filter.h"
+
+#include <math.h>
+#include <stdbool.h>
+#include <string.h>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#define BLE_FILTER_HAVE_SSE2
+#endif
+
+typedef struct _biquad {
+        double          b0, b1, b2;
+        double          a1, a2;         // a0 normalized to 1
+} biquad;
+
+struct _ble_filter_bank {
+        guint           channels;
+        double          dc_alpha;
+        gboolean        primed;         // DC tracking has started
+        biquad          sections[BLE_FILTER_SECTIONS];
+        double          *dc;            // per channel
+        double          *state;         // per section, s1 then s2 of every channel
+};
+
+// Q of the two sections of a 4th-order Butterworth
+static const double butterworth_q[2] = { 0.54119610014619698, 1.3065629648763766 };
+
+// Bilinear-transform sections, as in the Audio EQ Cookbook
+static biquad _design(gboolean high_pass, double rate, double cutoff, double q)
+{
+        double w0 = 2.0 * G_PI * cutoff / rate;
+        double cos_w0 = cos(w0), alpha = sin(w0) / (2.0 * q);
+        double a0 = 1.0 + alpha;
+        double edge = high_pass ? (1.0 + cos_w0) / 2.0 : (1.0 - cos_w0) / 2.0;
+        biquad section = {
+                .b0 = edge / a0,
+                .b1 = (high_pass ? -2.0 : 2.0) * edge / a0,
+                .b2 = edge / a0,
+                .a1 = -2.0 * cos_w0 / a0,
+                .a2 = (1.0 - alpha) / a0,
+        };
+        return section;
+}
+
+ble_filter_bank *ble_filter_bank_new(guint channels, double rate, double low, double high)
+{
+        ble_filter_bank *bank = g_new0(ble_filter_bank, 1);
+
+        bank->channels = channels;
+        bank->dc_alpha = 1.0 - exp(-1.0 / (rate * BLE_FILTER_DC_S));
+        for (int i = 0; i < 2; i++)
+        {
+                bank->sections[i] = _design(true, rate, low, butterworth_q[i]);
+                bank->sections[2 + i] = _design(false, rate, high, butterworth_q[i]);
+        }
+        bank->dc = g_new0(double, channels);
+        bank->state = g_new0(double, 2 * BLE_FILTER_SECTIONS * channels);
+        return bank;
+}
+
+void ble_filter_bank_reset(ble_filter_bank *bank)
+{
+        bank->primed = false;
+        memset(bank->state, 0, 2 * BLE_FILTER_SECTIONS * bank->channels * sizeof(double));
+}
+
+// One sample of channel `c` through DC removal and every section
+static inline double _run_scalar(ble_filter_bank *bank, guint c, double x)
+{
+        const guint n = bank->channels;
+
+        bank->dc[c] += bank->dc_alpha * (x - bank->dc[c]);
+        x -= bank->dc[c];
+        // Transposed direct form II
+        for (int s = 0; s < BLE_FILTER_SECTIONS; s++)
+        {
+                const biquad *q = &bank->sections[s];
+                double *s1 = bank->state + (gsize)2 * s * n + c, *s2 = s1 + n;
+                double y = q->b0 * x + *s1;
+                *s1 = q->b1 * x - q->a1 * y + *s2;
+                *s2 = q->b2 * x - q->a2 * y;
+                x = y;
+        }
+        return x;
+}
+
+#ifdef BLE_FILTER_HAVE_SSE2
+
+/* ---------- SSE2, channels c and c + 1 at once ---------- */
+
+static inline void _run_sse2(ble_filter_bank *bank, guint c, double *v)
+{
+        const guint n = bank->channels;
+        __m128d x = _mm_loadu_pd(v);
+        __m128d dc = _mm_loadu_pd(bank->dc + c);
+
+        dc = _mm_add_pd(dc, _mm_mul_pd(_mm_set1_pd(bank->dc_alpha), _mm_sub_pd(x, dc)));
+        _mm_storeu_pd(bank->dc + c, dc);
+        x = _mm_sub_pd(x, dc);
+        for (int s = 0; s < BLE_FILTER_SECTIONS; s++)
+        {
+                const biquad *q = &bank->sections[s];
+                double *s1 = bank->state + (gsize)2 * s * n + c, *s2 = s1 + n;
+                __m128d y = _mm_add_pd(_mm_mul_pd(_mm_set1_pd(q->b0), x), _mm_loadu_pd(s1));
+                _mm_storeu_pd(s1, _mm_add_pd(_mm_sub_pd(_mm_mul_pd(_mm_set1_pd(q->b1), x),
+                                                        _mm_mul_pd(_mm_set1_pd(q->a1), y)),
+                                             _mm_loadu_pd(s2)));
+                _mm_storeu_pd(s2, _mm_sub_pd(_mm_mul_pd(_mm_set1_pd(q->b2), x),
+                                             _mm_mul_pd(_mm_set1_pd(q->a2), y)));
+                x = y;
+        }
+        _mm_storeu_pd(v, x);
+}
+
+#endif
+
+void ble_filter_bank_run(ble_filter_bank *bank, double *samples, guint count)
+{
+        const guint n = bank->channels;
+
+        if (count == 0)
+                return;
+        if (!bank->primed)
+        {
+                memcpy(bank->dc, samples, n * sizeof(double));
+                bank->primed = true;
+        }
+        for (guint i = 0; i < count; i++)
+        {
+                double *v = samples + (gsize)i * n;
+                guint c = 0;
+#ifdef BLE_FILTER_HAVE_SSE2
+                for (; c + 2 <= n; c += 2)
+                        _run_sse2(bank, c, v + c);
+#endif
+                for (; c < n; c++)
+                        v[c] = _run_scalar(bank, c, v[c]);
+        }
+}
+
+void ble_filter_bank_free(ble_filter_bank *bank)
+{
+        if (bank == NULL)
+                return;
+        g_free(bank->dc);
+        g_free(bank->state);
+        g_free(bank);
+}
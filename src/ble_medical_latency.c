@@ -0,0 +1,121 @@
+#include "ble_medical_latency.h"
+#include "ble_medical_debug.h"
+
+#include <stdbool.h>
+#include <stdio.h>
+
+static const gchar *hop_names[BLE_LATENCY_HOPS] = {
+        "decode",
+        "enqueue",
+        "ingest",
+        "draw",
+        "end-to-end"
+};
+
+static guint _bucket_index(guint64 us)
+{
+        if (us < 2 * BLE_HISTOGRAM_SUB)
+                return (guint)us;
+        guint shift = (63 - __builtin_clzll(us)) - BLE_HISTOGRAM_SUB_BITS;
+        guint index = (shift + 1) * BLE_HISTOGRAM_SUB + (guint)(us >> shift) - BLE_HISTOGRAM_SUB;
+        return MIN(index, BLE_HISTOGRAM_BUCKETS - 1);
+}
+
+// The largest value that lands in a bucket
+static gint64 _bucket_value(guint index)
+{
+        if (index < 2 * BLE_HISTOGRAM_SUB)
+                return index;
+        guint shift = index / BLE_HISTOGRAM_SUB - 1;
+        gint64 mantissa = index % BLE_HISTOGRAM_SUB + BLE_HISTOGRAM_SUB;
+        return ((mantissa + 1) << shift) - 1;
+}
+
+void ble_histogram_record(ble_histogram *histogram, gint64 us)
+{
+        us = MAX(us, 0);
+        g_atomic_int_inc(&histogram->counts[_bucket_index((guint64)us)]);
+        g_atomic_int_inc(&histogram->total);
+        __atomic_fetch_add(&histogram->sum, us, __ATOMIC_RELAXED);
+
+        gint value = (gint)MIN(us, G_MAXINT);
+        gint max = g_atomic_int_get(&histogram->max);
+        while (value > max && !g_atomic_int_compare_and_exchange(&histogram->max, max, value))
+                max = g_atomic_int_get(&histogram->max);
+}
+
+gint64 ble_histogram_percentile(const ble_histogram *histogram, double percentile)
+{
+        gint total = g_atomic_int_get(&histogram->total);
+        gint max = g_atomic_int_get(&histogram->max);
+        gint64 seen = 0;
+
+        if (total == 0)
+                return 0;
+        gint64 wanted = (gint64)(total * percentile / 100.0 + 0.5);
+        wanted = CLAMP(wanted, 1, total);
+        for (guint i = 0; i < BLE_HISTOGRAM_BUCKETS; i++)
+        {
+                seen += g_atomic_int_get(&histogram->counts[i]);
+                if (seen >= wanted)
+                        return MIN(_bucket_value(i), max);
+        }
+        return max;
+}
+
+const gchar *ble_latency_hop_name(ble_latency_hop hop)
+{
+        return hop < BLE_LATENCY_HOPS ? hop_names[hop] : "unknown";
+}
+
+void ble_latency_record(ble_latency *latency, ble_latency_hop hop, ble_time_t from, ble_time_t to)
+{
+        ble_histogram_record(&latency->hops[hop], to - from);
+}
+
+gchar *ble_latency_summary(const ble_latency *latency)
+{
+        GString *text = g_string_new(NULL);
+
+        for (guint hop = 0; hop < BLE_LATENCY_HOPS; hop++)
+        {
+                const ble_histogram *histogram = &latency->hops[hop];
+                g_string_append_printf(text, "%-10s p50 %7.2f  p99 %7.2f  max %7.2f ms  (%d)\n",
+                                       hop_names[hop],
+                                       ble_histogram_percentile(histogram, 50.0) / 1000.0,
+                                       ble_histogram_percentile(histogram, 99.0) / 1000.0,
+                                       g_atomic_int_get(&histogram->max) / 1000.0,
+                                       g_atomic_int_get(&histogram->total));
+        }
+        return g_string_free(text, false);
+}
+
+int ble_latency_dump(const ble_latency *latency, const gchar *path)
+{
+        g_autofree gchar *summary = ble_latency_summary(latency);
+        FILE *file = fopen(path, "w");
+
+        if (file == NULL)
+        {
+                _debug_print("Latency dump could not be opened");
+                return -1;
+        }
+        fprintf(file, "%s", summary);
+        // hop, largest value of the bucket in microseconds, count
+        for (guint hop = 0; hop < BLE_LATENCY_HOPS; hop++)
+        {
+                fprintf(file, "\n# %s\n", hop_names[hop]);
+                for (guint i = 0; i < BLE_HISTOGRAM_BUCKETS; i++)
+                {
+                        gint count = g_atomic_int_get(&latency->hops[hop].counts[i]);
+                        if (count > 0)
+                                fprintf(file, "%s\t%" G_GINT64_FORMAT "\t%d\n", hop_names[hop], _bucket_value(i), count);
+                }
+        }
+        if (fclose(file) != 0)
+        {
+                _debug_print("Latency dump could not be written");
+                return -1;
+        }
+        return 0;
+}
@@ -0,0 +1,56 @@
+#ifndef BLE_MEDICAL_LATENCY_H
+#define BLE_MEDICAL_LATENCY_H
+
+#include <glib.h>
+
+#include "ble_medical_data.h"
+
+/*
+ * How stale a frame is by the time it is on screen.
+ *
+ * Every hop a frame makes, from the BLE read to the first chart snapshot
+ * that draws it, goes into a histogram of its own. The histograms are
+ * HDR-style: exact below 64 us, then 32 linear buckets per power of two,
+ * so any value is off by at most 1/32 up to hours. Recording is a single
+ * atomic increment, cheap enough to stay on in production; reading takes
+ * no lock either and sees counts at most a few frames behind.
+ */
+
+#define BLE_HISTOGRAM_SUB_BITS          5
+#define BLE_HISTOGRAM_SUB               (1 << BLE_HISTOGRAM_SUB_BITS)
+// Values past 2^36 us, about 19 hours, land in the last bucket
+#define BLE_HISTOGRAM_BUCKETS           ((36 - BLE_HISTOGRAM_SUB_BITS + 1) * BLE_HISTOGRAM_SUB)
+
+typedef struct _ble_histogram {
+        gint            counts[BLE_HISTOGRAM_BUCKETS];
+        gint            total;
+        gint            max;            // microseconds
+        gint64          sum;
+} ble_histogram;
+
+typedef enum _ble_latency_hop {
+        BLE_LATENCY_DECODE,             // BLE read to decoded
+        BLE_LATENCY_ENQUEUE,            // decoded to queued for the chart
+        BLE_LATENCY_INGEST,             // queued to handed to the chart
+        BLE_LATENCY_DRAW,               // handed to the chart to first snapshot
+        BLE_LATENCY_END_TO_END,         // BLE read to first snapshot
+        BLE_LATENCY_HOPS
+} ble_latency_hop;
+
+typedef struct _ble_latency {
+        ble_histogram   hops[BLE_LATENCY_HOPS];
+} ble_latency;
+
+void ble_histogram_record(ble_histogram*, gint64 us);
+// The value at or below which `percentile` percent of the samples fall
+gint64 ble_histogram_percentile(const ble_histogram*, double percentile);
+
+const gchar *ble_latency_hop_name(ble_latency_hop);
+// Times are g_get_monotonic_time() microseconds; negative spans count as 0
+void ble_latency_record(ble_latency*, ble_latency_hop, ble_time_t from, ble_time_t to);
+// p50, p99 and max of every hop, one line each, to free with g_free()
+gchar *ble_latency_summary(const ble_latency*);
+// The summary followed by every non-empty bucket, for offline plotting
+int ble_latency_dump(const ble_latency*, const gchar *path);
+
+#endif
@@ -0,0 +1,314 @@
+#include "ble_medical_metrics.h"
+#include "ble_medical_debug.h"
+
+#include <errno.h>
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+// Registration and rendering only; values are never behind it
+static GMutex metrics_lock;
+static GPtrArray *metrics = NULL;
+
+static int server_fd = -1;
+static gchar *server_path = NULL;
+static GThread *server_thread = NULL;
+
+static ble_metric *_register(const gchar *name, const gchar *labels, const gchar *help, ble_metric_type type)
+{
+        ble_metric *metric = NULL;
+
+        g_mutex_lock(&metrics_lock);
+        if (metrics == NULL)
+                metrics = g_ptr_array_new();
+        for (guint i = 0; i < metrics->len && metric == NULL; i++)
+        {
+                ble_metric *known = g_ptr_array_index(metrics, i);
+                if (g_strcmp0(known->name, name) == 0 && g_strcmp0(known->labels, labels) == 0)
+                        metric = known;
+        }
+        if (metric == NULL)
+        {
+                metric = g_new0(ble_metric, 1);
+                metric->name = g_strdup(name);
+                metric->labels = g_strdup(labels);
+                metric->help = g_strdup(help);
+                metric->type = type;
+                if (type == BLE_METRIC_SUMMARY)
+                        metric->histogram = g_new0(ble_histogram, 1);
+                g_ptr_array_add(metrics, metric);
+        }
+        metric->registrations++;
+        g_mutex_unlock(&metrics_lock);
+        return metric;
+}
+
+void ble_metrics_unregister(ble_metric *metric)
+{
+        if (metric == NULL)
+                return;
+        g_mutex_lock(&metrics_lock);
+        gboolean last = --metric->registrations == 0;
+        if (last)
+                g_ptr_array_remove(metrics, metric);
+        g_mutex_unlock(&metrics_lock);
+        if (!last)
+                return;
+        g_free(metric->name);
+        g_free(metric->labels);
+        g_free(metric->help);
+        g_free(metric->histogram);
+        g_free(metric);
+}
+
+ble_metric *ble_metrics_counter(const gchar *name, const gchar *labels, const gchar *help)
+{
+        return _register(name, labels, help, BLE_METRIC_COUNTER);
+}
+
+ble_metric *ble_metrics_gauge(const gchar *name, const gchar *labels, const gchar *help)
+{
+        return _register(name, labels, help, BLE_METRIC_GAUGE);
+}
+
+ble_metric *ble_metrics_summary(const gchar *name, const gchar *labels, const gchar *help)
+{
+        return _register(name, labels, help, BLE_METRIC_SUMMARY);
+}
+
+const ble_metrics_core *ble_metrics_core_get(void)
+{
+        static ble_metrics_core core;
+        static gsize initialized = 0;
+
+        if (g_once_init_enter(&initialized))
+        {
+                core.frames_read = ble_metrics_counter("ble_frames_read_total", NULL,
+                                                       "Frames read from the sensor");
+                core.frames_duplicate = ble_metrics_counter("ble_frames_duplicate_total", NULL,
+                                                            "Frames identical to the one before");
+                core.frames_gap = ble_metrics_counter("ble_frames_gap_total", NULL,
+                                                      "Frames read more than 0.5 s after the one before");
+                core.read_errors = ble_metrics_counter("ble_read_errors_total", NULL,
+                                                       "Failed reads from the sensor");
+                core.reconnects = ble_metrics_counter("ble_reconnects_total", NULL,
+                                                      "Connections to the sensor reopened after a failed read");
+                core.bytes_written = ble_metrics_counter("ble_record_bytes_written_total", NULL,
+                                                         "Bytes of blocks written to recordings");
+                core.write_errors = ble_metrics_counter("ble_record_write_errors_total", NULL,
+                                                        "Frames the recording could not take");
+                core.fsync = ble_metrics_summary("ble_record_fsync_seconds", NULL,
+                                                 "Time to make a recording durable");
+                core.render_frame = ble_metrics_summary("ble_render_frame_seconds", NULL,
+                                                        "Time to draw one chart frame");
+                g_once_init_leave(&initialized, 1);
+        }
+        return &core;
+}
+
+void ble_metrics_frame_read(ble_frame_check *check, ble_time_t time, const uint8_t *frame)
+{
+        const ble_metrics_core *core = ble_metrics_core_get();
+
+        ble_metric_add(core->frames_read, 1);
+        if (check->seen)
+        {
+                if (memcmp(check->last, frame, PACKAGE_SIZE) == 0)
+                        ble_metric_add(core->frames_duplicate, 1);
+                if (time - check->last_time > BLE_METRICS_GAP_US)
+                        ble_metric_add(core->frames_gap, 1);
+        }
+        memcpy(check->last, frame, PACKAGE_SIZE);
+        check->last_time = time;
+        check->seen = true;
+}
+
+static void _append_sample(GString *text, const gchar *name, const gchar *suffix, const gchar *labels,
+                           const gchar *extra, const gchar *value)
+{
+        g_string_append_printf(text, "%s%s", name, suffix);
+        if (labels != NULL || extra != NULL)
+                g_string_append_printf(text, "{%s%s%s}", labels ? labels : "",
+                                       labels && extra ? "," : "", extra ? extra : "");
+        g_string_append_printf(text, " %s\n", value);
+}
+
+static void _append_metric(GString *text, const ble_metric *metric)
+{
+        char value[G_ASCII_DTOSTR_BUF_SIZE];
+        static const double quantiles[] = { 0.5, 0.9, 0.99 };
+
+        if (metric->type != BLE_METRIC_SUMMARY)
+        {
+                g_snprintf(value, sizeof(value), "%" G_GINT64_FORMAT, ble_metric_get(metric));
+                _append_sample(text, metric->name, "", metric->labels, NULL, value);
+                return;
+        }
+        for (guint i = 0; i < G_N_ELEMENTS(quantiles); i++)
+        {
+                char quantile[32];
+                g_snprintf(quantile, sizeof(quantile), "quantile=\"%g\"", quantiles[i]);
+                g_ascii_formatd(value, sizeof(value), "%.9g",
+                                ble_histogram_percentile(metric->histogram, quantiles[i] * 100.0) / 1e6);
+                _append_sample(text, metric->name, "", metric->labels, quantile, value);
+        }
+        g_ascii_formatd(value, sizeof(value), "%.9g",
+                        __atomic_load_n(&metric->histogram->sum, __ATOMIC_RELAXED) / 1e6);
+        _append_sample(text, metric->name, "_sum", metric->labels, NULL, value);
+        g_snprintf(value, sizeof(value), "%d", g_atomic_int_get(&metric->histogram->total));
+        _append_sample(text, metric->name, "_count", metric->labels, NULL, value);
+}
+
+gchar *ble_metrics_render(void)
+{
+        static const gchar *types[] = { "counter", "gauge", "summary" };
+        GString *text = g_string_new(NULL);
+
+        ble_metrics_core_get();
+        g_mutex_lock(&metrics_lock);
+        // A family's samples go together, in the order it was first registered
+        for (guint i = 0; i < metrics->len; i++)
+        {
+                ble_metric *metric = g_ptr_array_index(metrics, i);
+                gboolean first = true;
+                for (guint j = 0; j < i && first; j++)
+                        first = g_strcmp0(((ble_metric*)g_ptr_array_index(metrics, j))->name, metric->name) != 0;
+                if (!first)
+                        continue;
+                g_string_append_printf(text, "# HELP %s %s\n# TYPE %s %s\n",
+                                       metric->name, metric->help, metric->name, types[metric->type]);
+                for (guint j = i; j < metrics->len; j++)
+                {
+                        ble_metric *sample = g_ptr_array_index(metrics, j);
+                        if (g_strcmp0(sample->name, metric->name) == 0)
+                                _append_metric(text, sample);
+                }
+        }
+        g_mutex_unlock(&metrics_lock);
+        return g_string_free(text, false);
+}
+
+// A client gone early must not raise SIGPIPE
+static int _send_full(int fd, const char *data, size_t length)
+{
+        while (length > 0)
+        {
+                ssize_t written = send(fd, data, length, MSG_NOSIGNAL);
+                if (written < 0 && errno == EINTR)
+                        continue;
+                if (written <= 0)
+                        return -1;
+                data += written;
+                length -= (size_t)written;
+        }
+        return 0;
+}
+
+static gpointer _server_thread(gpointer data)
+{
+        int fd = GPOINTER_TO_INT(data);
+
+        while (true)
+        {
+                int client = accept(fd, NULL, NULL);
+                if (client < 0)
+                {
+                        if (errno == EINTR || errno == ECONNABORTED)
+                                continue;
+                        break;
+                }
+                // Whatever the request, the answer is the metrics; the
+                // request is read so that the client sees no reset
+                struct timeval timeout = { 0, 100000 };
+                char request[1024];
+                setsockopt(client, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+                if (read(client, request, sizeof(request)) < 0)
+                        _debug_print("Metrics request could not be read");
+
+                g_autofree gchar *body = ble_metrics_render();
+                g_autofree gchar *head = g_strdup_printf("HTTP/1.0 200 OK\r\n"
+                                                         "Content-Type: text/plain; version=0.0.4\r\n"
+                                                         "Content-Length: %zu\r\n\r\n", strlen(body));
+                if (_send_full(client, head, strlen(head)) != 0 || _send_full(client, body, strlen(body)) != 0)
+                        _debug_print("Metrics response could not be written");
+                close(client);
+        }
+        return NULL;
+}
+
+// Frees `address` for bind(): removes a socket left behind by a server
+// that is gone, which refuses connections, and leaves anything else alone
+// with EADDRINUSE
+static int _clear_stale(const struct sockaddr_un *address)
+{
+        struct stat st;
+
+        if (lstat(address->sun_path, &st) != 0)
+                return errno == ENOENT ? 0 : -1;
+        if (!S_ISSOCK(st.st_mode))
+        {
+                errno = EADDRINUSE;
+                return -1;
+        }
+        int probe = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (probe < 0)
+                return -1;
+        int stale = connect(probe, (const struct sockaddr*)address, sizeof(*address)) != 0 && errno == ECONNREFUSED;
+        close(probe);
+        if (!stale)
+        {
+                errno = EADDRINUSE;
+                return -1;
+        }
+        return unlink(address->sun_path);
+}
+
+int ble_metrics_serve(const gchar *path, GError **error)
+{
+        struct sockaddr_un address = { .sun_family = AF_UNIX };
+
+        if (server_fd >= 0)
+        {
+                g_set_error(error, G_FILE_ERROR, G_FILE_ERROR_EXIST, "Metrics are already served on %s", server_path);
+                return -1;
+        }
+        if (strlen(path) >= sizeof(address.sun_path))
+        {
+                g_set_error(error, G_FILE_ERROR, G_FILE_ERROR_NAMETOOLONG, "Socket path %s is too long", path);
+                return -1;
+        }
+        strcpy(address.sun_path, path);
+
+        int fd = -1;
+        if (_clear_stale(&address) != 0 || (fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0)) < 0 ||
+            bind(fd, (struct sockaddr*)&address, sizeof(address)) != 0 || listen(fd, 8) != 0)
+        {
+                int saved = errno;
+                g_set_error(error, G_FILE_ERROR, g_file_error_from_errno(saved),
+                            "Metrics socket %s: %s", path, g_strerror(saved));
+                if (fd >= 0)
+                        close(fd);
+                return -1;
+        }
+        server_fd = fd;
+        server_path = g_strdup(path);
+        server_thread = g_thread_new("metrics", _server_thread, GINT_TO_POINTER(fd));
+        return 0;
+}
+
+void ble_metrics_shutdown(void)
+{
+        if (server_fd < 0)
+                return;
+        // Wakes the accept() up with an error
+        shutdown(server_fd, SHUT_RDWR);
+        g_thread_join(server_thread);
+        close(server_fd);
+        unlink(server_path);
+        g_clear_pointer(&server_path, g_free);
+        server_thread = NULL;
+        server_fd = -1;
+}
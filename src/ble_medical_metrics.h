@@ -0,0 +1,106 @@
+#ifndef BLE_MEDICAL_METRICS_H
+#define BLE_MEDICAL_METRICS_H
+
+#include <glib.h>
+
+#include "ble_medical_data.h"
+#include "ble_medical_latency.h"
+
+/*
+ * Counters, gauges and summaries for operations, served in the Prometheus
+ * text format.
+ *
+ * A metric is registered once under its name and labels; registering the
+ * same pair again returns the same one, so a second session keeps counting
+ * where the first stopped. It lives until every registration is dropped
+ * with ble_metrics_unregister(), or as long as the process. Updates are
+ * relaxed atomics and summaries are latency histograms, so the hot paths
+ * never take a lock. ble_metrics_serve() answers every connection on a
+ * Unix socket with the current values, as a plain HTTP/1.0 response that
+ * both Prometheus, through a socket proxy, and
+ *
+ *   curl --unix-socket PATH http://localhost/metrics
+ *
+ * understand.
+ */
+
+// Longer between two frames counts as a gap, as in the EDF+ export
+#define BLE_METRICS_GAP_US              500000
+
+typedef enum _ble_metric_type {
+        BLE_METRIC_COUNTER,
+        BLE_METRIC_GAUGE,
+        BLE_METRIC_SUMMARY              // microseconds in, seconds out
+} ble_metric_type;
+
+typedef struct _ble_metric {
+        gchar                   *name;
+        gchar                   *labels;        // `key="value",...`, NULL for none
+        gchar                   *help;
+        ble_metric_type         type;
+        gint64                  value;
+        ble_histogram           *histogram;     // summaries only
+        guint                   registrations;
+} ble_metric;
+
+// The metrics the acquisition path updates, shared by every front end
+typedef struct _ble_metrics_core {
+        ble_metric      *frames_read;
+        ble_metric      *frames_duplicate;
+        ble_metric      *frames_gap;
+        ble_metric      *read_errors;
+        ble_metric      *reconnects;
+        ble_metric      *bytes_written;
+        ble_metric      *write_errors;
+        ble_metric      *fsync;
+        ble_metric      *render_frame;
+} ble_metrics_core;
+
+// What ble_metrics_frame_read() compares each frame with
+typedef struct _ble_frame_check {
+        uint8_t         last[PACKAGE_SIZE];
+        ble_time_t      last_time;
+        gboolean        seen;
+} ble_frame_check;
+
+ble_metric *ble_metrics_counter(const gchar *name, const gchar *labels, const gchar *help);
+ble_metric *ble_metrics_gauge(const gchar *name, const gchar *labels, const gchar *help);
+ble_metric *ble_metrics_summary(const gchar *name, const gchar *labels, const gchar *help);
+// Drops one registration; the last one removes the metric, which must no
+// longer be updated
+void ble_metrics_unregister(ble_metric*);
+const ble_metrics_core *ble_metrics_core_get(void);
+
+static inline void ble_metric_add(ble_metric *metric, gint64 value)
+{
+        __atomic_fetch_add(&metric->value, value, __ATOMIC_RELAXED);
+}
+
+static inline void ble_metric_set(ble_metric *metric, gint64 value)
+{
+        __atomic_store_n(&metric->value, value, __ATOMIC_RELAXED);
+}
+
+static inline gint64 ble_metric_get(const ble_metric *metric)
+{
+        return __atomic_load_n(&metric->value, __ATOMIC_RELAXED);
+}
+
+static inline void ble_metric_observe(ble_metric *metric, gint64 us)
+{
+        ble_histogram_record(metric->histogram, us);
+}
+
+// Counts a frame just read, and whether it repeats the last one or comes
+// after a gap
+void ble_metrics_frame_read(ble_frame_check*, ble_time_t, const uint8_t *frame);
+
+// Every metric in the text exposition format, to free with g_free()
+gchar *ble_metrics_render(void);
+// Serves the metrics on a Unix socket at `path` from a thread of its own,
+// one server per process. A socket file nobody listens on is replaced;
+// a live socket or any other file fails with EADDRINUSE.
+int ble_metrics_serve(const gchar *path, GError **error);
+void ble_metrics_shutdown(void);
+
+#endif
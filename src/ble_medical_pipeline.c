@@ -0,0 +1,378 @@
+#ifdef __linux__
+#define _GNU_SOURCE
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+#include "ble_medical_pipeline.h"
+#include "ble_medical_debug.h"
+#include "ble_medical_metrics.h"
+#include "ble_medical_trace.h"
+
+#include <stdbool.h>
+
+typedef struct _queued_item {
+        gpointer        item;
+        gint64          time;           // when it was queued
+} queued_item;
+
+struct _ble_stage {
+        ble_pipeline            *pipeline;
+        gchar                   *name;
+        ble_stage_func          func;
+        gpointer                data;
+        ble_stage_policy        policy;
+        guint                   batch;
+        gint                    cpu;
+        GPtrArray               *outputs;
+        GThread                 *thread;
+        // Guards everything below; `more` wakes the stage, `room` its feeders
+        GMutex                  lock;
+        GCond                   more;
+        GCond                   room;
+        queued_item             *ring;
+        guint                   capacity;
+        guint                   head;
+        guint                   depth;
+        guint                   open_inputs;    // upstream stages still running
+        gboolean                closed;         // nothing more will be pushed
+        gboolean                done;
+        ble_stage_stats         stats;
+        // The same figures for scraping, labelled with pipeline and stage
+        ble_metric              *items_metric;
+        ble_metric              *dropped_metric;
+        ble_metric              *depth_metric;
+        ble_metric              *batch_metric;
+        ble_metric              *capacity_metric;
+};
+
+struct _ble_pipeline {
+        gchar                   *name;
+        gpointer                (*ref)(gpointer);
+        GDestroyNotify          unref;
+        GPtrArray               *stages;        // in the order they were added
+        gboolean                started;
+        gboolean                closed;
+        // Stages done so far, waited on by ble_pipeline_wait()
+        GMutex                  lock;
+        GCond                   cond;
+        guint                   done;
+};
+
+ble_pipeline *ble_pipeline_new(const gchar *name, gpointer (*ref)(gpointer), GDestroyNotify unref)
+{
+        ble_pipeline *pipeline = g_new0(ble_pipeline, 1);
+
+        pipeline->name = g_strdup(name);
+        pipeline->ref = ref;
+        pipeline->unref = unref;
+        pipeline->stages = g_ptr_array_new();
+        g_mutex_init(&pipeline->lock);
+        g_cond_init(&pipeline->cond);
+        return pipeline;
+}
+
+ble_stage *ble_pipeline_add_stage(ble_pipeline *pipeline, const gchar *name, ble_stage_func func, gpointer data,
+                                  guint capacity, guint batch, ble_stage_policy policy, gint cpu)
+{
+        g_return_val_if_fail(!pipeline->started, NULL);
+
+        ble_stage *stage = g_new0(ble_stage, 1);
+        stage->pipeline = pipeline;
+        stage->name = g_strdup(name);
+        stage->func = func;
+        stage->data = data;
+        stage->policy = policy;
+        stage->capacity = MAX(capacity, 1);
+        stage->batch = CLAMP(batch, 1, stage->capacity);
+        stage->cpu = cpu;
+        stage->outputs = g_ptr_array_new();
+        stage->ring = g_new0(queued_item, stage->capacity);
+        g_mutex_init(&stage->lock);
+        g_cond_init(&stage->more);
+        g_cond_init(&stage->room);
+
+        g_autofree gchar *labels = g_strdup_printf("pipeline=\"%s\",stage=\"%s\"", pipeline->name, name);
+        stage->items_metric = ble_metrics_counter("ble_stage_items_total", labels, "Items through a pipeline stage");
+        stage->dropped_metric = ble_metrics_counter("ble_stage_dropped_total", labels,
+                                                    "Items a pipeline stage had no room for");
+        stage->depth_metric = ble_metrics_gauge("ble_stage_queue_depth", labels, "Items queued in front of a stage");
+        stage->batch_metric = ble_metrics_summary("ble_stage_batch_seconds", labels, "Time a stage takes per batch");
+        stage->capacity_metric = ble_metrics_gauge("ble_stage_queue_capacity", labels, "Items a stage queues at most");
+        ble_metric_set(stage->capacity_metric, stage->capacity);
+        g_ptr_array_add(pipeline->stages, stage);
+        return stage;
+}
+
+void ble_stage_connect(ble_stage *from, ble_stage *to)
+{
+        g_return_if_fail(!from->pipeline->started && from->pipeline == to->pipeline);
+        g_ptr_array_add(from->outputs, to);
+        to->open_inputs++;
+}
+
+static void _stage_close(ble_stage *stage)
+{
+        g_mutex_lock(&stage->lock);
+        stage->closed = true;
+        g_cond_broadcast(&stage->more);
+        g_mutex_unlock(&stage->lock);
+}
+
+void ble_stage_push(ble_stage *stage, gpointer item)
+{
+        ble_pipeline *pipeline = stage->pipeline;
+        gpointer dropped = NULL;
+
+        g_mutex_lock(&stage->lock);
+        while (stage->depth == stage->capacity && stage->policy == BLE_STAGE_BLOCK && !stage->done)
+                g_cond_wait(&stage->room, &stage->lock);
+        if (stage->done)
+        {
+                // A stage that is gone has nowhere to put it
+                stage->stats.dropped++;
+                ble_metric_add(stage->dropped_metric, 1);
+                dropped = item;
+        }
+        else
+        {
+                if (stage->depth == stage->capacity)
+                {
+                        ble_trace(BLE_TRACE_QUEUE_DROP, stage->depth, 0);
+                        dropped = stage->ring[stage->head].item;
+                        stage->head = (stage->head + 1) % stage->capacity;
+                        stage->depth--;
+                        stage->stats.dropped++;
+                        ble_metric_add(stage->dropped_metric, 1);
+                }
+                queued_item *slot = &stage->ring[(stage->head + stage->depth) % stage->capacity];
+                slot->item = item;
+                slot->time = g_get_monotonic_time();
+                stage->depth++;
+                stage->stats.depth_max = MAX(stage->stats.depth_max, stage->depth);
+                ble_metric_set(stage->depth_metric, stage->depth);
+                g_cond_signal(&stage->more);
+        }
+        g_mutex_unlock(&stage->lock);
+        if (dropped != NULL)
+                pipeline->unref(dropped);
+}
+
+static void _stage_pin(ble_stage *stage)
+{
+        if (stage->cpu < 0)
+                return;
+#ifdef __linux__
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(stage->cpu, &set);
+        if (pthread_setaffinity_np(pthread_self(), sizeof(set), &set) != 0)
+                _debug_print("Stage thread could not be pinned");
+#else
+        _debug_print("Stage affinity is not supported here");
+#endif
+}
+
+static gpointer _stage_thread(gpointer data)
+{
+        ble_stage *stage = (ble_stage*)data;
+        ble_pipeline *pipeline = stage->pipeline;
+        gpointer *items = g_new(gpointer, stage->batch);
+
+        _stage_pin(stage);
+        while (true)
+        {
+                guint count = 0;
+                gint64 wait_max = 0;
+
+                g_mutex_lock(&stage->lock);
+                while (stage->depth == 0 && !stage->closed)
+                        g_cond_wait(&stage->more, &stage->lock);
+                if (stage->depth == 0)
+                {
+                        g_mutex_unlock(&stage->lock);
+                        break;
+                }
+                gint64 now = g_get_monotonic_time();
+                while (count < stage->batch && stage->depth > 0)
+                {
+                        queued_item *slot = &stage->ring[stage->head];
+                        items[count++] = slot->item;
+                        wait_max = MAX(wait_max, now - slot->time);
+                        stage->head = (stage->head + 1) % stage->capacity;
+                        stage->depth--;
+                }
+                ble_metric_set(stage->depth_metric, stage->depth);
+                g_cond_broadcast(&stage->room);
+                g_mutex_unlock(&stage->lock);
+
+                ble_trace(BLE_TRACE_BATCH_BEGIN, count, wait_max);
+                stage->func(items, count, stage->data);
+                ble_trace(BLE_TRACE_BATCH_END, 0, 0);
+                gint64 elapsed = g_get_monotonic_time() - now;
+                ble_metric_add(stage->items_metric, count);
+                ble_metric_observe(stage->batch_metric, elapsed);
+
+                for (guint i = 0; i < count; i++)
+                {
+                        if (items[i] == NULL)
+                                continue;
+                        for (guint j = 0; j < stage->outputs->len; j++)
+                        {
+                                ble_stage *output = g_ptr_array_index(stage->outputs, j);
+                                // The last output takes over our reference
+                                ble_stage_push(output, j + 1 < stage->outputs->len ? pipeline->ref(items[i]) : items[i]);
+                        }
+                        if (stage->outputs->len == 0)
+                                pipeline->unref(items[i]);
+                }
+
+                g_mutex_lock(&stage->lock);
+                stage->stats.items += count;
+                stage->stats.batches++;
+                stage->stats.busy_us += elapsed;
+                stage->stats.latency_max_us = MAX(stage->stats.latency_max_us, elapsed);
+                stage->stats.wait_max_us = MAX(stage->stats.wait_max_us, wait_max);
+                g_mutex_unlock(&stage->lock);
+        }
+        g_free(items);
+
+        g_mutex_lock(&stage->lock);
+        stage->done = true;
+        g_cond_broadcast(&stage->room);
+        g_mutex_unlock(&stage->lock);
+        for (guint j = 0; j < stage->outputs->len; j++)
+        {
+                ble_stage *output = g_ptr_array_index(stage->outputs, j);
+                g_mutex_lock(&output->lock);
+                gboolean last = --output->open_inputs == 0;
+                g_mutex_unlock(&output->lock);
+                if (last)
+                        _stage_close(output);
+        }
+
+        g_mutex_lock(&pipeline->lock);
+        pipeline->done++;
+        g_cond_broadcast(&pipeline->cond);
+        g_mutex_unlock(&pipeline->lock);
+        return NULL;
+}
+
+void ble_pipeline_start(ble_pipeline *pipeline)
+{
+        g_return_if_fail(!pipeline->started);
+        pipeline->started = true;
+        for (guint i = 0; i < pipeline->stages->len; i++)
+        {
+                ble_stage *stage = g_ptr_array_index(pipeline->stages, i);
+                stage->thread = g_thread_new(stage->name, _stage_thread, stage);
+        }
+}
+
+void ble_pipeline_close(ble_pipeline *pipeline)
+{
+        if (pipeline->closed)
+                return;
+        pipeline->closed = true;
+        // The sources close the rest as they finish
+        for (guint i = 0; i < pipeline->stages->len; i++)
+        {
+                ble_stage *stage = g_ptr_array_index(pipeline->stages, i);
+                g_mutex_lock(&stage->lock);
+                gboolean source = stage->open_inputs == 0;
+                g_mutex_unlock(&stage->lock);
+                if (source)
+                        _stage_close(stage);
+        }
+}
+
+gboolean ble_pipeline_wait(ble_pipeline *pipeline, gint64 deadline)
+{
+        gboolean finished = true;
+
+        if (!pipeline->started)
+                return true;
+        g_mutex_lock(&pipeline->lock);
+        while (pipeline->done < pipeline->stages->len)
+        {
+                if (deadline < 0)
+                {
+                        g_cond_wait(&pipeline->cond, &pipeline->lock);
+                }
+                else if (!g_cond_wait_until(&pipeline->cond, &pipeline->lock, deadline))
+                {
+                        finished = pipeline->done == pipeline->stages->len;
+                        break;
+                }
+        }
+        g_mutex_unlock(&pipeline->lock);
+        return finished;
+}
+
+void ble_pipeline_free(ble_pipeline *pipeline)
+{
+        if (pipeline == NULL)
+                return;
+        ble_pipeline_close(pipeline);
+        for (guint i = 0; i < pipeline->stages->len; i++)
+        {
+                ble_stage *stage = g_ptr_array_index(pipeline->stages, i);
+                if (stage->thread != NULL)
+                        g_thread_join(stage->thread);
+        }
+        for (guint i = 0; i < pipeline->stages->len; i++)
+        {
+                ble_stage *stage = g_ptr_array_index(pipeline->stages, i);
+                // Left over when the pipeline never started or was pushed to after closing
+                for (; stage->depth > 0; stage->depth--)
+                {
+                        pipeline->unref(stage->ring[stage->head].item);
+                        stage->head = (stage->head + 1) % stage->capacity;
+                }
+                g_free(stage->ring);
+                g_ptr_array_free(stage->outputs, true);
+                g_mutex_clear(&stage->lock);
+                g_cond_clear(&stage->more);
+                g_cond_clear(&stage->room);
+                ble_metrics_unregister(stage->items_metric);
+                ble_metrics_unregister(stage->dropped_metric);
+                ble_metrics_unregister(stage->depth_metric);
+                ble_metrics_unregister(stage->batch_metric);
+                ble_metrics_unregister(stage->capacity_metric);
+                g_free(stage->name);
+                g_free(stage);
+        }
+        g_ptr_array_free(pipeline->stages, true);
+        g_free(pipeline->name);
+        g_mutex_clear(&pipeline->lock);
+        g_cond_clear(&pipeline->cond);
+        g_free(pipeline);
+}
+
+void ble_stage_get_stats(ble_stage *stage, ble_stage_stats *stats)
+{
+        g_mutex_lock(&stage->lock);
+        *stats = stage->stats;
+        stats->depth = stage->depth;
+        g_mutex_unlock(&stage->lock);
+}
+
+gchar *ble_pipeline_describe(ble_pipeline *pipeline)
+{
+        GString *text = g_string_new(NULL);
+
+        for (guint i = 0; i < pipeline->stages->len; i++)
+        {
+                ble_stage *stage = g_ptr_array_index(pipeline->stages, i);
+                ble_stage_stats stats;
+                ble_stage_get_stats(stage, &stats);
+                g_string_append_printf(text,
+                        "%-8s %8" G_GUINT64_FORMAT " items %6" G_GUINT64_FORMAT " batches %6" G_GUINT64_FORMAT " dropped"
+                        "  depth %u/%u max %u  busy %.2f ms/batch max %.2f ms  waited max %.2f ms\n",
+                        stage->name, stats.items, stats.batches, stats.dropped,
+                        stats.depth, stage->capacity, stats.depth_max,
+                        stats.batches ? stats.busy_us / 1000.0 / stats.batches : 0.0,
+                        stats.latency_max_us / 1000.0, stats.wait_max_us / 1000.0);
+        }
+        return g_string_free(text, false);
+}
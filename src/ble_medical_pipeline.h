@@ -0,0 +1,74 @@
+#ifndef BLE_MEDICAL_PIPELINE_H
+#define BLE_MEDICAL_PIPELINE_H
+
+#include <glib.h>
+
+/*
+ * A small dataflow runtime for the acquisition path.
+ *
+ * Every stage runs on a thread of its own behind a bounded queue and takes
+ * its items in batches. Once the stage function has run, the items left
+ * in the batch go on to every stage it is connected to, each downstream
+ * stage getting a reference of its own; a stage with no outputs is a sink
+ * and releases them. When its queue is full a BLE_STAGE_BLOCK stage holds
+ * up whoever feeds it, while a BLE_STAGE_DROP_OLDEST one releases its
+ * oldest item to make room, so a slow renderer never stalls the recorder.
+ *
+ * Stages are added and connected before ble_pipeline_start(). Closing the
+ * pipeline lets every stage finish what is queued, in order from the
+ * sources to the sinks.
+ */
+
+typedef enum _ble_stage_policy {
+        BLE_STAGE_BLOCK,
+        BLE_STAGE_DROP_OLDEST
+} ble_stage_policy;
+
+typedef struct _ble_stage ble_stage;
+typedef struct _ble_pipeline ble_pipeline;
+
+// Runs on the stage thread over `count` items in arrival order. An item
+// the stage consumes is released and its slot set to NULL; the others are
+// forwarded.
+typedef void (*ble_stage_func)(gpointer *items, guint count, gpointer data);
+
+typedef struct _ble_stage_stats {
+        guint64         items;          // through the stage function
+        guint64         batches;
+        guint64         dropped;        // pushed out of a full queue
+        guint           depth;          // queued right now
+        guint           depth_max;
+        gint64          busy_us;        // in the stage function, all batches
+        gint64          latency_max_us; // slowest batch
+        gint64          wait_max_us;    // longest an item sat in the queue
+} ble_stage_stats;
+
+// Items are shared between the stages they fan out to. The name labels the
+// stage metrics, which pipelines of the same name share: give concurrent
+// pipelines names of their own. The metrics go with the last pipeline of
+// the name.
+ble_pipeline *ble_pipeline_new(const gchar *name, gpointer (*ref)(gpointer), GDestroyNotify unref);
+// `capacity` items queue at most and up to `batch` reach the function at
+// once; `cpu` pins the stage thread, -1 for anywhere
+ble_stage *ble_pipeline_add_stage(ble_pipeline*, const gchar *name, ble_stage_func func, gpointer data,
+                                  guint capacity, guint batch, ble_stage_policy policy, gint cpu);
+void ble_stage_connect(ble_stage *from, ble_stage *to);
+void ble_pipeline_start(ble_pipeline*);
+// Hands `item` to a stage from outside the pipeline
+void ble_stage_push(ble_stage*, gpointer item);
+// No more pushes: stages stop once their queues are empty
+void ble_pipeline_close(ble_pipeline*);
+// After closing, waits until every stage is done or the monotonic
+// `deadline` passes, -1 for no deadline. Returns whether they are done.
+gboolean ble_pipeline_wait(ble_pipeline*, gint64 deadline);
+// Closes, joins every stage thread however long it takes, and releases
+// anything still queued. No deadline applies here: bound the drain with
+// ble_pipeline_wait() and have the stages cut their work short before
+// freeing.
+void ble_pipeline_free(ble_pipeline*);
+
+void ble_stage_get_stats(ble_stage*, ble_stage_stats*);
+// One line of statistics per stage, to free with g_free()
+gchar *ble_pipeline_describe(ble_pipeline*);
+
+#endif
@@ -1,218 +1,837 @@
 #include "ble_medical_plot.h"
 #include "ble_medical_data.h"
 #include "ble_medical_debug.h"
+#include "ble_medical_capture.h"
+#include "ble_medical_pipeline.h"
+#include "ble_medical_latency.h"
+#include "ble_medical_metrics.h"
+#include "ble_medical_trace.h"
+#include "ble_medical_filter.h"
+#include "ble_medical_device.h"
 #include "config.h"
+#include <errno.h>
 #include <math.h>
+#include <string.h>
 #include "ble_medical_bluetooth.h"
 #include <simpleble_c/simpleble.h>
 
 //#define __DEBUG__
-static GMutex producer_mutex;
-static GtkChart *chart = NULL;
-static ble_time_t _starting_time;
-static GFileOutputStream* fstream;
-static int initiatedDataReceiving = false;
-static int isWriting = false;
-static int isPlotting = false;
+// Writer backlog a Stop waits for before dropping the rest
+#define STOP_DRAIN_US   (2 * G_USEC_PER_SEC)
+// Set to show the latency overlay on the chart
+#define LATENCY_ENV             "BLE_MEDICAL_LATENCY"
+// A file every session writes its latency histograms to when it ends
+#define LATENCY_DUMP_ENV        "BLE_MEDICAL_LATENCY_DUMP"
+#define LATENCY_OVERLAY_MS      500
+// Set to plot raw ADC counts instead of the band-passed pulse
+#define RAW_ENV                 "BLE_MEDICAL_RAW"
+// Frames the main loop may fall behind the render stage before it skips them
+#define PLOT_QUEUE_FRAMES       64
 
-gint _data_compare_func (gconstpointer first, gconstpointer second, gpointer data)
+// A point the render stage hands to the main loop
+typedef struct _chart_point {
+        double                  x;
+        double                  y;
+        gint64                  received;       // 0 unless stamped
+        gint64                  ingested;
+} chart_point;
+
+typedef enum _session_state {
+        SESSION_IDLE,
+        SESSION_RUNNING,
+        SESSION_PAUSED,         // connected, nothing read
+        SESSION_STOPPING
+} session_state;
+
+/*
+ * One acquisition, from Start to the peripheral released on Stop.
+ *
+ * Everything a stream touches lives here rather than in file statics, so
+ * that sessions on different peripherals and live paths run side by side.
+ * The window holds a reference while the session is its current one, the
+ * producer thread another until its report is handled on the main loop.
+ */
+typedef struct _plot_session {
+        gint                    ref;
+        GtkWindow               *window;
+        GtkChart                *chart;
+        simpleble_peripheral_t  peripheral;
+        gchar                   *live_path;
+        // Guards state, writing and plotting; a paused producer waits on cond
+        GMutex                  lock;
+        GCond                   cond;
+        session_state           state;
+        int                     writing;
+        int                     plotting;
+        GCancellable            *cancellable;
+        GThread                 *producer;
+        // acquire -> decode -> {store, render}, fed by the producer
+        ble_pipeline            *pipeline;
+        ble_stage               *decode;
+        // GTK is main thread only: the render stage queues points here and
+        // the main loop plots them, one idle callback per batch in flight
+        GMutex                  plot_lock;
+        GArray                  *plot_points;   // chart_point
+        GArray                  *plot_spare;    // swapped in by the drain
+        gboolean                plot_scheduled;
+        // The recording and its EDF+ copy, opened by the producer thread
+        ble_capture             *capture;
+        ble_time_t              starting_time;
+        // Band-pass of the plotted channel, run by the decode stage only;
+        // NULL to plot raw counts
+        ble_filter_bank         *filter;
+        ble_time_t              filter_time;    // of the last frame filtered
+        gint64                  stop_requested;
+        // Frames written, and dropped past the drain deadline
+        gint                    frames_written;
+        gint                    frames_dropped;
+        gint                    discarding;
+        // File Information as Stop found it, under lock; names the
+        // finished recording
+        gchar                   *meta_id;
+        gchar                   *meta_name;
+        gchar                   *meta_day;
+        // How the session ended, filled in by the producer
+        const char              *reason;        // NULL on Stop
+        gint64                  stop_time;      // from Stop to the peripheral released
+        gchar                   *saved_path;    // the finished recording, NULL if none
+        gchar                   *stage_stats;
+        // Radio to pixels, recorded by the stages and the chart
+        ble_latency             latency;
+} plot_session;
+
+// Sessions still recording, flushed if the process exits under them
+static GMutex sessions_lock;
+static GSList *sessions = NULL;
+
+static plot_session *_session_ref(plot_session *session)
+{
+        g_atomic_int_inc(&session->ref);
+        return session;
+}
+
+static void _session_unref(gpointer data)
+{
+        plot_session *session = (plot_session*)data;
+
+        if (!g_atomic_int_dec_and_test(&session->ref))
+                return;
+        ble_pipeline_free(session->pipeline);
+        ble_capture_free(session->capture);
+        ble_filter_bank_free(session->filter);
+        g_clear_object(&session->cancellable);
+        g_object_unref(session->chart);
+        g_object_unref(session->window);
+        g_free(session->live_path);
+        g_free(session->meta_id);
+        g_free(session->meta_name);
+        g_free(session->meta_day);
+        g_free(session->saved_path);
+        g_free(session->stage_stats);
+        g_array_unref(session->plot_points);
+        g_array_unref(session->plot_spare);
+        g_mutex_clear(&session->plot_lock);
+        g_mutex_clear(&session->lock);
+        g_cond_clear(&session->cond);
+        g_free(session);
+}
+
+static gpointer _pack_ref(gpointer data)
 {
-        ble_time_t _first = ((t_pack*)first)->time;
-        ble_time_t _second = ((t_pack*)second)->time;
-        return (int)(_first - _second);
+        g_atomic_int_inc(&((t_pack*)data)->refs);
+        return data;
 }
 
-void data_writing(gpointer data)
+// The stages a frame fans out to each hold a reference to it
+static void _pack_unref(gpointer data)
 {
         t_pack *t_pack_0 = (t_pack*)data;
-        point_t points[10];
-        pack_to_point(points, _starting_time, t_pack_0);
-        gsize bytes_written;
-#ifndef BLE_MEDICAL_PLOT_LOG
-        for (size_t j = 0; j < 10; j++)
-                g_output_stream_printf(G_OUTPUT_STREAM(fstream), &bytes_written, NULL, NULL, "%f :: %f\n", points[j].x, points[j].y);
-#else
-        for (size_t j = 0; j < 10; j++) {
-                uint16_t* rvalue = ble_pack_get_rvalue(t_pack_0->data);
-                uint16_t* irvalue = ble_pack_get_irvalue(t_pack_0->data);
-                g_output_stream_printf(G_OUTPUT_STREAM(fstream), &bytes_written, NULL, NULL, "T1: %hhu\nT2: %hhu\nRed value: %hu %hu %hu %hu %hu %hu %hu %hu %hu %hu\nIR Value: %hu %hu %hu %hu %hu %hu %hu %hu %hu %hu\nBeat average: %d\n\n", 
-                ble_pack_get_t1(t_pack_0->data),
-                ble_pack_get_t2(t_pack_0->data),
-                rvalue[0], rvalue[1], rvalue[2], rvalue[3], rvalue[4], rvalue[5], rvalue[6], rvalue[7], rvalue[8], rvalue[9],
-                irvalue[0], irvalue[1], irvalue[2], irvalue[3], irvalue[4], irvalue[5], irvalue[6], irvalue[7], irvalue[8], irvalue[9],
-                ble_pack_get_beat(t_pack_0->data)
-                );
-        }
-#endif
-        if (t_pack_0->plotWritten == false)
-                t_pack_0->fileWritten = true;
-        else
+
+        if (g_atomic_int_dec_and_test(&t_pack_0->refs))
         {
                 simpleble_free(t_pack_0->data);
                 g_free(t_pack_0);
         }
+}
 
+// Takes the DC off the plotted samples and keeps the pulse band; after a
+// gap the filter starts over rather than ring on the jump. Recordings keep
+// the raw counts.
+static void _filter_points(plot_session *session, t_pack *t_pack_0)
+{
+        double samples[PACKAGE_SAMPLES];
 
+        if (session->filter_time != 0 && t_pack_0->time - session->filter_time > BLE_METRICS_GAP_US)
+                ble_filter_bank_reset(session->filter);
+        session->filter_time = t_pack_0->time;
+        for (size_t j = 0; j < PACKAGE_SAMPLES; j++)
+                samples[j] = t_pack_0->points[j].y;
+        ble_filter_bank_run(session->filter, samples, PACKAGE_SAMPLES);
+        for (size_t j = 0; j < PACKAGE_SAMPLES; j++)
+                t_pack_0->points[j].y = samples[j];
 }
 
-void gui_chart_plot_thread(gpointer data)
+static void _decode_stage(gpointer *items, guint count, gpointer data)
 {
+        plot_session *session = (plot_session*)data;
 
-        t_pack *t_pack_0 = (t_pack*) data;
-        point_t points[10];
-//        g_mutex_lock(&producer_mutex);
-        pack_to_point(points, _starting_time, t_pack_0);
-        for (size_t j = 0; j < 10; j++)
-                gtk_chart_plot_point(chart, points[j].x, points[j].y);
+        for (guint i = 0; i < count; i++)
+        {
+                t_pack *t_pack_0 = (t_pack*)items[i];
+                pack_to_point(t_pack_0->points, session->starting_time, t_pack_0);
+                if (session->filter != NULL)
+                        _filter_points(session, t_pack_0);
+                t_pack_0->decoded = g_get_monotonic_time();
+                ble_latency_record(&session->latency, BLE_LATENCY_DECODE, t_pack_0->time, t_pack_0->decoded);
+        }
+        // The batch goes on to the renderer as soon as this returns
+        ble_time_t queued = g_get_monotonic_time();
+        for (guint i = 0; i < count; i++)
+        {
+                t_pack *t_pack_0 = (t_pack*)items[i];
+                t_pack_0->queued = queued;
+                ble_latency_record(&session->latency, BLE_LATENCY_ENQUEUE, t_pack_0->decoded, queued);
+        }
+}
 
-        if (points[0].x > 10) {
-                // [TODO]: Clear the existing chart
+static void _store_stage(gpointer *items, guint count, gpointer data)
+{
+        plot_session *session = (plot_session*)data;
+
+        if (!g_atomic_int_get(&session->writing))
+                return;
+        for (guint i = 0; i < count; i++)
+        {
+                t_pack *t_pack_0 = (t_pack*)items[i];
+                if (g_atomic_int_get(&session->discarding))
+                        g_atomic_int_inc(&session->frames_dropped);
+                else
+                {
+                        ble_capture_append(session->capture, t_pack_0->time, t_pack_0->data);
+                        g_atomic_int_inc(&session->frames_written);
+                }
         }
+}
 
-        if (t_pack_0->fileWritten == false)
-                t_pack_0->plotWritten = true;
-        else {
-                simpleble_free(t_pack_0->data);
-                g_free(data);
+// On the main loop: plots what the render stage queued since the last call
+static gboolean _plot_queued(gpointer data)
+{
+        plot_session *session = (plot_session*)data;
+
+        g_mutex_lock(&session->plot_lock);
+        GArray *points = session->plot_points;
+        session->plot_points = session->plot_spare;
+        session->plot_spare = points;
+        session->plot_scheduled = false;
+        g_mutex_unlock(&session->plot_lock);
+
+        // Only the main loop touches the spare, so it is filled again only
+        // after this
+        for (guint i = 0; i < points->len; i++)
+        {
+                const chart_point *point = &g_array_index(points, chart_point, i);
+                if (point->ingested != 0)
+                        gtk_chart_plot_point_stamped(session->chart, point->x, point->y,
+                                                     point->received, point->ingested);
+                else
+                        gtk_chart_plot_point(session->chart, point->x, point->y);
+        }
+        g_array_set_size(points, 0);
+        return G_SOURCE_REMOVE;
+}
+
+static void _render_stage(gpointer *items, guint count, gpointer data)
+{
+        plot_session *session = (plot_session*)data;
+        gboolean scheduled;
+
+        // Nothing is drawn once Stop is asked for
+        if (!g_atomic_int_get(&session->plotting) || g_cancellable_is_cancelled(session->cancellable))
+                return;
+        g_mutex_lock(&session->plot_lock);
+        for (guint i = 0; i < count; i++)
+        {
+                t_pack *t_pack_0 = (t_pack*)items[i];
+                // A stalled main loop skips frames, as the render queue does
+                if (session->plot_points->len >= PLOT_QUEUE_FRAMES * PACKAGE_SAMPLES)
+                        break;
+                point_t *points = t_pack_0->points;
+                ble_time_t ingested = g_get_monotonic_time();
+                ble_latency_record(&session->latency, BLE_LATENCY_INGEST, t_pack_0->queued, ingested);
+                // One stamped point per frame times its first draw
+                chart_point first = { points[0].x, points[0].y, t_pack_0->time, ingested };
+                g_array_append_val(session->plot_points, first);
+                for (size_t j = 1; j < PACKAGE_SAMPLES; j++)
+                {
+                        chart_point point = { points[j].x, points[j].y, 0, 0 };
+                        g_array_append_val(session->plot_points, point);
+                }
         }
+        scheduled = session->plot_scheduled;
+        session->plot_scheduled = true;
+        g_mutex_unlock(&session->plot_lock);
 
-//        g_mutex_unlock(&producer_mutex);
+        // Ahead of the redraw, so that a frame is drawn in the next one
+        if (!scheduled)
+                g_idle_add_full(G_PRIORITY_HIGH_IDLE, _plot_queued, _session_ref(session), _session_unref);
 }
 
-gpointer _producer_function(gpointer data)
+// On the main loop, from the snapshot that first draws a frame
+static void _frame_drawn(GtkChart *chart, gint64 received, gint64 ingested, gint64 drawn, gpointer data)
 {
-        GtkWindow *window = (GtkWindow*)data;
-        gint adapter_index = GPOINTER_TO_INT(g_object_get_data(G_OBJECT(window), "adapter_index"));
-        simpleble_peripheral_t *main_peripheral = (simpleble_peripheral_t*)g_object_get_data(G_OBJECT(window), "main_peripheral");
+        plot_session *session = (plot_session*)data;
+
+        ble_latency_record(&session->latency, BLE_LATENCY_DRAW, ingested, drawn);
+        ble_latency_record(&session->latency, BLE_LATENCY_END_TO_END, received, drawn);
+}
+
+// On the main loop: traces the chart drawing and times every snapshot into
+// the render_frame metric
+static void _chart_event(GtkChart *chart, GtkChartEvent event, double a, double b, gpointer data)
+{
+        static gint64 snapshot_begin;
+
+        switch (event)
+        {
+        case GTK_CHART_EVENT_SNAPSHOT_BEGIN:
+                snapshot_begin = g_get_monotonic_time();
+                ble_trace(BLE_TRACE_SNAPSHOT_BEGIN, (int64_t)a, (int64_t)b);
+                break;
+        case GTK_CHART_EVENT_SNAPSHOT_END:
+                ble_trace(BLE_TRACE_SNAPSHOT_END, 0, 0);
+                ble_metric_observe(ble_metrics_core_get()->render_frame, g_get_monotonic_time() - snapshot_begin);
+                break;
+        case GTK_CHART_EVENT_SCALE_POINT:
+                ble_trace(BLE_TRACE_SCALE_POINT, ble_trace_double(a), ble_trace_double(b));
+                break;
+        case GTK_CHART_EVENT_SCALE_FRAME:
+                ble_trace(BLE_TRACE_SCALE_FRAME, ble_trace_double(a), ble_trace_double(b));
+                break;
+        }
+}
+
+// Flushes the partial block and checkpoints the journal of every session
+// still recording, so that an exit while recording leaves recordings that
+// recover without loss.
+void _record_on_exit()
+{
+        g_mutex_lock(&sessions_lock);
+        for (GSList *l = sessions; l != NULL; l = l->next)
+        {
+                plot_session *session = (plot_session*)l->data;
+                if (session->capture != NULL)
+                        ble_capture_stop(session->capture);
+        }
+        g_mutex_unlock(&sessions_lock);
+}
 
-        double x = 0;
-        double y;
-        point_t point;
+static plot_session *_session_new(GtkWindow *window, simpleble_peripheral_t peripheral, const gchar *live_path)
+{
+        plot_session *session = g_new0(plot_session, 1);
+        static gboolean exit_handler = false;
+        static gint sessions_started = 0;
 
-        simpleble_service_t service;
-        int service_set = false;
-        int char_set = false;
-        size_t service_index, characteristic_index, services_count;
-        simpleble_adapter_t adapter = simpleble_adapter_get_handle(adapter_index);
-        simpleble_err_t err_code = simpleble_peripheral_connect(main_peripheral[0]);
+        session->ref = 1;
+        session->window = g_object_ref(window);
+        session->chart = g_object_ref(g_object_get_data(G_OBJECT(window), "chart"));
+        session->peripheral = peripheral;
+        session->live_path = g_strdup(live_path);
+        g_mutex_init(&session->lock);
+        g_cond_init(&session->cond);
+        g_mutex_init(&session->plot_lock);
+        session->plot_points = g_array_new(false, false, sizeof(chart_point));
+        session->plot_spare = g_array_new(false, false, sizeof(chart_point));
+        session->state = SESSION_IDLE;
+        session->cancellable = g_cancellable_new();
+        if (g_getenv(RAW_ENV) == NULL)
+                session->filter = ble_filter_bank_new(1, 1.0 / PACKAGE_INTERVAL, BLE_FILTER_LOW_HZ, BLE_FILTER_HIGH_HZ);
+        // The recorder holds up acquisition when it falls behind, the chart
+        // only skips frames. Each session labels its stage metrics apart, so
+        // that two windows never add up into the same queue depths.
+        gchar *name = g_strdup_printf("gui-%d", g_atomic_int_add(&sessions_started, 1) + 1);
+        session->pipeline = ble_pipeline_new(name, _pack_ref, _pack_unref);
+        g_free(name);
+        session->decode = ble_pipeline_add_stage(session->pipeline, "decode", _decode_stage, session,
+                                                 256, 16, BLE_STAGE_BLOCK, -1);
+        ble_stage *store = ble_pipeline_add_stage(session->pipeline, "store", _store_stage, session,
+                                                  1024, 32, BLE_STAGE_BLOCK, -1);
+        ble_stage *render = ble_pipeline_add_stage(session->pipeline, "render", _render_stage, session,
+                                                   64, 8, BLE_STAGE_DROP_OLDEST, -1);
+        ble_stage_connect(session->decode, store);
+        ble_stage_connect(session->decode, render);
+        if (!exit_handler)
+        {
+                exit_handler = true;
+                atexit(_record_on_exit);
+        }
+        return session;
+}
+
+// Back on the main loop once the producer is done
+static gboolean _session_finished(gpointer data)
+{
+        plot_session *session = (plot_session*)data;
+        GObject *window = G_OBJECT(session->window);
+        GtkLabel *status = GTK_LABEL(g_object_get_data(window, "label_status"));
+        GtkButton *start_button = GTK_BUTTON(g_object_get_data(window, "button_start"));
+        gint written = g_atomic_int_get(&session->frames_written);
+        char _label_text[BUFSIZ];
+
+        g_thread_join(session->producer);
+        session->producer = NULL;
+        g_mutex_lock(&sessions_lock);
+        sessions = g_slist_remove(sessions, session);
+        g_mutex_unlock(&sessions_lock);
+
+        g_autofree gchar *latency = ble_latency_summary(&session->latency);
+        const gchar *dump_path = g_getenv(LATENCY_DUMP_ENV);
+        if (session->stage_stats != NULL)
+                _debug_print(g_strchomp(session->stage_stats));
+        _debug_print(g_strchomp(latency));
+        if (dump_path != NULL && ble_latency_dump(&session->latency, dump_path) == 0)
+        {
+                g_autofree gchar *message = g_strdup_printf("Latency histograms written to %s", dump_path);
+                _debug_print(message);
+        }
+        if (session->reason != NULL)
+                snprintf(_label_text, BUFSIZ, "%s, %d frames written", session->reason, written);
+        else
+                snprintf(_label_text, BUFSIZ, "Stopped in %.1f ms, %d frames written, %d lost",
+                         session->stop_time / 1000.0, written, g_atomic_int_get(&session->frames_dropped));
+        if (session->saved_path != NULL)
+        {
+                gsize used = strlen(_label_text);
+                snprintf(_label_text + used, BUFSIZ - used, ", saved %s", session->saved_path);
+        }
+        _debug_print(_label_text);
 
-        if (err_code != SIMPLEBLE_SUCCESS) {
+        // A newer session may already be the window's current one
+        if (g_object_get_data(window, "session") == session)
+        {
+                gtk_label_set_text(status, _label_text);
+                gtk_button_set_label(start_button, "Start");
+                gtk_chart_set_drawn_func(session->chart, NULL, NULL, NULL);
+                g_object_set_data(window, "session", NULL);
+        }
+        _session_unref(session);
+        return G_SOURCE_REMOVE;
+}
+
+static gboolean _session_open(plot_session *session, simpleble_uuid_t *service, simpleble_uuid_t *characteristic)
+{
+        if (simpleble_peripheral_connect(session->peripheral) != SIMPLEBLE_SUCCESS)
+        {
                 _debug_print("Plotting peripheral connection failed");
-                exit(1);
-        } else {
-                _debug_print("Plotting peripheral connection success");
+                session->reason = "Peripheral connection failed";
+                return false;
+        }
+        _debug_print("Plotting peripheral connection success");
+        if (!ble_device_find(session->peripheral, service, characteristic))
+        {
+                session->reason = "Peripheral has no sensor characteristic";
+                simpleble_peripheral_disconnect(session->peripheral);
+                return false;
+        }
+
+        ble_capture *capture = ble_capture_open(session->live_path, true, NULL);
+        if (capture == NULL)
+        {
+                _debug_print("Recording could not be opened");
+                session->reason = "Recording could not be opened";
+                simpleble_peripheral_disconnect(session->peripheral);
+                return false;
         }
+        g_mutex_lock(&sessions_lock);
+        session->capture = capture;
+        sessions = g_slist_prepend(sessions, session);
+        g_mutex_unlock(&sessions_lock);
+        return true;
+}
 
-        services_count = simpleble_peripheral_services_count(main_peripheral[0]);
+gpointer _producer_function(gpointer data)
+{
+        plot_session *session = (plot_session*)data;
+        simpleble_uuid_t service, characteristic;
+        simpleble_err_t err_code;
 
-        for (size_t i = 0; i < services_count; i++)
+        if (!_session_open(session, &service, &characteristic))
         {
-                if (service_set && char_set)
-                        break;
-                err_code = simpleble_peripheral_services_get(main_peripheral[0], i, &service);
-                if (err_code != SIMPLEBLE_SUCCESS)
-                        exit(1);
-                if (g_strcmp0(service.uuid.value, DEFAULT_SERVICE_UUID) == 0)
-                {
-                        service_index = i;
-                        for (size_t j = 0; j < service.characteristic_count; j++)
-                        {
-                                if (g_strcmp0(service.uuid.value, DEFAULT_CHARACTERISTIC_UUID) == 0)
-                                {
-                                        characteristic_index = j;
-                                        service_set = true;
-                                        char_set = true;
-                                }
-                        }
-                }
+                ble_pipeline_free(session->pipeline);
+                session->pipeline = NULL;
+                g_idle_add(_session_finished, session);
+                return NULL;
         }
-//        g_mutex_lock(&producer_mutex);
+
         ble_pack_t pack;
         size_t pack_len;
         int hasFirstTime = false;
+        ble_frame_check check = { 0 };
+
+        ble_pipeline_start(session->pipeline);
 
-        GThreadPool *thread_plot = g_thread_pool_new(
-                gui_chart_plot_thread,
-                chart,
-                4,
-                false,
-                NULL);
-        GThreadPool *thread_write = g_thread_pool_new(
-                data_writing,
-                fstream,
-                4,
-                false,
-                NULL
-        );
-        g_thread_pool_set_sort_function(thread_plot, _data_compare_func, NULL);
-        g_thread_pool_set_sort_function(thread_write, _data_compare_func, NULL);
-        g_mutex_init(&producer_mutex);
-        GFile* file = g_file_new_for_path(DEFAULT_PATH);
-         fstream = g_file_append_to(file, G_FILE_CREATE_REPLACE_DESTINATION, NULL, NULL);
-        size_t j = 0;
         while (true) {
-                err_code = simpleble_peripheral_read(main_peripheral[0], 
-                service.uuid, 
-                service.characteristics[characteristic_index].uuid, 
+                g_mutex_lock(&session->lock);
+                while (session->state == SESSION_PAUSED)
+                        g_cond_wait(&session->cond, &session->lock);
+                // A frame read while Stop was asked for is still kept
+                int plotting = session->plotting;
+                int writing = session->writing;
+                g_mutex_unlock(&session->lock);
+                if (g_cancellable_is_cancelled(session->cancellable))
+                        break;
+
+                err_code = simpleble_peripheral_read(session->peripheral, 
+                service, 
+                characteristic, 
                 &pack, 
                 &pack_len);
                 ble_time_t time_0 = g_get_monotonic_time();
                 if (err_code != SIMPLEBLE_SUCCESS)
-                        exit(12);
+                {
+                        ble_trace(BLE_TRACE_READ_ERROR, 0, 0);
+                        ble_metric_add(ble_metrics_core_get()->read_errors, 1);
+                        session->reason = "Connection lost";
+                        break;
+                }
                 if (hasFirstTime == false) {
                         hasFirstTime = true;
-                        _starting_time = time_0;
+                        session->starting_time = time_0;
+                }
+
+                ble_trace(BLE_TRACE_READ, pack_len, 0);
+                if (pack_len == PACKAGE_SIZE)
+                        ble_metrics_frame_read(&check, time_0, pack);
+                else
+                        ble_trace(BLE_TRACE_FRAME_DROPPED, pack_len, 0);
+                if (pack_len != PACKAGE_SIZE || (!plotting && !writing))
+                {
+                        simpleble_free(pack);
+                        continue;
                 }
 
                 t_pack *t_pack_1 = (t_pack*)g_malloc0(sizeof(*t_pack_1));
                 t_pack_1->data = (ble_pack_inf*)pack;
                 t_pack_1->time = time_0;
-                t_pack_1->fileWritten = false;
-                t_pack_1->plotWritten = false;
-
-                if (isPlotting == true)
-                        g_thread_pool_push(thread_plot, t_pack_1, NULL);
-                if (isWriting == true)
-                        g_thread_pool_push(thread_write, t_pack_1, NULL);
-                usleep(PACKAGE_INTERVAL);
-//                simpleble_free(pack);
-                j++;
+                t_pack_1->refs = 1;
+                // Blocks while the recorder is behind
+                ble_stage_push(session->decode, t_pack_1);
         }
 
-        g_output_stream_close(G_OUTPUT_STREAM(fstream), NULL, NULL);
+        // Let the writer catch up until the deadline, then drop the rest
+        gint64 t_stop = session->stop_requested != 0 ? session->stop_requested : g_get_monotonic_time();
+        gint64 deadline = t_stop + STOP_DRAIN_US;
+        ble_pipeline_close(session->pipeline);
+        if (!ble_pipeline_wait(session->pipeline, deadline))
+                g_atomic_int_set(&session->discarding, true);
+        session->stage_stats = ble_pipeline_describe(session->pipeline);
+        ble_pipeline_free(session->pipeline);
+        session->pipeline = NULL;
+        g_mutex_lock(&session->lock);
+        ble_record_meta meta = { session->meta_id, session->meta_name, session->meta_day };
+        g_mutex_unlock(&session->lock);
+        // A session that ends is finished for good, so that only a crash
+        // leaves anything to recover
+        if (ble_capture_finish(session->capture, &meta, &session->saved_path) != 0 && session->reason == NULL)
+                session->reason = "Stopped, recording left for recovery";
+        simpleble_peripheral_disconnect(session->peripheral);
+
+        session->stop_time = g_get_monotonic_time() - t_stop;
+        g_idle_add(_session_finished, session);
         return NULL;
 }
 
-void _plotting_button_clicked(GtkButton *button, gpointer data)
+// Starts a session on the connected peripheral as the window's current one
+static plot_session *_session_start(GtkWindow *window)
 {
-//        g_mutex_lock(&producer_mutex);
-        isPlotting = true;
-        if (initiatedDataReceiving == false)
+        simpleble_peripheral_t *main_peripheral = (simpleble_peripheral_t*)g_object_get_data(G_OBJECT(window), "main_peripheral");
+        GtkLabel *status = GTK_LABEL(g_object_get_data(G_OBJECT(window), "label_status"));
+
+        if (main_peripheral == NULL)
         {
-                initiatedDataReceiving = true;
-                GThread *_producer_thread = g_thread_new("producer_thread", _producer_function, data);
+                gtk_label_set_text(status, "No peripheral connected");
+                return NULL;
         }
+        // Sessions overlap while one drains, and several windows may record
+        g_autofree gchar *live_path = ble_capture_session_path(DEFAULT_PATH);
+        if (live_path == NULL)
+        {
+                gtk_label_set_text(status, "Recording folder is not writable");
+                return NULL;
+        }
+        plot_session *session = _session_new(window, main_peripheral[0], live_path);
+        session->state = SESSION_RUNNING;
+        g_object_set_data_full(G_OBJECT(window), "session", session, _session_unref);
+        gtk_chart_set_drawn_func(session->chart, _frame_drawn, _session_ref(session), _session_unref);
+        session->producer = g_thread_new("producer_thread", _producer_function, _session_ref(session));
+        return session;
+}
+
+void _plotting_button_clicked(GtkButton *button, gpointer data)
+{
+        plot_session *session = (plot_session*)g_object_get_data(G_OBJECT(data), "session");
+
+        if (session == NULL)
+                session = _session_start(GTK_WINDOW(data));
+        if (session == NULL)
+                return;
+        g_mutex_lock(&session->lock);
+        if (session->state != SESSION_STOPPING)
+                session->plotting = true;
+        g_mutex_unlock(&session->lock);
 }
 
+// Start, then Pause and Resume; Stop ends the session
 void _start_button_clicked(GtkButton *button, gpointer data)
 {
-        isWriting = true;
-        if (initiatedDataReceiving == false)
+        plot_session *session = (plot_session*)g_object_get_data(G_OBJECT(data), "session");
+
+        if (session == NULL)
         {
-                initiatedDataReceiving = true;
-                GThread *_producer_thread = g_thread_new("producer_thread", _producer_function, data);
+                session = _session_start(GTK_WINDOW(data));
+                if (session == NULL)
+                        return;
+                g_mutex_lock(&session->lock);
+                session->writing = true;
+                g_mutex_unlock(&session->lock);
+                gtk_button_set_label(button, "Pause");
+                return;
         }
+
+        g_mutex_lock(&session->lock);
+        switch (session->state)
+        {
+        case SESSION_RUNNING:
+                if (!session->writing)
+                {
+                        session->writing = true;
+                        gtk_button_set_label(button, "Pause");
+                }
+                else
+                {
+                        session->state = SESSION_PAUSED;
+                        gtk_button_set_label(button, "Resume");
+                }
+                break;
+        case SESSION_PAUSED:
+                session->writing = true;
+                session->state = SESSION_RUNNING;
+                g_cond_broadcast(&session->cond);
+                gtk_button_set_label(button, "Pause");
+                break;
+        case SESSION_IDLE:
+        case SESSION_STOPPING:
+                break;
+        }
+        g_mutex_unlock(&session->lock);
+}
+
+static gchar *_entry_text(GObject *window, const char *key)
+{
+        GtkEditable *entry = GTK_EDITABLE(g_object_get_data(window, key));
+        return g_strstrip(g_strdup(gtk_editable_get_text(entry)));
 }
 
 void _stop_button_clicked(GtkButton *button, gpointer data)
 {
-        // Stop _producer_function()
+        plot_session *session = (plot_session*)g_object_get_data(G_OBJECT(data), "session");
+        GtkLabel *status = GTK_LABEL(g_object_get_data(G_OBJECT(data), "label_status"));
+
+        if (session == NULL)
+                return;
+        g_mutex_lock(&session->lock);
+        if (session->state == SESSION_RUNNING || session->state == SESSION_PAUSED)
+        {
+                session->meta_id = _entry_text(G_OBJECT(data), "text_id");
+                session->meta_name = _entry_text(G_OBJECT(data), "text_name");
+                session->meta_day = _entry_text(G_OBJECT(data), "text_day");
+                // The producer ends after the read in flight, if any
+                session->stop_requested = g_get_monotonic_time();
+                session->state = SESSION_STOPPING;
+                g_cancellable_cancel(session->cancellable);
+                g_cond_broadcast(&session->cond);
+                gtk_label_set_text(status, "Stopping");
+        }
+        g_mutex_unlock(&session->lock);
+}
+
+// A New Record in flight, from the button to its status line
+typedef struct _rotate_job {
+        plot_session            *session;
+        GtkLabel                *status;
+        gchar                   *filename;
+        gchar                   *id;
+        gchar                   *name;
+        gchar                   *day;
+        gchar                   *path;
+        gint64                  latency;
+} rotate_job;
+
+static void _rotate_job_free(gpointer data)
+{
+        rotate_job *job = (rotate_job*)data;
+
+        _session_unref(job->session);
+        g_object_unref(job->status);
+        g_free(job->filename);
+        g_free(job->id);
+        g_free(job->name);
+        g_free(job->day);
+        g_free(job->path);
+        g_free(job);
+}
+
+// Waits for the writer and the disk, so away from the main loop
+static void _rotate_thread(GTask *task, gpointer source, gpointer data, GCancellable *cancellable)
+{
+        rotate_job *job = (rotate_job*)data;
+        ble_capture *capture = job->session->capture;
+        ble_record_meta meta = { job->id, job->name, job->day };
+
+        job->path = ble_capture_segment_path(capture->live_path, job->filename, &meta);
+        if (job->path == NULL || ble_capture_rotate(capture, job->path, &meta, &job->latency, NULL, NULL) != 0)
+        {
+                g_task_return_new_error(task, G_IO_ERROR, G_IO_ERROR_FAILED, "New record failed");
+                return;
+        }
+        g_task_return_boolean(task, true);
+}
+
+static void _rotate_done(GObject *source, GAsyncResult *result, gpointer data)
+{
+        rotate_job *job = (rotate_job*)g_task_get_task_data(G_TASK(result));
+        char _label_text[BUFSIZ];
 
+        gtk_widget_set_sensitive(GTK_WIDGET(source), true);
+        if (!g_task_propagate_boolean(G_TASK(result), NULL))
+        {
+                gtk_label_set_text(job->status, "New record failed, still recording to the same file");
+                return;
+        }
+        snprintf(_label_text, BUFSIZ, "Saved %s (writer paused %.2f ms, max %.2f ms)", job->path,
+                 job->latency / 1000.0, ble_capture_rotation_max(job->session->capture) / 1000.0);
+        gtk_label_set_text(job->status, _label_text);
 }
 
 void _new_record_button_clicked(GtkButton *button, gpointer data)
 {
         // Save the temporary file as a new file with additional metadata
+        GObject *window = G_OBJECT(data);
+        GtkLabel *status = GTK_LABEL(g_object_get_data(window, "label_status"));
+        plot_session *session = (plot_session*)g_object_get_data(window, "session");
+        ble_capture *capture = NULL;
+
+        // Set once by the producer, freed only with the session
+        if (session != NULL)
+        {
+                g_mutex_lock(&sessions_lock);
+                capture = session->capture;
+                g_mutex_unlock(&sessions_lock);
+        }
+        gboolean recording = false;
+        if (capture != NULL)
+        {
+                g_mutex_lock(&capture->lock);
+                recording = capture->record != NULL;
+                g_mutex_unlock(&capture->lock);
+        }
+        if (!recording)
+        {
+                gtk_label_set_text(status, "Nothing is being recorded");
+                return;
+        }
+
+        rotate_job *job = g_new0(rotate_job, 1);
+        job->session = _session_ref(session);
+        job->status = g_object_ref(status);
+        job->filename = _entry_text(window, "text_filenam");
+        job->id = _entry_text(window, "text_id");
+        job->name = _entry_text(window, "text_name");
+        job->day = _entry_text(window, "text_day");
+        // One rotation at a time; the button comes back with its result
+        gtk_widget_set_sensitive(GTK_WIDGET(button), false);
+        gtk_label_set_text(status, "Saving");
+        GTask *task = g_task_new(button, NULL, _rotate_done, NULL);
+        g_task_set_task_data(task, job, _rotate_job_free);
+        g_task_run_in_thread(task, _rotate_thread);
+        g_object_unref(task);
+}
+
+// Whether a session of this process is recording to `path`
+static gboolean _recording_to(const gchar *path)
+{
+        gboolean found = false;
+
+        g_mutex_lock(&sessions_lock);
+        for (GSList *l = sessions; l != NULL && !found; l = l->next)
+                found = g_strcmp0(((plot_session*)l->data)->live_path, path) == 0;
+        g_mutex_unlock(&sessions_lock);
+        return found;
+}
+
+// Brings the recordings crashed sessions left back to their last valid
+// block and finalizes them, so that they come up only once. The task
+// returns the status line, NULL when there was nothing to report.
+static void _recover_thread(GTask *task, gpointer source, gpointer data, GCancellable *cancellable)
+{
+        g_autoptr(GPtrArray) paths = ble_capture_unfinished(DEFAULT_PATH);
+        ble_record_recovery report;
+        guint64 frames = 0, truncated = 0;
+        guint blocks = 0, recovered = 0;
+        gchar *failure = NULL;
+
+        for (guint i = 0; i < paths->len; i++)
+        {
+                const gchar *path = g_ptr_array_index(paths, i);
+                g_autofree gchar *final_path = NULL;
+                // Another window of this process may be recording there
+                if (_recording_to(path))
+                        continue;
+                if (ble_capture_recover_session(path, &report, &final_path) != 0)
+                {
+                        _debug_print("Recording recovery failed");
+                        g_free(failure);
+                        failure = g_strdup_printf("%s could not be recovered: %s", path, g_strerror(errno));
+                        continue;
+                }
+                if (final_path == NULL)
+                        continue;
+                g_autofree gchar *message = g_strdup_printf("%s: %" G_GUINT64_FORMAT " frames, verified %"
+                                                            G_GUINT64_FORMAT " bytes past checkpoint %"
+                                                            G_GUINT64_FORMAT ", dropped %" G_GUINT64_FORMAT,
+                                                            path, report.frames, report.scanned_bytes,
+                                                            report.checkpoint, report.truncated_bytes);
+                _debug_print(message);
+                frames += report.frames;
+                blocks += report.blocks;
+                truncated += report.truncated_bytes;
+                recovered++;
+        }
+        // A file left untouched stays on the status line
+        if (failure != NULL || recovered == 0)
+        {
+                g_task_return_pointer(task, failure, g_free);
+                return;
+        }
+        g_task_return_pointer(task, g_strdup_printf("Recovered %" G_GUINT64_FORMAT " frames in %u blocks from %u "
+                                                    "recordings, dropped %" G_GUINT64_FORMAT " damaged bytes",
+                                                    frames, blocks, recovered, truncated), g_free);
+}
+
+static void _recover_done(GObject *source, GAsyncResult *result, gpointer data)
+{
+        g_autofree gchar *text = g_task_propagate_pointer(G_TASK(result), NULL);
+
+        if (text != NULL)
+                gtk_label_set_text(GTK_LABEL(source), text);
+}
+
+// Recovers on a worker thread, so that the window comes up at once
+void _recover_recording(GtkLabel *status)
+{
+        GTask *task = g_task_new(status, NULL, _recover_done, NULL);
+
+        g_task_run_in_thread(task, _recover_thread);
+        g_object_unref(task);
 }
 
 void chart_register_starting(GtkChart *chart, ble_time_t current_time)
@@ -220,17 +839,53 @@ void chart_register_starting(GtkChart *chart, ble_time_t current_time)
         g_object_set_data(G_OBJECT(chart), "beginning_time", GINT_TO_POINTER(current_time));
 }
 
+static gboolean _latency_overlay_update(gpointer data)
+{
+        GtkLabel *label = GTK_LABEL(data);
+        GtkWidget *window = gtk_widget_get_ancestor(GTK_WIDGET(label), GTK_TYPE_WINDOW);
+        plot_session *session = window ? (plot_session*)g_object_get_data(G_OBJECT(window), "session") : NULL;
+
+        // The last session's figures stay up once it ends
+        if (session != NULL)
+        {
+                g_autofree gchar *summary = ble_latency_summary(&session->latency);
+                gtk_label_set_text(label, g_strchomp(summary));
+        }
+        return G_SOURCE_CONTINUE;
+}
+
+// The chart with the latency of the current session over its corner
+static GtkWidget *_latency_overlay_new(GtkChart *chart)
+{
+        GtkWidget *overlay = gtk_overlay_new();
+        GtkWidget *label = gtk_label_new("No session yet");
+
+        gtk_overlay_set_child(GTK_OVERLAY(overlay), GTK_WIDGET(chart));
+        gtk_widget_set_hexpand(overlay, true);
+        gtk_widget_set_vexpand(overlay, true);
+        gtk_widget_set_halign(label, GTK_ALIGN_END);
+        gtk_widget_set_valign(label, GTK_ALIGN_START);
+        gtk_widget_set_can_target(label, false);
+        gtk_widget_add_css_class(label, "monospace");
+        gtk_overlay_add_overlay(GTK_OVERLAY(overlay), label);
+        g_timeout_add_full(G_PRIORITY_LOW, LATENCY_OVERLAY_MS, _latency_overlay_update,
+                           g_object_ref(label), g_object_unref);
+        return overlay;
+}
+
 void load_plotting(GtkBuilder *builder, GtkWindow *window)
 {
-        GObject *bled   = gtk_builder_get_object(builder, "bluetooth_dialog");
         GObject *plot_button = gtk_builder_get_object(builder, "button_plot");
 
         GObject *start_button = gtk_builder_get_object(builder, "button_start");
         GObject *new_record_button = gtk_builder_get_object(builder, "button_newrecord");
         GObject *stop_button = gtk_builder_get_object(builder, "button_stop");
         GObject *plot_box = gtk_builder_get_object(builder, "plot_box");
+        GObject *status_label = gtk_builder_get_object(builder, "label_status");
 
-        chart = GTK_CHART(gtk_chart_new());
+        _recover_recording(GTK_LABEL(status_label));
+
+        GtkChart *chart = GTK_CHART(gtk_chart_new());
         gtk_chart_set_type(chart, GTK_CHART_TYPE_LINEAR_AUTOSCALE);
         gtk_chart_set_title(chart, "PPG Signal");
         gtk_chart_set_label(chart, "Random label");
@@ -239,16 +894,25 @@ void load_plotting(GtkBuilder *builder, GtkWindow *window)
         gtk_chart_set_x_interval(chart, 10.0);
         gtk_chart_set_y_upper(chart, 5000);
         gtk_chart_set_width(chart, 1000);
+        gtk_chart_set_event_func(chart, _chart_event, NULL, NULL);
         gtk_widget_set_hexpand(GTK_WIDGET(chart), true);
         gtk_widget_set_vexpand(GTK_WIDGET(chart), true);
         gtk_widget_set_hexpand(GTK_WIDGET(plot_box), true);
         gtk_widget_set_vexpand(GTK_WIDGET(plot_box), true);
-        gtk_box_append(GTK_BOX(plot_box), GTK_WIDGET(chart));
+        if (g_getenv(LATENCY_ENV) != NULL)
+                gtk_box_append(GTK_BOX(plot_box), _latency_overlay_new(chart));
+        else
+                gtk_box_append(GTK_BOX(plot_box), GTK_WIDGET(chart));
         g_object_set_data(G_OBJECT(window), "chart", chart);
+        g_object_set_data(G_OBJECT(window), "label_status", status_label);
+        g_object_set_data(G_OBJECT(window), "button_start", start_button);
+        g_object_set_data(G_OBJECT(window), "text_filenam", gtk_builder_get_object(builder, "text_filenam"));
+        g_object_set_data(G_OBJECT(window), "text_id", gtk_builder_get_object(builder, "text_id"));
+        g_object_set_data(G_OBJECT(window), "text_name", gtk_builder_get_object(builder, "text_name"));
+        g_object_set_data(G_OBJECT(window), "text_day", gtk_builder_get_object(builder, "text_day"));
         g_signal_connect(plot_button, "clicked", G_CALLBACK(_plotting_button_clicked), window);
         g_signal_connect(start_button, "clicked", G_CALLBACK(_start_button_clicked), window);
         g_signal_connect(new_record_button, "clicked", G_CALLBACK(_new_record_button_clicked), window);
         g_signal_connect(stop_button, "clicked", G_CALLBACK(_stop_button_clicked), window);
 
-//        g_mutex_unlock(&producer_mutex);
 }
\ No newline at end of file
@@ -0,0 +1,192 @@
+#include "ble_medical_query.h"
+
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+typedef struct _query_acc {
+        uint64_t        count;
+        uint64_t        sum;
+        uint64_t        sumsq;
+        uint16_t        min;
+        uint16_t        max;
+} query_acc;
+
+void ble_sketch_init(ble_sketch *sketch)
+{
+        memset(sketch, 0, sizeof(*sketch));
+}
+
+void ble_sketch_add(ble_sketch *sketch, const uint16_t *samples, size_t n)
+{
+        for (size_t i = 0; i < n; i++)
+                sketch->bins[samples[i] >> BLE_SKETCH_SHIFT]++;
+        sketch->total += n;
+}
+
+void ble_sketch_merge(ble_sketch *sketch, const ble_sketch *other)
+{
+        for (size_t i = 0; i < BLE_SKETCH_BINS; i++)
+                sketch->bins[i] += other->bins[i];
+        sketch->total += other->total;
+}
+
+static void _sketch_merge_stored(ble_sketch *sketch, const uint8_t *bins)
+{
+        uint16_t stored[BLE_SKETCH_BINS];
+        memcpy(stored, bins, sizeof(stored));
+        for (size_t i = 0; i < BLE_SKETCH_BINS; i++)
+        {
+                sketch->bins[i] += stored[i];
+                sketch->total += stored[i];
+        }
+}
+
+// Samples are taken as spread evenly inside their bin
+double ble_sketch_quantile(const ble_sketch *sketch, double q)
+{
+        const double width = 1 << BLE_SKETCH_SHIFT;
+        double rank;
+        uint64_t below = 0;
+
+        if (sketch->total == 0)
+                return NAN;
+        q = q < 0 ? 0 : q > 1 ? 1 : q;
+        rank = q * (double)(sketch->total - 1);
+        for (size_t i = 0; i < BLE_SKETCH_BINS; i++)
+        {
+                uint64_t n = sketch->bins[i];
+                if (n > 0 && rank < (double)(below + n))
+                        return i * width + (rank - below + 0.5) / n * width;
+                below += n;
+        }
+        return BLE_SKETCH_BINS * width - 1;
+}
+
+static void _acc_samples(query_acc *acc, const uint16_t *samples, size_t n)
+{
+        for (size_t i = 0; i < n; i++)
+        {
+                uint16_t s = samples[i];
+                if (s < acc->min)
+                        acc->min = s;
+                if (s > acc->max)
+                        acc->max = s;
+                acc->sum += s;
+                acc->sumsq += (uint64_t)s * s;
+        }
+        acc->count += n;
+}
+
+static void _acc_block(query_acc *acc, const uint8_t *stored, int channel, uint64_t n)
+{
+        ble_block_aggregate aggregate;
+        memcpy(&aggregate, stored, sizeof(aggregate));
+        if (aggregate.min[channel] < acc->min)
+                acc->min = aggregate.min[channel];
+        if (aggregate.max[channel] > acc->max)
+                acc->max = aggregate.max[channel];
+        acc->sum += aggregate.sum[channel];
+        acc->sumsq += aggregate.sumsq[channel];
+        acc->count += n;
+}
+
+// Aggregate payload once its checksum held, NULL otherwise
+static const uint8_t *_aggregates(const ble_reader *reader, ble_aggregate_header *header)
+{
+        const ble_block_header *block = reader->aggregate;
+        if (block == NULL || !ble_record_block_valid(block, (const uint8_t*)(block + 1)))
+                return NULL;
+        memcpy(header, block + 1, sizeof(*header));
+        return (const uint8_t*)(block + 1) + sizeof(*header);
+}
+
+int ble_query_range(const ble_reader    *reader,
+                    int64_t             t_begin,
+                    int64_t             t_end,
+                    int                 channel,
+                    ble_stats           *stats,
+                    ble_sketch          *sketch)
+{
+        query_acc acc = { .min = UINT16_MAX };
+        ble_aggregate_header header;
+        const uint8_t *aggregates = _aggregates(reader, &header);
+        const uint8_t *sketches = NULL;
+        ble_frames *frames = NULL;
+        uint32_t first, end, inner_first, inner_end;
+
+        if (channel != BLE_SUMMARY_RED && channel != BLE_SUMMARY_IR)
+                return -1;
+        if (aggregates != NULL)
+                sketches = aggregates + (size_t)header.blocks * sizeof(ble_block_aggregate);
+
+        // [first, end) touches the window, [inner_first, inner_end) lies inside it
+        first = ble_reader_seek(reader, t_begin);
+        for (end = first; end < reader->blocks && reader->index[end].t_first <= t_end; end++)
+                ;
+        inner_first = first;
+        inner_end = end;
+        if (inner_first < inner_end && reader->index[inner_first].t_first < t_begin)
+                inner_first++;
+        if (inner_end > inner_first && reader->index[inner_end - 1].t_last > t_end)
+                inner_end--;
+
+        for (uint32_t i = first; i < end; i++)
+        {
+                const ble_index_entry *entry = &reader->index[i];
+                int inside = i >= inner_first && i < inner_end;
+                int sketched = 0;
+
+                if (sketch != NULL && aggregates != NULL && inside)
+                {
+                        uint32_t span_first = i - i % header.sketch_blocks;
+                        uint32_t span_end = span_first + header.sketch_blocks;
+                        if (span_end > reader->blocks)
+                                span_end = reader->blocks;
+                        sketched = span_first >= inner_first && span_end <= inner_end;
+                        if (sketched && i == span_first)
+                                _sketch_merge_stored(sketch, sketches +
+                                        (size_t)(i / header.sketch_blocks) * sizeof(ble_sketch_bins) +
+                                        (size_t)channel * BLE_SKETCH_BINS * sizeof(uint16_t));
+                }
+
+                if (inside && aggregates != NULL && (sketch == NULL || sketched))
+                {
+                        _acc_block(&acc, aggregates + (size_t)i * sizeof(ble_block_aggregate), channel,
+                                   (uint64_t)entry->count * PACKAGE_SAMPLES);
+                        continue;
+                }
+
+                if (frames == NULL && (frames = malloc(sizeof(*frames))) == NULL)
+                        return -1;
+                if (ble_reader_block(reader, i, frames) != 0)
+                        continue;
+
+                uint32_t lo = 0, hi = frames->count;
+                while (lo < hi && frames->times[lo] < t_begin)
+                        lo++;
+                while (hi > lo && frames->times[hi - 1] > t_end)
+                        hi--;
+                const uint16_t *samples = (channel == BLE_SUMMARY_RED ? frames->red : frames->ir) +
+                                          (size_t)lo * PACKAGE_SAMPLES;
+                size_t n = (size_t)(hi - lo) * PACKAGE_SAMPLES;
+                _acc_samples(&acc, samples, n);
+                if (sketch != NULL)
+                        ble_sketch_add(sketch, samples, n);
+        }
+        free(frames);
+
+        memset(stats, 0, sizeof(*stats));
+        stats->count = acc.count;
+        if (acc.count > 0)
+        {
+                double mean = (double)acc.sum / acc.count;
+                stats->min = acc.min;
+                stats->max = acc.max;
+                stats->mean = mean;
+                stats->variance = (double)acc.sumsq / acc.count - mean * mean;
+                if (stats->variance < 0)
+                        stats->variance = 0;
+        }
+        return 0;
+}
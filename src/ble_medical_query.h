@@ -0,0 +1,44 @@
+#ifndef BLE_MEDICAL_QUERY_H
+#define BLE_MEDICAL_QUERY_H
+
+#include "ble_medical_reader.h"
+
+/*
+ * Statistics of one sample stream over a time window.
+ *
+ * Frame blocks lying wholly inside the window are taken from the
+ * recording's aggregate block; only the blocks cut by the window edges are
+ * decoded. Percentiles come from histogram sketches, which merge by adding
+ * bins: whole sketch spans inside the window are merged as stored, the
+ * frame blocks of the two partial spans are decoded. Recordings without
+ * aggregates (unfinalized, recovered) are answered by decoding the window.
+ *
+ * A frame belongs to the window when its receive time is in
+ * [t_begin, t_end]; all its samples share that time.
+ */
+
+typedef struct _ble_stats {
+        uint64_t        count;
+        uint16_t        min;
+        uint16_t        max;
+        double          mean;
+        double          variance;
+} ble_stats;
+
+typedef struct _ble_sketch {
+        uint64_t        total;
+        uint64_t        bins[BLE_SKETCH_BINS];
+} ble_sketch;
+
+void ble_sketch_init(ble_sketch*);
+void ble_sketch_add(ble_sketch*, const uint16_t *samples, size_t n);
+void ble_sketch_merge(ble_sketch*, const ble_sketch*);
+// Accurate to a bin width, 1 << BLE_SKETCH_SHIFT. NaN when empty.
+double ble_sketch_quantile(const ble_sketch*, double q);
+
+// `channel` is BLE_SUMMARY_RED or BLE_SUMMARY_IR; `sketch` may be NULL when
+// no percentile is needed, which spares decoding the edge sketch spans.
+int ble_query_range(const ble_reader*, int64_t t_begin, int64_t t_end, int channel,
+                    ble_stats*, ble_sketch*);
+
+#endif
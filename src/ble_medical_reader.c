@@ -0,0 +1,344 @@
+#include "ble_medical_reader.h"
+#include "ble_medical_crc.h"
+
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+static const ble_block_header *_block_at(const ble_reader *reader, uint64_t offset)
+{
+        if (offset < BLE_RECORD_HEADER_SIZE || offset + sizeof(ble_block_header) > reader->size)
+                return NULL;
+        const ble_block_header *block = (const ble_block_header*)(reader->map + offset);
+        if (block->magic != BLE_RECORD_BLOCK_MAGIC ||
+            block->length > reader->size - offset - sizeof(*block))
+                return NULL;
+        return block;
+}
+
+static int _load_persisted_index(ble_reader *reader)
+{
+        const ble_block_header *block = _block_at(reader, reader->header.index_offset);
+        if (block == NULL || block->type != BLE_BLOCK_INDEX ||
+            block->length % sizeof(ble_index_entry) != 0)
+                return -1;
+        const uint8_t *payload = (const uint8_t*)(block + 1);
+        if (!ble_record_block_valid(block, payload))
+                return -1;
+
+        reader->blocks = block->length / sizeof(ble_index_entry);
+        reader->owned_index = malloc(block->length ? block->length : 1);
+        if (reader->owned_index == NULL)
+                return -1;
+        memcpy(reader->owned_index, payload, block->length);
+        reader->index_persisted = true;
+        return 0;
+}
+
+// Walks block headers only; payload checksums are verified on decode
+static int _rebuild_index(ble_reader *reader)
+{
+        uint32_t cap = 256;
+        uint64_t offset = BLE_RECORD_HEADER_SIZE, frame = 0;
+        const ble_block_header *block;
+
+        reader->blocks = 0;
+        reader->owned_index = malloc(cap * sizeof(ble_index_entry));
+        if (reader->owned_index == NULL)
+                return -1;
+
+        while ((block = _block_at(reader, offset)) != NULL)
+        {
+                if (block->type == BLE_BLOCK_FRAMES)
+                {
+                        if (reader->blocks == cap)
+                        {
+                                cap *= 2;
+                                ble_index_entry *index = realloc(reader->owned_index, cap * sizeof(*index));
+                                if (index == NULL)
+                                        return -1;
+                                reader->owned_index = index;
+                        }
+                        reader->owned_index[reader->blocks++] = (ble_index_entry) {
+                                .offset  = offset,
+                                .t_first = block->t_first,
+                                .t_last  = block->t_last,
+                                .frame   = frame,
+                                .count   = block->count,
+                        };
+                        frame += block->count;
+                }
+                offset += sizeof(*block) + block->length;
+        }
+        return 0;
+}
+
+// Only the layout is checked here; levels are verified as they are read
+static void _load_summary(ble_reader *reader)
+{
+        const ble_block_header *block = _block_at(reader, reader->header.summary_offset);
+        ble_summary_header header;
+        uint64_t entries = 0;
+
+        if (block == NULL || block->type != BLE_BLOCK_SUMMARY || block->length < sizeof(header))
+                return;
+        memcpy(&header, block + 1, sizeof(header));
+        if (header.levels == 0 || header.levels > BLE_SUMMARY_MAX_LEVELS || header.shift >= 32)
+                return;
+        for (uint32_t level = 0; level < header.levels; level++)
+                entries += header.count[level];
+        if (sizeof(header) + entries * sizeof(ble_summary_entry) != block->length)
+                return;
+
+        reader->summary = (const uint8_t*)(block + 1) + sizeof(header);
+        reader->summary_header = header;
+}
+
+// Kept only when it matches the index; its checksum is left to queries
+static void _load_aggregate(ble_reader *reader)
+{
+        const ble_block_header *block = _block_at(reader, reader->header.aggregate_offset);
+        ble_aggregate_header header;
+
+        if (block == NULL || block->type != BLE_BLOCK_AGGREGATE || block->length < sizeof(header))
+                return;
+        memcpy(&header, block + 1, sizeof(header));
+        if (header.blocks != reader->blocks || header.bins != BLE_SKETCH_BINS ||
+            header.sketch_blocks == 0 ||
+            header.sketches != (header.blocks + header.sketch_blocks - 1) / header.sketch_blocks ||
+            block->length != sizeof(header) + (uint64_t)header.blocks * sizeof(ble_block_aggregate) +
+                             (uint64_t)header.sketches * sizeof(ble_sketch_bins))
+                return;
+        reader->aggregate = block;
+}
+
+ble_reader *ble_reader_open(const char *path)
+{
+        struct stat st;
+        ble_reader *reader = calloc(1, sizeof(*reader));
+        if (reader == NULL)
+                return NULL;
+
+        reader->fd = open(path, O_RDONLY | O_CLOEXEC);
+        if (reader->fd < 0 || fstat(reader->fd, &st) != 0 || st.st_size < BLE_RECORD_HEADER_SIZE)
+                goto FAIL;
+        reader->size = (size_t)st.st_size;
+        reader->map = mmap(NULL, reader->size, PROT_READ, MAP_SHARED, reader->fd, 0);
+        if (reader->map == MAP_FAILED)
+        {
+                reader->map = NULL;
+                goto FAIL;
+        }
+
+        memcpy(&reader->header, reader->map, sizeof(reader->header));
+        if (!ble_record_header_valid(&reader->header))
+                goto FAIL;
+
+        if (((reader->header.flags & BLE_RECORD_FINALIZED) == 0 || _load_persisted_index(reader) != 0) &&
+            _rebuild_index(reader) != 0)
+                goto FAIL;
+        reader->index = reader->owned_index;
+        if (reader->blocks > 0)
+                reader->frames = reader->index[reader->blocks - 1].frame + reader->index[reader->blocks - 1].count;
+        if (reader->header.flags & BLE_RECORD_FINALIZED)
+        {
+                _load_summary(reader);
+                _load_aggregate(reader);
+        }
+        return reader;
+
+FAIL:
+        ble_reader_close(reader);
+        return NULL;
+}
+
+void ble_reader_close(ble_reader *reader)
+{
+        if (reader == NULL)
+                return;
+        if (reader->map != NULL)
+                munmap((void*)reader->map, reader->size);
+        if (reader->fd >= 0)
+                close(reader->fd);
+        free(reader->owned_index);
+        free(reader);
+}
+
+// Index of the first block ending at or after `time`, `blocks` if none does
+uint32_t ble_reader_seek(const ble_reader *reader, int64_t time)
+{
+        uint32_t low = 0, high = reader->blocks;
+        while (low < high)
+        {
+                uint32_t mid = low + (high - low) / 2;
+                if (reader->index[mid].t_last < time)
+                        low = mid + 1;
+                else
+                        high = mid;
+        }
+        return low;
+}
+
+int ble_reader_block(const ble_reader *reader, uint32_t i, ble_frames *frames)
+{
+        if (i >= reader->blocks)
+                return -1;
+        const ble_block_header *block = _block_at(reader, reader->index[i].offset);
+        if (block == NULL)
+                return -1;
+        const uint8_t *payload = (const uint8_t*)(block + 1);
+        if (!ble_record_block_valid(block, payload))
+                return -1;
+        return ble_record_decode_block(block, payload, frames);
+}
+
+// Reads the recording's thumbnail block, or outlines the IR channel from the
+// frame blocks when the file has none (recovered or appended to later).
+int ble_reader_thumbnail(const ble_reader *reader, ble_thumbnail *thumbnail)
+{
+        const ble_block_header *block = _block_at(reader, reader->header.thumbnail_offset);
+        if (block != NULL && block->type == BLE_BLOCK_THUMBNAIL &&
+            block->length == sizeof(*thumbnail) &&
+            ble_record_block_valid(block, (const uint8_t*)(block + 1)))
+        {
+                memcpy(thumbnail, block + 1, sizeof(*thumbnail));
+                if (thumbnail->count <= BLE_THUMBNAIL_POINTS)
+                        return 0;
+        }
+
+        ble_thumbnail_init(thumbnail);
+        return ble_reader_thumbnail_extend(reader, 0, thumbnail) < 0 ? -1 : 0;
+}
+
+// Adds the IR samples of frame blocks `first` onwards to `thumbnail`, which
+// outlines the blocks before. Returns how many blocks are taken in for good:
+// damaged ones at the end may be a block still being written and are left
+// for the next call.
+int64_t ble_reader_thumbnail_extend(const ble_reader *reader, uint32_t first, ble_thumbnail *thumbnail)
+{
+        ble_frames *frames = malloc(sizeof(*frames));
+        uint32_t done = first;
+
+        if (frames == NULL)
+                return -1;
+        for (uint32_t i = first; i < reader->blocks; i++)
+        {
+                if (ble_reader_block(reader, i, frames) != 0)
+                        continue;
+                ble_thumbnail_add(thumbnail, frames->ir, (size_t)frames->count * PACKAGE_SAMPLES);
+                done = i + 1;
+        }
+        free(frames);
+        return done;
+}
+
+// Ordinal, per channel, of the first sample of the block holding `time`
+uint64_t ble_reader_sample_at(const ble_reader *reader, int64_t time)
+{
+        uint32_t block = ble_reader_seek(reader, time);
+        if (block == reader->blocks)
+                return reader->frames * PACKAGE_SAMPLES;
+        return reader->index[block].frame * PACKAGE_SAMPLES;
+}
+
+// Coarsest summary level still giving `points` entries over `samples`
+// samples, -1 when there is no summary or the raw samples are needed.
+int ble_reader_summary_level(const ble_reader *reader, uint64_t samples, uint32_t points)
+{
+        const ble_summary_header *header = &reader->summary_header;
+        int level = -1;
+
+        if (reader->summary == NULL || points == 0)
+                return -1;
+        for (uint32_t l = 0; l < header->levels && header->shift + l < 64; l++)
+        {
+                if ((samples >> (header->shift + l)) < points)
+                        break;
+                level = (int)l;
+        }
+        return level;
+}
+
+// Copies the entries of `level` covering [first_sample, first_sample +
+// samples). Returns how many, 0 when the level is missing or damaged.
+size_t ble_reader_summary_read(const ble_reader *reader, uint32_t level, uint64_t first_sample,
+                               uint64_t samples, ble_summary_entry *out, size_t max)
+{
+        const ble_summary_header *header = &reader->summary_header;
+        const uint8_t *entries = reader->summary;
+
+        if (entries == NULL || level >= header->levels || samples == 0)
+                return 0;
+        for (uint32_t l = 0; l < level; l++)
+                entries += (size_t)header->count[l] * sizeof(ble_summary_entry);
+
+        uint32_t count = header->count[level];
+        if (ble_crc32c(0, entries, (size_t)count * sizeof(ble_summary_entry)) != header->crc[level])
+                return 0;
+
+        uint32_t shift = header->shift + level;
+        uint64_t first = first_sample >> shift, last = (first_sample + samples - 1) >> shift;
+        if (first >= count)
+                return 0;
+        if (last >= count)
+                last = count - 1;
+        size_t n = last - first + 1 < max ? (size_t)(last - first + 1) : max;
+        memcpy(out, entries + first * sizeof(ble_summary_entry), n * sizeof(ble_summary_entry));
+        return n;
+}
+
+int64_t ble_reader_time_from_real(const ble_reader *reader, int64_t real_time)
+{
+        return real_time - reader->header.origin_real + reader->header.origin_mono;
+}
+
+int64_t ble_reader_time_to_real(const ble_reader *reader, int64_t time)
+{
+        return time - reader->header.origin_mono + reader->header.origin_real;
+}
+
+void ble_range_init(ble_range *range, const ble_reader *reader, int64_t t_begin, int64_t t_end)
+{
+        range->reader = reader;
+        range->t_begin = t_begin;
+        range->t_end = t_end;
+        range->block = ble_reader_seek(reader, t_begin);
+}
+
+// Fills `view` with the next run of frames inside the range. Returns false
+// once the range is exhausted; damaged blocks are skipped.
+int ble_range_next(ble_range *range, ble_view *view)
+{
+        const ble_reader *reader = range->reader;
+        ble_frames *frames = &range->frames;
+
+        while (range->block < reader->blocks &&
+               reader->index[range->block].t_first <= range->t_end)
+        {
+                uint32_t i = range->block++;
+                if (ble_reader_block(reader, i, frames) != 0)
+                        continue;
+
+                uint32_t first = 0, last = frames->count;
+                while (first < last && frames->times[first] < range->t_begin)
+                        first++;
+                while (last > first && frames->times[last - 1] > range->t_end)
+                        last--;
+                if (first == last)
+                        continue;
+
+                view->count = last - first;
+                view->frame = reader->index[i].frame + first;
+                view->times = frames->times + first;
+                view->t1 = frames->t1 + first;
+                view->t2 = frames->t2 + first;
+                view->beat = frames->beat + first;
+                view->red = frames->red + (size_t)first * PACKAGE_SAMPLES;
+                view->ir = frames->ir + (size_t)first * PACKAGE_SAMPLES;
+                return true;
+        }
+        return false;
+}
@@ -0,0 +1,73 @@
+#ifndef BLE_MEDICAL_READER_H
+#define BLE_MEDICAL_READER_H
+
+#include "ble_medical_record.h"
+
+/*
+ * Read-only access to a recording through mmap().
+ *
+ * The block index comes from the recording's index block when it has one,
+ * otherwise it is rebuilt by walking block headers (unfinalized or recovered
+ * files). Seeking is a binary search over it; a range is then read one block
+ * at a time, decoding only the blocks the range touches.
+ *
+ * Overviews come from the summary pyramid of finalized recordings: pick the
+ * level for the pixel budget, then read just that level. Each level has its
+ * own checksum, so a zoomed-out view never pages in the finer ones.
+ *
+ * Views point into the iterator's decoded block and stay valid until the
+ * next ble_range_next() call. A reader may be shared by several iterators,
+ * including from different threads.
+ */
+
+typedef struct _ble_reader {
+        int                     fd;
+        const uint8_t           *map;
+        size_t                  size;
+        ble_record_header       header;
+        const ble_index_entry   *index;
+        ble_index_entry         *owned_index;
+        uint32_t                blocks;
+        uint64_t                frames;
+        int                     index_persisted;
+        const uint8_t           *summary;       // level 0 entries, NULL if none
+        ble_summary_header      summary_header;
+        const ble_block_header  *aggregate;     // BLE_BLOCK_AGGREGATE, NULL if none
+} ble_reader;
+
+typedef struct _ble_view {
+        uint32_t                count;          // frames in the view
+        uint64_t                frame;          // ordinal of the first one
+        const int64_t           *times;
+        const uint8_t           *t1;
+        const uint8_t           *t2;
+        const int32_t           *beat;
+        const uint16_t          *red;           // count * PACKAGE_SAMPLES
+        const uint16_t          *ir;
+} ble_view;
+
+typedef struct _ble_range {
+        const ble_reader        *reader;
+        int64_t                 t_begin;
+        int64_t                 t_end;
+        uint32_t                block;
+        ble_frames              frames;
+} ble_range;
+
+ble_reader *ble_reader_open(const char *path);
+void ble_reader_close(ble_reader*);
+uint32_t ble_reader_seek(const ble_reader*, int64_t time);
+int ble_reader_block(const ble_reader*, uint32_t block, ble_frames*);
+int ble_reader_thumbnail(const ble_reader*, ble_thumbnail*);
+int64_t ble_reader_thumbnail_extend(const ble_reader*, uint32_t first, ble_thumbnail*);
+uint64_t ble_reader_sample_at(const ble_reader*, int64_t time);
+int ble_reader_summary_level(const ble_reader*, uint64_t samples, uint32_t points);
+size_t ble_reader_summary_read(const ble_reader*, uint32_t level, uint64_t first_sample,
+                               uint64_t samples, ble_summary_entry *out, size_t max);
+int64_t ble_reader_time_from_real(const ble_reader*, int64_t real_time);
+int64_t ble_reader_time_to_real(const ble_reader*, int64_t time);
+
+void ble_range_init(ble_range*, const ble_reader*, int64_t t_begin, int64_t t_end);
+int ble_range_next(ble_range*, ble_view*);
+
+#endif
@@ -0,0 +1,1262 @@
+#include "ble_medical_record.h"
+#include "ble_medical_crc.h"
+#include "ble_medical_codec.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <libgen.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+static const uint8_t unknown_boot[16];
+
+static int64_t _clock_us(clockid_t clock)
+{
+        struct timespec ts;
+        clock_gettime(clock, &ts);
+        return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static char *_journal_path(const char *path)
+{
+        size_t len = strlen(path);
+        char *jpath = malloc(len + sizeof(BLE_RECORD_JOURNAL_SUFFIX));
+        if (jpath == NULL)
+                return NULL;
+        memcpy(jpath, path, len);
+        memcpy(jpath + len, BLE_RECORD_JOURNAL_SUFFIX, sizeof(BLE_RECORD_JOURNAL_SUFFIX));
+        return jpath;
+}
+
+// Identifies the kernel boot, and with it the monotonic clock; zeros when
+// the kernel does not tell
+static void _boot_id(uint8_t id[16])
+{
+        char text[64];
+        size_t digits = 0;
+        FILE *file = fopen("/proc/sys/kernel/random/boot_id", "re");
+
+        memset(id, 0, 16);
+        if (file == NULL)
+                return;
+        if (fgets(text, sizeof(text), file) != NULL)
+        {
+                for (const char *p = text; *p != '\0' && digits < 32; p++)
+                {
+                        int v = *p >= '0' && *p <= '9' ? *p - '0' :
+                                *p >= 'a' && *p <= 'f' ? *p - 'a' + 10 : -1;
+                        if (v < 0)
+                                continue;
+                        id[digits / 2] |= (uint8_t)(digits % 2 ? v : v << 4);
+                        digits++;
+                }
+        }
+        fclose(file);
+        if (digits != 32)
+                memset(id, 0, 16);
+}
+
+static uint64_t _nonce(void)
+{
+        uint64_t nonce;
+        if (getentropy(&nonce, sizeof(nonce)) == 0)
+                return nonce;
+        return (uint64_t)_clock_us(CLOCK_REALTIME) ^ ((uint64_t)getpid() << 32) ^
+               (uint64_t)_clock_us(CLOCK_MONOTONIC) * 0x9e3779b97f4a7c15u;
+}
+
+// Makes a rename or a creation in the directory of `path` durable
+static int _sync_dir(const char *path)
+{
+        char *copy = strdup(path);
+        if (copy == NULL)
+                return -1;
+        int fd = open(dirname(copy), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        free(copy);
+        if (fd < 0)
+                return -1;
+        int res = fsync(fd);
+        close(fd);
+        return res;
+}
+
+static int _pread_full(int fd, void *buf, size_t len, uint64_t offset)
+{
+        uint8_t *p = buf;
+        while (len > 0)
+        {
+                ssize_t n = pread(fd, p, len, (off_t)offset);
+                if (n < 0 && errno == EINTR)
+                        continue;
+                if (n <= 0)
+                        return -1;
+                p += n;
+                len -= (size_t)n;
+                offset += (uint64_t)n;
+        }
+        return 0;
+}
+
+static int _pwrite_full(int fd, const void *buf, size_t len, uint64_t offset)
+{
+        const uint8_t *p = buf;
+        while (len > 0)
+        {
+                ssize_t n = pwrite(fd, p, len, (off_t)offset);
+                if (n < 0 && errno == EINTR)
+                        continue;
+                if (n <= 0)
+                        return -1;
+                p += n;
+                len -= (size_t)n;
+                offset += (uint64_t)n;
+        }
+        return 0;
+}
+
+int ble_record_header_valid(const ble_record_header *header)
+{
+        if (memcmp(header->magic, BLE_RECORD_MAGIC, sizeof(header->magic)) != 0)
+                return false;
+        return ble_crc32c(0, header, offsetof(ble_record_header, crc)) == header->crc;
+}
+
+// Reads nothing but the fixed header; enough for catalogs and file lists
+int ble_record_read_header(const char *path, ble_record_header *header)
+{
+        int fd = open(path, O_RDONLY | O_CLOEXEC);
+        if (fd < 0)
+                return -1;
+        int res = _pread_full(fd, header, sizeof(*header), 0);
+        close(fd);
+        if (res != 0 || !ble_record_header_valid(header))
+                return -1;
+        return 0;
+}
+
+static uint32_t _block_crc(const ble_block_header *block, const uint8_t *payload)
+{
+        ble_block_header tmp = *block;
+        tmp.crc = 0;
+        uint32_t crc = ble_crc32c(0, &tmp, sizeof(tmp));
+        return ble_crc32c(crc, payload, block->length);
+}
+
+int ble_record_block_valid(const ble_block_header *block, const uint8_t *payload)
+{
+        if (block->magic != BLE_RECORD_BLOCK_MAGIC || block->length > BLE_RECORD_MAX_PAYLOAD)
+                return false;
+        return _block_crc(block, payload) == block->crc;
+}
+
+static int _journal_read(const char *path, ble_journal_entry *entry)
+{
+        char *jpath = _journal_path(path);
+        if (jpath == NULL)
+                return -1;
+        int fd = open(jpath, O_RDONLY | O_CLOEXEC);
+        free(jpath);
+        if (fd < 0)
+                return -1;
+        int res = _pread_full(fd, entry, sizeof(*entry), 0);
+        close(fd);
+        if (res != 0 || entry->magic != BLE_RECORD_JOURNAL_MAGIC)
+                return -1;
+        if (ble_crc32c(0, entry, offsetof(ble_journal_entry, crc)) != entry->crc)
+                return -1;
+        return 0;
+}
+
+// The checkpoint only moves once the entry itself is durable, so a crash
+// leaves either the previous entry or this one
+static int _journal_write(ble_record *record)
+{
+        if (record->journal_fd < 0)
+                return 0;
+        ble_journal_entry entry = {
+                .magic  = BLE_RECORD_JOURNAL_MAGIC,
+                .seq    = record->seq,
+                .offset = record->offset,
+                .frames = record->frames,
+                .nonce  = record->header.nonce,
+                .t_last = record->t_last,
+                .blocks = record->blocks,
+        };
+        entry.crc = ble_crc32c(0, &entry, offsetof(ble_journal_entry, crc));
+        if (_pwrite_full(record->journal_fd, &entry, sizeof(entry), 0) != 0)
+                return -1;
+        return fdatasync(record->journal_fd);
+}
+
+// A journal entry left by another file at this path, or pointing anywhere
+// but at the start of the block it expects, is not to be trusted
+static int _checkpoint_valid(int fd, const ble_record_header *header, const ble_journal_entry *entry,
+                             uint64_t size)
+{
+        ble_block_header block;
+
+        if (entry->nonce != header->nonce ||
+            entry->offset < BLE_RECORD_HEADER_SIZE || entry->offset > size)
+                return false;
+        if (entry->offset == size)
+                return true;
+        // The block there may be torn, but its header must be the one expected
+        if (entry->offset + sizeof(block) > size ||
+            _pread_full(fd, &block, sizeof(block), entry->offset) != 0)
+                return false;
+        return block.magic == BLE_RECORD_BLOCK_MAGIC && block.seq == entry->seq;
+}
+
+static int _write_new_header(int fd, ble_record_header *header)
+{
+        memset(header, 0, sizeof(*header));
+        memcpy(header->magic, BLE_RECORD_MAGIC, sizeof(header->magic));
+        header->version = BLE_RECORD_VERSION;
+        header->channels = BLE_CHANNEL_ALL;
+        header->origin_mono = _clock_us(CLOCK_MONOTONIC);
+        header->origin_real = _clock_us(CLOCK_REALTIME);
+        header->nonce = _nonce();
+        _boot_id(header->boot_id);
+        header->crc = ble_crc32c(0, header, offsetof(ble_record_header, crc));
+
+        if (ftruncate(fd, 0) != 0)
+                return -1;
+        // Made durable by the first checkpoint; a header lost before that
+        // is simply recreated by recovery.
+        return _pwrite_full(fd, header, sizeof(*header), 0);
+}
+
+// Walks blocks from `offset` while they verify. Returns the end of the last
+// good block; counters in `report` are advanced for every block accepted.
+static uint64_t _scan_tail(int fd, uint64_t offset, uint64_t size, uint32_t *seq,
+                           ble_record_recovery *report)
+{
+        uint8_t *payload = NULL;
+        size_t capacity = 0;
+
+        while (offset + sizeof(ble_block_header) <= size)
+        {
+                ble_block_header block;
+                if (_pread_full(fd, &block, sizeof(block), offset) != 0)
+                        break;
+                if (block.magic != BLE_RECORD_BLOCK_MAGIC ||
+                    block.length > BLE_RECORD_MAX_PAYLOAD ||
+                    offset + sizeof(block) + block.length > size)
+                        break;
+                if (block.length > capacity)
+                {
+                        uint8_t *tmp = realloc(payload, block.length);
+                        if (tmp == NULL)
+                                break;
+                        payload = tmp;
+                        capacity = block.length;
+                }
+                if (_pread_full(fd, payload, block.length, offset + sizeof(block)) != 0)
+                        break;
+                if (!ble_record_block_valid(&block, payload))
+                        break;
+
+                offset += sizeof(block) + block.length;
+                report->scanned_bytes += sizeof(block) + block.length;
+                report->tail_blocks++;
+                if (block.type == BLE_BLOCK_FRAMES)
+                {
+                        report->frames += block.count;
+                        report->blocks++;
+                        report->t_last = block.t_last;
+                }
+                *seq = block.seq + 1;
+        }
+        free(payload);
+        return offset;
+}
+
+// Time of the first frame, from the first frame block
+static int64_t _first_time(int fd, uint64_t size)
+{
+        ble_block_header block;
+
+        for (uint64_t offset = BLE_RECORD_HEADER_SIZE; offset + sizeof(block) <= size;
+             offset += sizeof(block) + block.length)
+        {
+                if (_pread_full(fd, &block, sizeof(block), offset) != 0 ||
+                    block.magic != BLE_RECORD_BLOCK_MAGIC)
+                        break;
+                if (block.type == BLE_BLOCK_FRAMES)
+                        return block.t_first;
+        }
+        return 0;
+}
+
+// Whether the monotonic clock the recording was written on has restarted
+static int _clock_restarted(const ble_record_header *header, int64_t t_last)
+{
+        uint8_t boot[16];
+
+        _boot_id(boot);
+        if (memcmp(boot, unknown_boot, sizeof(boot)) != 0 &&
+            memcmp(header->boot_id, unknown_boot, sizeof(boot)) != 0 &&
+            memcmp(boot, header->boot_id, sizeof(boot)) != 0)
+                return true;
+        return _clock_us(CLOCK_MONOTONIC) < t_last;
+}
+
+// Nothing but our own header, torn before the first checkpoint
+static int _torn_header(int fd, uint64_t size)
+{
+        char magic[sizeof(BLE_RECORD_MAGIC) - 1];
+        size_t len = size < sizeof(magic) ? (size_t)size : sizeof(magic);
+
+        if (size > BLE_RECORD_HEADER_SIZE || _pread_full(fd, magic, len, 0) != 0)
+                return false;
+        return memcmp(magic, BLE_RECORD_MAGIC, len) == 0;
+}
+
+static int _recover_fd(int fd, const char *path, uint32_t *seq, ble_record_header *header,
+                       ble_record_recovery *report)
+{
+        struct stat st;
+        ble_journal_entry entry;
+
+        memset(report, 0, sizeof(*report));
+        *seq = 0;
+        if (fstat(fd, &st) != 0)
+                return -1;
+        report->file_size = (uint64_t)st.st_size;
+
+        if (report->file_size < BLE_RECORD_HEADER_SIZE ||
+            _pread_full(fd, header, sizeof(*header), 0) != 0 ||
+            !ble_record_header_valid(header))
+        {
+                // Anything else is left alone: a wrong path must not cost a file
+                if (report->file_size > 0 && !_torn_header(fd, report->file_size))
+                {
+                        errno = EBADMSG;
+                        return -1;
+                }
+                report->created = true;
+                report->truncated_bytes = report->file_size;
+                report->valid_size = BLE_RECORD_HEADER_SIZE;
+                return _write_new_header(fd, header);
+        }
+        if (header->version > BLE_RECORD_VERSION)
+        {
+                errno = ENOTSUP;
+                return -1;
+        }
+
+        uint64_t start = BLE_RECORD_HEADER_SIZE;
+        if (_journal_read(path, &entry) == 0 &&
+            _checkpoint_valid(fd, header, &entry, report->file_size))
+        {
+                start = entry.offset;
+                *seq = entry.seq;
+                report->checkpoint = entry.offset;
+                report->frames = entry.frames;
+                report->blocks = entry.blocks;
+                report->t_last = entry.t_last;
+                report->journal_used = true;
+        }
+
+        uint64_t end = _scan_tail(fd, start, report->file_size, seq, report);
+        report->valid_size = end;
+        report->truncated_bytes = report->file_size - end;
+        if (report->truncated_bytes > 0)
+        {
+                if (ftruncate(fd, (off_t)end) != 0)
+                        return -1;
+                if (fdatasync(fd) != 0)
+                        return -1;
+        }
+        if (report->frames > 0)
+                report->t_first = _first_time(fd, end);
+
+        if (_clock_restarted(header, report->t_last))
+        {
+                // With no frame yet, the file just takes the clocks of this boot
+                if (report->frames == 0)
+                {
+                        report->created = true;
+                        report->truncated_bytes = report->file_size;
+                        report->valid_size = BLE_RECORD_HEADER_SIZE;
+                        *seq = 0;
+                        return _write_new_header(fd, header);
+                }
+                report->clock_restarted = true;
+        }
+        return 0;
+}
+
+int ble_record_recover(const char *path, ble_record_recovery *report)
+{
+        uint32_t seq;
+        ble_record_header header;
+        int fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+        if (fd < 0)
+                return -1;
+        int res = _recover_fd(fd, path, &seq, &header, report);
+        close(fd);
+        return res;
+}
+
+ble_record *ble_record_open(const char *path, ble_record_recovery *report)
+{
+        ble_record_recovery _report;
+        ble_record *record = calloc(1, sizeof(*record));
+        if (record == NULL)
+                return NULL;
+        if (report == NULL)
+                report = &_report;
+        record->fd = -1;
+        record->journal_fd = -1;
+
+        record->path = strdup(path);
+        char *jpath = _journal_path(path);
+        if (record->path == NULL || jpath == NULL)
+                goto FAIL;
+
+        record->fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+        if (record->fd < 0)
+                goto FAIL;
+        if (_recover_fd(record->fd, path, &record->seq, &record->header, report) != 0)
+                goto FAIL;
+
+        record->journal_fd = open(jpath, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+        if (record->journal_fd < 0)
+                goto FAIL;
+        free(jpath);
+
+        record->offset = report->valid_size;
+        record->frames = report->frames;
+        record->blocks = report->blocks;
+        record->t_first = report->t_first;
+        record->t_last = report->t_last;
+        ble_thumbnail_init(&record->thumbnail);
+        record->whole = record->frames == 0;
+
+        // Appending reopens a finalized segment: its index would go stale
+        if (record->header.flags & BLE_RECORD_FINALIZED)
+        {
+                record->header.flags &= ~BLE_RECORD_FINALIZED;
+                record->header.index_offset = 0;
+                record->header.thumbnail_offset = 0;
+                record->header.summary_offset = 0;
+                record->header.aggregate_offset = 0;
+                record->header.crc = ble_crc32c(0, &record->header, offsetof(ble_record_header, crc));
+                if (_pwrite_full(record->fd, &record->header, sizeof(record->header), 0) != 0)
+                        goto FAIL_OPENED;
+        }
+        if (_journal_write(record) != 0)
+                goto FAIL_OPENED;
+        return record;
+
+FAIL:
+        free(jpath);
+        if (record->fd >= 0)
+                close(record->fd);
+        free(record->path);
+        free(record);
+        return NULL;
+FAIL_OPENED:
+        ble_record_close(record);
+        return NULL;
+}
+
+int ble_record_append(ble_record *record, ble_time_t time, const uint8_t *frame)
+{
+        // A block whose write failed is retried before taking more frames
+        if (record->count == BLE_RECORD_BLOCK_FRAMES && ble_record_flush(record) != 0)
+                return -1;
+        if (record->failed)
+        {
+                errno = EIO;
+                return -1;
+        }
+        if (record->frames == 0 && record->count == 0)
+                record->t_first = time;
+        record->t_last = time;
+        record->times[record->count] = time;
+        memcpy(record->data[record->count], frame, PACKAGE_SIZE);
+        if (record->whole)
+        {
+                uint16_t red[PACKAGE_SAMPLES], ir[PACKAGE_SAMPLES];
+                memcpy(red, frame + 2, sizeof(red));
+                memcpy(ir, frame + 22, sizeof(ir));
+                ble_thumbnail_add(&record->thumbnail, ir, PACKAGE_SAMPLES);
+                ble_summary_add(&record->summary, red, ir, PACKAGE_SAMPLES);
+                ble_aggregate_add(&record->aggregate, red, ir, PACKAGE_SAMPLES);
+        }
+        if (++record->count < BLE_RECORD_BLOCK_FRAMES)
+                return 0;
+        if (ble_record_flush(record) != 0)
+                return -1;
+        if (record->unsynced >= BLE_RECORD_SYNC_BLOCKS)
+                return ble_record_sync(record);
+        return 0;
+}
+
+#define BLE_RECORD_BLOCK_SAMPLES (BLE_RECORD_BLOCK_FRAMES * PACKAGE_SAMPLES)
+#define BLE_RECORD_MAX_FRAME_PAYLOAD (BLE_RECORD_BLOCK_FRAMES * (10 + 2 + 5) + \
+        2 * ((BLE_RECORD_BLOCK_SAMPLES + BLE_CODEC_GROUP - 1) / BLE_CODEC_GROUP) * \
+        (BLE_CODEC_GROUP_HEADER + 2 * BLE_CODEC_GROUP))
+
+static_assert(BLE_RECORD_MAX_FRAME_PAYLOAD >= BLE_RECORD_BLOCK_FRAMES * (sizeof(int64_t) + PACKAGE_SIZE),
+              "raw frames must fit the block buffer");
+
+static uint8_t *_put_varint(uint8_t *p, uint64_t v)
+{
+        while (v >= 0x80)
+        {
+                *p++ = (uint8_t)(v | 0x80);
+                v >>= 7;
+        }
+        *p++ = (uint8_t)v;
+        return p;
+}
+
+static const uint8_t *_get_varint(const uint8_t *p, const uint8_t *end, uint64_t *v)
+{
+        uint64_t result = 0;
+        for (int shift = 0; p < end && shift < 64; shift += 7)
+        {
+                uint8_t byte = *p++;
+                result |= (uint64_t)(byte & 0x7f) << shift;
+                if ((byte & 0x80) == 0)
+                {
+                        *v = result;
+                        return p;
+                }
+        }
+        return NULL;
+}
+
+static inline uint64_t _zigzag64(int64_t v)
+{
+        return ((uint64_t)v << 1) ^ (uint64_t)(v >> 63);
+}
+
+static inline int64_t _unzigzag64(uint64_t v)
+{
+        return (int64_t)(v >> 1) ^ -(int64_t)(v & 1);
+}
+
+static size_t _encode_frames(const ble_record *record, uint8_t *out)
+{
+        uint16_t red[BLE_RECORD_BLOCK_SAMPLES], ir[BLE_RECORD_BLOCK_SAMPLES];
+        uint32_t count = record->count;
+        uint8_t *p = out;
+        int32_t beat_prev = 0;
+
+        for (uint32_t i = 1; i < count; i++)
+                p = _put_varint(p, _zigzag64(record->times[i] - record->times[i - 1]));
+        for (uint32_t i = 0; i < count; i++)
+                *p++ = record->data[i][0];
+        for (uint32_t i = 0; i < count; i++)
+                *p++ = record->data[i][1];
+        for (uint32_t i = 0; i < count; i++)
+        {
+                int32_t beat;
+                memcpy(&beat, record->data[i] + 42, sizeof(beat));
+                p = _put_varint(p, _zigzag64((int64_t)beat - beat_prev));
+                beat_prev = beat;
+        }
+        for (uint32_t i = 0; i < count; i++)
+        {
+                memcpy(red + i * PACKAGE_SAMPLES, record->data[i] + 2, sizeof(uint16_t) * PACKAGE_SAMPLES);
+                memcpy(ir + i * PACKAGE_SAMPLES, record->data[i] + 22, sizeof(uint16_t) * PACKAGE_SAMPLES);
+        }
+        p += ble_codec_encode(red, (size_t)count * PACKAGE_SAMPLES, p);
+        p += ble_codec_encode(ir, (size_t)count * PACKAGE_SAMPLES, p);
+        return (size_t)(p - out);
+}
+
+static int _decode_encoded(const ble_block_header *block, const uint8_t *p, ble_frames *frames)
+{
+        const uint8_t *end = p + block->length;
+        uint32_t count = block->count;
+        size_t samples = (size_t)count * PACKAGE_SAMPLES;
+        uint64_t v;
+        int64_t beat = 0;
+
+        frames->times[0] = block->t_first;
+        for (uint32_t i = 1; i < count; i++)
+        {
+                if ((p = _get_varint(p, end, &v)) == NULL)
+                        return -1;
+                frames->times[i] = frames->times[i - 1] + _unzigzag64(v);
+        }
+        if ((size_t)(end - p) < 2 * (size_t)count)
+                return -1;
+        memcpy(frames->t1, p, count);
+        memcpy(frames->t2, p + count, count);
+        p += 2 * count;
+        for (uint32_t i = 0; i < count; i++)
+        {
+                if ((p = _get_varint(p, end, &v)) == NULL)
+                        return -1;
+                beat += _unzigzag64(v);
+                frames->beat[i] = (int32_t)beat;
+        }
+        size_t used = ble_codec_decode(p, (size_t)(end - p), frames->red, samples);
+        if (used == 0)
+                return -1;
+        p += used;
+        if (ble_codec_decode(p, (size_t)(end - p), frames->ir, samples) == 0)
+                return -1;
+        return 0;
+}
+
+// Expands a frame block, raw or encoded, into per-field arrays.
+int ble_record_decode_block(const ble_block_header *block, const uint8_t *payload, ble_frames *frames)
+{
+        uint32_t count = block->count;
+
+        if (block->type != BLE_BLOCK_FRAMES || count == 0 || count > BLE_RECORD_BLOCK_FRAMES)
+                return -1;
+        frames->count = count;
+        if (block->flags & BLE_BLOCK_ENCODED)
+                return _decode_encoded(block, payload, frames);
+
+        if (block->length != count * (sizeof(int64_t) + PACKAGE_SIZE))
+                return -1;
+        memcpy(frames->times, payload, sizeof(int64_t) * count);
+        const uint8_t *data = payload + sizeof(int64_t) * count;
+        for (uint32_t i = 0; i < count; i++, data += PACKAGE_SIZE)
+        {
+                frames->t1[i] = data[0];
+                frames->t2[i] = data[1];
+                memcpy(frames->red + i * PACKAGE_SAMPLES, data + 2, sizeof(uint16_t) * PACKAGE_SAMPLES);
+                memcpy(frames->ir + i * PACKAGE_SAMPLES, data + 22, sizeof(uint16_t) * PACKAGE_SAMPLES);
+                memcpy(&frames->beat[i], data + 42, sizeof(int32_t));
+        }
+        return 0;
+}
+
+// Remembers where the block went for the index written on finalization.
+// Running out of memory only costs the index, never the recording.
+static void _index_add(ble_record *record, const ble_block_header *block)
+{
+        if (record->index_len != record->blocks)
+                return;
+        if (record->index_len == record->index_cap)
+        {
+                uint32_t cap = record->index_cap ? record->index_cap * 2 : 256;
+                ble_index_entry *index = realloc(record->index, cap * sizeof(*index));
+                if (index == NULL)
+                        return;
+                record->index = index;
+                record->index_cap = cap;
+        }
+        record->index[record->index_len++] = (ble_index_entry) {
+                .offset  = record->offset,
+                .t_first = block->t_first,
+                .t_last  = block->t_last,
+                .frame   = record->frames,
+                .count   = block->count,
+        };
+}
+
+// Writes the buffered frames as one block, header and payload in a single
+// pwrite so that a torn write can only ever damage the last block. Frames are
+// stored encoded unless that would not save anything.
+int ble_record_flush(ble_record *record)
+{
+        if (record->failed)
+        {
+                errno = EIO;
+                return -1;
+        }
+        if (record->count == 0)
+                return 0;
+
+        size_t times_len = sizeof(int64_t) * record->count;
+        size_t data_len = (size_t)PACKAGE_SIZE * record->count;
+        uint8_t buf[sizeof(ble_block_header) + BLE_RECORD_MAX_FRAME_PAYLOAD];
+        ble_block_header *block = (ble_block_header*)buf;
+        uint8_t *payload = buf + sizeof(*block);
+        uint16_t flags = BLE_BLOCK_ENCODED;
+
+        size_t length = _encode_frames(record, payload);
+        if (length >= times_len + data_len)
+        {
+                memcpy(payload, record->times, times_len);
+                memcpy(payload + times_len, record->data, data_len);
+                length = times_len + data_len;
+                flags = 0;
+        }
+
+        *block = (ble_block_header) {
+                .magic   = BLE_RECORD_BLOCK_MAGIC,
+                .type    = BLE_BLOCK_FRAMES,
+                .flags   = flags,
+                .seq     = record->seq,
+                .length  = (uint32_t)length,
+                .count   = record->count,
+                .t_first = record->times[0],
+                .t_last  = record->times[record->count - 1],
+        };
+        block->crc = _block_crc(block, payload);
+
+        size_t total = sizeof(*block) + block->length;
+        if (_pwrite_full(record->fd, buf, total, record->offset) != 0)
+                return -1;
+
+        _index_add(record, block);
+        if (record->whole)
+                ble_aggregate_push(&record->aggregate);
+        record->offset += total;
+        record->frames += record->count;
+        record->blocks++;
+        record->seq++;
+        record->unsynced++;
+        record->count = 0;
+        return 0;
+}
+
+// Makes everything written so far durable, then moves the journal checkpoint.
+int ble_record_sync(ble_record *record)
+{
+        int64_t t_begin = _clock_us(CLOCK_MONOTONIC);
+        if (fdatasync(record->fd) != 0)
+                return -1;
+        record->sync_us = _clock_us(CLOCK_MONOTONIC) - t_begin;
+        record->syncs++;
+        record->unsynced = 0;
+        return _journal_write(record);
+}
+
+int ble_record_close(ble_record *record)
+{
+        int res = 0;
+        if (record == NULL)
+                return 0;
+        if (ble_record_flush(record) != 0 || ble_record_sync(record) != 0)
+                res = -1;
+        else if (record->moved && _sync_dir(record->path) != 0)
+                res = -1;
+        if (record->journal_fd >= 0)
+                close(record->journal_fd);
+        close(record->fd);
+        free(record->index);
+        ble_summary_free(&record->summary);
+        ble_aggregate_free(&record->aggregate);
+        free(record->path);
+        free(record);
+        return res;
+}
+
+static void _copy_field(char *dest, size_t size, const char *src)
+{
+        memset(dest, 0, size);
+        if (src != NULL)
+                strncpy(dest, src, size - 1);
+}
+
+// Appends the index block, provided every frame block of the file is known
+static int _write_index(ble_record *record)
+{
+        if (record->blocks == 0 || record->index_len != record->blocks)
+                return 0;
+
+        size_t length = record->index_len * sizeof(ble_index_entry);
+        uint8_t *buf = malloc(sizeof(ble_block_header) + length);
+        if (buf == NULL)
+                return 0;
+        ble_block_header *block = (ble_block_header*)buf;
+        *block = (ble_block_header) {
+                .magic   = BLE_RECORD_BLOCK_MAGIC,
+                .type    = BLE_BLOCK_INDEX,
+                .seq     = record->seq,
+                .length  = (uint32_t)length,
+                .t_first = record->t_first,
+                .t_last  = record->t_last,
+        };
+        memcpy(buf + sizeof(*block), record->index, length);
+        block->crc = _block_crc(block, buf + sizeof(*block));
+
+        int res = _pwrite_full(record->fd, buf, sizeof(*block) + length, record->offset);
+        free(buf);
+        if (res != 0)
+                return -1;
+        record->header.index_offset = record->offset;
+        record->offset += sizeof(*block) + length;
+        record->seq++;
+        return 0;
+}
+
+void ble_thumbnail_init(ble_thumbnail *thumbnail)
+{
+        memset(thumbnail, 0, sizeof(*thumbnail));
+        thumbnail->span = 1;
+}
+
+static void _thumbnail_halve(ble_thumbnail *thumbnail)
+{
+        for (uint32_t i = 0; i < thumbnail->count / 2; i++)
+        {
+                uint16_t min_a = thumbnail->min[2 * i], min_b = thumbnail->min[2 * i + 1];
+                uint16_t max_a = thumbnail->max[2 * i], max_b = thumbnail->max[2 * i + 1];
+                thumbnail->min[i] = min_a < min_b ? min_a : min_b;
+                thumbnail->max[i] = max_a > max_b ? max_a : max_b;
+        }
+        thumbnail->count /= 2;
+        thumbnail->span *= 2;
+        thumbnail->fill = thumbnail->span;
+}
+
+void ble_thumbnail_add(ble_thumbnail *thumbnail, const uint16_t *samples, size_t n)
+{
+        for (size_t i = 0; i < n; i++)
+        {
+                uint16_t s = samples[i];
+                if (thumbnail->count == 0 || thumbnail->fill == thumbnail->span)
+                {
+                        if (thumbnail->count == BLE_THUMBNAIL_POINTS)
+                                _thumbnail_halve(thumbnail);
+                        thumbnail->min[thumbnail->count] = s;
+                        thumbnail->max[thumbnail->count] = s;
+                        thumbnail->count++;
+                        thumbnail->fill = 1;
+                        continue;
+                }
+                uint32_t last = thumbnail->count - 1;
+                if (s < thumbnail->min[last])
+                        thumbnail->min[last] = s;
+                if (s > thumbnail->max[last])
+                        thumbnail->max[last] = s;
+                thumbnail->fill++;
+        }
+}
+
+// Appends a block of `type` carrying `payload`, returning its offset or 0
+static uint64_t _write_block(ble_record *record, uint16_t type, const uint8_t *payload, size_t length)
+{
+        ble_block_header block = {
+                .magic   = BLE_RECORD_BLOCK_MAGIC,
+                .type    = type,
+                .seq     = record->seq,
+                .length  = (uint32_t)length,
+                .t_first = record->t_first,
+                .t_last  = record->t_last,
+        };
+        uint64_t offset = record->offset;
+
+        block.crc = _block_crc(&block, payload);
+        if (_pwrite_full(record->fd, &block, sizeof(block), offset) != 0 ||
+            _pwrite_full(record->fd, payload, length, offset + sizeof(block)) != 0)
+                return 0;
+        record->offset += sizeof(block) + length;
+        record->seq++;
+        return offset;
+}
+
+static int _write_thumbnail(ble_record *record)
+{
+        if (!record->whole || record->thumbnail.count == 0)
+                return 0;
+        uint64_t offset = _write_block(record, BLE_BLOCK_THUMBNAIL, (const uint8_t*)&record->thumbnail,
+                                       sizeof(record->thumbnail));
+        if (offset == 0)
+                return -1;
+        record->header.thumbnail_offset = offset;
+        return 0;
+}
+
+static void _summary_reset(ble_summary_acc *acc)
+{
+        for (int c = 0; c < BLE_SUMMARY_CHANNELS; c++)
+        {
+                acc->min[c] = UINT16_MAX;
+                acc->max[c] = 0;
+                acc->sum[c] = 0;
+        }
+        acc->n = 0;
+}
+
+static void _summary_merge(ble_summary_acc *acc, const ble_summary_acc *other)
+{
+        for (int c = 0; c < BLE_SUMMARY_CHANNELS; c++)
+        {
+                if (other->min[c] < acc->min[c])
+                        acc->min[c] = other->min[c];
+                if (other->max[c] > acc->max[c])
+                        acc->max[c] = other->max[c];
+                acc->sum[c] += other->sum[c];
+        }
+        acc->n += other->n;
+}
+
+static int _summary_push(ble_summary_builder *summary)
+{
+        if (summary->count == summary->cap)
+        {
+                uint32_t cap = summary->cap ? summary->cap * 2 : 1024;
+                ble_summary_acc *base = realloc(summary->base, cap * sizeof(*base));
+                if (base == NULL)
+                        return -1;
+                summary->base = base;
+                summary->cap = cap;
+        }
+        summary->base[summary->count++] = summary->pending;
+        _summary_reset(&summary->pending);
+        return 0;
+}
+
+void ble_summary_add(ble_summary_builder *summary, const uint16_t *red, const uint16_t *ir, size_t n)
+{
+        ble_summary_acc *acc = &summary->pending;
+
+        if (summary->failed)
+                return;
+        if (summary->count == 0 && acc->n == 0)
+                _summary_reset(acc);
+        for (size_t i = 0; i < n; i++)
+        {
+                const uint16_t s[BLE_SUMMARY_CHANNELS] = { red[i], ir[i] };
+                for (int c = 0; c < BLE_SUMMARY_CHANNELS; c++)
+                {
+                        if (s[c] < acc->min[c])
+                                acc->min[c] = s[c];
+                        if (s[c] > acc->max[c])
+                                acc->max[c] = s[c];
+                        acc->sum[c] += s[c];
+                }
+                if (++acc->n == (1u << BLE_SUMMARY_SHIFT) && _summary_push(summary) != 0)
+                        summary->failed = 1;
+        }
+}
+
+void ble_summary_free(ble_summary_builder *summary)
+{
+        free(summary->base);
+        memset(summary, 0, sizeof(*summary));
+}
+
+static ble_summary_entry _summary_entry(const ble_summary_acc *acc)
+{
+        ble_summary_entry entry;
+        for (int c = 0; c < BLE_SUMMARY_CHANNELS; c++)
+        {
+                entry.min[c] = acc->min[c];
+                entry.max[c] = acc->max[c];
+                entry.mean[c] = (uint16_t)((acc->sum[c] + acc->n / 2) / acc->n);
+        }
+        return entry;
+}
+
+// Upper levels are merged in place over a scratch copy of level 0, halving
+// it each time, so building costs two passes over the base.
+uint8_t *ble_summary_build(ble_summary_builder *summary, size_t *length)
+{
+        ble_summary_header header = { .shift = BLE_SUMMARY_SHIFT };
+        uint32_t count = summary->count + (summary->pending.n > 0);
+        uint64_t entries = 0;
+
+        if (summary->failed || count == 0)
+                return NULL;
+        for (uint32_t n = count; ; n = (n + 1) / 2)
+        {
+                if (header.levels == BLE_SUMMARY_MAX_LEVELS)
+                        return NULL;
+                header.count[header.levels++] = n;
+                entries += n;
+                if (n == 1)
+                        break;
+        }
+
+        ble_summary_acc *scratch = malloc(count * sizeof(*scratch));
+        *length = sizeof(header) + entries * sizeof(ble_summary_entry);
+        uint8_t *payload = malloc(*length);
+        if (scratch == NULL || payload == NULL)
+        {
+                free(scratch);
+                free(payload);
+                return NULL;
+        }
+        memcpy(scratch, summary->base, summary->count * sizeof(*scratch));
+        if (summary->pending.n > 0)
+                scratch[summary->count] = summary->pending;
+
+        ble_summary_entry *out = (ble_summary_entry*)(payload + sizeof(header));
+        for (uint32_t level = 0; level < header.levels; level++)
+        {
+                uint32_t n = header.count[level];
+                for (uint32_t i = 0; i < n; i++)
+                        out[i] = _summary_entry(&scratch[i]);
+                header.crc[level] = ble_crc32c(0, out, n * sizeof(*out));
+                out += n;
+                for (uint32_t i = 0; i < n / 2; i++)
+                {
+                        scratch[i] = scratch[2 * i];
+                        _summary_merge(&scratch[i], &scratch[2 * i + 1]);
+                }
+                if (n % 2)
+                        scratch[n / 2] = scratch[n - 1];
+        }
+        header.samples = ((uint64_t)summary->count << BLE_SUMMARY_SHIFT) + summary->pending.n;
+        memcpy(payload, &header, sizeof(header));
+        free(scratch);
+        return payload;
+}
+
+static int _write_summary(ble_record *record)
+{
+        size_t length;
+        if (!record->whole)
+                return 0;
+        uint8_t *payload = ble_summary_build(&record->summary, &length);
+        if (payload == NULL || length > BLE_RECORD_MAX_PAYLOAD)
+        {
+                free(payload);
+                return 0;
+        }
+        uint64_t offset = _write_block(record, BLE_BLOCK_SUMMARY, payload, length);
+        free(payload);
+        if (offset == 0)
+                return -1;
+        record->header.summary_offset = offset;
+        return 0;
+}
+
+static void _aggregate_reset(ble_block_aggregate *aggregate)
+{
+        memset(aggregate, 0, sizeof(*aggregate));
+        for (int c = 0; c < BLE_SUMMARY_CHANNELS; c++)
+                aggregate->min[c] = UINT16_MAX;
+}
+
+// Sketch covering the current frame block, zeroed when first used
+static ble_sketch_bins *_aggregate_sketch(ble_aggregate_builder *aggregate)
+{
+        uint32_t i = aggregate->count / BLE_AGGREGATE_SKETCH_BLOCKS;
+        if (i >= aggregate->sketches_cap)
+        {
+                uint32_t cap = aggregate->sketches_cap ? aggregate->sketches_cap * 2 : 16;
+                ble_sketch_bins *sketches = realloc(aggregate->sketches, cap * sizeof(*sketches));
+                if (sketches == NULL)
+                        return NULL;
+                memset(sketches + aggregate->sketches_cap, 0,
+                       (cap - aggregate->sketches_cap) * sizeof(*sketches));
+                aggregate->sketches = sketches;
+                aggregate->sketches_cap = cap;
+        }
+        return aggregate->sketches + i;
+}
+
+void ble_aggregate_add(ble_aggregate_builder *aggregate, const uint16_t *red, const uint16_t *ir, size_t n)
+{
+        ble_block_aggregate *current = &aggregate->current;
+        const uint16_t *samples[BLE_SUMMARY_CHANNELS] = { red, ir };
+
+        if (aggregate->failed)
+                return;
+        ble_sketch_bins *sketch = _aggregate_sketch(aggregate);
+        if (sketch == NULL)
+        {
+                aggregate->failed = 1;
+                return;
+        }
+        if (aggregate->pending == 0)
+                _aggregate_reset(current);
+        aggregate->pending += n;
+
+        for (int c = 0; c < BLE_SUMMARY_CHANNELS; c++)
+        {
+                for (size_t i = 0; i < n; i++)
+                {
+                        uint16_t s = samples[c][i];
+                        if (s < current->min[c])
+                                current->min[c] = s;
+                        if (s > current->max[c])
+                                current->max[c] = s;
+                        current->sum[c] += s;
+                        current->sumsq[c] += (uint64_t)s * s;
+                        (*sketch)[c][s >> BLE_SKETCH_SHIFT]++;
+                }
+        }
+}
+
+// Closes the aggregate of the frame block just written
+void ble_aggregate_push(ble_aggregate_builder *aggregate)
+{
+        if (aggregate->failed)
+                return;
+        if (aggregate->count == aggregate->cap)
+        {
+                uint32_t cap = aggregate->cap ? aggregate->cap * 2 : 256;
+                ble_block_aggregate *blocks = realloc(aggregate->blocks, cap * sizeof(*blocks));
+                if (blocks == NULL)
+                {
+                        aggregate->failed = 1;
+                        return;
+                }
+                aggregate->blocks = blocks;
+                aggregate->cap = cap;
+        }
+        aggregate->blocks[aggregate->count++] = aggregate->current;
+        aggregate->pending = 0;
+}
+
+void ble_aggregate_free(ble_aggregate_builder *aggregate)
+{
+        free(aggregate->blocks);
+        free(aggregate->sketches);
+        memset(aggregate, 0, sizeof(*aggregate));
+}
+
+uint8_t *ble_aggregate_build(ble_aggregate_builder *aggregate, size_t *length)
+{
+        ble_aggregate_header header = {
+                .blocks         = aggregate->count,
+                .sketch_blocks  = BLE_AGGREGATE_SKETCH_BLOCKS,
+                .sketches       = (aggregate->count + BLE_AGGREGATE_SKETCH_BLOCKS - 1) / BLE_AGGREGATE_SKETCH_BLOCKS,
+                .bins           = BLE_SKETCH_BINS,
+        };
+        size_t blocks_len = header.blocks * sizeof(ble_block_aggregate);
+        size_t sketches_len = header.sketches * sizeof(ble_sketch_bins);
+
+        if (aggregate->failed || aggregate->count == 0)
+                return NULL;
+        *length = sizeof(header) + blocks_len + sketches_len;
+        uint8_t *payload = malloc(*length);
+        if (payload == NULL)
+                return NULL;
+        memcpy(payload, &header, sizeof(header));
+        memcpy(payload + sizeof(header), aggregate->blocks, blocks_len);
+        memcpy(payload + sizeof(header) + blocks_len, aggregate->sketches, sketches_len);
+        return payload;
+}
+
+// Aggregates are only worth writing when they match the index one to one
+static int _write_aggregate(ble_record *record)
+{
+        size_t length;
+        if (!record->whole || record->aggregate.count != record->blocks)
+                return 0;
+        uint8_t *payload = ble_aggregate_build(&record->aggregate, &length);
+        if (payload == NULL || length > BLE_RECORD_MAX_PAYLOAD)
+        {
+                free(payload);
+                return 0;
+        }
+        uint64_t offset = _write_block(record, BLE_BLOCK_AGGREGATE, payload, length);
+        free(payload);
+        if (offset == 0)
+                return -1;
+        record->header.aggregate_offset = offset;
+        return 0;
+}
+
+// Flushes the partial block, appends the thumbnail, summary, aggregate and
+// index blocks and stamps the header with the session metadata. Nothing is
+// synced here.
+static int _stamp_header(ble_record *record, const ble_record_meta *meta)
+{
+        ble_record_header *header = &record->header;
+
+        if (ble_record_flush(record) != 0 || _write_thumbnail(record) != 0 ||
+            _write_summary(record) != 0 || _write_aggregate(record) != 0 ||
+            _write_index(record) != 0)
+                return -1;
+        if (meta != NULL)
+        {
+                _copy_field(header->id, sizeof(header->id), meta->id);
+                _copy_field(header->name, sizeof(header->name), meta->name);
+                _copy_field(header->day, sizeof(header->day), meta->day);
+        }
+        header->flags |= BLE_RECORD_FINALIZED;
+        header->t_first = record->t_first;
+        header->t_last = record->t_last;
+        header->frames = record->frames;
+        header->blocks = record->blocks;
+        header->crc = ble_crc32c(0, header, offsetof(ble_record_header, crc));
+        return _pwrite_full(record->fd, header, sizeof(*header), 0);
+}
+
+int ble_record_finalize(ble_record *record, const ble_record_meta *meta)
+{
+        if (_stamp_header(record, meta) != 0)
+                return -1;
+        return ble_record_sync(record);
+}
+
+// Takes back what _stamp_header() wrote, from the header and end of file it
+// started with. A file that cannot be restored refuses any further write,
+// since its header may claim an index that misses the frames to come.
+static void _unstamp(ble_record *record, const ble_record_header *header, uint64_t offset, uint32_t seq)
+{
+        record->header = *header;
+        record->offset = offset;
+        record->seq = seq;
+        if (ftruncate(record->fd, (off_t)offset) != 0 ||
+            _pwrite_full(record->fd, header, sizeof(*header), 0) != 0)
+                record->failed = true;
+}
+
+/*
+ * Ends the current segment at a block boundary and starts a fresh one at the
+ * same path. The finished segment is renamed to `final_path`, so no sample is
+ * copied, but its thumbnail, summary, aggregate and index blocks are built
+ * and written here, which takes time in proportion to the segment length.
+ * The rename replaces whatever is at `final_path`: reserve a free name first,
+ * as ble_capture_segment_path() does.
+ *
+ * The returned record replaces `record`, which is left detached from its
+ * journal: the caller closes it afterwards, outside any lock, to pay for the
+ * fdatasync() and the sync of the directory that makes both the rename and
+ * the fresh segment durable.
+ *
+ * Returns NULL on failure, with whatever was written taken back so `record`
+ * goes on at its path. Should even that fail, `record` refuses any further
+ * write, and its frames stay where they are.
+ */
+ble_record *ble_record_rotate(ble_record *record, const char *final_path, const ble_record_meta *meta)
+{
+        char *path = record->path;
+        char *renamed = strdup(final_path);
+        ble_record_header header;
+        uint64_t offset;
+        uint32_t seq;
+        ble_record *next = NULL;
+
+        if (renamed == NULL || ble_record_flush(record) != 0)
+        {
+                free(renamed);
+                return NULL;
+        }
+        header = record->header;
+        offset = record->offset;
+        seq = record->seq;
+        if (_stamp_header(record, meta) != 0)
+                goto FAIL;
+        if (rename(path, final_path) != 0)
+                goto FAIL;
+        next = ble_record_open(path, NULL);
+        if (next == NULL)
+        {
+                if (rename(final_path, path) != 0)
+                {
+                        free(path);
+                        record->path = renamed;
+                        record->failed = true;
+                        return NULL;
+                }
+                goto FAIL;
+        }
+
+        if (record->journal_fd >= 0)
+                close(record->journal_fd);
+        record->journal_fd = -1;
+        record->path = renamed;
+        record->moved = true;
+        free(path);
+        return next;
+
+FAIL:
+        _unstamp(record, &header, offset, seq);
+        free(renamed);
+        return NULL;
+}
@@ -0,0 +1,323 @@
+#ifndef BLE_MEDICAL_RECORD_H
+#define BLE_MEDICAL_RECORD_H
+
+#include <assert.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stddef.h>
+#include "ble_medical_data.h"
+
+/*
+ * Recording file layout
+ *
+ *   [file header, 256 bytes][block][block]...
+ *
+ * Every block is a 40-byte header followed by its payload, and carries a
+ * CRC32C over both. Frame blocks hold BLE_RECORD_BLOCK_FRAMES frames at most.
+ * Receive times are int64 microseconds on the g_get_monotonic_time clock.
+ *
+ * Raw frame payload:     times[count], then the PACKAGE_SIZE-byte frames
+ * BLE_BLOCK_ENCODED:     varint time deltas from t_first, t1[count],
+ *                        t2[count], varint beat deltas, then the red and IR
+ *                        samples through ble_codec_encode()
+ *
+ * A finalized recording ends with a BLE_BLOCK_INDEX block listing every frame
+ * block, and its header points to it, so readers need not walk the file.
+ * Before it come a BLE_BLOCK_THUMBNAIL block, a fixed-size min/max outline
+ * of the IR channel for file browsers, and a BLE_BLOCK_SUMMARY block, when
+ * the whole file was written in one go.
+ *
+ * The summary is a pyramid over the red and IR sample streams: level 0 has
+ * min, max and mean per 2^BLE_SUMMARY_SHIFT samples, each level above
+ * merges two entries of the one below, up to a single entry. Payload:
+ *
+ *   [ble_summary_header][level 0 entries][level 1 entries]...
+ *
+ * A BLE_BLOCK_AGGREGATE block holds, per frame block in index order, the
+ * min, max, sum and sum of squares of both streams, then one histogram
+ * sketch per BLE_AGGREGATE_SKETCH_BLOCKS frame blocks for percentiles:
+ *
+ *   [ble_aggregate_header][ble_block_aggregate * blocks]
+ *   [uint16_t sketch[sketches][BLE_SUMMARY_CHANNELS][BLE_SKETCH_BINS]]
+ *
+ * Beside the recording, "<path>.journal" holds the last checkpoint: the offset
+ * up to which the data was fdatasync()ed. Recovery only verifies blocks past
+ * that offset, so it costs time proportional to the damaged tail. The journal
+ * is synced too, and an entry only counts for the file whose header nonce it
+ * carries and when a block of the expected sequence number starts at its
+ * offset; otherwise recovery walks the whole file.
+ *
+ * Times belong to the boot recorded in the header. A recording left by an
+ * earlier boot is reported as such on recovery, since frames appended to it
+ * would go back in time: the capture moves it aside and starts a new one.
+ */
+
+#define BLE_RECORD_MAGIC                "BLEREC\0\1"
+#define BLE_RECORD_VERSION              1
+#define BLE_RECORD_HEADER_SIZE          256
+#define BLE_RECORD_BLOCK_MAGIC          0x4b4c4242u     // "BBLK"
+#define BLE_RECORD_JOURNAL_MAGIC        0x4c4e524au     // "JRNL"
+#define BLE_RECORD_BLOCK_FRAMES         64
+#define BLE_RECORD_SYNC_BLOCKS          4
+#define BLE_RECORD_MAX_PAYLOAD          (1 << 24)
+#define BLE_RECORD_JOURNAL_SUFFIX       ".journal"
+#define BLE_RECORD_EXTENSION            ".blerec"
+
+#define BLE_RECORD_FINALIZED            (1u << 0)
+
+#define BLE_CHANNEL_RED                 (1u << 0)
+#define BLE_CHANNEL_IR                  (1u << 1)
+#define BLE_CHANNEL_BEAT                (1u << 2)
+#define BLE_CHANNEL_ALL                 (BLE_CHANNEL_RED | BLE_CHANNEL_IR | BLE_CHANNEL_BEAT)
+
+typedef enum _ble_block_type {
+        BLE_BLOCK_FRAMES = 1,
+        BLE_BLOCK_INDEX = 2,
+        BLE_BLOCK_THUMBNAIL = 3,
+        BLE_BLOCK_SUMMARY = 4,
+        BLE_BLOCK_AGGREGATE = 5
+} ble_block_type;
+
+#define BLE_BLOCK_ENCODED               (1u << 0)
+
+typedef struct _ble_record_header {
+        char            magic[8];
+        uint32_t        version;
+        uint32_t        flags;
+        int64_t         origin_mono;    // monotonic clock when the file was created
+        int64_t         origin_real;    // wall clock at the same instant
+        char            id[32];         // session metadata, stamped on finalization
+        char            name[64];
+        char            day[16];
+        int64_t         t_first;
+        int64_t         t_last;
+        uint64_t        frames;
+        uint64_t        index_offset;   // BLE_BLOCK_INDEX block, 0 if none
+        uint32_t        blocks;
+        uint32_t        channels;       // BLE_CHANNEL_* stored in frame blocks
+        uint64_t        thumbnail_offset; // BLE_BLOCK_THUMBNAIL block, 0 if none
+        uint64_t        summary_offset; // BLE_BLOCK_SUMMARY block, 0 if none
+        uint64_t        aggregate_offset; // BLE_BLOCK_AGGREGATE block, 0 if none
+        uint64_t        nonce;          // random per file, ties the journal to it
+        uint8_t         boot_id[16];    // kernel boot of origin_mono, 0 if unknown
+        uint8_t         reserved[20];
+        uint32_t        crc;            // CRC32C of the preceding bytes
+} ble_record_header;
+
+typedef struct _ble_block_header {
+        uint32_t        magic;
+        uint16_t        type;
+        uint16_t        flags;
+        uint32_t        seq;
+        uint32_t        length;         // payload bytes following the header
+        uint32_t        count;          // frames in the payload
+        uint32_t        crc;            // CRC32C of header (crc = 0) and payload
+        int64_t         t_first;
+        int64_t         t_last;
+} ble_block_header;
+
+typedef struct _ble_index_entry {
+        uint64_t        offset;         // of the frame block header
+        int64_t         t_first;
+        int64_t         t_last;
+        uint64_t        frame;          // ordinal of the block's first frame
+        uint32_t        count;
+        uint32_t        reserved;
+} ble_index_entry;
+
+typedef struct _ble_journal_entry {
+        uint32_t        magic;
+        uint32_t        seq;            // sequence number of the next block
+        uint64_t        offset;         // durable end of the recording
+        uint64_t        frames;         // frames before offset
+        uint64_t        nonce;          // of the recording header
+        int64_t         t_last;         // last frame before offset
+        uint32_t        blocks;         // blocks before offset
+        uint32_t        crc;
+} ble_journal_entry;
+
+typedef struct _ble_frames {
+        uint32_t        count;
+        int64_t         times[BLE_RECORD_BLOCK_FRAMES];
+        uint8_t         t1[BLE_RECORD_BLOCK_FRAMES];
+        uint8_t         t2[BLE_RECORD_BLOCK_FRAMES];
+        int32_t         beat[BLE_RECORD_BLOCK_FRAMES];
+        uint16_t        red[BLE_RECORD_BLOCK_FRAMES * PACKAGE_SAMPLES];
+        uint16_t        ir[BLE_RECORD_BLOCK_FRAMES * PACKAGE_SAMPLES];
+} ble_frames;
+
+#define BLE_THUMBNAIL_POINTS            128
+
+// Min/max of consecutive runs of `span` samples. When all points are used,
+// neighbours are merged and the span doubles, so the length of the
+// recording never needs to be known up front.
+typedef struct _ble_thumbnail {
+        uint32_t        count;          // points in use
+        uint32_t        span;           // samples per point
+        uint32_t        fill;           // samples in the last point
+        uint32_t        reserved;
+        uint16_t        min[BLE_THUMBNAIL_POINTS];
+        uint16_t        max[BLE_THUMBNAIL_POINTS];
+} ble_thumbnail;
+
+#define BLE_SUMMARY_SHIFT               9
+#define BLE_SUMMARY_MAX_LEVELS          40
+
+enum { BLE_SUMMARY_RED, BLE_SUMMARY_IR, BLE_SUMMARY_CHANNELS };
+
+typedef struct _ble_summary_header {
+        uint32_t        shift;          // log2 of samples per level 0 entry
+        uint32_t        levels;
+        uint64_t        samples;        // per channel
+        uint32_t        count[BLE_SUMMARY_MAX_LEVELS];
+        uint32_t        crc[BLE_SUMMARY_MAX_LEVELS];    // CRC32C of each level, read on its own
+} ble_summary_header;
+
+typedef struct _ble_summary_entry {
+        uint16_t        min[BLE_SUMMARY_CHANNELS];
+        uint16_t        max[BLE_SUMMARY_CHANNELS];
+        uint16_t        mean[BLE_SUMMARY_CHANNELS];
+} ble_summary_entry;
+
+// Level 0 as it is being written; exact sums so upper means stay exact
+typedef struct _ble_summary_acc {
+        uint16_t        min[BLE_SUMMARY_CHANNELS];
+        uint16_t        max[BLE_SUMMARY_CHANNELS];
+        uint64_t        sum[BLE_SUMMARY_CHANNELS];
+        uint64_t        n;
+} ble_summary_acc;
+
+typedef struct _ble_summary_builder {
+        ble_summary_acc *base;
+        uint32_t        count;
+        uint32_t        cap;
+        ble_summary_acc pending;
+        int             failed;         // out of memory, no summary
+} ble_summary_builder;
+
+#define BLE_AGGREGATE_SKETCH_BLOCKS     64
+#define BLE_SKETCH_SHIFT                7
+#define BLE_SKETCH_BINS                 (65536 >> BLE_SKETCH_SHIFT)
+
+typedef struct _ble_aggregate_header {
+        uint32_t        blocks;
+        uint32_t        sketch_blocks;  // frame blocks per sketch
+        uint32_t        sketches;
+        uint32_t        bins;           // per channel and sketch
+} ble_aggregate_header;
+
+typedef struct _ble_block_aggregate {
+        uint16_t        min[BLE_SUMMARY_CHANNELS];
+        uint16_t        max[BLE_SUMMARY_CHANNELS];
+        uint32_t        sum[BLE_SUMMARY_CHANNELS];
+        uint64_t        sumsq[BLE_SUMMARY_CHANNELS];
+} ble_block_aggregate;
+
+// Bin counts stay below 2^16: a sketch sees at most 64 * 640 samples
+typedef uint16_t ble_sketch_bins[BLE_SUMMARY_CHANNELS][BLE_SKETCH_BINS];
+
+typedef struct _ble_aggregate_builder {
+        ble_block_aggregate     current;        // buffered frames
+        uint32_t                pending;        // samples in current
+        ble_block_aggregate     *blocks;
+        uint32_t                count;
+        uint32_t                cap;
+        ble_sketch_bins         *sketches;
+        uint32_t                sketches_cap;
+        int                     failed;
+} ble_aggregate_builder;
+
+typedef struct _ble_record_meta {
+        const char      *id;
+        const char      *name;
+        const char      *day;
+} ble_record_meta;
+
+typedef struct _ble_record_recovery {
+        uint64_t        file_size;      // size found on disk
+        uint64_t        checkpoint;     // offset trusted from the journal, 0 if none
+        uint64_t        scanned_bytes;  // bytes verified past the checkpoint
+        uint64_t        valid_size;     // size after truncation
+        uint64_t        truncated_bytes;
+        uint64_t        frames;         // frames kept in the recording
+        uint32_t        blocks;         // blocks kept in the recording
+        uint32_t        tail_blocks;    // blocks verified past the checkpoint
+        int64_t         t_first;        // first and last frame kept
+        int64_t         t_last;
+        int             journal_used;
+        int             created;        // no usable recording existed
+        int             clock_restarted; // frames are from an earlier boot
+} ble_record_recovery;
+
+typedef struct _ble_record {
+        int                     fd;
+        int                     journal_fd;
+        char                    *path;
+        uint32_t                seq;
+        uint64_t                offset;
+        uint64_t                frames;
+        uint32_t                blocks;
+        uint32_t                unsynced;
+        uint32_t                syncs;
+        int64_t                 sync_us;        // the last fdatasync()
+        ble_index_entry         *index;
+        uint32_t                index_len;
+        uint32_t                index_cap;
+        uint32_t                count;
+        int64_t                 t_first;
+        int64_t                 t_last;
+        int64_t                 times[BLE_RECORD_BLOCK_FRAMES];
+        uint8_t                 data[BLE_RECORD_BLOCK_FRAMES][PACKAGE_SIZE];
+        ble_thumbnail           thumbnail;
+        ble_summary_builder     summary;
+        ble_aggregate_builder   aggregate;
+        int                     whole;          // the above cover every frame
+        int                     failed;         // a rotation could not be undone, writes refused
+        int                     moved;          // renamed, directory not synced yet
+        ble_record_header       header;
+} ble_record;
+
+static_assert(sizeof(ble_record_header) == BLE_RECORD_HEADER_SIZE, "record header size");
+static_assert(sizeof(ble_block_header) == 40, "block header size");
+static_assert(sizeof(ble_journal_entry) == 48, "journal entry size");
+static_assert(sizeof(ble_index_entry) == 40, "index entry size");
+static_assert(sizeof(ble_thumbnail) == 16 + 4 * BLE_THUMBNAIL_POINTS, "thumbnail size");
+static_assert(sizeof(ble_summary_header) == 16 + 8 * BLE_SUMMARY_MAX_LEVELS, "summary header size");
+static_assert(sizeof(ble_summary_entry) == 12, "summary entry size");
+static_assert(sizeof(ble_block_aggregate) == 32, "block aggregate size");
+static_assert(BLE_AGGREGATE_SKETCH_BLOCKS * BLE_RECORD_BLOCK_FRAMES * PACKAGE_SAMPLES <= UINT16_MAX,
+              "sketch bins are 16-bit");
+
+// Truncates a damaged tail. Fails with EBADMSG, leaving the file alone,
+// when it is not a recording, ENOTSUP when it is of a newer version.
+int ble_record_recover(const char *path, ble_record_recovery *report);
+ble_record *ble_record_open(const char *path, ble_record_recovery *report);
+// Fails, keeping the frame out, while a full block cannot be written
+int ble_record_append(ble_record*, ble_time_t, const uint8_t *frame);
+int ble_record_flush(ble_record*);
+int ble_record_sync(ble_record*);
+int ble_record_close(ble_record*);
+int ble_record_finalize(ble_record*, const ble_record_meta*);
+// Finalizes the recording as `final_path` and returns a fresh one in its
+// place; NULL on failure, with the recording going on where it was
+ble_record *ble_record_rotate(ble_record*, const char *final_path, const ble_record_meta*);
+
+int ble_record_header_valid(const ble_record_header*);
+int ble_record_read_header(const char *path, ble_record_header*);
+int ble_record_block_valid(const ble_block_header*, const uint8_t *payload);
+int ble_record_decode_block(const ble_block_header*, const uint8_t *payload, ble_frames*);
+
+void ble_thumbnail_init(ble_thumbnail*);
+void ble_thumbnail_add(ble_thumbnail*, const uint16_t *samples, size_t n);
+
+void ble_summary_add(ble_summary_builder*, const uint16_t *red, const uint16_t *ir, size_t n);
+void ble_summary_free(ble_summary_builder*);
+// Serializes the pyramid into a malloc()ed payload, NULL if empty or on error
+uint8_t *ble_summary_build(ble_summary_builder*, size_t *length);
+
+void ble_aggregate_add(ble_aggregate_builder*, const uint16_t *red, const uint16_t *ir, size_t n);
+void ble_aggregate_push(ble_aggregate_builder*);
+void ble_aggregate_free(ble_aggregate_builder*);
+uint8_t *ble_aggregate_build(ble_aggregate_builder*, size_t *length);
+
+#endif
@@ -0,0 +1,505 @@
+#include "ble_medical_render.h"
+
+#include <glib.h>
+#include <glib/gstdio.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <cairo-pdf.h>
+
+#define RENDER_MARGIN           36.0    // in units of a 595-high page
+#define RENDER_TITLE_SIZE       12.0
+#define RENDER_LABEL_SIZE       8.0
+#define RENDER_MAX_TICKS        10
+#define RENDER_GAP_US           250000  // shorter pauses are drawn through
+
+typedef struct _render_envelope {
+        uint32_t        columns;
+        uint16_t        *min[BLE_SUMMARY_CHANNELS];
+        uint16_t        *max[BLE_SUMMARY_CHANNELS];
+        uint8_t         *filled;
+        uint32_t        gap_columns;    // empty columns still drawn through
+        uint16_t        low[BLE_SUMMARY_CHANNELS];      // over the whole window
+        uint16_t        high[BLE_SUMMARY_CHANNELS];
+} render_envelope;
+
+static const int64_t _tick_steps[] = {
+        1, 2, 5, 10, 15, 30, 60, 120, 300, 600, 900, 1800, 3600, 7200, 10800, 21600
+};
+
+static int _envelope_init(render_envelope *env, uint32_t columns)
+{
+        size_t n = columns ? columns : 1;
+        uint8_t *mem = calloc(n, 4 * BLE_SUMMARY_CHANNELS + 1);
+
+        if (mem == NULL)
+                return -1;
+        env->columns = columns;
+        for (int c = 0; c < BLE_SUMMARY_CHANNELS; c++)
+        {
+                env->min[c] = (uint16_t*)mem + (2 * c) * n;
+                env->max[c] = (uint16_t*)mem + (2 * c + 1) * n;
+                env->low[c] = UINT16_MAX;
+                env->high[c] = 0;
+        }
+        env->filled = mem + 4 * BLE_SUMMARY_CHANNELS * n;
+        return 0;
+}
+
+static void _envelope_free(render_envelope *env)
+{
+        free(env->min[0]);
+}
+
+static void _envelope_add(render_envelope *env, int64_t column, int channel, uint16_t min, uint16_t max)
+{
+        if (column < 0 || column >= env->columns)
+                return;
+        if (!(env->filled[column] & (1 << channel)))
+        {
+                env->filled[column] |= 1 << channel;
+                env->min[channel][column] = min;
+                env->max[channel][column] = max;
+        }
+        else
+        {
+                if (min < env->min[channel][column])
+                        env->min[channel][column] = min;
+                if (max > env->max[channel][column])
+                        env->max[channel][column] = max;
+        }
+        if (min < env->low[channel])
+                env->low[channel] = min;
+        if (max > env->high[channel])
+                env->high[channel] = max;
+}
+
+static int64_t _column(const render_envelope *env, const ble_render_options *options, int64_t time)
+{
+        if (time < options->t_begin || time > options->t_end)
+                return -1;
+        return (int64_t)((double)(time - options->t_begin) /
+                         (double)(options->t_end - options->t_begin + 1) * env->columns);
+}
+
+// Receive time of a sample, interpolated between the frames of its block
+static int64_t _sample_time(const ble_reader *reader, uint64_t sample)
+{
+        uint64_t frame = sample / PACKAGE_SAMPLES;
+        uint32_t lo = 0, hi = reader->blocks;
+
+        while (hi - lo > 1)
+        {
+                uint32_t mid = lo + (hi - lo) / 2;
+                if (reader->index[mid].frame <= frame)
+                        lo = mid;
+                else
+                        hi = mid;
+        }
+        const ble_index_entry *entry = &reader->index[lo];
+        int64_t t = entry->t_first;
+        if (entry->count > 1)
+                t += (int64_t)((double)(entry->t_last - entry->t_first) *
+                               (double)(frame - entry->frame) / (entry->count - 1));
+        return t + (int64_t)((sample % PACKAGE_SAMPLES) * PACKAGE_INTERVAL * 1e6);
+}
+
+static int _envelope_from_summary(render_envelope *env, const ble_reader *reader,
+                                  const ble_render_options *options, int level)
+{
+        uint32_t shift = reader->summary_header.shift + (uint32_t)level;
+        uint64_t first = ble_reader_sample_at(reader, options->t_begin) >> shift << shift;
+        uint32_t last_block = ble_reader_seek(reader, options->t_end);
+        uint64_t end = last_block < reader->blocks ?
+                (reader->index[last_block].frame + reader->index[last_block].count) * PACKAGE_SAMPLES :
+                reader->frames * PACKAGE_SAMPLES;
+        size_t max = (size_t)((end - first) >> shift) + 1;
+        ble_summary_entry *entries = malloc(max * sizeof(*entries));
+
+        if (entries == NULL)
+                return -1;
+        size_t n = ble_reader_summary_read(reader, (uint32_t)level, first, end - first, entries, max);
+        for (size_t k = 0; k < n; k++)
+        {
+                int64_t column = _column(env, options, _sample_time(reader, first + ((uint64_t)k << shift)));
+                for (int c = 0; c < BLE_SUMMARY_CHANNELS; c++)
+                        _envelope_add(env, column, c, entries[k].min[c], entries[k].max[c]);
+        }
+        free(entries);
+        // A damaged level falls back to the samples
+        return n > 0 ? 0 : 1;
+}
+
+static int _envelope_from_samples(render_envelope *env, const ble_reader *reader,
+                                  const ble_render_options *options)
+{
+        ble_range *range = malloc(sizeof(*range));
+        ble_view view;
+
+        if (range == NULL)
+                return -1;
+        ble_range_init(range, reader, options->t_begin, options->t_end);
+        while (ble_range_next(range, &view))
+        {
+                for (uint32_t i = 0; i < view.count; i++)
+                {
+                        const uint16_t *red = view.red + (size_t)i * PACKAGE_SAMPLES;
+                        const uint16_t *ir = view.ir + (size_t)i * PACKAGE_SAMPLES;
+                        for (uint32_t j = 0; j < PACKAGE_SAMPLES; j++)
+                        {
+                                int64_t t = view.times[i] + (int64_t)(j * PACKAGE_INTERVAL * 1e6);
+                                int64_t column = _column(env, options, t);
+                                _envelope_add(env, column, BLE_SUMMARY_RED, red[j], red[j]);
+                                _envelope_add(env, column, BLE_SUMMARY_IR, ir[j], ir[j]);
+                        }
+                }
+        }
+        free(range);
+        return 0;
+}
+
+static int _envelope_build(render_envelope *env, const ble_reader *reader,
+                           const ble_render_options *options)
+{
+        if (reader->blocks == 0)
+                return 0;
+        uint64_t samples = ble_reader_sample_at(reader, options->t_end) -
+                           ble_reader_sample_at(reader, options->t_begin);
+        int level = ble_reader_summary_level(reader, samples, env->columns);
+        if (level >= 0)
+        {
+                int res = _envelope_from_summary(env, reader, options, level);
+                if (res <= 0)
+                        return res;
+        }
+        return _envelope_from_samples(env, reader, options);
+}
+
+static void _format_clock(char *text, size_t size, const char *format, int64_t real_us)
+{
+        time_t seconds = (time_t)(real_us / 1000000);
+        struct tm tm;
+        localtime_r(&seconds, &tm);
+        strftime(text, size, format, &tm);
+}
+
+static void _draw_title(cairo_t *cr, const ble_reader *reader, const ble_render_options *options,
+                        double x, double y, double unit)
+{
+        const ble_record_header *h = &reader->header;
+        int64_t real_begin = ble_reader_time_to_real(reader, options->t_begin);
+        int64_t real_end = ble_reader_time_to_real(reader, options->t_end);
+        char begin[32], end[32], day_begin[16], day_end[16], title[256];
+
+        // The end only gets its date when it falls on another day
+        _format_clock(day_begin, sizeof(day_begin), "%Y-%m-%d", real_begin);
+        _format_clock(day_end, sizeof(day_end), "%Y-%m-%d", real_end);
+        _format_clock(begin, sizeof(begin), "%Y-%m-%d %H:%M:%S", real_begin);
+        _format_clock(end, sizeof(end), strcmp(day_begin, day_end) ? "%Y-%m-%d %H:%M:%S" : "%H:%M:%S",
+                      real_end);
+        snprintf(title, sizeof(title), "%.64s %.32s %.16s  %s - %s",
+                 h->name[0] ? h->name : "Recording", h->id, h->day, begin, end);
+
+        cairo_set_source_rgb(cr, 0, 0, 0);
+        cairo_set_font_size(cr, RENDER_TITLE_SIZE * unit);
+        cairo_move_to(cr, x, y);
+        cairo_show_text(cr, title);
+}
+
+static void _draw_strip(cairo_t *cr, const render_envelope *env, int channel,
+                        double x, double y, double w, double h, double unit)
+{
+        double low = env->low[channel], high = env->high[channel];
+        char label[64];
+        uint32_t empty = 0;
+        int pen = false;
+
+        if (high <= low)
+        {
+                low -= 1;
+                high += 1;
+        }
+        double pad = (high - low) * 0.05;
+        low -= pad;
+        high += pad;
+
+        cairo_set_source_rgb(cr, 0.6, 0.6, 0.6);
+        cairo_set_line_width(cr, 0.5 * unit);
+        cairo_rectangle(cr, x, y, w, h);
+        cairo_stroke(cr);
+
+        cairo_save(cr);
+        cairo_rectangle(cr, x, y, w, h);
+        cairo_clip(cr);
+        if (channel == BLE_SUMMARY_RED)
+                cairo_set_source_rgb(cr, 0.8, 0.1, 0.1);
+        else
+                cairo_set_source_rgb(cr, 0.1, 0.2, 0.7);
+        cairo_set_line_width(cr, 0.4 * unit);
+        cairo_set_line_join(cr, CAIRO_LINE_JOIN_BEVEL);
+        for (uint32_t c = 0; c < env->columns; c++)
+        {
+                if (!(env->filled[c] & (1 << channel)))
+                {
+                        if (++empty > env->gap_columns)
+                                pen = false;
+                        continue;
+                }
+                empty = 0;
+                double cx = x + (c + 0.5) * w / env->columns;
+                double y_max = y + h - (env->max[channel][c] - low) / (high - low) * h;
+                double y_min = y + h - (env->min[channel][c] - low) / (high - low) * h;
+                if (pen)
+                        cairo_line_to(cr, cx, y_max);
+                else
+                        cairo_move_to(cr, cx, y_max);
+                cairo_line_to(cr, cx, y_min);
+                pen = true;
+        }
+        cairo_stroke(cr);
+        cairo_restore(cr);
+
+        if (env->low[channel] <= env->high[channel])
+                snprintf(label, sizeof(label), "%s  %u - %u", channel == BLE_SUMMARY_RED ? "Red" : "IR",
+                         env->low[channel], env->high[channel]);
+        else
+                snprintf(label, sizeof(label), "%s  no data", channel == BLE_SUMMARY_RED ? "Red" : "IR");
+        cairo_set_source_rgb(cr, 0.2, 0.2, 0.2);
+        cairo_set_font_size(cr, RENDER_LABEL_SIZE * unit);
+        cairo_move_to(cr, x + 3 * unit, y + (RENDER_LABEL_SIZE + 2) * unit);
+        cairo_show_text(cr, label);
+}
+
+// Wall clock ticks at a round step, about RENDER_MAX_TICKS of them
+static void _draw_axis(cairo_t *cr, const ble_reader *reader, const ble_render_options *options,
+                       double x, double y, double w, double unit)
+{
+        int64_t real_begin = ble_reader_time_to_real(reader, options->t_begin);
+        int64_t span = options->t_end - options->t_begin + 1;
+        int64_t step = _tick_steps[G_N_ELEMENTS(_tick_steps) - 1] * 1000000;
+        char text[16];
+
+        for (size_t i = 0; i < G_N_ELEMENTS(_tick_steps); i++)
+        {
+                if (span / (_tick_steps[i] * 1000000) <= RENDER_MAX_TICKS)
+                {
+                        step = _tick_steps[i] * 1000000;
+                        break;
+                }
+        }
+
+        cairo_set_source_rgb(cr, 0.2, 0.2, 0.2);
+        cairo_set_line_width(cr, 0.5 * unit);
+        cairo_set_font_size(cr, RENDER_LABEL_SIZE * unit);
+        for (int64_t tick = (real_begin + step - 1) / step * step; tick < real_begin + span; tick += step)
+        {
+                double tx = x + (double)(tick - real_begin) / span * w;
+                cairo_move_to(cr, tx, y);
+                cairo_line_to(cr, tx, y + 4 * unit);
+                cairo_stroke(cr);
+                _format_clock(text, sizeof(text), "%H:%M:%S", tick);
+                cairo_move_to(cr, tx - 14 * unit, y + (6 + RENDER_LABEL_SIZE) * unit);
+                cairo_show_text(cr, text);
+        }
+}
+
+int ble_render_draw(const ble_reader *reader, cairo_t *cr, const ble_render_options *options)
+{
+        double unit = options->height / BLE_RENDER_PDF_HEIGHT;
+        double margin = RENDER_MARGIN * unit;
+        double plot_w = options->width - 2 * margin;
+        double top = margin + RENDER_TITLE_SIZE * unit * 1.5;
+        double bottom = options->height - margin - (RENDER_LABEL_SIZE + 8) * unit;
+        int channels[BLE_SUMMARY_CHANNELS], n = 0;
+        render_envelope env;
+
+        if (options->channels & BLE_CHANNEL_RED)
+                channels[n++] = BLE_SUMMARY_RED;
+        if (options->channels & BLE_CHANNEL_IR)
+                channels[n++] = BLE_SUMMARY_IR;
+        if (plot_w <= 0 || bottom <= top || options->t_end <= options->t_begin)
+                return -1;
+        if (_envelope_init(&env, (uint32_t)ceil(plot_w * options->columns)) != 0)
+                return -1;
+        env.gap_columns = (uint32_t)((double)RENDER_GAP_US * env.columns /
+                                     (double)(options->t_end - options->t_begin + 1));
+        if (_envelope_build(&env, reader, options) != 0)
+        {
+                _envelope_free(&env);
+                return -1;
+        }
+
+        cairo_save(cr);
+        cairo_set_source_rgb(cr, 1, 1, 1);
+        cairo_paint(cr);
+        cairo_select_font_face(cr, "sans-serif", CAIRO_FONT_SLANT_NORMAL, CAIRO_FONT_WEIGHT_NORMAL);
+        _draw_title(cr, reader, options, margin, margin + RENDER_TITLE_SIZE * unit, unit);
+
+        double gap = 6 * unit;
+        double strip_h = n > 0 ? (bottom - top - gap * (n - 1)) / n : 0;
+        for (int i = 0; i < n; i++)
+                _draw_strip(cr, &env, channels[i], margin, top + i * (strip_h + gap), plot_w, strip_h, unit);
+        _draw_axis(cr, reader, options, margin, bottom, plot_w, unit);
+        cairo_restore(cr);
+
+        _envelope_free(&env);
+        return cairo_status(cr) == CAIRO_STATUS_SUCCESS ? 0 : -1;
+}
+
+// Open-ended windows stop at the recording's first and last frame
+static ble_render_options _clamp_window(const ble_reader *reader, const ble_render_options *options)
+{
+        ble_render_options clamped = *options;
+        if (reader->blocks > 0)
+        {
+                if (clamped.t_begin < reader->index[0].t_first)
+                        clamped.t_begin = reader->index[0].t_first;
+                if (clamped.t_end > reader->index[reader->blocks - 1].t_last)
+                        clamped.t_end = reader->index[reader->blocks - 1].t_last;
+        }
+        if (clamped.columns <= 0)
+                clamped.columns = 1;
+        return clamped;
+}
+
+int ble_render_png(const ble_reader *reader, const char *path, const ble_render_options *options)
+{
+        ble_render_options clamped = _clamp_window(reader, options);
+        cairo_surface_t *surface = cairo_image_surface_create(CAIRO_FORMAT_RGB24,
+                                                              (int)ceil(clamped.width),
+                                                              (int)ceil(clamped.height));
+        cairo_t *cr = cairo_create(surface);
+        int res = ble_render_draw(reader, cr, &clamped);
+
+        cairo_destroy(cr);
+        if (res == 0 && cairo_surface_write_to_png(surface, path) != CAIRO_STATUS_SUCCESS)
+                res = -1;
+        cairo_surface_destroy(surface);
+        return res;
+}
+
+/*
+ * Report pages are numbered from 1 in the pool so that none is NULL. The
+ * writer waits for them in order; a page is pushed once the page
+ * BLE_RENDER_PAGES_AHEAD * threads before it has been written.
+ */
+
+typedef struct _render_page {
+        cairo_surface_t *surface;
+        int             done;
+} render_page;
+
+typedef struct _render_report {
+        const ble_reader        *reader;
+        ble_render_options      options;
+        int64_t                 page_span;
+        render_page             *pages;
+        GMutex                  lock;
+        GCond                   cond;
+        gint                    stopped;
+} render_report;
+
+static void _render_page_work(gpointer data, gpointer user_data)
+{
+        render_report *report = user_data;
+        guint i = GPOINTER_TO_UINT(data) - 1;
+        cairo_surface_t *surface = NULL;
+
+        if (!g_atomic_int_get(&report->stopped))
+        {
+                cairo_rectangle_t extents = { 0, 0, report->options.width, report->options.height };
+                ble_render_options options = report->options;
+                options.t_begin = report->options.t_begin + (int64_t)i * report->page_span;
+                options.t_end = options.t_begin + report->page_span - 1;
+
+                surface = cairo_recording_surface_create(CAIRO_CONTENT_COLOR, &extents);
+                cairo_t *cr = cairo_create(surface);
+                if (ble_render_draw(report->reader, cr, &options) != 0)
+                {
+                        cairo_surface_destroy(surface);
+                        surface = NULL;
+                }
+                cairo_destroy(cr);
+        }
+
+        g_mutex_lock(&report->lock);
+        report->pages[i].surface = surface;
+        report->pages[i].done = true;
+        g_cond_broadcast(&report->cond);
+        g_mutex_unlock(&report->lock);
+}
+
+int ble_render_report(const ble_reader          *reader,
+                      const char                *path,
+                      const ble_render_options  *options,
+                      int64_t                   page_span,
+                      int                       threads,
+                      ble_render_progress_func  progress,
+                      void                      *data)
+{
+        render_report report = { .reader = reader, .page_span = page_span };
+        int res = 0;
+
+        report.options = _clamp_window(reader, options);
+        if (page_span <= 0 || report.options.t_end <= report.options.t_begin)
+                return -1;
+        if (threads <= 0)
+                threads = MAX((int)g_get_num_processors() - 1, 1);
+
+        guint count = (guint)((report.options.t_end - report.options.t_begin + page_span) / page_span);
+        guint ahead = (guint)threads * BLE_RENDER_PAGES_AHEAD;
+        report.pages = g_new0(render_page, count);
+        g_mutex_init(&report.lock);
+        g_cond_init(&report.cond);
+
+        GThreadPool *pool = g_thread_pool_new(_render_page_work, &report, threads, false, NULL);
+        for (guint i = 0; i < count && i < ahead; i++)
+                g_thread_pool_push(pool, GUINT_TO_POINTER(i + 1), NULL);
+
+        cairo_surface_t *pdf = cairo_pdf_surface_create(path, options->width, options->height);
+        cairo_t *cr = cairo_create(pdf);
+        for (guint i = 0; i < count && res == 0; i++)
+        {
+                g_mutex_lock(&report.lock);
+                while (!report.pages[i].done)
+                        g_cond_wait(&report.cond, &report.lock);
+                g_mutex_unlock(&report.lock);
+
+                if (i + ahead < count)
+                        g_thread_pool_push(pool, GUINT_TO_POINTER(i + ahead + 1), NULL);
+                if (report.pages[i].surface == NULL)
+                {
+                        res = -1;
+                        break;
+                }
+                cairo_set_source_surface(cr, report.pages[i].surface, 0, 0);
+                cairo_paint(cr);
+                cairo_show_page(cr);
+                cairo_surface_destroy(report.pages[i].surface);
+                report.pages[i].surface = NULL;
+                if (progress != NULL && !progress(i + 1, count, data))
+                        res = 1;
+        }
+
+        // Queued pages are skipped, running ones are waited for
+        g_atomic_int_set(&report.stopped, res != 0);
+        g_thread_pool_free(pool, false, true);
+        for (guint i = 0; i < count; i++)
+                if (report.pages[i].surface != NULL)
+                        cairo_surface_destroy(report.pages[i].surface);
+
+        cairo_destroy(cr);
+        cairo_surface_finish(pdf);
+        if (res == 0 && cairo_surface_status(pdf) != CAIRO_STATUS_SUCCESS)
+                res = -1;
+        cairo_surface_destroy(pdf);
+        if (res != 0)
+                g_unlink(path);
+
+        g_free(report.pages);
+        g_mutex_clear(&report.lock);
+        g_cond_clear(&report.cond);
+        return res;
+}
@@ -0,0 +1,49 @@
+#ifndef BLE_MEDICAL_RENDER_H
+#define BLE_MEDICAL_RENDER_H
+
+#include <cairo.h>
+
+#include "ble_medical_reader.h"
+
+/*
+ * Headless rendering of recordings with cairo, independent of any widget.
+ *
+ * A page shows the red and/or IR stream of a time window as a min/max
+ * envelope, one envelope point per output column, under a title with the
+ * session metadata and wall clock times. Windows holding many samples per
+ * column are drawn from the summary pyramid, others from decoded blocks;
+ * columns with no frame leave a gap in the trace.
+ *
+ * Sizes are pixels for images and points for PDF, so any resolution can be
+ * asked for. Multi-page reports render pages concurrently into recording
+ * surfaces on a thread pool, at most BLE_RENDER_PAGES_AHEAD per thread
+ * ahead of the page being written, and the caller's thread copies them
+ * into the PDF in order. All of it blocks; run it from a worker thread.
+ */
+
+#define BLE_RENDER_PDF_WIDTH            842.0   // A4 landscape, points
+#define BLE_RENDER_PDF_HEIGHT           595.0
+#define BLE_RENDER_PDF_COLUMNS          4.0     // envelope points per PDF point
+#define BLE_RENDER_PAGES_AHEAD          2
+
+typedef struct _ble_render_options {
+        int64_t         t_begin;        // receive times
+        int64_t         t_end;
+        uint32_t        channels;       // BLE_CHANNEL_RED and/or BLE_CHANNEL_IR
+        double          width;
+        double          height;
+        double          columns;        // envelope points per unit of width
+} ble_render_options;
+
+// Return false to stop the report
+typedef int (*ble_render_progress_func)(uint64_t pages_done, uint64_t pages, void *data);
+
+int ble_render_draw(const ble_reader*, cairo_t*, const ble_render_options*);
+int ble_render_png(const ble_reader*, const char *path, const ble_render_options*);
+// Pages of `page_span` microseconds over [t_begin, t_end]; `threads` <= 0
+// uses all processors but one. Returns 0, -1, or 1 when stopped.
+int ble_render_report(const ble_reader*, const char *path, const ble_render_options*,
+                      int64_t page_span, int threads,
+                      ble_render_progress_func progress, void *data);
+
+#endif
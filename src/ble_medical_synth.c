@@ -0,0 +1,295 @@
+#include "ble_medical_synth.h"
+#include "ble_medical_debug.h"
+
+#include <math.h>
+#include <stdbool.h>
+#include <string.h>
+
+#define SYNTH_FRAME_S           (PACKAGE_SAMPLES * PACKAGE_INTERVAL)
+// Raw levels of the sensor at rest, and the pulse as a fraction of IR
+#define SYNTH_DC_IR             40000.0
+#define SYNTH_DC_RED            32000.0
+#define SYNTH_PERFUSION         0.02
+#define SYNTH_BREATH_HZ         0.25
+// A frame read twice arrives just after the first copy
+#define SYNTH_DUPLICATE_S       0.001
+
+G_DEFINE_QUARK(ble-synth-error-quark, ble_synth_error)
+
+struct _ble_synth {
+        ble_synth_config        config;
+        GRand                   *rand;
+        // Held by reads and reconnections but while they wait, so the
+        // state below can be looked at from other threads
+        GMutex                  lock;
+        GCond                   cond;
+        gboolean                stopped;
+        gint64                  real_origin;
+        ble_time_t              origin;
+        // Signal, all times in source seconds
+        guint64                 sample;
+        double                  phase;          // of the cardiac cycle
+        double                  breath;         // of the respiratory cycle
+        double                  drift;          // of the heart rate, bpm
+        double                  heart_rate;
+        double                  ac_red;
+        double                  motion_start;
+        double                  motion_end;
+        double                  motion_amp;
+        double                  motion_hz[2];
+        double                  motion_phase[2];
+        double                  next_motion;
+        // Delivery
+        uint8_t                 last[PACKAGE_SIZE];
+        double                  last_arrival;
+        gboolean                duplicate;      // the last frame is read again
+        double                  stall_end;
+        double                  next_stall;
+        double                  next_disconnect;
+        gboolean                disconnected;
+        double                  down_end;
+        ble_synth_stats         stats;
+};
+
+void ble_synth_config_default(ble_synth_config *config)
+{
+        memset(config, 0, sizeof(*config));
+        config->heart_rate = 72.0;
+        config->spo2 = 97.0;
+        config->noise = 20.0;
+        config->motion = 2000.0;
+        config->speed = 1.0;
+        config->seed = 1;
+}
+
+// Until an event at `rate` per second comes, never at a rate of 0
+static double _interval(GRand *rand, double rate)
+{
+        if (rate <= 0)
+                return INFINITY;
+        return -log(1.0 - g_rand_double(rand)) / rate;
+}
+
+static double _gauss(GRand *rand)
+{
+        double u = 1.0 - g_rand_double(rand), v = g_rand_double(rand);
+        return sqrt(-2.0 * log(u)) * cos(2.0 * G_PI * v);
+}
+
+static uint16_t _adc(double value)
+{
+        return (uint16_t)CLAMP(lround(value), 0, UINT16_MAX);
+}
+
+ble_synth *ble_synth_new(const ble_synth_config *config)
+{
+        ble_synth *synth = g_new0(ble_synth, 1);
+
+        synth->config = *config;
+        synth->config.drop_rate = CLAMP(config->drop_rate, 0.0, 0.99);
+        synth->config.speed = MAX(config->speed, 0.0);
+        synth->rand = g_rand_new_with_seed(config->seed);
+        g_mutex_init(&synth->lock);
+        g_cond_init(&synth->cond);
+        synth->real_origin = g_get_monotonic_time();
+        synth->origin = synth->real_origin;
+        synth->heart_rate = config->heart_rate;
+        // Ratio of ratios for the SpO2, by the usual linear calibration
+        double ratio = (110.0 - CLAMP(config->spo2, 50.0, 100.0)) / 25.0;
+        synth->ac_red = ratio * SYNTH_PERFUSION * SYNTH_DC_RED;
+        synth->next_motion = _interval(synth->rand, config->motion_per_minute / 60.0);
+        synth->next_stall = _interval(synth->rand, config->stalls_per_minute / 60.0);
+        synth->next_disconnect = _interval(synth->rand, config->disconnects_per_hour / 3600.0);
+        return synth;
+}
+
+static double _motion(ble_synth *synth, double t)
+{
+        if (t >= synth->next_motion)
+        {
+                GRand *rand = synth->rand;
+                synth->motion_start = t;
+                synth->motion_end = t + 1.0 + 3.0 * g_rand_double(rand);
+                synth->motion_amp = synth->config.motion * (0.5 + 0.5 * g_rand_double(rand));
+                for (int i = 0; i < 2; i++)
+                {
+                        synth->motion_hz[i] = 0.5 + 2.5 * g_rand_double(rand);
+                        synth->motion_phase[i] = 2.0 * G_PI * g_rand_double(rand);
+                }
+                synth->next_motion = synth->motion_end + _interval(rand, synth->config.motion_per_minute / 60.0);
+                synth->stats.motion++;
+        }
+        if (t >= synth->motion_end)
+                return 0;
+        double envelope = sin(G_PI * (t - synth->motion_start) / (synth->motion_end - synth->motion_start));
+        return synth->motion_amp * envelope * (sin(2.0 * G_PI * synth->motion_hz[0] * t + synth->motion_phase[0]) +
+                                               0.5 * sin(2.0 * G_PI * synth->motion_hz[1] * t + synth->motion_phase[1]));
+}
+
+// The next frame into `last`, sample by sample
+static void _generate(ble_synth *synth)
+{
+        const double dt = PACKAGE_INTERVAL;
+        const double ac_ir = SYNTH_PERFUSION * SYNTH_DC_IR;
+        uint8_t *frame = synth->last;
+
+        for (int i = 0; i < PACKAGE_SAMPLES; i++, synth->sample++)
+        {
+                double t = synth->sample * dt;
+                // Slow wander and respiratory sinus arrhythmia around the set rate
+                synth->drift += -synth->drift / 20.0 * dt + 0.5 * sqrt(dt) * _gauss(synth->rand);
+                double breath = sin(2.0 * G_PI * synth->breath);
+                synth->heart_rate = MAX(synth->config.heart_rate + synth->drift + 3.0 * breath, 20.0);
+                synth->phase = fmod(synth->phase + synth->heart_rate / 60.0 * dt, 1.0);
+                synth->breath = fmod(synth->breath + SYNTH_BREATH_HZ * dt, 1.0);
+
+                double systole = (synth->phase - 0.25) / 0.07, notch = (synth->phase - 0.55) / 0.1;
+                double pulse = (exp(-systole * systole) + 0.35 * exp(-notch * notch)) * (1.0 + 0.1 * breath);
+                double motion = _motion(synth, t);
+                uint16_t red = _adc(SYNTH_DC_RED * (1.0 + 0.01 * breath) - synth->ac_red * pulse + motion +
+                                    synth->config.noise * _gauss(synth->rand));
+                uint16_t ir = _adc(SYNTH_DC_IR * (1.0 + 0.01 * breath) - ac_ir * pulse + 1.2 * motion +
+                                   synth->config.noise * _gauss(synth->rand));
+                memcpy(frame + 2 + i * sizeof(uint16_t), &red, sizeof(red));
+                memcpy(frame + 22 + i * sizeof(uint16_t), &ir, sizeof(ir));
+        }
+        int32_t beat = (int32_t)lround(synth->heart_rate);
+        frame[0] = (uint8_t)synth->stats.frames;
+        frame[1] = (uint8_t)(synth->stats.frames >> 8);
+        memcpy(frame + 42, &beat, sizeof(beat));
+        synth->stats.frames++;
+}
+
+// Until `time` in source seconds, the lock held; false when stopped
+static gboolean _wait(ble_synth *synth, double time)
+{
+        gint64 deadline = synth->config.speed > 0 ?
+                          synth->real_origin + (gint64)(time * G_USEC_PER_SEC / synth->config.speed) : 0;
+
+        while (!synth->stopped && g_get_monotonic_time() < deadline)
+                g_cond_wait_until(&synth->cond, &synth->lock, deadline);
+        return !synth->stopped;
+}
+
+static int _stopped(GError **error)
+{
+        g_set_error(error, BLE_SYNTH_ERROR, BLE_SYNTH_ERROR_STOPPED, "Synthetic sensor stopped");
+        return -1;
+}
+
+static int _read(ble_synth *synth, uint8_t frame[PACKAGE_SIZE], ble_time_t *time, GError **error)
+{
+        double arrival;
+
+        for (;;)
+        {
+                if (synth->disconnected)
+                {
+                        g_set_error(error, BLE_SYNTH_ERROR, BLE_SYNTH_ERROR_DISCONNECTED,
+                                    "Synthetic sensor disconnected");
+                        return -1;
+                }
+                if (synth->duplicate)
+                {
+                        synth->duplicate = false;
+                        synth->stats.duplicated++;
+                        arrival = synth->last_arrival + SYNTH_DUPLICATE_S;
+                        break;
+                }
+                double due = synth->stats.frames * SYNTH_FRAME_S;
+                if (due >= synth->next_disconnect)
+                {
+                        synth->disconnected = true;
+                        synth->down_end = due + synth->config.disconnect_s;
+                        synth->next_disconnect = synth->down_end +
+                                                 _interval(synth->rand, synth->config.disconnects_per_hour / 3600.0);
+                        synth->stats.disconnects++;
+                        continue;
+                }
+                _generate(synth);
+                if (g_rand_double(synth->rand) < synth->config.drop_rate)
+                {
+                        synth->stats.dropped++;
+                        continue;
+                }
+                // Frames due during a stall are held and arrive together
+                if (due >= synth->next_stall)
+                {
+                        synth->stall_end = due + g_rand_double(synth->rand) * synth->config.stall_ms / 1000.0;
+                        synth->next_stall = synth->stall_end + _interval(synth->rand, synth->config.stalls_per_minute / 60.0);
+                        synth->stats.stalls++;
+                }
+                arrival = MAX(due, synth->stall_end);
+                synth->duplicate = g_rand_double(synth->rand) < synth->config.duplicate_rate;
+                break;
+        }
+
+        arrival = MAX(arrival, synth->last_arrival);
+        if (!_wait(synth, arrival))
+                return _stopped(error);
+        memcpy(frame, synth->last, PACKAGE_SIZE);
+        synth->last_arrival = arrival;
+        synth->stats.delivered++;
+        *time = synth->origin + (ble_time_t)(arrival * G_USEC_PER_SEC);
+        return 0;
+}
+
+int ble_synth_read(ble_synth *synth, uint8_t frame[PACKAGE_SIZE], ble_time_t *time, GError **error)
+{
+        g_mutex_lock(&synth->lock);
+        int ret = _read(synth, frame, time, error);
+        g_mutex_unlock(&synth->lock);
+        return ret;
+}
+
+static int _reconnect(ble_synth *synth, GError **error)
+{
+        if (!synth->disconnected)
+                return 0;
+        // What the sensor measured meanwhile never arrives
+        while (synth->stats.frames * SYNTH_FRAME_S < synth->down_end)
+        {
+                _generate(synth);
+                synth->stats.lost++;
+        }
+        if (!_wait(synth, synth->down_end))
+                return _stopped(error);
+        synth->last_arrival = MAX(synth->last_arrival, synth->down_end);
+        synth->duplicate = false;
+        synth->disconnected = false;
+        _debug_print("Synthetic sensor reconnected");
+        return 0;
+}
+
+int ble_synth_reconnect(ble_synth *synth, GError **error)
+{
+        g_mutex_lock(&synth->lock);
+        int ret = _reconnect(synth, error);
+        g_mutex_unlock(&synth->lock);
+        return ret;
+}
+
+void ble_synth_stop(ble_synth *synth)
+{
+        g_mutex_lock(&synth->lock);
+        synth->stopped = true;
+        g_cond_broadcast(&synth->cond);
+        g_mutex_unlock(&synth->lock);
+}
+
+void ble_synth_get_stats(ble_synth *synth, ble_synth_stats *stats)
+{
+        g_mutex_lock(&synth->lock);
+        *stats = synth->stats;
+        g_mutex_unlock(&synth->lock);
+}
+
+void ble_synth_free(ble_synth *synth)
+{
+        if (synth == NULL)
+                return;
+        g_rand_free(synth->rand);
+        g_mutex_clear(&synth->lock);
+        g_cond_clear(&synth->cond);
+        g_free(synth);
+}
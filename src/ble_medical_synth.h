@@ -0,0 +1,83 @@
+#ifndef BLE_MEDICAL_SYNTH_H
+#define BLE_MEDICAL_SYNTH_H
+
+#include <glib.h>
+
+#include "ble_medical_data.h"
+
+/*
+ * A synthetic sensor for soak and throughput tests.
+ *
+ * Frames come in the PACKAGE_SIZE layout pack_from_data() parses: red and
+ * IR photoplethysmograms with a systolic peak and dicrotic notch at the
+ * configured heart rate, their pulse amplitudes in the ratio the SpO2
+ * calls for, respiratory baseline wander and heart rate variability,
+ * sensor noise and bursts of motion artifact, and the rounded heart rate
+ * as beatAvg. The two leading bytes hold a 16-bit frame counter, so every
+ * lost frame shows in a recording.
+ *
+ * The source keeps its own clock, running `speed` times real time: reads
+ * block until their frame is due, and return the source time of its
+ * arrival, in microseconds from g_get_monotonic_time() at creation. At
+ * 100x a day of frames takes under a quarter of an hour.
+ *
+ * Faults come at random, at the configured rates in source time, the same
+ * for a given seed: frames dropped, frames read twice, stalls after which
+ * the held frames arrive at once, and disconnects. A disconnect fails the
+ * read with BLE_SYNTH_ERROR_DISCONNECTED, and reads keep failing until
+ * ble_synth_reconnect(), which takes `disconnect_s`; frames due meanwhile
+ * are lost.
+ */
+
+#define BLE_SYNTH_ERROR                 (ble_synth_error_quark())
+
+typedef enum _ble_synth_error {
+        BLE_SYNTH_ERROR_DISCONNECTED,
+        BLE_SYNTH_ERROR_STOPPED
+} ble_synth_error;
+
+typedef struct _ble_synth_config {
+        double          heart_rate;             // beats per minute
+        double          spo2;                   // percent
+        double          noise;                  // ADC counts RMS on each channel
+        double          motion_per_minute;      // motion artifacts
+        double          motion;                 // their amplitude, ADC counts
+        double          drop_rate;              // fraction of frames lost
+        double          duplicate_rate;         // fraction of frames read twice
+        double          stalls_per_minute;      // delivery jitter bursts
+        double          stall_ms;               // longest stall
+        double          disconnects_per_hour;
+        double          disconnect_s;           // until the reconnection
+        double          speed;                  // times real time, 0 as fast as possible
+        guint32         seed;
+} ble_synth_config;
+
+typedef struct _ble_synth_stats {
+        guint64         frames;                 // generated, lost ones included
+        guint64         delivered;              // duplicates included
+        guint64         dropped;
+        guint64         duplicated;
+        guint64         stalls;
+        guint64         disconnects;
+        guint64         lost;                   // while disconnected
+        guint64         motion;
+} ble_synth_stats;
+
+typedef struct _ble_synth ble_synth;
+
+GQuark ble_synth_error_quark(void);
+
+// A healthy adult at rest in real time, no faults
+void ble_synth_config_default(ble_synth_config*);
+ble_synth *ble_synth_new(const ble_synth_config*);
+// Blocks until the next frame is due and copies it into `frame`
+int ble_synth_read(ble_synth*, uint8_t frame[PACKAGE_SIZE], ble_time_t *time, GError **error);
+// After a disconnect, blocks until the sensor is back
+int ble_synth_reconnect(ble_synth*, GError **error);
+// Wakes a blocked read or reconnection, which then fail, as do later ones
+void ble_synth_stop(ble_synth*);
+// From any thread, even while a read blocks
+void ble_synth_get_stats(ble_synth*, ble_synth_stats*);
+void ble_synth_free(ble_synth*);
+
+#endif
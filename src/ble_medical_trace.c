@@ -0,0 +1,198 @@
+#ifdef __linux__
+#define _GNU_SOURCE
+#include <pthread.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+#include "ble_medical_trace.h"
+
+#include <errno.h>
+#include <stdbool.h>
+#include <stdio.h>
+
+// Rings kept at most; past that, threads that are gone give theirs up
+#define TRACE_RINGS_MAX         64
+
+#define TRACE_MAGIC             "BLETRACE"
+#define TRACE_VERSION           1
+
+G_STATIC_ASSERT(sizeof(ble_trace_event) == 32);
+
+gint ble_trace_on = false;
+__thread ble_trace_ring *ble_trace_local = NULL;
+
+static GMutex rings_lock;
+static GPtrArray *rings = NULL;
+static uint64_t start_ns = 0;
+// Rings given up so far; a thread that found none free retries only once
+// this moves past what it saw, plus one so that 0 is never tried
+static gint rings_retired = 0;
+static __thread guint rings_denied = 0;
+
+#define _BLE_TRACE_ENTRY(id, kind, name, format) { id, BLE_TRACE_KIND_##kind, name, format },
+static const struct {
+        ble_trace_id    id;
+        ble_trace_kind  kind;
+        const char      *name;
+        const char      *format;
+} trace_table[] = {
+        BLE_TRACE_EVENTS(_BLE_TRACE_ENTRY)
+};
+#undef _BLE_TRACE_ENTRY
+
+static void _ring_retire(gpointer data)
+{
+        ble_trace_ring *ring = (ble_trace_ring*)data;
+        g_atomic_int_set(&ring->retired, true);
+        g_atomic_int_inc(&rings_retired);
+}
+
+static GPrivate ring_key = G_PRIVATE_INIT(_ring_retire);
+
+ble_trace_ring *ble_trace_ring_get(void)
+{
+        ble_trace_ring *ring = NULL;
+        guint retired = (guint)g_atomic_int_get(&rings_retired);
+
+        if (rings_denied == retired + 1)
+                return NULL;
+        g_mutex_lock(&rings_lock);
+        if (rings == NULL)
+                rings = g_ptr_array_new();
+        if (rings->len < TRACE_RINGS_MAX)
+        {
+                ring = g_malloc(sizeof(ble_trace_ring));
+                g_ptr_array_add(rings, ring);
+        }
+        else
+        {
+                for (guint i = 0; i < rings->len && ring == NULL; i++)
+                {
+                        ble_trace_ring *old = g_ptr_array_index(rings, i);
+                        if (g_atomic_int_get(&old->retired))
+                                ring = old;
+                }
+        }
+        if (ring != NULL)
+        {
+                ring->head = 0;
+                ring->retired = false;
+                memset(ring->name, 0, sizeof(ring->name));
+#ifdef __linux__
+                ring->thread = (uint32_t)syscall(SYS_gettid);
+                pthread_getname_np(pthread_self(), ring->name, sizeof(ring->name));
+#else
+                ring->thread = rings->len;
+#endif
+        }
+        g_mutex_unlock(&rings_lock);
+
+        // Untraced rather than unbounded when every ring is in use
+        if (ring != NULL)
+        {
+                ble_trace_local = ring;
+                g_private_set(&ring_key, ring);
+        }
+        else
+                rings_denied = retired + 1;
+        return ring;
+}
+
+void ble_trace_start(void)
+{
+        g_mutex_lock(&rings_lock);
+        if (start_ns == 0)
+                start_ns = ble_trace_now();
+        g_mutex_unlock(&rings_lock);
+        __atomic_store_n(&ble_trace_on, true, __ATOMIC_RELAXED);
+}
+
+void ble_trace_stop(void)
+{
+        __atomic_store_n(&ble_trace_on, false, __ATOMIC_RELAXED);
+}
+
+static gboolean _write(FILE *file, const void *data, size_t length)
+{
+        return fwrite(data, 1, length, file) == length;
+}
+
+// The events of `ring` still there once copied, oldest first; the owner
+// goes on writing meanwhile and may overwrite the oldest ones
+static guint _ring_copy(const ble_trace_ring *ring, ble_trace_event *copy)
+{
+        uint64_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+        uint64_t first = head > BLE_TRACE_RING_EVENTS ? head - BLE_TRACE_RING_EVENTS : 0;
+
+        for (uint64_t i = first; i < head; i++)
+                copy[i - first] = ring->events[i & (BLE_TRACE_RING_EVENTS - 1)];
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        // The event being written when we finished replaces head + 1 - N
+        uint64_t now = __atomic_load_n(&ring->head, __ATOMIC_RELAXED);
+        uint64_t valid = now + 1 > BLE_TRACE_RING_EVENTS ? now + 1 - BLE_TRACE_RING_EVENTS : 0;
+        if (valid <= first)
+                return head - first;
+        if (valid >= head)
+                return 0;
+        memmove(copy, copy + (valid - first), (head - valid) * sizeof(ble_trace_event));
+        return head - valid;
+}
+
+/*
+ * File layout, in host byte order:
+ *
+ *   "BLETRACE", u32 version, u32 ids, u32 rings, u32 0, u64 start ns
+ *   per id:     u32 id, u32 kind, u16 name length, u16 format length,
+ *               name, format
+ *   per ring:   u32 thread, char name[16], u32 events, u32 0,
+ *               events of 32 bytes as in ble_trace_event
+ */
+int ble_trace_dump(const gchar *path, GError **error)
+{
+        FILE *file = fopen(path, "wb");
+        gboolean ok = true;
+
+        if (file == NULL)
+        {
+                int saved = errno;
+                g_set_error(error, G_FILE_ERROR, g_file_error_from_errno(saved),
+                            "Trace %s: %s", path, g_strerror(saved));
+                return -1;
+        }
+
+        ble_trace_event *copy = g_new(ble_trace_event, BLE_TRACE_RING_EVENTS);
+        g_mutex_lock(&rings_lock);
+        uint32_t header[4] = { TRACE_VERSION, BLE_TRACE_IDS, rings ? rings->len : 0, 0 };
+        ok = _write(file, TRACE_MAGIC, 8) && _write(file, header, sizeof(header)) &&
+             _write(file, &start_ns, sizeof(start_ns));
+        for (guint i = 0; ok && i < G_N_ELEMENTS(trace_table); i++)
+        {
+                uint32_t entry[2] = { trace_table[i].id, trace_table[i].kind };
+                uint16_t lengths[2] = { strlen(trace_table[i].name), strlen(trace_table[i].format) };
+                ok = _write(file, entry, sizeof(entry)) && _write(file, lengths, sizeof(lengths)) &&
+                     _write(file, trace_table[i].name, lengths[0]) &&
+                     _write(file, trace_table[i].format, lengths[1]);
+        }
+        for (guint i = 0; ok && rings != NULL && i < rings->len; i++)
+        {
+                const ble_trace_ring *ring = g_ptr_array_index(rings, i);
+                uint32_t count = _ring_copy(ring, copy);
+                uint32_t trailer[2] = { count, 0 };
+                ok = _write(file, &ring->thread, sizeof(ring->thread)) &&
+                     _write(file, ring->name, sizeof(ring->name)) &&
+                     _write(file, trailer, sizeof(trailer)) &&
+                     _write(file, copy, count * sizeof(ble_trace_event));
+        }
+        g_mutex_unlock(&rings_lock);
+        g_free(copy);
+
+        if (fclose(file) != 0)
+                ok = false;
+        if (!ok)
+        {
+                g_set_error(error, G_FILE_ERROR, G_FILE_ERROR_IO, "Trace %s could not be written", path);
+                return -1;
+        }
+        return 0;
+}
@@ -0,0 +1,119 @@
+#ifndef BLE_MEDICAL_TRACE_H
+#define BLE_MEDICAL_TRACE_H
+
+#include <glib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+
+/*
+ * A binary flight recorder for the render and acquisition hot paths.
+ *
+ * Every thread that traces writes fixed-size events into a ring of its
+ * own, so recording takes no lock and no system call: a relaxed load of
+ * the on switch, a vDSO clock read and a few stores, 20-50 ns depending
+ * mostly on the clock. Events
+ * carry a compile-time id from the table below and up to two integer
+ * arguments; the text lives only in the table, which ble_trace_dump()
+ * writes ahead of the rings, so tools/ble_trace can decode a dump to text
+ * or Chrome trace JSON without this build. A full ring overwrites its
+ * oldest events, keeping the last few seconds before the dump.
+ *
+ * Tracing is off until ble_trace_start(); until then each event costs a
+ * predicted branch.
+ */
+
+typedef enum _ble_trace_kind {
+        BLE_TRACE_KIND_INSTANT,
+        BLE_TRACE_KIND_BEGIN,           // opens a span on its thread
+        BLE_TRACE_KIND_END              // closes the innermost one
+} ble_trace_kind;
+
+// id, kind, name, format. The format takes "{}" for an integer argument
+// and "{f}" for a double passed through ble_trace_double().
+#define BLE_TRACE_EVENTS(X) \
+        X(BLE_TRACE_READ,            INSTANT, "read",            "frame of {} bytes") \
+        X(BLE_TRACE_READ_ERROR,      INSTANT, "read_error",      "read failed") \
+        X(BLE_TRACE_FRAME_DROPPED,   INSTANT, "frame_dropped",   "frame of {} bytes left out") \
+        X(BLE_TRACE_RECONNECT,       INSTANT, "reconnect",       "sensor back after {} ms") \
+        X(BLE_TRACE_BATCH_BEGIN,     BEGIN,   "batch",           "{} items, oldest queued {} us") \
+        X(BLE_TRACE_BATCH_END,       END,     "batch",           "") \
+        X(BLE_TRACE_QUEUE_DROP,      INSTANT, "queue_drop",      "oldest of {} queued dropped") \
+        X(BLE_TRACE_APPEND_BEGIN,    BEGIN,   "append",          "") \
+        X(BLE_TRACE_APPEND_END,      END,     "append",          "{} bytes written") \
+        X(BLE_TRACE_FSYNC,           INSTANT, "fsync",           "took {} us") \
+        X(BLE_TRACE_SNAPSHOT_BEGIN,  BEGIN,   "snapshot",        "{} x {} px") \
+        X(BLE_TRACE_SNAPSHOT_END,    END,     "snapshot",        "") \
+        X(BLE_TRACE_SCALE_POINT,     INSTANT, "scale_point",     "last point {f} : {f}") \
+        X(BLE_TRACE_SCALE_FRAME,     INSTANT, "scale_frame",     "frame changed, y {f} to {f}")
+
+#define _BLE_TRACE_ID(id, kind, name, format) id,
+typedef enum _ble_trace_id {
+        BLE_TRACE_EVENTS(_BLE_TRACE_ID)
+        BLE_TRACE_IDS
+} ble_trace_id;
+#undef _BLE_TRACE_ID
+
+// Events kept per thread, a power of two; 32 bytes each
+#define BLE_TRACE_RING_EVENTS           (1 << 14)
+
+typedef struct _ble_trace_event {
+        uint64_t        ns;             // CLOCK_MONOTONIC
+        uint32_t        id;
+        uint32_t        reserved;
+        int64_t         args[2];
+} ble_trace_event;
+
+typedef struct _ble_trace_ring {
+        uint64_t        head;           // events ever written, by the owner only
+        uint32_t        thread;
+        char            name[16];
+        gboolean        retired;        // its thread is gone
+        ble_trace_event events[BLE_TRACE_RING_EVENTS];
+} ble_trace_ring;
+
+extern gint ble_trace_on;
+extern __thread ble_trace_ring *ble_trace_local;
+
+// The calling thread's ring, registered on its first event. NULL when
+// every ring is in use, then without locking until a thread gives one up
+ble_trace_ring *ble_trace_ring_get(void);
+
+static inline uint64_t ble_trace_now(void)
+{
+        struct timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        return (uint64_t)now.tv_sec * 1000000000u + (uint64_t)now.tv_nsec;
+}
+
+static inline int64_t ble_trace_double(double value)
+{
+        int64_t bits;
+        memcpy(&bits, &value, sizeof(bits));
+        return bits;
+}
+
+static inline void ble_trace(ble_trace_id id, int64_t a, int64_t b)
+{
+        if (G_LIKELY(!__atomic_load_n(&ble_trace_on, __ATOMIC_RELAXED)))
+                return;
+        ble_trace_ring *ring = ble_trace_local;
+        if (G_UNLIKELY(ring == NULL) && (ring = ble_trace_ring_get()) == NULL)
+                return;
+        uint64_t head = ring->head;
+        ble_trace_event *event = &ring->events[head & (BLE_TRACE_RING_EVENTS - 1)];
+        event->ns = ble_trace_now();
+        event->id = id;
+        event->reserved = 0;
+        event->args[0] = a;
+        event->args[1] = b;
+        // Publishes the event to a dump running on another thread
+        __atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+}
+
+void ble_trace_start(void);
+void ble_trace_stop(void);
+// Writes the event table and every ring to `path`, while tracing goes on
+int ble_trace_dump(const gchar *path, GError **error);
+
+#endif
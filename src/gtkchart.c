@@ -37,6 +37,8 @@ struct chart_point_t
 {
     double x;
     double y;
+    gint64 received;  // 0 unless stamped
+    gint64 ingested;
 };
 
 struct _GtkChart
@@ -63,6 +65,7 @@ struct _GtkChart
     int width;
     void *user_data;
     GSList *point_list;
+    GSList *point_tail;      // last link of point_list, appended to
     GSList *point_last;
     GtkSnapshot *snapshot;
     GdkRGBA text_color;
@@ -70,6 +73,13 @@ struct _GtkChart
     GdkRGBA grid_color;
     GdkRGBA axis_color;
     gchar *font_name;
+    GSList *point_reported;  // last point already passed to drawn_func
+    GtkChartDrawnFunc drawn_func;
+    gpointer drawn_data;
+    GDestroyNotify drawn_destroy;
+    GtkChartEventFunc event_func;
+    gpointer event_data;
+    GDestroyNotify event_destroy;
 };
 
 struct _GtkChartClass
@@ -79,6 +89,12 @@ struct _GtkChartClass
 
 G_DEFINE_TYPE (GtkChart, gtk_chart, GTK_TYPE_WIDGET)
 
+static void chart_event(GtkChart *self, GtkChartEvent event, double a, double b)
+{
+    if (self->event_func != NULL)
+        self->event_func(self, event, a, b, self->event_data);
+}
+
 static void gtk_chart_init(GtkChart *self)
 {
     // Defaults
@@ -98,8 +114,12 @@ static void gtk_chart_init(GtkChart *self)
     self->grid_color.alpha = -1.0;
     self->axis_color.alpha = -1.0;
     self->font_name = NULL;
+    self->point_tail = NULL;
     self->point_last = NULL;
     self->point_start = NULL;
+    self->point_reported = NULL;
+    self->drawn_func = NULL;
+    self->event_func = NULL;
 
     // Automatically use GTK font
     GtkSettings *widget_settings = gtk_widget_get_settings(&self->parent_instance);
@@ -145,11 +165,14 @@ static void gtk_chart_dispose (GObject *object)
     g_free(self->label);
     g_free(self->x_label);
     g_free(self->y_label);
+    gtk_chart_set_drawn_func(self, NULL, NULL, NULL);
+    gtk_chart_set_event_func(self, NULL, NULL, NULL);
 
     gdk_display_sync(gdk_display_get_default());
 
     g_slist_free_full(g_steal_pointer(&self->point_list), g_free);
     g_slist_free(self->point_list);
+    self->point_tail = NULL;
 
     G_OBJECT_CLASS (gtk_chart_parent_class)->dispose (object);
 }
@@ -439,7 +462,7 @@ static void chart_draw_auto_scale(GtkChart *self,
         self->point_start = self->point_list;
     list = self->point_last;
     struct chart_point_t *point = list->data;
-    g_print("%.1f : %.1f\t", point->x, point->y);
+    chart_event(self, GTK_CHART_EVENT_SCALE_POINT, point->x, point->y);
     if (point->x > self->x_upper)
     {
         struct chart_point_t *tp = self->point_start->data;
@@ -461,7 +484,7 @@ static void chart_draw_auto_scale(GtkChart *self,
         self->x_lower = self->x_upper;
         self->x_upper += self->x_interval;
         self->point_start = list;
-        g_print("[DEBUG]: Frame changed\n");
+        chart_event(self, GTK_CHART_EVENT_SCALE_FRAME, min_y, max_y);
     }
 
     cairo_t *cr = gtk_snapshot_append_cairo(snapshot, &GRAPHENE_RECT_INIT(0, 0, w, h));
@@ -965,6 +988,7 @@ static void gtk_chart_snapshot (GtkWidget   *widget,
 
     float width = gtk_widget_get_width (widget);
     float height = gtk_widget_get_height (widget);
+    chart_event(self, GTK_CHART_EVENT_SNAPSHOT_BEGIN, width, height);
 
     // Automatically update colors if none set
     GtkStyleContext *context = gtk_widget_get_style_context(&self->parent_instance);
@@ -1019,10 +1043,27 @@ static void gtk_chart_snapshot (GtkWidget   *widget,
             chart_draw_unknown_type(self, snapshot, height, width);
             break;
     }
+
+    // Report the stamped points this snapshot draws for the first time.
+    // Points are only appended on the main thread, so the list holds
+    // still during the walk.
+    if (self->drawn_func != NULL)
+    {
+        GSList *l = self->point_reported ? self->point_reported->next : self->point_list;
+        gint64 now = g_get_monotonic_time();
+        for (; l != NULL; l = l->next)
+        {
+            struct chart_point_t *point = l->data;
+            if (point->ingested != 0)
+                self->drawn_func(self, point->received, point->ingested, now, self->drawn_data);
+            self->point_reported = l;
+        }
+    }
     goto RETURN;
 
 RETURN:
     self->snapshot = snapshot;
+    chart_event(self, GTK_CHART_EVENT_SNAPSHOT_END, 0, 0);
 }
 
 static void gtk_chart_class_init (GtkChartClass *class)
@@ -1140,14 +1181,30 @@ EXPORT void gtk_chart_set_width(GtkChart *chart, int width)
 }
 
 EXPORT void gtk_chart_plot_point(GtkChart *chart, double x, double y)
+{
+    gtk_chart_plot_point_stamped(chart, x, y, 0, 0);
+}
+
+EXPORT void gtk_chart_plot_point_stamped(GtkChart *chart, double x, double y, gint64 received, gint64 ingested)
 {
     // Allocate memory for new point
     struct chart_point_t *point = g_new0(struct chart_point_t, 1);
     point->x = x;
     point->y = y;
+    point->received = received;
+    point->ingested = ingested;
 
-    // Add point to list to be drawn
-    chart->point_list = g_slist_append(chart->point_list, point);
+    // Add point to list to be drawn, after the tail rather than walking to it
+    GSList *link = g_slist_prepend(NULL, point);
+    if (chart->point_tail == NULL)
+    {
+        chart->point_list = link;
+    }
+    else
+    {
+        chart->point_tail->next = link;
+    }
+    chart->point_tail = link;
 
     // Queue draw of widget
     if (GTK_IS_WIDGET(chart))
@@ -1156,6 +1213,30 @@ EXPORT void gtk_chart_plot_point(GtkChart *chart, double x, double y)
     }
 }
 
+EXPORT void gtk_chart_set_drawn_func(GtkChart *chart, GtkChartDrawnFunc func, gpointer user_data, GDestroyNotify destroy)
+{
+    if (chart->drawn_destroy != NULL)
+    {
+        chart->drawn_destroy(chart->drawn_data);
+    }
+    chart->drawn_func = func;
+    chart->drawn_data = user_data;
+    chart->drawn_destroy = destroy;
+    // Points plotted before are not reported
+    chart->point_reported = chart->point_tail;
+}
+
+EXPORT void gtk_chart_set_event_func(GtkChart *chart, GtkChartEventFunc func, gpointer user_data, GDestroyNotify destroy)
+{
+    if (chart->event_destroy != NULL)
+    {
+        chart->event_destroy(chart->event_data);
+    }
+    chart->event_func = func;
+    chart->event_data = user_data;
+    chart->event_destroy = destroy;
+}
+
 EXPORT void gtk_chart_set_value(GtkChart *chart, double value)
 {
     chart->value = value;
@@ -60,6 +60,21 @@ typedef enum
   GTK_CHART_TYPE_NUMBER
 } GtkChartType;
 
+// Called from the snapshot that first draws a point stamped with
+// gtk_chart_plot_point_stamped(), all times from g_get_monotonic_time()
+typedef void (*GtkChartDrawnFunc)(GtkChart *chart, gint64 received, gint64 ingested, gint64 drawn, gpointer user_data);
+
+typedef enum
+{
+  GTK_CHART_EVENT_SNAPSHOT_BEGIN,   // a, b: width and height in pixels
+  GTK_CHART_EVENT_SNAPSHOT_END,
+  GTK_CHART_EVENT_SCALE_POINT,      // a, b: the last point scaled to
+  GTK_CHART_EVENT_SCALE_FRAME       // a, b: the new y range
+} GtkChartEvent;
+
+// Called on the main loop as the chart draws, to time or trace it
+typedef void (*GtkChartEventFunc)(GtkChart *chart, GtkChartEvent event, double a, double b, gpointer user_data);
+
 EXPORT GtkWidget * gtk_chart_new (void);
 EXPORT void gtk_chart_set_type(GtkChart *chart, GtkChartType type);
 EXPORT void gtk_chart_set_title(GtkChart *chart, const char *title);
@@ -69,7 +84,11 @@ EXPORT void gtk_chart_set_y_label(GtkChart *chart, const char *y_label);
 EXPORT void gtk_chart_set_x_max(GtkChart *chart, double x_max);
 EXPORT void gtk_chart_set_y_max(GtkChart *chart, double y_max);
 EXPORT void gtk_chart_set_width(GtkChart *chart, int width);
+// Points are plotted from the main thread, as every GTK call
 EXPORT void gtk_chart_plot_point(GtkChart *chart, double x, double y);
+EXPORT void gtk_chart_plot_point_stamped(GtkChart *chart, double x, double y, gint64 received, gint64 ingested);
+EXPORT void gtk_chart_set_drawn_func(GtkChart *chart, GtkChartDrawnFunc func, gpointer user_data, GDestroyNotify destroy);
+EXPORT void gtk_chart_set_event_func(GtkChart *chart, GtkChartEventFunc func, gpointer user_data, GDestroyNotify destroy);
 EXPORT void gtk_chart_set_value(GtkChart *chart, double value);
 EXPORT void gtk_chart_set_value_min(GtkChart *chart, double value);
 EXPORT void gtk_chart_set_value_max(GtkChart *chart, double value);
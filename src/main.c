@@ -3,11 +3,66 @@
 #include <glib/gi18n.h>
 #include "ble_medical.h"
 
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define UI_RESOURCE     "/org/gtk/ble-medical/builder.ui"
+// Set to print the time from process start to the first frame on stderr;
+// "exit" also quits once it is drawn, for `make startup`
+#define STARTUP_ENV     "BLE_MEDICAL_STARTUP"
+// A Unix socket to serve the runtime metrics on
+#define METRICS_ENV     "BLE_MEDICAL_METRICS"
+// A file to write the trace of the hot paths to at exit
+#define TRACE_ENV       "BLE_MEDICAL_TRACE"
+
+static gint64 _main_time;
+
+// Process start on the monotonic clock, from /proc/self/stat to the clock
+// tick; the entry of main() when it cannot be read
+static gint64 _process_start_time(void)
+{
+        g_autofree gchar *stat = NULL;
+        struct timespec now;
+
+        if (!g_file_get_contents("/proc/self/stat", &stat, NULL, NULL) ||
+            clock_gettime(CLOCK_BOOTTIME, &now) != 0)
+                return _main_time;
+        // starttime is field 22, the command name in field 2 may hold spaces
+        const gchar *p = strrchr(stat, ')');
+        for (int field = 2; p != NULL && field < 22; field++)
+                p = strchr(p + 1, ' ');
+        if (p == NULL)
+                return _main_time;
+        guint64 ticks = g_ascii_strtoull(p + 1, NULL, 10);
+        gint64 age = (gint64)now.tv_sec * G_USEC_PER_SEC + now.tv_nsec / 1000 -
+                     (gint64)(ticks * G_USEC_PER_SEC / sysconf(_SC_CLK_TCK));
+        return MIN(g_get_monotonic_time() - age, _main_time);
+}
+
+static void _first_frame(GdkFrameClock *clock, gpointer data)
+{
+        gint64 now = g_get_monotonic_time();
+        gint64 start = _process_start_time();
+
+        g_signal_handlers_disconnect_by_func(clock, _first_frame, data);
+        g_printerr("Startup: %.1f ms to first frame, %.1f ms of it before main()\n",
+                   (now - start) / 1000.0, (_main_time - start) / 1000.0);
+        if (g_strcmp0(g_getenv(STARTUP_ENV), "exit") == 0)
+                g_application_quit(G_APPLICATION(data));
+}
+
+static void _window_mapped(GtkWidget *window, gpointer data)
+{
+        g_signal_connect(gtk_widget_get_frame_clock(window), "after-paint", G_CALLBACK(_first_frame), data);
+}
+
 static void activate (  GtkApplication  *app,
                         gpointer        user_data)
 {
-        GtkBuilder *builder = gtk_builder_new ();
-        gtk_builder_add_from_file (builder, "builder.ui", NULL);
+        // Compiled in, so no file is read or looked up; dialogs are built
+        // from their own resources on first use
+        GtkBuilder *builder = gtk_builder_new_from_resource (UI_RESOURCE);
 
         GObject *window = gtk_builder_get_object (builder, "window");
         gtk_window_set_application (GTK_WINDOW (window), app);
@@ -20,6 +75,8 @@ static void activate (  GtkApplication  *app,
         gtk_window_set_default_size(GTK_WINDOW(window), 1000, 700);
         gtk_widget_set_size_request(GTK_WIDGET(window), 1000, 700);
         gtk_window_set_resizable(GTK_WINDOW(window), false);
+        if (g_getenv(STARTUP_ENV) != NULL)
+                g_signal_connect(window, "map", G_CALLBACK(_window_mapped), app);
         gtk_widget_show (GTK_WIDGET (window));
 
         // Remember to free memory
@@ -28,6 +85,7 @@ static void activate (  GtkApplication  *app,
 
 int main (int argc,char *argv[])
 {
+        _main_time = g_get_monotonic_time();
 #ifdef GTK_SRCDIR
         g_chdir (GTK_SRCDIR);
 #endif
@@ -35,7 +93,19 @@ int main (int argc,char *argv[])
         GtkApplication *app = gtk_application_new ("org.gtk.ble-medical", G_APPLICATION_DEFAULT_FLAGS);
         g_signal_connect (app, "activate", G_CALLBACK (activate), NULL);
 
+        g_autoptr(GError) error = NULL;
+        const gchar *metrics_path = g_getenv(METRICS_ENV);
+        if (metrics_path != NULL && ble_metrics_serve(metrics_path, &error) != 0)
+                g_printerr("%s\n", error->message);
+        g_clear_error(&error);
+        const gchar *trace_path = g_getenv(TRACE_ENV);
+        if (trace_path != NULL)
+                ble_trace_start();
+
         int status = g_application_run (G_APPLICATION (app), argc, argv);
+        ble_metrics_shutdown();
+        if (trace_path != NULL && ble_trace_dump(trace_path, &error) != 0)
+                g_printerr("%s\n", error->message);
         g_object_unref (app);
 
         return status;
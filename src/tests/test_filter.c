@@ -0,0 +1,123 @@
+/*
+ * PPG band-pass: DC removal, the frequency response of the cascade, and
+ * the SSE2 path against the scalar one.
+ *
+ *   make check
+ */
+#include "../ble_medical_filter.h"
+
+#include <glib.h>
+
+#include <math.h>
+
+// The sensor rate, 1 / PACKAGE_INTERVAL
+#define RATE            120.0
+// Long enough for the slowest section and the DC tracking to settle
+#define SETTLE_S        30.0
+#define MEASURE_S       20.0
+
+// Peak output for a sine of `hz` on an offset, once settled
+static double _gain(double hz)
+{
+        guint settle = (guint)(SETTLE_S * RATE), count = settle + (guint)(MEASURE_S * RATE);
+        double *samples = g_new(double, count);
+        ble_filter_bank *bank = ble_filter_bank_new(1, RATE, BLE_FILTER_LOW_HZ, BLE_FILTER_HIGH_HZ);
+        double peak = 0;
+
+        for (guint i = 0; i < count; i++)
+                samples[i] = 30000.0 + 1000.0 * sin(2.0 * G_PI * hz * i / RATE);
+        ble_filter_bank_run(bank, samples, count);
+        for (guint i = settle; i < count; i++)
+                peak = MAX(peak, fabs(samples[i]));
+        ble_filter_bank_free(bank);
+        g_free(samples);
+        return peak / 1000.0;
+}
+
+static void test_dc(void)
+{
+        guint count = (guint)(SETTLE_S * RATE);
+        double *samples = g_new(double, count);
+        ble_filter_bank *bank = ble_filter_bank_new(1, RATE, BLE_FILTER_LOW_HZ, BLE_FILTER_HIGH_HZ);
+
+        // Started on the first sample, the offset is never seen as a step
+        for (guint i = 0; i < count; i++)
+                samples[i] = 40000.0;
+        ble_filter_bank_run(bank, samples, count);
+        for (guint i = 0; i < count; i++)
+                g_assert_cmpfloat(fabs(samples[i]), <, 1e-6);
+
+        // Nor after a reset, on a new level
+        ble_filter_bank_reset(bank);
+        for (guint i = 0; i < count; i++)
+                samples[i] = 20000.0;
+        ble_filter_bank_run(bank, samples, count);
+        for (guint i = 0; i < count; i++)
+                g_assert_cmpfloat(fabs(samples[i]), <, 1e-6);
+        ble_filter_bank_free(bank);
+        g_free(samples);
+}
+
+static void test_response(void)
+{
+        double center = sqrt(BLE_FILTER_LOW_HZ * BLE_FILTER_HIGH_HZ);
+
+        // Flat in the band, about -3 dB at both edges, and the 4th-order
+        // slopes well outside
+        g_assert_cmpfloat(_gain(center), >, 0.95);
+        g_assert_cmpfloat(_gain(center), <, 1.02);
+        g_assert_cmpfloat(_gain(1.2), >, 0.9);
+        g_assert_cmpfloat(_gain(BLE_FILTER_LOW_HZ), >, 0.6);
+        g_assert_cmpfloat(_gain(BLE_FILTER_LOW_HZ), <, 0.75);
+        g_assert_cmpfloat(_gain(BLE_FILTER_HIGH_HZ), >, 0.6);
+        g_assert_cmpfloat(_gain(BLE_FILTER_HIGH_HZ), <, 0.75);
+        g_assert_cmpfloat(_gain(BLE_FILTER_LOW_HZ / 5.0), <, 0.01);
+        g_assert_cmpfloat(_gain(BLE_FILTER_HIGH_HZ * 5.0), <, 0.01);
+        g_assert_cmpfloat(_gain(50.0), <, 1e-3);
+}
+
+// Three channels, two through SSE2 where there is SSE2 and the last one
+// scalar, against each channel alone in a bank of one, which is scalar
+// only; fed in uneven chunks, so state carries over between calls
+static void test_lanes(void)
+{
+        const guint channels = 3, count = 6000;
+        double *interleaved = g_new(double, channels * count);
+        double *single = g_new(double, count);
+        ble_filter_bank *bank = ble_filter_bank_new(channels, RATE, BLE_FILTER_LOW_HZ, BLE_FILTER_HIGH_HZ);
+        GRand *rand = g_rand_new_with_seed(7);
+
+        for (guint i = 0; i < count; i++)
+                for (guint c = 0; c < channels; c++)
+                        interleaved[i * channels + c] = 30000.0 + 5000.0 * c +
+                                                        800.0 * sin(2.0 * G_PI * (1.0 + 0.3 * c) * i / RATE) +
+                                                        g_rand_double_range(rand, -20.0, 20.0);
+        double *input = g_memdup2(interleaved, channels * count * sizeof(double));
+        for (guint done = 0, chunk = 1; done < count; done += chunk, chunk = chunk * 3 % 97 + 1)
+                ble_filter_bank_run(bank, interleaved + done * channels, MIN(chunk, count - done));
+
+        for (guint c = 0; c < channels; c++)
+        {
+                ble_filter_bank *alone = ble_filter_bank_new(1, RATE, BLE_FILTER_LOW_HZ, BLE_FILTER_HIGH_HZ);
+                for (guint i = 0; i < count; i++)
+                        single[i] = input[i * channels + c];
+                ble_filter_bank_run(alone, single, count);
+                for (guint i = 0; i < count; i++)
+                        g_assert_cmpfloat_with_epsilon(interleaved[i * channels + c], single[i], 1e-9);
+                ble_filter_bank_free(alone);
+        }
+        g_rand_free(rand);
+        g_free(input);
+        g_free(single);
+        g_free(interleaved);
+        ble_filter_bank_free(bank);
+}
+
+int main(int argc, char **argv)
+{
+        g_test_init(&argc, &argv, NULL);
+        g_test_add_func("/filter/dc", test_dc);
+        g_test_add_func("/filter/response", test_response);
+        g_test_add_func("/filter/sse2-scalar", test_lanes);
+        return g_test_run();
+}
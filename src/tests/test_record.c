@@ -0,0 +1,478 @@
+/*
+ * Recording format: CRC32C, the sample codec, writing and reading back,
+ * failed writes and crash recovery.
+ *
+ *   make check
+ */
+#include "../ble_medical_codec.h"
+#include "../ble_medical_crc.h"
+#include "../ble_medical_reader.h"
+#include "../ble_medical_record.h"
+
+#include <glib.h>
+#include <glib/gstdio.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define FRAME_US        83333
+
+static gchar *tmp_dir;
+
+static gchar *_path(const gchar *name)
+{
+        gchar *path = g_build_filename(tmp_dir, name, NULL);
+        g_autofree gchar *journal = g_strconcat(path, BLE_RECORD_JOURNAL_SUFFIX, NULL);
+        g_remove(path);
+        g_remove(journal);
+        return path;
+}
+
+static int64_t _now_us(void)
+{
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+// Frame `i` of a reproducible recording: a slow wave with some noise, so
+// the codec sees both runs of small deltas and wider groups
+static void _frame(uint64_t i, uint8_t frame[PACKAGE_SIZE])
+{
+        uint32_t seed = (uint32_t)i * 2654435761u;
+        int32_t beat = 60 + (int32_t)(i % 40);
+
+        frame[0] = (uint8_t)i;
+        frame[1] = (uint8_t)(i >> 8);
+        for (int s = 0; s < PACKAGE_SAMPLES; s++)
+        {
+                seed = seed * 1103515245u + 12345u;
+                uint16_t red = (uint16_t)(30000 + (i * PACKAGE_SAMPLES + s) % 500 + (seed >> 28));
+                uint16_t ir = (uint16_t)(40000 - (i * PACKAGE_SAMPLES + s) % 700 + (seed >> 20 & 0xff));
+                memcpy(frame + 2 + s * sizeof(uint16_t), &red, sizeof(red));
+                memcpy(frame + 22 + s * sizeof(uint16_t), &ir, sizeof(ir));
+        }
+        memcpy(frame + 42, &beat, sizeof(beat));
+}
+
+static int64_t _time(uint64_t i)
+{
+        return 1000000 + (int64_t)i * FRAME_US;
+}
+
+static void _append_frames(ble_record *record, uint64_t first, uint64_t count)
+{
+        uint8_t frame[PACKAGE_SIZE];
+        for (uint64_t i = first; i < first + count; i++)
+        {
+                _frame(i, frame);
+                g_assert_cmpint(ble_record_append(record, _time(i), frame), ==, 0);
+        }
+}
+
+// Every frame of the recording at `path` is frame 0 to `frames` - 1
+static void _check_frames(const gchar *path, uint64_t frames)
+{
+        ble_reader *reader = ble_reader_open(path);
+        ble_frames *block = g_new0(ble_frames, 1);
+        uint8_t frame[PACKAGE_SIZE];
+        uint64_t i = 0;
+
+        g_assert_nonnull(reader);
+        g_assert_cmpuint(reader->frames, ==, frames);
+        for (uint32_t b = 0; b < reader->blocks; b++)
+        {
+                g_assert_cmpint(ble_reader_block(reader, b, block), ==, 0);
+                for (uint32_t f = 0; f < block->count; f++, i++)
+                {
+                        _frame(i, frame);
+                        g_assert_cmpint(block->times[f], ==, _time(i));
+                        g_assert_cmpuint(block->t1[f], ==, frame[0]);
+                        g_assert_cmpuint(block->t2[f], ==, frame[1]);
+                        g_assert_cmpmem(block->red + f * PACKAGE_SAMPLES, sizeof(uint16_t) * PACKAGE_SAMPLES,
+                                        frame + 2, sizeof(uint16_t) * PACKAGE_SAMPLES);
+                        g_assert_cmpmem(block->ir + f * PACKAGE_SAMPLES, sizeof(uint16_t) * PACKAGE_SAMPLES,
+                                        frame + 22, sizeof(uint16_t) * PACKAGE_SAMPLES);
+                        g_assert_cmpmem(&block->beat[f], sizeof(int32_t), frame + 42, sizeof(int32_t));
+                }
+        }
+        g_assert_cmpuint(i, ==, frames);
+        g_free(block);
+        ble_reader_close(reader);
+}
+
+// What a crash leaves: nothing flushed or synced beyond what already was
+static void _abandon(ble_record *record)
+{
+        close(record->fd);
+        if (record->journal_fd >= 0)
+                close(record->journal_fd);
+        free(record->index);
+        ble_summary_free(&record->summary);
+        ble_aggregate_free(&record->aggregate);
+        free(record->path);
+        free(record);
+}
+
+static void _rewrite_header(const gchar *path, void (*change)(ble_record_header*))
+{
+        ble_record_header header;
+        int fd = g_open(path, O_RDWR, 0);
+
+        g_assert_cmpint(fd, >=, 0);
+        g_assert_cmpint(pread(fd, &header, sizeof(header), 0), ==, sizeof(header));
+        change(&header);
+        header.crc = ble_crc32c(0, &header, offsetof(ble_record_header, crc));
+        g_assert_cmpint(pwrite(fd, &header, sizeof(header), 0), ==, sizeof(header));
+        close(fd);
+}
+
+static void test_crc32c(void)
+{
+        static const char check[] = "123456789";
+
+        g_assert_cmphex(ble_crc32c(0, check, 9), ==, 0xe3069283);
+        g_assert_cmphex(ble_crc32c(ble_crc32c(0, check, 4), check + 4, 5), ==, 0xe3069283);
+        g_assert_cmphex(ble_crc32c(0, check, 0), ==, 0);
+}
+
+static void test_codec(void)
+{
+        static const size_t lengths[] = { 1, 7, 127, 128, 129, 640, 1000 };
+        GRand *rand = g_rand_new_with_seed(28);
+
+        for (int impl = BLE_CODEC_SCALAR; impl < BLE_CODEC_AUTO; impl++)
+        {
+                if (ble_codec_select((ble_codec_impl)impl) != (ble_codec_impl)impl)
+                        continue;
+                for (size_t l = 0; l < G_N_ELEMENTS(lengths); l++)
+                {
+                        size_t n = lengths[l];
+                        g_autofree uint16_t *in = g_new(uint16_t, n);
+                        g_autofree uint16_t *out = g_new(uint16_t, n);
+                        g_autofree uint8_t *packed = g_malloc(ble_codec_bound(n));
+
+                        // Smooth, then full-range noise, then constant
+                        for (int kind = 0; kind < 3; kind++)
+                        {
+                                for (size_t i = 0; i < n; i++)
+                                        in[i] = kind == 0 ? (uint16_t)(30000 + (i * 37) % 211) :
+                                                kind == 1 ? (uint16_t)g_rand_int_range(rand, 0, 65536) : 4242;
+                                size_t len = ble_codec_encode(in, n, packed);
+                                g_assert_cmpuint(len, <=, ble_codec_bound(n));
+                                g_assert_cmpuint(ble_codec_decode(packed, len, out, n), ==, len);
+                                g_assert_cmpmem(in, n * sizeof(*in), out, n * sizeof(*out));
+                                // Cut short, it must refuse rather than read on
+                                g_assert_cmpuint(ble_codec_decode(packed, len - 1, out, n), ==, 0);
+                        }
+                }
+        }
+        ble_codec_select(BLE_CODEC_AUTO);
+        g_rand_free(rand);
+}
+
+static void test_round_trip(void)
+{
+        g_autofree gchar *path = _path("round_trip.blerec");
+        ble_record_meta meta = { "id-1", "Name", "2026-10-19" };
+        ble_record_recovery report;
+        ble_record_header header;
+        const uint64_t frames = 1000;
+
+        ble_record *record = ble_record_open(path, &report);
+        g_assert_nonnull(record);
+        g_assert_true(report.created);
+        _append_frames(record, 0, frames);
+        g_assert_cmpint(ble_record_finalize(record, &meta), ==, 0);
+        g_assert_cmpint(ble_record_close(record), ==, 0);
+
+        g_assert_cmpint(ble_record_read_header(path, &header), ==, 0);
+        g_assert_true(header.flags & BLE_RECORD_FINALIZED);
+        g_assert_cmpuint(header.frames, ==, frames);
+        g_assert_cmpint(header.t_first, ==, _time(0));
+        g_assert_cmpint(header.t_last, ==, _time(frames - 1));
+        g_assert_cmpstr(header.name, ==, "Name");
+        g_assert_cmpuint(header.index_offset, !=, 0);
+        _check_frames(path, frames);
+}
+
+// A block that cannot be written stays buffered, refusing frames, until a
+// retry gets it out
+static void test_failed_flush(void)
+{
+        g_autofree gchar *path = _path("failed_flush.blerec");
+        uint8_t frame[PACKAGE_SIZE];
+
+        ble_record *record = ble_record_open(path, NULL);
+        g_assert_nonnull(record);
+        _append_frames(record, 0, BLE_RECORD_BLOCK_FRAMES - 1);
+
+        int writable = dup(record->fd);
+        int read_only = g_open(path, O_RDONLY, 0);
+        g_assert_cmpint(dup2(read_only, record->fd), ==, record->fd);
+        close(read_only);
+
+        _frame(BLE_RECORD_BLOCK_FRAMES - 1, frame);
+        g_assert_cmpint(ble_record_append(record, _time(BLE_RECORD_BLOCK_FRAMES - 1), frame), ==, -1);
+        g_assert_cmpuint(record->count, ==, BLE_RECORD_BLOCK_FRAMES);
+        _frame(BLE_RECORD_BLOCK_FRAMES, frame);
+        for (int i = 0; i < 3; i++)
+        {
+                g_assert_cmpint(ble_record_append(record, _time(BLE_RECORD_BLOCK_FRAMES), frame), ==, -1);
+                g_assert_cmpuint(record->count, ==, BLE_RECORD_BLOCK_FRAMES);
+        }
+
+        g_assert_cmpint(dup2(writable, record->fd), ==, record->fd);
+        close(writable);
+        g_assert_cmpint(ble_record_append(record, _time(BLE_RECORD_BLOCK_FRAMES), frame), ==, 0);
+        g_assert_cmpuint(record->frames, ==, BLE_RECORD_BLOCK_FRAMES);
+        g_assert_cmpint(ble_record_close(record), ==, 0);
+        _check_frames(path, BLE_RECORD_BLOCK_FRAMES + 1);
+}
+
+static void test_recovery(void)
+{
+        g_autofree gchar *path = _path("recovery.blerec");
+        const uint64_t synced = BLE_RECORD_SYNC_BLOCKS * BLE_RECORD_BLOCK_FRAMES;
+        ble_record_recovery report;
+
+        ble_record *record = ble_record_open(path, NULL);
+        g_assert_nonnull(record);
+        // One checkpoint, one more complete block and one torn by the crash
+        _append_frames(record, 0, synced + 2 * BLE_RECORD_BLOCK_FRAMES);
+        g_assert_cmpuint(record->syncs, ==, 1);
+        uint64_t checkpoint = record->index[BLE_RECORD_SYNC_BLOCKS].offset;
+        uint64_t torn = record->index[BLE_RECORD_SYNC_BLOCKS + 1].offset;
+        g_assert_cmpint(ftruncate(record->fd, (off_t)(record->offset - 10)), ==, 0);
+        _abandon(record);
+
+        g_assert_cmpint(ble_record_recover(path, &report), ==, 0);
+        g_assert_true(report.journal_used);
+        g_assert_cmpuint(report.checkpoint, ==, checkpoint);
+        g_assert_cmpuint(report.tail_blocks, ==, 1);
+        g_assert_cmpuint(report.valid_size, ==, torn);
+        g_assert_cmpuint(report.frames, ==, synced + BLE_RECORD_BLOCK_FRAMES);
+        g_assert_cmpint(report.t_first, ==, _time(0));
+        g_assert_cmpint(report.t_last, ==, _time(synced + BLE_RECORD_BLOCK_FRAMES - 1));
+        g_assert_false(report.clock_restarted);
+
+        // Recording resumes where the valid blocks end
+        record = ble_record_open(path, &report);
+        g_assert_nonnull(record);
+        g_assert_cmpint(record->t_first, ==, _time(0));
+        _append_frames(record, synced + BLE_RECORD_BLOCK_FRAMES, 100);
+        g_assert_cmpint(ble_record_close(record), ==, 0);
+        _check_frames(path, synced + BLE_RECORD_BLOCK_FRAMES + 100);
+}
+
+static void _journal_copy(const gchar *from, const gchar *to)
+{
+        g_autofree gchar *from_journal = g_strconcat(from, BLE_RECORD_JOURNAL_SUFFIX, NULL);
+        g_autofree gchar *to_journal = g_strconcat(to, BLE_RECORD_JOURNAL_SUFFIX, NULL);
+        g_autofree gchar *contents = NULL;
+        gsize length;
+
+        g_assert_true(g_file_get_contents(from_journal, &contents, &length, NULL));
+        g_assert_true(g_file_set_contents(to_journal, contents, (gssize)length, NULL));
+}
+
+// Journals of other files, or pointing inside a block, are not trusted
+static void test_journal_checks(void)
+{
+        g_autofree gchar *path = _path("journal.blerec");
+        g_autofree gchar *other = _path("journal_other.blerec");
+        g_autofree gchar *journal = g_strconcat(path, BLE_RECORD_JOURNAL_SUFFIX, NULL);
+        const uint64_t frames = 3 * BLE_RECORD_SYNC_BLOCKS * BLE_RECORD_BLOCK_FRAMES;
+        ble_record_recovery report;
+        ble_journal_entry entry;
+
+        ble_record *record = ble_record_open(path, NULL);
+        _append_frames(record, 0, frames);
+        g_assert_cmpint(ble_record_close(record), ==, 0);
+        record = ble_record_open(other, NULL);
+        _append_frames(record, 0, BLE_RECORD_SYNC_BLOCKS * BLE_RECORD_BLOCK_FRAMES);
+        g_assert_cmpint(ble_record_close(record), ==, 0);
+
+        g_assert_cmpint(ble_record_recover(path, &report), ==, 0);
+        g_assert_true(report.journal_used);
+        g_assert_cmpuint(report.frames, ==, frames);
+
+        _journal_copy(other, path);
+        g_assert_cmpint(ble_record_recover(path, &report), ==, 0);
+        g_assert_false(report.journal_used);
+        g_assert_cmpuint(report.truncated_bytes, ==, 0);
+        g_assert_cmpuint(report.frames, ==, frames);
+
+        // A checkpoint of this file, moved off the block boundary
+        record = ble_record_open(path, NULL);
+        g_assert_cmpint(ble_record_close(record), ==, 0);
+        int fd = g_open(journal, O_RDWR, 0);
+        g_assert_cmpint(pread(fd, &entry, sizeof(entry), 0), ==, sizeof(entry));
+        entry.offset -= 8;
+        entry.crc = ble_crc32c(0, &entry, offsetof(ble_journal_entry, crc));
+        g_assert_cmpint(pwrite(fd, &entry, sizeof(entry), 0), ==, sizeof(entry));
+        close(fd);
+        g_assert_cmpint(ble_record_recover(path, &report), ==, 0);
+        g_assert_false(report.journal_used);
+        g_assert_cmpuint(report.truncated_bytes, ==, 0);
+        g_assert_cmpuint(report.frames, ==, frames);
+}
+
+static void _newer_version(ble_record_header *header)
+{
+        header->version = BLE_RECORD_VERSION + 1;
+}
+
+static void test_foreign_files(void)
+{
+        g_autofree gchar *path = _path("foreign.blerec");
+        g_autofree gchar *contents = NULL;
+        ble_record_recovery report;
+        gsize length;
+
+        // Not a recording at all: refused and left as it was
+        GString *text = g_string_new(NULL);
+        for (int i = 0; i < 100; i++)
+                g_string_append(text, "Not a recording, just some text\n");
+        g_assert_true(g_file_set_contents(path, text->str, (gssize)text->len, NULL));
+        errno = 0;
+        g_assert_cmpint(ble_record_recover(path, &report), ==, -1);
+        g_assert_cmpint(errno, ==, EBADMSG);
+        g_assert_null(ble_record_open(path, NULL));
+        g_assert_true(g_file_get_contents(path, &contents, &length, NULL));
+        g_assert_cmpmem(contents, length, text->str, text->len);
+        g_string_free(text, true);
+
+        // A recording of a newer version is not ours to repair
+        g_remove(path);
+        ble_record *record = ble_record_open(path, NULL);
+        _append_frames(record, 0, 10);
+        g_assert_cmpint(ble_record_close(record), ==, 0);
+        _rewrite_header(path, _newer_version);
+        errno = 0;
+        g_assert_cmpint(ble_record_recover(path, &report), ==, -1);
+        g_assert_cmpint(errno, ==, ENOTSUP);
+
+        // An empty file is simply started
+        g_assert_true(g_file_set_contents(path, "", 0, NULL));
+        g_assert_cmpint(ble_record_recover(path, &report), ==, 0);
+        g_assert_true(report.created);
+}
+
+// Frames stamped ahead of the monotonic clock, as after a reboot
+static void test_clock_restart(void)
+{
+        g_autofree gchar *path = _path("restart.blerec");
+        uint8_t frame[PACKAGE_SIZE];
+        ble_record_recovery report;
+        int64_t later = _now_us() + (int64_t)3600 * G_USEC_PER_SEC;
+
+        ble_record *record = ble_record_open(path, NULL);
+        _frame(0, frame);
+        g_assert_cmpint(ble_record_append(record, later, frame), ==, 0);
+        g_assert_cmpint(ble_record_close(record), ==, 0);
+
+        g_assert_cmpint(ble_record_recover(path, &report), ==, 0);
+        g_assert_true(report.clock_restarted);
+        g_assert_cmpuint(report.frames, ==, 1);
+}
+
+// A resumed recording keeps the start of its first frame once rotated, and a
+// failed rotation leaves the live one going
+static void test_rotate(void)
+{
+        g_autofree gchar *path = _path("rotate.blerec");
+        g_autofree gchar *segment = _path("rotate_segment.blerec");
+        g_autofree gchar *nowhere = g_build_filename(tmp_dir, "missing", "segment.blerec", NULL);
+        ble_record_meta meta = { "id-2", "Rotated", "2026-10-19" };
+        ble_record_header header;
+
+        ble_record *record = ble_record_open(path, NULL);
+        _append_frames(record, 0, 300);
+        g_assert_cmpint(ble_record_close(record), ==, 0);
+        record = ble_record_open(path, NULL);
+        _append_frames(record, 300, 100);
+
+        g_assert_null(ble_record_rotate(record, nowhere, &meta));
+        g_assert_false(record->failed);
+        _append_frames(record, 400, 100);
+
+        ble_record *next = ble_record_rotate(record, segment, &meta);
+        g_assert_nonnull(next);
+        g_assert_cmpint(ble_record_close(record), ==, 0);
+        g_assert_cmpint(ble_record_close(next), ==, 0);
+
+        g_assert_cmpint(ble_record_read_header(segment, &header), ==, 0);
+        g_assert_true(header.flags & BLE_RECORD_FINALIZED);
+        g_assert_cmpint(header.t_first, ==, _time(0));
+        g_assert_cmpint(header.t_last, ==, _time(499));
+        g_assert_cmpuint(header.frames, ==, 500);
+        _check_frames(segment, 500);
+        g_assert_cmpint(ble_record_read_header(path, &header), ==, 0);
+        g_assert_false(header.flags & BLE_RECORD_FINALIZED);
+        g_assert_cmpuint(header.frames, ==, 0);
+}
+
+// An outline extended block by block as the file grows is the one a single
+// pass over the finished file gives
+static void test_thumbnail_extend(void)
+{
+        g_autofree gchar *path = _path("thumbnail.blerec");
+        ble_thumbnail whole, grown;
+        int64_t blocks = 0;
+
+        ble_thumbnail_init(&grown);
+        ble_record *record = ble_record_open(path, NULL);
+        for (uint64_t i = 0; i < 4000; i += 700)
+        {
+                _append_frames(record, i, MIN(700, 4000 - i));
+                g_assert_cmpint(ble_record_flush(record), ==, 0);
+                ble_reader *reader = ble_reader_open(path);
+                g_assert_nonnull(reader);
+                blocks = ble_reader_thumbnail_extend(reader, (uint32_t)blocks, &grown);
+                g_assert_cmpint(blocks, ==, reader->blocks);
+                ble_reader_close(reader);
+        }
+        _abandon(record);
+
+        ble_reader *reader = ble_reader_open(path);
+        g_assert_cmpint(ble_reader_thumbnail(reader, &whole), ==, 0);
+        ble_reader_close(reader);
+        g_assert_cmpuint(whole.span, >, 1);
+        g_assert_cmpmem(&grown, sizeof(grown), &whole, sizeof(whole));
+}
+
+int main(int argc, char **argv)
+{
+        g_test_init(&argc, &argv, NULL);
+        tmp_dir = g_dir_make_tmp("ble_test_record_XXXXXX", NULL);
+        g_assert_nonnull(tmp_dir);
+
+        g_test_add_func("/crc32c/check", test_crc32c);
+        g_test_add_func("/codec/round-trip", test_codec);
+        g_test_add_func("/record/round-trip", test_round_trip);
+        g_test_add_func("/record/failed-flush", test_failed_flush);
+        g_test_add_func("/record/recovery", test_recovery);
+        g_test_add_func("/record/journal-checks", test_journal_checks);
+        g_test_add_func("/record/foreign-files", test_foreign_files);
+        g_test_add_func("/record/clock-restart", test_clock_restart);
+        g_test_add_func("/record/rotate", test_rotate);
+        g_test_add_func("/reader/thumbnail-extend", test_thumbnail_extend);
+        int res = g_test_run();
+
+        GDir *dir = g_dir_open(tmp_dir, 0, NULL);
+        const gchar *name;
+        while (dir != NULL && (name = g_dir_read_name(dir)) != NULL)
+        {
+                g_autofree gchar *path = g_build_filename(tmp_dir, name, NULL);
+                g_remove(path);
+        }
+        if (dir != NULL)
+                g_dir_close(dir);
+        g_rmdir(tmp_dir);
+        g_free(tmp_dir);
+        return res;
+}
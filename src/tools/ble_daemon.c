@@ -0,0 +1,596 @@
+/*
+ * Headless acquisition for gateways without a display.
+ *
+ *   ble_daemon [--config FILE] [--adapter ADDR] [--peripheral ADDR]
+ *              [--live-path PATH] [--segment-minutes N] [--csv] [--no-edf]
+ *              [--id ID] [--name NAME] [--day DAY] [--duration SECONDS]
+ *              [--writer-cpu N] [--metrics SOCKET] [--trace FILE]
+ *              [--synthetic] [--speed X]
+ *
+ * Recovers the live recording left by a previous run, scans for the sensor
+ * and records every frame to the live path, DEFAULT_PATH unless told
+ * otherwise, with its EDF+ copy, through the same capture as the GUI. The
+ * GUI records each session to a file of its own beside DEFAULT_PATH and
+ * never touches that one, so the two can run side by side. Every --segment-minutes the recording so far is saved as a
+ * segment named after the session metadata and, with --csv, exported to a
+ * CSV file beside it. SIGINT and SIGTERM stop it cleanly, saving the last
+ * segment when segments are on. Frames reach the recording through a
+ * blocking store stage, so a slow disk holds up reads instead of piling
+ * frames up in memory; --writer-cpu pins that stage to one CPU. With
+ * --metrics the counters are served on a Unix socket for Prometheus. With
+ * --trace the hot paths are traced and the trace is written to FILE on
+ * SIGUSR1 and at exit, for tools/ble_trace to decode. A failed read closes
+ * the connection and reopens it, retrying with a growing pause.
+ *
+ * With --synthetic the frames come from a synthetic sensor instead, for
+ * soak tests, running --speed times real time and injecting the faults the
+ * [synthetic] group sets (see ble_medical_synth.h). --duration and
+ * --segment-minutes then count the sensor's time, so
+ *
+ *   ble_daemon --synthetic --speed 100 --duration 86400
+ *
+ * records a day in under a quarter of an hour.
+ *
+ * Flags override the [daemon] group of the config file, which takes the
+ * same names:
+ *
+ *   [daemon]
+ *   adapter=00:1A:7D:DA:71:13
+ *   live-path=/var/lib/ble-medical/live.blerec
+ *   segment-minutes=60
+ *   csv=true
+ *   id=bed-12
+ *
+ *   [synthetic]
+ *   heart-rate=72
+ *   spo2=97
+ *   noise=20
+ *   motion-per-minute=0.5
+ *   motion=2000
+ *   drop-rate=0.001
+ *   duplicate-rate=0.002
+ *   stalls-per-minute=1
+ *   stall-ms=800
+ *   disconnects-per-hour=2
+ *   disconnect-s=10
+ *   seed=1
+ *
+ * Only GLib and SimpleBLE are linked in; nothing of GTK is loaded.
+ */
+#include "../ble_medical_capture.h"
+#include "../ble_medical_device.h"
+#include "../ble_medical_reader.h"
+#include "../ble_medical_csv.h"
+#include "../ble_medical_pipeline.h"
+#include "../ble_medical_metrics.h"
+#include "../ble_medical_trace.h"
+#include "../ble_medical_synth.h"
+#include "config.h"
+
+#include <glib-unix.h>
+#include <signal.h>
+#include <stdio.h>
+#include <string.h>
+
+#define DAEMON_GROUP    "daemon"
+#define SYNTH_GROUP     "synthetic"
+#define STORE_CAPACITY  1024
+#define STORE_BATCH     32
+// Pauses between attempts to reopen the connection
+#define RECONNECT_MIN_MS        500
+#define RECONNECT_MAX_MS        30000
+
+static gchar *config_file = NULL;
+static gchar *adapter_address = NULL;
+static gchar *peripheral_address = NULL;
+static gchar *live_path = NULL;
+static gint scan_ms = -1;
+static gint segment_minutes = -1;
+static gboolean csv = false;
+static gboolean no_edf = false;
+static gchar *id = NULL;
+static gchar *name = NULL;
+static gchar *day = NULL;
+static gint duration = -1;
+static gint writer_cpu = -1;
+static gchar *metrics_path = NULL;
+static gchar *trace_path = NULL;
+static gboolean synthetic = false;
+static gdouble speed = -1;
+static ble_synth_config synth_config;
+
+static GOptionEntry options[] = {
+        { "config", 'c', 0, G_OPTION_ARG_FILENAME, &config_file, "Settings, overridden by the flags", "FILE" },
+        { "adapter", 'a', 0, G_OPTION_ARG_STRING, &adapter_address, "Bluetooth adapter, the first one by default", "ADDR" },
+        { "peripheral", 'p', 0, G_OPTION_ARG_STRING, &peripheral_address, "Sensor, the first one answering by default", "ADDR" },
+        { "scan-ms", 0, 0, G_OPTION_ARG_INT, &scan_ms, "Scan time", "MS" },
+        { "live-path", 'l', 0, G_OPTION_ARG_FILENAME, &live_path, "Live recording, " DEFAULT_PATH " by default", "PATH" },
+        { "segment-minutes", 's', 0, G_OPTION_ARG_INT, &segment_minutes, "Save a segment this often, 0 never", "N" },
+        { "csv", 0, 0, G_OPTION_ARG_NONE, &csv, "Export every saved segment to CSV", NULL },
+        { "no-edf", 0, 0, G_OPTION_ARG_NONE, &no_edf, "Do not write the EDF+ copy", NULL },
+        { "id", 0, 0, G_OPTION_ARG_STRING, &id, "Session ID stamped on segments", "ID" },
+        { "name", 0, 0, G_OPTION_ARG_STRING, &name, "Patient name stamped on segments", "NAME" },
+        { "day", 0, 0, G_OPTION_ARG_STRING, &day, "Session day stamped on segments", "DAY" },
+        { "duration", 'd', 0, G_OPTION_ARG_INT, &duration, "Stop after this long, 0 never", "SECONDS" },
+        { "writer-cpu", 0, 0, G_OPTION_ARG_INT, &writer_cpu, "Pin the recording writer to this CPU", "N" },
+        { "metrics", 'm', 0, G_OPTION_ARG_FILENAME, &metrics_path, "Serve metrics on this Unix socket", "SOCKET" },
+        { "trace", 't', 0, G_OPTION_ARG_FILENAME, &trace_path, "Trace the hot paths into this file", "FILE" },
+        { "synthetic", 0, 0, G_OPTION_ARG_NONE, &synthetic, "Record a synthetic sensor with faults", NULL },
+        { "speed", 0, 0, G_OPTION_ARG_DOUBLE, &speed, "Synthetic sensor speed, times real time, 0 unpaced", "X" },
+        { NULL }
+};
+
+typedef struct _daemon_state {
+        GMainLoop       *loop;
+        ble_capture     *capture;
+        ble_device      *device;
+        ble_synth       *synth;
+        ble_pipeline    *pipeline;
+        ble_stage       *store;
+        gint            stopping;
+        gint            failed;
+        guint64         frames;         // read by the reader thread only
+        ble_time_t      source_start;   // synthetic sensor time, reader thread only
+        ble_time_t      next_segment;
+        GMutex          lock;
+        GCond           cond;
+        guint           segments;       // being closed or exported
+} daemon_state;
+
+static void _key_string(GKeyFile *file, const gchar *key, gchar **value)
+{
+        if (*value == NULL)
+                *value = g_key_file_get_string(file, DAEMON_GROUP, key, NULL);
+}
+
+static void _key_int(GKeyFile *file, const gchar *key, gint *value)
+{
+        if (*value < 0 && g_key_file_has_key(file, DAEMON_GROUP, key, NULL))
+                *value = g_key_file_get_integer(file, DAEMON_GROUP, key, NULL);
+}
+
+static void _key_flag(GKeyFile *file, const gchar *key, gboolean *value, gboolean inverse)
+{
+        if (!*value && g_key_file_has_key(file, DAEMON_GROUP, key, NULL))
+                *value = g_key_file_get_boolean(file, DAEMON_GROUP, key, NULL) != inverse;
+}
+
+static void _key_double(GKeyFile *file, const gchar *group, const gchar *key, gdouble *value)
+{
+        if (g_key_file_has_key(file, group, key, NULL))
+                *value = g_key_file_get_double(file, group, key, NULL);
+}
+
+static void _load_synth_config(GKeyFile *file)
+{
+        gdouble seed = synth_config.seed;
+
+        _key_double(file, SYNTH_GROUP, "heart-rate", &synth_config.heart_rate);
+        _key_double(file, SYNTH_GROUP, "spo2", &synth_config.spo2);
+        _key_double(file, SYNTH_GROUP, "noise", &synth_config.noise);
+        _key_double(file, SYNTH_GROUP, "motion-per-minute", &synth_config.motion_per_minute);
+        _key_double(file, SYNTH_GROUP, "motion", &synth_config.motion);
+        _key_double(file, SYNTH_GROUP, "drop-rate", &synth_config.drop_rate);
+        _key_double(file, SYNTH_GROUP, "duplicate-rate", &synth_config.duplicate_rate);
+        _key_double(file, SYNTH_GROUP, "stalls-per-minute", &synth_config.stalls_per_minute);
+        _key_double(file, SYNTH_GROUP, "stall-ms", &synth_config.stall_ms);
+        _key_double(file, SYNTH_GROUP, "disconnects-per-hour", &synth_config.disconnects_per_hour);
+        _key_double(file, SYNTH_GROUP, "disconnect-s", &synth_config.disconnect_s);
+        _key_double(file, SYNTH_GROUP, "seed", &seed);
+        synth_config.seed = (guint32)seed;
+}
+
+static gboolean _load_config(GError **error)
+{
+        ble_synth_config_default(&synth_config);
+        if (config_file != NULL)
+        {
+                g_autoptr(GKeyFile) file = g_key_file_new();
+                if (!g_key_file_load_from_file(file, config_file, G_KEY_FILE_NONE, error))
+                        return false;
+                _key_string(file, "adapter", &adapter_address);
+                _key_string(file, "peripheral", &peripheral_address);
+                _key_int(file, "scan-ms", &scan_ms);
+                _key_string(file, "live-path", &live_path);
+                _key_int(file, "segment-minutes", &segment_minutes);
+                _key_flag(file, "csv", &csv, false);
+                _key_flag(file, "edf", &no_edf, true);
+                _key_string(file, "id", &id);
+                _key_string(file, "name", &name);
+                _key_string(file, "day", &day);
+                _key_int(file, "duration", &duration);
+                _key_int(file, "writer-cpu", &writer_cpu);
+                _key_string(file, "metrics", &metrics_path);
+                _key_string(file, "trace", &trace_path);
+                _key_flag(file, "synthetic", &synthetic, false);
+                if (speed < 0)
+                        _key_double(file, DAEMON_GROUP, "speed", &speed);
+                _load_synth_config(file);
+        }
+        if (speed >= 0)
+                synth_config.speed = speed;
+        if (live_path == NULL)
+                live_path = g_strdup(DEFAULT_PATH);
+        segment_minutes = MAX(segment_minutes, 0);
+        duration = MAX(duration, 0);
+        return true;
+}
+
+static gpointer _frame_ref(gpointer data)
+{
+        g_atomic_int_inc(&((t_pack*)data)->refs);
+        return data;
+}
+
+static void _frame_unref(gpointer data)
+{
+        t_pack *pack = (t_pack*)data;
+
+        if (g_atomic_int_dec_and_test(&pack->refs))
+        {
+                g_free(pack->data);
+                g_free(pack);
+        }
+}
+
+static void _store_frames(gpointer *items, guint count, gpointer data)
+{
+        daemon_state *state = (daemon_state*)data;
+
+        for (guint i = 0; i < count; i++)
+                ble_capture_append(state->capture, ((t_pack*)items[i])->time, ((t_pack*)items[i])->data);
+}
+
+// One frame to release with g_free(), and when it arrived
+static int _read_frame(daemon_state *state, ble_pack_t *frame, size_t *length, ble_time_t *time, GError **error)
+{
+        if (state->synth != NULL)
+        {
+                *frame = g_malloc(PACKAGE_SIZE);
+                *length = PACKAGE_SIZE;
+                if (ble_synth_read(state->synth, *frame, time, error) != 0)
+                {
+                        g_clear_pointer(frame, g_free);
+                        return -1;
+                }
+                return 0;
+        }
+
+        ble_pack_t data = NULL;
+        if (ble_device_read(state->device, &data, length, error) != 0)
+                return -1;
+        *time = g_get_monotonic_time();
+        *frame = g_memdup2(data, *length);
+        simpleble_free(data);
+        return 0;
+}
+
+// Sleeps `ms` unless the daemon stops meanwhile
+static gboolean _pause(daemon_state *state, guint ms)
+{
+        for (guint slept = 0; slept < ms && !g_atomic_int_get(&state->stopping); slept += 100)
+                g_usleep(MIN(ms - slept, 100) * 1000);
+        return !g_atomic_int_get(&state->stopping);
+}
+
+// Reopens the connection after a failed read, to the same sensor, until it
+// answers or the daemon stops
+static gboolean _reconnect(daemon_state *state)
+{
+        g_autoptr(GError) error = NULL;
+        gint64 start = g_get_monotonic_time();
+
+        if (state->synth != NULL)
+        {
+                if (ble_synth_reconnect(state->synth, &error) != 0)
+                        return false;
+        }
+        else
+        {
+                g_autofree gchar *address = g_strdup(state->device->address);
+                guint pause_ms = RECONNECT_MIN_MS;
+                ble_device_close(state->device);
+                state->device = NULL;
+                while (state->device == NULL && _pause(state, pause_ms))
+                {
+                        state->device = ble_device_open(adapter_address, address, scan_ms, &error);
+                        if (state->device == NULL)
+                        {
+                                g_warning("%s, retrying", error->message);
+                                g_clear_error(&error);
+                                pause_ms = MIN(pause_ms * 2, RECONNECT_MAX_MS);
+                        }
+                }
+                if (state->device == NULL)
+                        return false;
+        }
+        gint64 elapsed = g_get_monotonic_time() - start;
+        ble_trace(BLE_TRACE_RECONNECT, elapsed / 1000, 0);
+        ble_metric_add(ble_metrics_core_get()->reconnects, 1);
+        g_message("Reconnected after %.1f ms", elapsed / 1000.0);
+        return true;
+}
+
+static gboolean _on_stop(gpointer data);
+static gboolean _on_segment_idle(gpointer data);
+
+// With the synthetic sensor, segments and the duration go by its clock;
+// false once the duration is over
+static gboolean _source_clock(daemon_state *state, ble_time_t time)
+{
+        gint64 segment_us = (gint64)segment_minutes * 60 * G_USEC_PER_SEC;
+
+        if (state->source_start == 0)
+        {
+                state->source_start = time;
+                state->next_segment = time + segment_us;
+        }
+        // The last segment is saved on the way out
+        if (duration > 0 && time - state->source_start >= (gint64)duration * G_USEC_PER_SEC)
+        {
+                g_idle_add(_on_stop, state);
+                return false;
+        }
+        if (segment_minutes > 0 && time >= state->next_segment)
+        {
+                state->next_segment += segment_us;
+                g_idle_add(_on_segment_idle, state);
+        }
+        return true;
+}
+
+// Frames are read back to back: each read is a round trip to the sensor
+static gpointer _reader_thread(gpointer data)
+{
+        daemon_state *state = (daemon_state*)data;
+        g_autoptr(GError) error = NULL;
+        ble_frame_check check = { 0 };
+
+        while (!g_atomic_int_get(&state->stopping))
+        {
+                ble_pack_t frame = NULL;
+                size_t length = 0;
+                ble_time_t time;
+                if (_read_frame(state, &frame, &length, &time, &error) != 0)
+                {
+                        // Woken up to stop
+                        if (g_atomic_int_get(&state->stopping))
+                                break;
+                        g_warning("%s", error->message);
+                        g_clear_error(&error);
+                        ble_trace(BLE_TRACE_READ_ERROR, 0, 0);
+                        ble_metric_add(ble_metrics_core_get()->read_errors, 1);
+                        if (_reconnect(state) || g_atomic_int_get(&state->stopping))
+                                continue;
+                        g_atomic_int_set(&state->failed, true);
+                        g_main_loop_quit(state->loop);
+                        break;
+                }
+                ble_trace(BLE_TRACE_READ, length, 0);
+                if (length != PACKAGE_SIZE)
+                {
+                        ble_trace(BLE_TRACE_FRAME_DROPPED, length, 0);
+                        g_free(frame);
+                        continue;
+                }
+                t_pack *pack = g_new0(t_pack, 1);
+                pack->data = frame;
+                pack->time = time;
+                ble_metrics_frame_read(&check, pack->time, frame);
+                pack->refs = 1;
+                ble_stage_push(state->store, pack);
+                state->frames++;
+                if (state->synth != NULL && !_source_clock(state, time))
+                        break;
+        }
+        return NULL;
+}
+
+static void _segment_done(const gchar *path, int status, gpointer data)
+{
+        daemon_state *state = (daemon_state*)data;
+
+        if (status != 0)
+                g_warning("Segment %s could not be completed", path);
+        else
+                g_message("Saved %s", path);
+
+        if (status == 0 && csv)
+        {
+                g_autofree gchar *base = g_strdup(path);
+                if (g_str_has_suffix(base, BLE_RECORD_EXTENSION))
+                        base[strlen(base) - strlen(BLE_RECORD_EXTENSION)] = '\0';
+                g_autofree gchar *csv_path = g_strconcat(base, ".csv", NULL);
+                ble_reader *reader = ble_reader_open(path);
+                if (reader == NULL || ble_csv_export(reader, csv_path, BLE_CHANNEL_ALL, NULL, 0, NULL, NULL) != 0)
+                        g_warning("CSV export to %s failed", csv_path);
+                else
+                        g_message("Exported %s", csv_path);
+                if (reader != NULL)
+                        ble_reader_close(reader);
+        }
+
+        g_mutex_lock(&state->lock);
+        state->segments--;
+        g_cond_signal(&state->cond);
+        g_mutex_unlock(&state->lock);
+}
+
+static void _save_segment(daemon_state *state)
+{
+        ble_record_meta meta = { id ? id : "", name ? name : "", day ? day : "" };
+        g_autofree gchar *path = ble_capture_segment_path(live_path, NULL, &meta);
+        gint64 latency;
+
+        if (path == NULL)
+        {
+                g_warning("No free segment name next to %s, still recording to it", live_path);
+                return;
+        }
+        g_mutex_lock(&state->lock);
+        state->segments++;
+        g_mutex_unlock(&state->lock);
+        if (ble_capture_rotate(state->capture, path, &meta, &latency, _segment_done, state) != 0)
+        {
+                g_warning("Saving %s failed, still recording to %s", path, live_path);
+                g_mutex_lock(&state->lock);
+                state->segments--;
+                g_mutex_unlock(&state->lock);
+                return;
+        }
+        g_message("Saving %s (writer paused %.2f ms, max %.2f ms)", path,
+                  latency / 1000.0, ble_capture_rotation_max(state->capture) / 1000.0);
+}
+
+static gboolean _on_segment_timeout(gpointer data)
+{
+        _save_segment((daemon_state*)data);
+        return G_SOURCE_CONTINUE;
+}
+
+static gboolean _on_segment_idle(gpointer data)
+{
+        _save_segment((daemon_state*)data);
+        return G_SOURCE_REMOVE;
+}
+
+static gboolean _on_stop(gpointer data)
+{
+        daemon_state *state = (daemon_state*)data;
+        g_main_loop_quit(state->loop);
+        return G_SOURCE_REMOVE;
+}
+
+static void _dump_trace(void)
+{
+        g_autoptr(GError) error = NULL;
+
+        if (ble_trace_dump(trace_path, &error) != 0)
+                g_warning("%s", error->message);
+        else
+                g_message("Trace written to %s", trace_path);
+}
+
+static gboolean _on_trace_dump(gpointer data)
+{
+        (void)data;
+        _dump_trace();
+        return G_SOURCE_CONTINUE;
+}
+
+int main(int argc, char *argv[])
+{
+        g_autoptr(GOptionContext) context = g_option_context_new(NULL);
+        g_autoptr(GError) error = NULL;
+        daemon_state state = { 0 };
+        ble_record_recovery report;
+
+        g_option_context_set_summary(context, "Record the BLE sensor without a display.");
+        g_option_context_add_main_entries(context, options, NULL);
+        if (!g_option_context_parse(context, &argc, &argv, &error) || !_load_config(&error))
+        {
+                fprintf(stderr, "%s\n", error->message);
+                return 2;
+        }
+        if (metrics_path != NULL)
+        {
+                if (ble_metrics_serve(metrics_path, &error) != 0)
+                {
+                        fprintf(stderr, "%s\n", error->message);
+                        return 1;
+                }
+                g_message("Metrics on %s", metrics_path);
+        }
+        if (trace_path != NULL)
+                ble_trace_start();
+
+        gint64 start = g_get_monotonic_time();
+        state.capture = ble_capture_open(live_path, !no_edf, &report);
+        if (state.capture == NULL)
+        {
+                fprintf(stderr, "%s: recording could not be opened\n", live_path);
+                ble_metrics_shutdown();
+                return 1;
+        }
+        if (report.truncated_bytes > 0)
+                g_message("Recovered %" G_GUINT64_FORMAT " frames in %u blocks, dropped %" G_GUINT64_FORMAT " damaged bytes",
+                          report.frames, report.blocks, report.truncated_bytes);
+        g_message("Recording to %s, ready in %.1f ms", live_path, (g_get_monotonic_time() - start) / 1000.0);
+
+        if (synthetic)
+        {
+                state.synth = ble_synth_new(&synth_config);
+                g_message("Synthetic sensor at %.0f bpm and %.0f%% SpO2, %gx real time",
+                          synth_config.heart_rate, synth_config.spo2, synth_config.speed);
+        }
+        else
+        {
+                state.device = ble_device_open(adapter_address, peripheral_address, scan_ms, &error);
+                if (state.device == NULL)
+                {
+                        fprintf(stderr, "%s\n", error->message);
+                        ble_capture_free(state.capture);
+                        ble_metrics_shutdown();
+                        return 1;
+                }
+                g_message("Connected to %s (%s)", state.device->identifier, state.device->address);
+        }
+
+        g_mutex_init(&state.lock);
+        g_cond_init(&state.cond);
+        state.loop = g_main_loop_new(NULL, false);
+        // A single writer keeps blocks in arrival order
+        state.pipeline = ble_pipeline_new("daemon", _frame_ref, _frame_unref);
+        state.store = ble_pipeline_add_stage(state.pipeline, "store", _store_frames, &state,
+                                             STORE_CAPACITY, STORE_BATCH, BLE_STAGE_BLOCK, writer_cpu);
+        ble_pipeline_start(state.pipeline);
+        GThread *reader = g_thread_new("reader", _reader_thread, &state);
+
+        g_unix_signal_add(SIGINT, _on_stop, &state);
+        g_unix_signal_add(SIGTERM, _on_stop, &state);
+        if (trace_path != NULL)
+                g_unix_signal_add(SIGUSR1, _on_trace_dump, NULL);
+        if (segment_minutes > 0 && state.synth == NULL)
+                g_timeout_add_seconds(segment_minutes * 60, _on_segment_timeout, &state);
+        if (duration > 0 && state.synth == NULL)
+                g_timeout_add_seconds(duration, _on_stop, &state);
+        g_main_loop_run(state.loop);
+
+        g_atomic_int_set(&state.stopping, true);
+        if (state.synth != NULL)
+                ble_synth_stop(state.synth);
+        g_thread_join(reader);
+        ble_pipeline_close(state.pipeline);
+        ble_pipeline_wait(state.pipeline, -1);
+        g_autofree gchar *stage_stats = ble_pipeline_describe(state.pipeline);
+        g_message("Pipeline:\n%s", g_strchomp(stage_stats));
+        ble_pipeline_free(state.pipeline);
+        if (segment_minutes > 0)
+                _save_segment(&state);
+        g_mutex_lock(&state.lock);
+        while (state.segments > 0)
+                g_cond_wait(&state.cond, &state.lock);
+        g_mutex_unlock(&state.lock);
+        g_message("Stopped after %" G_GUINT64_FORMAT " frames", state.frames);
+        if (state.synth != NULL)
+        {
+                ble_synth_stats stats;
+                ble_synth_get_stats(state.synth, &stats);
+                g_message("Synthetic sensor: %" G_GUINT64_FORMAT " frames, %" G_GUINT64_FORMAT " dropped, %"
+                          G_GUINT64_FORMAT " read twice, %" G_GUINT64_FORMAT " stalls, %" G_GUINT64_FORMAT
+                          " disconnects losing %" G_GUINT64_FORMAT " frames, %" G_GUINT64_FORMAT " motion artifacts",
+                          stats.frames, stats.dropped, stats.duplicated, stats.stalls, stats.disconnects,
+                          stats.lost, stats.motion);
+        }
+
+        ble_capture_free(state.capture);
+        ble_device_close(state.device);
+        ble_synth_free(state.synth);
+        ble_metrics_shutdown();
+        if (trace_path != NULL)
+                _dump_trace();
+        g_main_loop_unref(state.loop);
+        g_cond_clear(&state.cond);
+        g_mutex_clear(&state.lock);
+        return state.failed;
+}
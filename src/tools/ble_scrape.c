@@ -0,0 +1,271 @@
+/*
+ * Checks the metrics endpoint under load, without a display or a sensor.
+ *
+ *   ble_scrape [-t threads] [-n frames]
+ *
+ * Serves the metrics on a temporary Unix socket while reader threads feed
+ * synthetic frames through the frame counters and a store pipeline, one
+ * frame in four a repeat and one in eight late. Meanwhile it scrapes the
+ * socket as Prometheus would, checking that every response is well formed
+ * and that no counter ever goes back. Once the load is over the counters
+ * must add up to exactly what was fed. Exits 1 on the first mismatch.
+ */
+#include "../ble_medical_metrics.h"
+#include "../ble_medical_pipeline.h"
+
+#include <errno.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+static gint threads = 4;
+static gint frames = 200000;
+
+static GOptionEntry options[] = {
+        { "threads", 't', 0, G_OPTION_ARG_INT, &threads, "Reader threads", "N" },
+        { "frames", 'n', 0, G_OPTION_ARG_INT, &frames, "Frames per reader", "N" },
+        { NULL }
+};
+
+typedef struct _scrape_state {
+        gchar           *path;
+        ble_stage       *store;
+        gint            finished;       // readers done
+} scrape_state;
+
+static gpointer _item_ref(gpointer item)
+{
+        return item;
+}
+
+static void _item_unref(gpointer item)
+{
+        (void)item;
+}
+
+static void _store_stage(gpointer *items, guint count, gpointer data)
+{
+        (void)items;
+        (void)count;
+        (void)data;
+}
+
+static gpointer _reader_thread(gpointer data)
+{
+        scrape_state *state = (scrape_state*)data;
+        ble_frame_check check = { 0 };
+        uint8_t frame[PACKAGE_SIZE] = { 0 };
+        ble_time_t time = 0;
+
+        for (gint i = 0; i < frames; i++)
+        {
+                // Frames 4k + 1 repeat the one before, 8k + 7 come late
+                if (i % 4 != 1)
+                        memcpy(frame, &i, sizeof(i));
+                time += i % 8 == 7 ? BLE_METRICS_GAP_US + 1 : 10000;
+                ble_metrics_frame_read(&check, time, frame);
+                ble_stage_push(state->store, GINT_TO_POINTER(i + 1));
+        }
+        g_atomic_int_inc(&state->finished);
+        return NULL;
+}
+
+// The whole response, NULL when the server could not be reached
+static gchar *_scrape(const gchar *path)
+{
+        struct sockaddr_un address = { .sun_family = AF_UNIX };
+        const char request[] = "GET /metrics HTTP/1.0\r\n\r\n";
+        GString *response = g_string_new(NULL);
+        char buffer[4096];
+        ssize_t length;
+
+        g_strlcpy(address.sun_path, path, sizeof(address.sun_path));
+        int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (fd < 0 || connect(fd, (struct sockaddr*)&address, sizeof(address)) != 0 ||
+            send(fd, request, sizeof(request) - 1, MSG_NOSIGNAL) < 0)
+        {
+                fprintf(stderr, "%s: %s\n", path, g_strerror(errno));
+                if (fd >= 0)
+                        close(fd);
+                g_string_free(response, true);
+                return NULL;
+        }
+        while ((length = read(fd, buffer, sizeof(buffer))) > 0 || (length < 0 && errno == EINTR))
+                if (length > 0)
+                        g_string_append_len(response, buffer, length);
+        close(fd);
+        return g_string_free(response, false);
+}
+
+// Splits a response into samples, keyed by name and labels. Fails on a bad
+// header, a body of the wrong length or a sample of an undeclared family.
+static GHashTable *_parse(const gchar *response)
+{
+        const gchar *body = strstr(response, "\r\n\r\n");
+        const gchar *length = strstr(response, "Content-Length: ");
+
+        if (!g_str_has_prefix(response, "HTTP/1.0 200 OK\r\n") || body == NULL || length == NULL ||
+            strtoul(length + strlen("Content-Length: "), NULL, 10) != strlen(body + 4))
+        {
+                fprintf(stderr, "Bad response header\n");
+                return NULL;
+        }
+
+        g_autoptr(GHashTable) types = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, g_free);
+        GHashTable *samples = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+        g_auto(GStrv) lines = g_strsplit(body + 4, "\n", -1);
+        for (guint i = 0; lines[i] != NULL; i++)
+        {
+                char name[256], kind[32];
+                const gchar *line = lines[i];
+                if (*line == '\0')
+                        continue;
+                if (sscanf(line, "# TYPE %255s %31s", name, kind) == 2)
+                {
+                        if (g_hash_table_contains(types, name))
+                        {
+                                fprintf(stderr, "%s declared twice\n", name);
+                                g_hash_table_destroy(samples);
+                                return NULL;
+                        }
+                        g_hash_table_insert(types, g_strdup(name), g_strdup(kind));
+                        continue;
+                }
+                if (g_str_has_prefix(line, "# HELP "))
+                        continue;
+
+                const gchar *value = strrchr(line, ' ');
+                gsize span = strcspn(line, "{ ");
+                g_autofree gchar *family = g_strndup(line, span);
+                char *end = NULL;
+                double number = value ? g_ascii_strtod(value + 1, &end) : 0;
+                // A summary's _sum and _count belong to it
+                if (!g_hash_table_contains(types, family) &&
+                    (g_str_has_suffix(family, "_sum") || g_str_has_suffix(family, "_count")))
+                        *strrchr(family, '_') = '\0';
+                if (value == NULL || end == NULL || *end != '\0' || number < 0 ||
+                    !g_hash_table_contains(types, family))
+                {
+                        fprintf(stderr, "Bad sample: %s\n", line);
+                        g_hash_table_destroy(samples);
+                        return NULL;
+                }
+                // Counts are whole numbers, kept as such to compare exactly
+                g_hash_table_insert(samples, g_strndup(line, value - line), GSIZE_TO_POINTER((gsize)number));
+        }
+        return samples;
+}
+
+// Every counter and count in `now` at least where it was in `before`
+static gboolean _monotonic(GHashTable *before, GHashTable *now)
+{
+        GHashTableIter iter;
+        gpointer key, value;
+
+        g_hash_table_iter_init(&iter, before);
+        while (g_hash_table_iter_next(&iter, &key, &value))
+        {
+                const gchar *sample = key;
+                if (!g_str_has_suffix(sample, "_total") && !g_str_has_suffix(sample, "_count") &&
+                    strstr(sample, "_total{") == NULL && strstr(sample, "_count{") == NULL)
+                        continue;
+                if (!g_hash_table_contains(now, sample) ||
+                    GPOINTER_TO_SIZE(g_hash_table_lookup(now, sample)) < GPOINTER_TO_SIZE(value))
+                {
+                        fprintf(stderr, "%s went back\n", sample);
+                        return false;
+                }
+        }
+        return true;
+}
+
+static gboolean _expect(GHashTable *samples, const gchar *sample, gsize expected)
+{
+        gsize value = GPOINTER_TO_SIZE(g_hash_table_lookup(samples, sample));
+
+        if (g_hash_table_contains(samples, sample) && value == expected)
+                return true;
+        fprintf(stderr, "%s is %zu, expected %zu\n", sample, value, expected);
+        return false;
+}
+
+int main(int argc, char *argv[])
+{
+        g_autoptr(GOptionContext) context = g_option_context_new(NULL);
+        g_autoptr(GError) error = NULL;
+        scrape_state state = { 0 };
+        gboolean ok = true;
+        guint scrapes = 0;
+
+        g_option_context_set_summary(context, "Scrape the metrics endpoint under synthetic load.");
+        g_option_context_add_main_entries(context, options, NULL);
+        if (!g_option_context_parse(context, &argc, &argv, &error) || threads < 1 || frames < 1)
+        {
+                fprintf(stderr, "%s\n", error ? error->message : "Threads and frames must be positive");
+                return 2;
+        }
+
+        state.path = g_strdup_printf("%s/ble_scrape.%d.sock", g_get_tmp_dir(), (int)getpid());
+        if (ble_metrics_serve(state.path, &error) != 0)
+        {
+                fprintf(stderr, "%s\n", error->message);
+                return 1;
+        }
+
+        ble_pipeline *pipeline = ble_pipeline_new("scrape", _item_ref, _item_unref);
+        state.store = ble_pipeline_add_stage(pipeline, "store", _store_stage, NULL, 1024, 32, BLE_STAGE_BLOCK, -1);
+        ble_pipeline_start(pipeline);
+
+        GThread **readers = g_new(GThread*, threads);
+        for (gint i = 0; i < threads; i++)
+                readers[i] = g_thread_new("reader", _reader_thread, &state);
+
+        // Scrapes as fast as the server answers, once more after the
+        // readers are done
+        g_autoptr(GHashTable) before = NULL;
+        gboolean finished;
+        do
+        {
+                finished = g_atomic_int_get(&state.finished) == threads;
+                g_autofree gchar *response = _scrape(state.path);
+                GHashTable *now = response ? _parse(response) : NULL;
+                ok = now != NULL && (before == NULL || _monotonic(before, now));
+                g_clear_pointer(&before, g_hash_table_destroy);
+                before = now;
+                scrapes++;
+        } while (ok && !finished);
+        for (gint i = 0; i < threads; i++)
+                g_thread_join(readers[i]);
+        g_free(readers);
+        // Drained but not freed, which would take the stage metrics along
+        ble_pipeline_close(pipeline);
+        ble_pipeline_wait(pipeline, -1);
+
+        gsize total = (gsize)threads * frames;
+        gsize repeats = (gsize)threads * ((frames + 2) / 4);
+        gsize gaps = (gsize)threads * (frames / 8);
+        g_autofree gchar *response = ok ? _scrape(state.path) : NULL;
+        g_autoptr(GHashTable) last = response ? _parse(response) : NULL;
+        ok = ok && last != NULL && _monotonic(before, last) &&
+             _expect(last, "ble_frames_read_total", total) &&
+             _expect(last, "ble_frames_duplicate_total", repeats) &&
+             _expect(last, "ble_frames_gap_total", gaps) &&
+             _expect(last, "ble_stage_items_total{pipeline=\"scrape\",stage=\"store\"}", total) &&
+             _expect(last, "ble_stage_queue_depth{pipeline=\"scrape\",stage=\"store\"}", 0) &&
+             _expect(last, "ble_stage_queue_capacity{pipeline=\"scrape\",stage=\"store\"}", 1024);
+
+        ble_pipeline_free(pipeline);
+        ble_metrics_shutdown();
+        if (access(state.path, F_OK) == 0)
+        {
+                fprintf(stderr, "%s left behind\n", state.path);
+                ok = false;
+        }
+        fprintf(stderr, "%u scrapes over %zu frames: %s\n", scrapes, total, ok ? "ok" : "FAILED");
+        g_free(state.path);
+        return !ok;
+}
@@ -0,0 +1,281 @@
+/*
+ * Decodes a trace dump, without a display.
+ *
+ *   ble_trace [--chrome] [-o output] TRACE
+ *
+ * Reads the event table and the per-thread rings written by
+ * ble_trace_dump() and prints every event, all threads merged in time
+ * order, one line each:
+ *
+ *   milliseconds since tracing started, thread id, thread name, event, text
+ *
+ * With --chrome the events become Chrome trace JSON instead, spans nested
+ * per thread, for chrome://tracing or ui.perfetto.dev. The dump describes
+ * its own events, so any build of this tool decodes it.
+ */
+#include <glib.h>
+
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../ble_medical_trace.h"
+
+static gboolean chrome = false;
+static gchar *output = NULL;
+
+static GOptionEntry options[] = {
+        { "chrome", 0, 0, G_OPTION_ARG_NONE, &chrome, "Chrome trace JSON instead of text", NULL },
+        { "output", 'o', 0, G_OPTION_ARG_FILENAME, &output, "Decoded trace, stdout by default", "FILE" },
+        { NULL }
+};
+
+typedef struct _trace_format {
+        ble_trace_kind  kind;
+        gchar           *name;
+        gchar           *format;
+} trace_format;
+
+typedef struct _trace_thread {
+        uint32_t        id;
+        char            name[17];
+} trace_thread;
+
+typedef struct _trace_entry {
+        ble_trace_event         event;
+        const trace_thread      *thread;
+} trace_entry;
+
+typedef struct _trace_file {
+        uint64_t        start_ns;
+        GHashTable      *formats;       // id to trace_format
+        trace_thread    *threads;
+        guint           thread_count;
+        GArray          *entries;       // of trace_entry, in time order
+} trace_file;
+
+// Takes `length` bytes from the dump, failing past its end
+static const void *_take(const gchar **cursor, const gchar *end, gsize length)
+{
+        const gchar *data = *cursor;
+
+        if ((gsize)(end - data) < length)
+                return NULL;
+        *cursor += length;
+        return data;
+}
+
+static void _format_free(gpointer data)
+{
+        trace_format *format = (trace_format*)data;
+
+        g_free(format->name);
+        g_free(format->format);
+        g_free(format);
+}
+
+static gint _entry_compare(gconstpointer a, gconstpointer b)
+{
+        const trace_entry *x = a, *y = b;
+
+        return (x->event.ns > y->event.ns) - (x->event.ns < y->event.ns);
+}
+
+static gboolean _load(trace_file *trace, const gchar *data, gsize length)
+{
+        const gchar *cursor = data, *end = data + length;
+        const uint32_t *header;
+        const uint64_t *start;
+
+        if ((header = _take(&cursor, end, 8)) == NULL || memcmp(header, "BLETRACE", 8) != 0 ||
+            (header = _take(&cursor, end, 4 * sizeof(uint32_t))) == NULL || header[0] != 1 ||
+            (start = _take(&cursor, end, sizeof(uint64_t))) == NULL)
+                return false;
+        memcpy(&trace->start_ns, start, sizeof(trace->start_ns));
+        guint ids = header[1];
+        trace->thread_count = header[2];
+
+        trace->formats = g_hash_table_new_full(g_direct_hash, g_direct_equal, NULL, _format_free);
+        for (guint i = 0; i < ids; i++)
+        {
+                const uint32_t *entry = _take(&cursor, end, 2 * sizeof(uint32_t));
+                const uint16_t *lengths = _take(&cursor, end, 2 * sizeof(uint16_t));
+                const gchar *name = lengths ? _take(&cursor, end, lengths[0]) : NULL;
+                const gchar *text = name ? _take(&cursor, end, lengths[1]) : NULL;
+                if (entry == NULL || text == NULL)
+                        return false;
+                trace_format *format = g_new0(trace_format, 1);
+                format->kind = entry[1];
+                format->name = g_strndup(name, lengths[0]);
+                format->format = g_strndup(text, lengths[1]);
+                g_hash_table_insert(trace->formats, GUINT_TO_POINTER(entry[0]), format);
+        }
+
+        trace->threads = g_new0(trace_thread, trace->thread_count);
+        trace->entries = g_array_new(false, false, sizeof(trace_entry));
+        for (guint i = 0; i < trace->thread_count; i++)
+        {
+                const uint32_t *id = _take(&cursor, end, sizeof(uint32_t));
+                const char *name = _take(&cursor, end, 16);
+                const uint32_t *count = _take(&cursor, end, 2 * sizeof(uint32_t));
+                if (id == NULL || name == NULL || count == NULL ||
+                    (gsize)(end - cursor) / sizeof(ble_trace_event) < count[0])
+                        return false;
+                trace->threads[i].id = *id;
+                memcpy(trace->threads[i].name, name, 16);
+                for (guint j = 0; j < count[0]; j++)
+                {
+                        trace_entry entry = { .thread = &trace->threads[i] };
+                        memcpy(&entry.event, _take(&cursor, end, sizeof(ble_trace_event)), sizeof(ble_trace_event));
+                        g_array_append_val(trace->entries, entry);
+                }
+        }
+        g_array_sort(trace->entries, _entry_compare);
+        return cursor == end;
+}
+
+// The format with its "{}" and "{f}" filled in from the arguments
+static gchar *_expand(const trace_format *format, const int64_t *args)
+{
+        GString *text = g_string_new(NULL);
+        guint used = 0;
+
+        for (const gchar *p = format->format; *p; p++)
+        {
+                if (used < 2 && g_str_has_prefix(p, "{}"))
+                {
+                        g_string_append_printf(text, "%" PRId64, args[used++]);
+                        p++;
+                }
+                else if (used < 2 && g_str_has_prefix(p, "{f}"))
+                {
+                        double value;
+                        memcpy(&value, &args[used++], sizeof(value));
+                        g_string_append_printf(text, "%.6g", value);
+                        p += 2;
+                }
+                else
+                        g_string_append_c(text, *p);
+        }
+        return g_string_free(text, false);
+}
+
+static void _put_json_string(FILE *out, const gchar *text)
+{
+        fputc('"', out);
+        for (const guchar *p = (const guchar*)text; *p; p++)
+        {
+                if (*p == '"' || *p == '\\')
+                        fprintf(out, "\\%c", *p);
+                else if (*p < 0x20)
+                        fprintf(out, "\\u%04x", *p);
+                else
+                        fputc(*p, out);
+        }
+        fputc('"', out);
+}
+
+static void _put_text(FILE *out, const trace_file *trace)
+{
+        for (guint i = 0; i < trace->entries->len; i++)
+        {
+                const trace_entry *entry = &g_array_index(trace->entries, trace_entry, i);
+                const trace_format *format = g_hash_table_lookup(trace->formats, GUINT_TO_POINTER(entry->event.id));
+                g_autofree gchar *text = format ? _expand(format, entry->event.args) : NULL;
+                fprintf(out, "%14.6f %7" PRIu32 " %-15s %-14s %s\n",
+                        ((int64_t)(entry->event.ns - trace->start_ns)) / 1e6,
+                        entry->thread->id, entry->thread->name,
+                        format ? format->name : "unknown", text ? text : "");
+        }
+}
+
+static void _put_chrome(FILE *out, const trace_file *trace)
+{
+        static const char phases[] = { 'i', 'B', 'E' };
+        gboolean first = true;
+
+        fputs("{\"displayTimeUnit\":\"ns\",\"traceEvents\":[\n", out);
+        for (guint i = 0; i < trace->thread_count; i++)
+        {
+                fprintf(out, "%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%" PRIu32 ",\"args\":{\"name\":",
+                        first ? "" : ",\n", trace->threads[i].id);
+                _put_json_string(out, trace->threads[i].name);
+                fputs("}}", out);
+                first = false;
+        }
+        for (guint i = 0; i < trace->entries->len; i++)
+        {
+                const trace_entry *entry = &g_array_index(trace->entries, trace_entry, i);
+                const trace_format *format = g_hash_table_lookup(trace->formats, GUINT_TO_POINTER(entry->event.id));
+                if (format == NULL || format->kind > BLE_TRACE_KIND_END)
+                        continue;
+                g_autofree gchar *text = _expand(format, entry->event.args);
+                fprintf(out, "%s{\"name\":", first ? "" : ",\n");
+                _put_json_string(out, format->name);
+                fprintf(out, ",\"ph\":\"%c\",\"ts\":%.3f,\"pid\":1,\"tid\":%" PRIu32 ",",
+                        phases[format->kind], ((int64_t)(entry->event.ns - trace->start_ns)) / 1e3,
+                        entry->thread->id);
+                if (format->kind == BLE_TRACE_KIND_INSTANT)
+                        fputs("\"s\":\"t\",", out);
+                fputs("\"args\":{", out);
+                if (*text)
+                {
+                        fputs("\"text\":", out);
+                        _put_json_string(out, text);
+                }
+                fputs("}}", out);
+                first = false;
+        }
+        fputs("\n]}\n", out);
+}
+
+int main(int argc, char *argv[])
+{
+        g_autoptr(GOptionContext) context = g_option_context_new("TRACE");
+        g_autoptr(GError) error = NULL;
+        g_autofree gchar *data = NULL;
+        trace_file trace = { 0 };
+        gsize length;
+
+        g_option_context_set_summary(context, "Decode a trace dump to text or Chrome trace JSON.");
+        g_option_context_add_main_entries(context, options, NULL);
+        if (!g_option_context_parse(context, &argc, &argv, &error) || argc != 2)
+        {
+                fprintf(stderr, "%s\n", error ? error->message : "One trace expected");
+                return 2;
+        }
+        if (!g_file_get_contents(argv[1], &data, &length, &error))
+        {
+                fprintf(stderr, "%s\n", error->message);
+                return 1;
+        }
+        gboolean loaded = _load(&trace, data, length);
+        if (!loaded)
+                fprintf(stderr, "%s: not a trace dump, or a damaged one\n", argv[1]);
+
+        FILE *out = output ? fopen(output, "w") : stdout;
+        if (loaded && out == NULL)
+                perror(output);
+        if (loaded && out != NULL)
+        {
+                if (chrome)
+                        _put_chrome(out, &trace);
+                else
+                        _put_text(out, &trace);
+                if ((out != stdout ? fclose(out) : fflush(out)) != 0)
+                {
+                        perror(output ? output : "stdout");
+                        loaded = false;
+                }
+        }
+
+        if (trace.formats != NULL)
+                g_hash_table_destroy(trace.formats);
+        if (trace.entries != NULL)
+                g_array_free(trace.entries, true);
+        g_free(trace.threads);
+        return loaded && out != NULL ? 0 : 1;
+}